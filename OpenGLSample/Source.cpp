@@ -1,8 +1,31 @@
 ﻿#include <iostream>         // cout, cerr
-#include <cstdlib>          // EXIT_FAILURE
+#include <cstdlib>          // EXIT_FAILURE, atof, atoi
+#include <vector>           // scene resource lists
+#include <algorithm>        // sort
+#include <cstring>          // strcmp
+#include <string>           // composed shader sources
+#include <atomic>           // flags set from worker threads
 #include <GL/glew.h>        // GLEW library
 #include <GLFW/glfw3.h>     // GLFW library
 #include "camera.h"         // Camera class
+#include "scenegraph.h"     // Transform hierarchy
+#include "ecs.h"            // Entity-component store
+#include "threadpool.h"     // Worker threads
+#include "framepacer.h"     // Frame rate limiter
+#include "gputimer.h"       // GPU time queries
+#include "dynres.h"         // Dynamic resolution scaling
+#include "clustered.h"      // Clustered light culling
+#include "gbuffer.h"        // Deferred shading targets
+#include "shadows.h"        // Shadow maps
+#include "lightmap.h"       // Baked lighting
+#include "probes.h"         // Light probes for dynamic objects
+#include "particles.h"      // Candle flame particles
+#include "oit.h"            // Order-independent transparency
+#include "objectlights.h"   // Per-object light lists
+#include "ssao.h"           // Screen space ambient occlusion
+#include "texturecache.h"   // Shared, asynchronously loaded textures
+#include "atlas.h"          // Texture atlas pages
+#include "virtualtexture.h" // Tiled, streamed textures
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"      // Image loading Utility functions
 
@@ -21,6 +44,11 @@ using namespace std;        // Standard namespace
 #define GLSL(Version, Source) "#version " #Version " core \n" #Source
 #endif
 
+/*Shader code shared between programs, without a #version line; see UComposeShader*/
+#ifndef GLSL_CHUNK
+#define GLSL_CHUNK(Source) #Source
+#endif
+
 // Unnamed namespace
 namespace
 {
@@ -30,10 +58,82 @@ namespace
     const int WINDOW_WIDTH = 850;
     const int WINDOW_HEIGHT = 900;
 
+    // Current framebuffer size, kept up to date by UResizeWindow
+    int gWindowWidth = WINDOW_WIDTH;
+    int gWindowHeight = WINDOW_HEIGHT;
+
+    // The scene is drawn offscreen at a scaled resolution picked from the measured GPU time, then upscaled
+    ScaledRenderTarget gSceneTarget;
+    DynamicResolution gDynamicResolution;
+    GpuTimer gSceneTimer;       // whole scene when forward, geometry pass when deferred
+
+    // Shading path: forward lights every fragment as it is drawn; deferred writes the surfaces into the
+    // G-buffer first and lights each visible pixel once in a fullscreen pass
+    enum RenderPath
+    {
+        RENDER_FORWARD,
+        RENDER_DEFERRED
+    };
+    RenderPath gRenderPath = RENDER_FORWARD;
+    GBuffer gGBuffer;           // allocated the first time the deferred path runs
+    GpuTimer gLightingTimer;    // deferred lighting pass
+    GLuint gFullscreenVao = 0;  // empty VAO for the fullscreen triangle, positions come from gl_VertexID
+
+    // Depth pre-pass: the opaque depth is laid down from the position-only streams first, so the shading pass
+    // (forward, or the G-buffer pass) shades each pixel once (--depth-prepass, Z toggles)
+    bool gDepthPrepass = false;
+    GpuTimer gPrepassTimer;
+
+    // Ambient occlusion darkens the ambient light in creases and corners. It is computed from the depth before
+    // shading, so the forward path runs the depth pre-pass whenever it is on (--ao N, V cycles off and 1 - 3)
+    AmbientOcclusion gAmbientOcclusion;
+    int gAmbientOcclusionQuality = 2;
+    GpuTimer gAmbientOcclusionTimer;
+
+    // Translucent surfaces are not sorted: they are accumulated with weighted blended order-independent
+    // transparency after the opaque pass and composited over it
+    OitBuffer gOitBuffer;       // allocated the first time something translucent is visible
+    GpuTimer gTransparentTimer; // accumulation and composite passes
+
+    // Shadows: cube maps for the shadowed point lights, cascades for the optional directional light (--sun)
+    struct ShadowedLight
+    {
+        int slot;            // cube map in gPointShadows
+        glm::vec3 position;  // world position of the light
+        float farPlane;      // shadow range
+    };
+    ShadowMapArray gPointShadows;
+    ShadowMapArray gCascadeShadows;             // only created when the directional light is on
+    std::vector<ShadowedLight> gShadowedLights; // filled by UUpdateLights
+    Cascades gCascades;
+    GpuTimer gShadowTimer;                      // all shadow passes of a frame
+    uint64_t gStaticCasterVersion = 0;          // bumped whenever a static object moves
+    bool gSunEnabled = false;
+    const glm::vec3 SUN_DIRECTION = glm::vec3(-0.4f, -1.0f, -0.3f);   // direction the light travels
+    const glm::vec3 SUN_COLOR = glm::vec3(0.15f, 0.18f, 0.3f);        // dim moonlight
+    const float POINT_SHADOW_RANGE = 25.0f;     // shadow far plane of point lights that never fade
+    const float CASCADE_SHADOW_DISTANCE = 20.0f;// view depth covered by the cascades
+
+    // Baked lighting: the diffuse light of the static lights, baked offline by --bake-lightmaps and loaded at
+    // startup when it matches the scene. Static objects get lightmaps, dynamic objects read a probe volume
+    std::vector<GLuint> gLightmapTextures;
+    bool gBakedLightingEnabled = true;          // L switches between baked and fully dynamic lighting
+    const char* const LIGHTMAP_PATH = "../resources/lightmaps.bin";
+    const GLuint LIGHTMAP_TEXTURE_UNIT = 3;
+    ProbeVolume gProbeVolume;                   // empty until baked
+    const char* const PROBE_PATH = "../resources/probes.bin";
+    const float PROBE_SPACING = 0.5f;           // distance between probes
+    const int PROBE_SAMPLES = 256;              // rays per probe for the bounced light
+
+    // Candle flames: flame, ember and smoke particles rising from emitter nodes on the wicks (--flames adds more)
+    ParticleSystem gParticles;
+    std::vector<SceneNode> gFlameNodes;         // one emitter per node
+    std::vector<glm::vec3> gFlamePositions;     // world position of each emitter this frame
+    GpuTimer gParticleTimer;                    // particle simulation
+    bool gParticlesEnabled = true;              // C turns the flames on and off
+    const float MAX_PARTICLE_STEP = 0.1f;       // longest simulation step, so a long stall does not fling particles away
+
     // glm functions for the various matrices
-    glm::mat4 rotation;     // Rotation matrice
-    glm::mat4 translation;  // Translation matice
-    glm::mat4 model;        // Model matrice
     glm::mat4 view;         // View matrice
     glm::mat4 projection;   // Projection matrice
     glm::mat4 perspective;  // Perspective matrice
@@ -46,14 +146,35 @@ namespace
     GLFWwindow* gWindow = nullptr;
 
     // Shader programs
-    GLuint gProgramId;
+    GLuint gProgramId;                  // forward shading
+    GLuint gGBufferProgramId;           // deferred geometry pass
+    GLuint gDeferredLightingProgramId;  // deferred lighting pass
+    GLuint gDepthPrepassProgramId;      // depth only, for the pre-pass
+    GLuint gAmbientOcclusionProgramId;  // raw occlusion at reduced resolution
+    GLuint gAmbientOcclusionResolveProgramId;   // bilateral upsample and temporal blend
+    GLuint gPointShadowProgramId;       // point light shadow depth (distance to the light)
+    GLuint gCascadeShadowProgramId;     // directional light shadow depth
+    GLuint gTransparentProgramId;       // translucent surfaces into the transparency targets
+    GLuint gOitCompositeProgramId;      // transparency targets over the opaque scene
+    GLuint gParticleComputeProgramId;   // particle simulation
+    GLuint gParticleProgramId;          // particle billboards
 
     // Stores the GL data relative to a given mesh
     struct GLMesh
     {
         GLuint vao;          // Handle for the vertex array object
         GLuint vbos[2];      // Handle for the vertex buffer object
+        GLuint depthVao;     // Positions only, for depth passes; shares the index buffer
+        GLuint depthVbo;     // Tightly packed positions
         GLuint nIndices;     // Number of indices of the mesh
+        glm::vec3 boundsMin; // Smallest vertex position of the mesh
+        glm::vec3 boundsMax; // Largest vertex position of the mesh
+        GLuint lightmapVao;  // Vertices split along the lightmap charts, with lightmap coordinates; 0 until baked
+        GLuint lightmapVbos[2];
+        std::vector<GLfloat> vertexData;    // CPU copy of the interleaved vertices, for the lightmap baker
+        std::vector<GLushort> indexData;    // CPU copy of the indices
+        GLuint floatsPerVertex;             // Floats per vertex in vertexData
+        GLuint uvOffset;                    // Offset of the texture coordinates inside a vertex
     };
 
     // stores coordinates for points
@@ -64,19 +185,110 @@ namespace
         GLfloat z;
     };
 
-    // Triangle mesh data
-    GLMesh upperCandlestickMesh;
-    GLMesh lowerCandlestickMesh; 
-    GLMesh candleMesh;
-    GLMesh candleWickMesh;
-    GLMesh tableMesh;
-    GLMesh napkinMesh;
-    GLMesh knifeMesh;
-    GLMesh knifeTipMesh;
+    // Scene storage: the GL resources are owned here, everything per-object lives in the entity store
+    std::vector<GLMesh> gMeshes;    // every mesh created for the scene
+    std::vector<GLuint> gTextures;  // texture of each TextureSlot; slots with the same image share one
+    std::vector<glm::vec4> gTextureRects;   // where each slot's image is in its texture (see AtlasRegion)
+    std::vector<glm::vec3> gTextureAlbedo;  // average color of each texture, how much light its surfaces bounce
+    SceneGraph gSceneGraph;         // transform hierarchy driving the entities
+    World gWorld;                   // renderable objects and lights
+    ThreadPool gThreadPool;         // workers for the per-chunk systems and texture decoding
+
+    // Textures are shared through the cache, decoded on the workers and swapped in as they finish; objects show
+    // a placeholder until then, and the smallest mip levels while the larger ones stream in. The baked lighting
+    // is keyed on the textures' colors, so it is loaded (or baked) once they are all in. --texture-budget MB caps
+    // their GPU memory: past it the cache drops the largest mip levels of the textures least needed on screen
+    // (see TextureCache::UpdateResidency)
+    TextureCache gTextureCache;
+    DecodedImageCache gDecodedImageCache;   // decoded textures kept on disk, so warm starts skip decoding them
+    const size_t MAX_TEXTURE_UPLOAD_BYTES_PER_FRAME = 4 * 1024 * 1024;    // levels are streamed in within this
+    bool gBakeLightmaps = false;    // --bake-lightmaps
+    bool gBakedLightingLoaded = false;
+
+    // The small material textures can instead be packed into atlas pages (--atlas), so the objects using them
+    // share one texture and their draws are not split by texture binds
+    TextureAtlas gTextureAtlas;
+    bool gAtlasTextures = false;
+
+    // The table can instead be drawn from a virtual texture (--virtual-texture): its image is cut into tiles on
+    // disk and only the tiles in view are streamed into a small cache, so its size is not bound by the GPU's memory
+    VirtualTexture gVirtualTexture;
+    bool gVirtualTextureEnabled = false;
+    const int MAX_VIRTUAL_TILE_UPLOADS_PER_FRAME = 8;
+    GLuint gVirtualTextureFeedbackProgramId;    // tile requests at low resolution
+
+    // Texture files, in the order generateTextures queues them
+    enum TextureSlot
+    {
+        TABLE_TEXTURE,
+        CANDLE_TEXTURE,
+        UPPER_CANDLESTICK_TEXTURE,
+        LOWER_CANDLESTICK_TEXTURE,
+        CANDLE_WICK_TEXTURE,
+        NAPKIN_TEXTURE,
+        KNIFE_TEXTURE,
+        KNIFE_TIP_TEXTURE,
+        TEXTURE_COUNT
+    };
+
+    const char* const TEXTURE_PATHS[TEXTURE_COUNT] =
+    {
+        "../resources/textures/pinktable.png",
+        "../resources/textures/candle.png",
+        "../resources/textures/silver1.jpg",
+        "../resources/textures/silver1.jpg",
+        "../resources/textures/wickflame.png",
+        "../resources/textures/napkin.png",
+        "../resources/textures/butterknife.jpg",
+        "../resources/textures/butterknife.jpg"
+    };
+
+    // Slots that go into the atlas: the small props. The table and candlesticks are big enough on screen to
+    // keep their own textures at full resolution
+    const bool TEXTURE_ATLASED[TEXTURE_COUNT] =
+    {
+        false, true, false, false, true, true, true, true
+    };
 
-    // VBO and VAO objects
-    unsigned int VBOplane, VBOcandle, VBOupperCandlestickMesh, VBOlowerCandlestickMesh, VBOcandleWick, VBOnapkin, VBOknife, VBOknifeTip;
-    unsigned int VAOplane, VAOcandle, VAOupperCandlestickMesh, VAOlowerCandlestickMesh, VAOcandleWick, VAOnapkin, VAOknife, VAOknifeTip;
+    // The slot that is streamed with --virtual-texture
+    const TextureSlot VIRTUAL_TEXTURE_SLOT = TABLE_TEXTURE;
+
+    // One draw call produced by the culling system
+    struct DrawItem
+    {
+        GLuint vao;          // Vertex array object to bind
+        GLuint depthVao;     // Position-only vertex array, for depth passes
+        GLuint nIndices;     // Number of indices to draw
+        GLuint texture;      // Texture to bind
+        glm::vec2 uvScale;   // Texture coordinate scale
+        glm::vec4 atlasRect; // Texture coordinate offset (xy) and scale (zw) of the image in its atlas page
+        bool virtualTexture; // Sampled from the virtual texture instead of texture
+        float specularIntensity; // Specular light strength
+        float highlightSize;     // Specular highlight size
+        float opacity;           // 1 for opaque surfaces
+        GLuint lightmap;     // Baked lighting texture, 0 for none
+        const ShProbe* probe;    // Probe lighting around a dynamic object, null for none
+        glm::mat4 model;     // World matrix
+        glm::vec3 center;    // World bounds center
+        glm::vec3 extent;    // World bounds half size
+        GLuint lightSlot;    // Per-object light list of the draw
+    };
+
+    std::vector<std::vector<DrawItem>> gChunkDrawLists;  // Per-chunk output of the culling pass
+    std::vector<std::vector<ShProbe>> gChunkProbes;      // Per-chunk probe lighting of the visible dynamic objects
+    std::vector<DrawItem> gDrawList;                     // Visible opaque draws for this frame, sorted by texture
+    std::vector<DrawItem> gTransparentDrawList;          // Visible translucent draws, in any order
+
+    // Lights: gathered from the light entities every frame and sorted into view space clusters
+    ClusteredLighting gClusteredLighting;
+    std::vector<GpuPointLight> gLightData;
+
+    // Forward lit draws can instead take their lights from a short per-object list (--object-lights, K toggles)
+    bool gPerObjectLights = false;
+    ObjectLightAssignment gObjectLights;
+    std::vector<ObjectBounds> gObjectBounds;   // world bounds of the forward lit draws, one per light slot
+    const float NEAR_PLANE = 0.1f;      // Projection near and far planes, shared with the light clusters
+    const float FAR_PLANE = 100.0f;
 
     //Camera variables 
     glm::vec3 gCameraPos = glm::vec3(0.0f, 0.0f, 3.0f);
@@ -91,36 +303,45 @@ namespace
     bool gFirstMouse = true;
 
     // timing
-    float gDeltaTime = 0.0f;    // time between current frame
-    float gLastFrame = 0.0f;    // time between last frame
+    float gDeltaTime = 0.0f;    // time between current frame and the last frame, from the frame pacer's nanosecond clock
+    FramePacer gFramePacer(60.0);   // paces frame starts; --fps sets the target rate, 0 uncaps it
 
     GLfloat halfScreenWidth = SCREEN_WIDTH / 2;
     GLfloat halfScreenHeight = SCREEN_HEIGHT / 2;
 
-    //Texture variables
-    unsigned int upperCandlestickTexture, candleTexture, napkinTexture, knifeTexture, knifeTipTexture, tableTexture, lowerCandlestickTexture, candleWickTexture;
-
-    // Keylight position, scale, and color
-    glm::vec3 gLightPosition(-3.5f, 2.0f, 3.0f);    // This is the light's position based on the x, y, z axis
-    glm::vec3 gLightScale(0.3f);                    // Scaling the light size
-    glm::vec3 gLightColor(1.0f, 0.2f, 0.75f);       // The key light color is set to pink
-
-    // fill light position, scale, and color
-    glm::vec3 gLight2Position(4.0f, 0.0f, 1.0f);    // This is the fill light's position based on the x, y, z axis
-    glm::vec3 gLight2Scale(0.3f);                   // Scaling the fill light size 
-    glm::vec3 gLight2Color(1.0f, 0.0f, 0.0f);       // The key light color is set to red
+    // Rendering mode: draw every loop iteration, or only when something on screen changed
+    enum RenderMode
+    {
+        RENDER_CONTINUOUS,
+        RENDER_ON_DEMAND
+    };
+    RenderMode gRenderMode = RENDER_CONTINUOUS;
+    bool gRedrawRequested = true;               // something changed since the last frame was drawn
+    int gActiveAnimations = 0;                  // running animations; while non-zero every loop draws a frame
+    const double IDLE_WAIT_TIMEOUT = 0.5;       // longest time (seconds) the on-demand loop blocks waiting for events
+    unsigned long long gFramesRendered = 0;     // frames drawn and presented
+    unsigned long long gFramesSkipped = 0;      // loop iterations that waited instead of drawing
 
 }
 
 // User-defined Function prototypes
 bool UInitialize(int, char* [], GLFWwindow** window);
 void generateTextures();
+void UCookTextures(BcFormat format, BcQuality quality);
+void UBenchmarkTextureEncoder();
 void UMousePositionCallback(GLFWwindow* window, double xpos, double ypos);
 void UMouseScrollCallback(GLFWwindow* window, double xoffset, double yoffset);
 void UMouseButtonCallback(GLFWwindow* window, int button, int action, int mods);
 void UProcessInput(GLFWwindow* window);
 void UResizeWindow(GLFWwindow* window, int width, int height);
+void UKeyCallback(GLFWwindow* window, int key, int scancode, int action, int mods);
+void URefreshCallback(GLFWwindow* window);
+void URequestRedraw();
+bool UFrameNeeded();
+void UPrintFrameStats();
 void URender();
+void UDrawScene(GLuint programId, const std::vector<DrawItem>& draws);
+void USetCameraUniforms(GLuint programId);
 void UCreatePlaneMesh(GLMesh& mesh, GLCoord topRight, GLCoord topLeft, GLCoord bottomLeft, GLCoord bottomRight);
 void UCreateCandleMesh(GLMesh& mesh);
 void UCreateNapkinMesh(GLMesh& mesh);
@@ -130,7 +351,38 @@ void UCreateCandleWickMesh(GLMesh& mesh);
 void UCreateUpperCandlestickMesh(GLMesh& mesh);
 void UCreateLowerCandlestickMesh(GLMesh& mesh);
 void UDestroyMesh(GLMesh& mesh);
+void UComputeMeshBounds(GLMesh& mesh, const GLfloat* verts, GLuint nFloats, GLuint floatsPerVertex);
+void UCreateDepthStream(GLMesh& mesh, const GLfloat* verts, GLuint nFloats, GLuint floatsPerVertex);
+void URetainMeshData(GLMesh& mesh, const GLfloat* verts, GLuint nFloats, GLuint floatsPerVertex, GLuint uvOffset, const GLushort* indices, GLuint nIndices);
+void UCreateLightmapStream(GLMesh& mesh, const LightmapUnwrap& unwrap);
+void UCreateScene();
+Entity UCreateRenderable(GLMesh& mesh, TextureSlot slot, SceneNode node, bool isStatic = true);
+Entity UCreateLight(SceneNode parent, glm::vec3 position, glm::vec3 color, float ambientStrength, glm::vec3 attenuation, bool isStatic = false);
+Entity UCreateSpotLight(glm::vec3 position, glm::vec3 direction, glm::vec3 color, glm::vec3 attenuation, float innerAngle, float outerAngle);
+void UCreateTestLights(int count);
+void UCreateTestFlames(int count);
+void ULoadBakedLighting(bool bake);
+void UUpdateTextures();
+void UVirtualTextureFeedbackPass();
+void USetVirtualTextureSamplers(GLuint programId, float lodBias);
+void UUpdateTransforms();
+void UBuildDrawList(const glm::mat4& viewProjection);
+void UNoteTextureUse();
+void UUpdateLights(const glm::mat4& viewMatrix, const glm::mat4& projectionMatrix);
+void UAssignObjectLights();
+void UShadowPass();
+void UUpdateParticles();
+void UTransparentPass();
+void UDepthPrepass();
+void UEndDepthPrepass();
+void UAmbientOcclusionPass(GLuint depthTexture);
+void UDrawParticles();
+void UDrawShadowCasters(GLuint programId, const glm::mat4& lightViewProjection, bool staticCasters, glm::vec3 center, float range);
+void USetShadowSamplers(GLuint programId);
+void USetShadowUniforms(GLuint programId);
 bool UCreateShaderProgram(const char* vtxShaderSource, const char* fragShaderSource, GLuint& programId);
+bool UCreateComputeProgram(const char* computeShaderSource, GLuint& programId);
+std::string UComposeShader(const char* source, const char* chunk);
 void UDestroyShaderProgram(GLuint programId);
 
 
@@ -139,10 +391,14 @@ const GLchar* vertexShaderSource = GLSL(440,
     layout(location = 0) in vec3 position; // VAP position 0 for vertex position data
     layout(location = 1) in vec3 normal;   // VAP position 1 for normals
     layout(location = 2) in vec2 texture; // VAP position 1 for texture coordinates
+    layout(location = 3) in vec2 lightmapCoord; // VAP position 3 for lightmap coordinates (lightmapped meshes only)
 
     out vec3 vertexNormal;      // For outgoing normals to fragment shader
     out vec3 vertexFragmentPos; // For outgoing color / pixels to fragment shader
     out vec2 TextureCoord;  // For outgoing texture coordinates to fragment shader
+    out float vertexViewDepth;  // Distance in front of the camera, used to find the light cluster
+    out vec2 LightmapCoord;     // For outgoing lightmap coordinates
+    invariant gl_Position;      // Must match the depth pre-pass bit for bit, it is tested with GL_EQUAL
 
     //Uniform 
     uniform mat4 model;       // Global variable for the model transform matrices
@@ -155,65 +411,642 @@ const GLchar* vertexShaderSource = GLSL(440,
         vertexFragmentPos = vec3(model * vec4(position, 1.0f));         // Gets fragment / pixel position in world space only (exclude view and projection)
         vertexNormal = mat3(transpose(inverse(model))) * normal;        // get normal vectors in world space only and exclude normal translation properties
         TextureCoord = texture; //references incoming texture data
+        vertexViewDepth = -(view * model * vec4(position, 1.0f)).z;
+        LightmapCoord = lightmapCoord;
+    }
+);
+
+/* Lighting code shared by the forward and deferred fragment shaders: Phong point and spot lights,
+   read from the clustered light lists or, for forward draws, the per-object ones*/
+const GLchar* lightingShaderChunk = GLSL_CHUNK(
+    // Lights, same layout as GpuPointLight in clustered.h
+    struct PointLight
+    {
+        vec4 positionRadius;   // world position, influence radius
+        vec4 colorAmbient;     // color, ambient strength
+        vec4 attenuation;      // constant, linear, quadratic, cos of the spot outer cutoff
+        vec4 spotDirection;    // spot direction, cos of the inner cutoff (below -1 for point lights)
+        vec4 shadow;           // shadow map slot (-1 for none), shadow far plane, depth bias, 1 if baked into the lightmaps
+    };
+
+    // Light culling results: every cluster holds an (offset, count) range into the light index list.
+    // With per-object assignment every draw has a slot of 8 (OBJECT_LIGHT_SLOT_SIZE): a count, then the indices
+    layout(std430, binding = 0) readonly buffer LightBuffer { PointLight lights[]; };
+    layout(std430, binding = 1) readonly buffer ClusterBuffer { uvec2 clusterRanges[]; };
+    layout(std430, binding = 2) readonly buffer LightIndexBuffer { uint lightIndices[]; };
+    layout(std430, binding = 5) readonly buffer ObjectLightBuffer { uint objectLights[]; };
+    uniform bool perObjectLights;      // Whether to read the object's list instead of the cluster's
+    uniform uint objectLightSlot;      // Slot of the object being drawn
+
+    // Screen space ambient occlusion, full resolution, scales the ambient term (see ssao.h)
+    uniform sampler2D ambientOcclusionTexture;
+    uniform bool hasAmbientOcclusion;
+
+    uniform vec3 viewPosition;         // Global variable for view position
+    uniform uvec3 clusterGridSize;     // Number of clusters along x, y and depth
+    uniform vec2 clusterViewport;      // Size in pixels of the area being rendered
+    uniform float clusterSliceScale;   // Depth slice = log(depth) * scale + bias
+    uniform float clusterSliceBias;
+
+    // Shadow maps and the optional directional light
+    uniform samplerCubeArrayShadow pointShadowMaps;   // distance to the light / far plane, one cube per shadowed light
+    uniform sampler2DArrayShadow cascadeShadowMaps;   // one layer per cascade
+    uniform vec4 sunDirection;                        // direction the light travels, w is 1 when it is on
+    uniform vec3 sunColor;
+    uniform mat4 cascadeViewProjection[3];
+    uniform vec3 cascadeSplits;                       // far view depth of each cascade
+
+    // 1 where the light reaches the fragment, 0 in its shadow, filtered in between
+    float CalcPointShadow(PointLight light, vec3 fragPos)
+    {
+        if (light.shadow.x < 0.0)
+            return 1.0;
+        vec3 fromLight = fragPos - light.positionRadius.xyz;
+        float depth = length(fromLight) / light.shadow.y;
+        if (depth >= 1.0)
+            return 1.0;   // beyond the shadow range
+        return texture(pointShadowMaps, vec4(fromLight, light.shadow.x), depth - light.shadow.z);
+    }
+
+    float CalcCascadeShadow(vec3 fragPos, float viewDepth)
+    {
+        if (viewDepth >= cascadeSplits.z)
+            return 1.0;
+        int cascade = viewDepth < cascadeSplits.x ? 0 : (viewDepth < cascadeSplits.y ? 1 : 2);
+        vec4 lightSpace = cascadeViewProjection[cascade] * vec4(fragPos, 1.0);
+        vec3 coord = lightSpace.xyz / lightSpace.w * 0.5 + 0.5;
+        return texture(cascadeShadowMaps, vec4(coord.xy, float(cascade), coord.z - 0.0015));
+    }
+
+    // Phong lighting model calculations to generate ambient, diffuse, and specular components for one light.
+    // On lightmapped surfaces the ambient and diffuse light of baked lights comes from the lightmap instead
+    vec3 CalcPointLight(PointLight light, vec3 norm, vec3 fragPos, vec3 viewDir, float specularIntensity, float highlightSize, bool bakedSurface, float occlusion)
+    {
+        vec3 lightColor = light.colorAmbient.rgb;
+        vec3 toLight = light.positionRadius.xyz - fragPos;
+        float distance = length(toLight);
+        vec3 lightDirection = toLight / distance;  // Calculate light direction between light source and fragments/pixels
+
+        //Calculate Ambient lighting, less of it where the surroundings block it
+        vec3 ambient = light.colorAmbient.a * occlusion * lightColor;
+
+        //Calculate Diffuse lighting
+        float impact = max(dot(norm, lightDirection), 0.0); // Calculate diffuse impact by generating dot product of normal and light
+        vec3 diffuse = impact * lightColor;
+
+        //Calculate Specular lighting
+        vec3 reflectDir = reflect(-lightDirection, norm);   // Calculate reflection vector
+        float specularComponent = pow(max(dot(viewDir, reflectDir), 0.0), highlightSize);
+        vec3 specular = specularIntensity * specularComponent * lightColor;
+
+        // Distance falloff, faded out to zero at the influence radius so the cluster cut-off does not show
+        float attenuation = 1.0 / (light.attenuation.x + light.attenuation.y * distance + light.attenuation.z * distance * distance);
+        float edge = distance / light.positionRadius.w;
+        attenuation *= clamp(1.0 - edge * edge * edge * edge, 0.0, 1.0);
+
+        if (bakedSurface && light.shadow.w > 0.0)
+            return specular * CalcPointShadow(light, fragPos) * attenuation;
+        return (ambient + (diffuse + specular) * CalcPointShadow(light, fragPos)) * attenuation;
+    }
+
+    // A point light limited to a cone, with a soft edge between the inner and outer cutoff
+    vec3 CalcSpotLight(PointLight light, vec3 norm, vec3 fragPos, vec3 viewDir, float specularIntensity, float highlightSize, bool bakedSurface, float occlusion)
+    {
+        vec3 lightDirection = normalize(light.positionRadius.xyz - fragPos);
+        float theta = dot(lightDirection, normalize(-light.spotDirection.xyz));
+        float epsilon = light.spotDirection.w - light.attenuation.w;
+        float intensity = clamp((theta - light.attenuation.w) / epsilon, 0.0, 1.0);
+        return CalcPointLight(light, norm, fragPos, viewDir, specularIntensity, highlightSize, bakedSurface, occlusion) * intensity;
+    }
+
+    // Directional light: diffuse and specular only, shadowed by the cascades
+    vec3 CalcDirLight(vec3 norm, vec3 fragPos, vec3 viewDir, float viewDepth, float specularIntensity, float highlightSize)
+    {
+        vec3 lightDirection = normalize(-sunDirection.xyz);
+        float impact = max(dot(norm, lightDirection), 0.0);
+        vec3 reflectDir = reflect(-lightDirection, norm);
+        float specularComponent = pow(max(dot(viewDir, reflectDir), 0.0), highlightSize);
+        return (impact + specularIntensity * specularComponent) * sunColor * CalcCascadeShadow(fragPos, viewDepth);
+    }
+
+    // Sums the lights that can reach this fragment: the object's own list when lights are assigned per object,
+    // otherwise the list of the cluster it falls in (screen tile from the pixel position, slice from the depth)
+    vec3 CalcLighting(vec3 norm, vec3 fragPos, float viewDepth, float specularIntensity, float highlightSize, bool bakedSurface)
+    {
+        vec3 viewDir = normalize(viewPosition - fragPos);  // Calculate view direction
+        float occlusion = hasAmbientOcclusion ? texelFetch(ambientOcclusionTexture, ivec2(gl_FragCoord.xy), 0).r : 1.0;
+
+        uint first;
+        uint count;
+        if (perObjectLights)
+        {
+            first = objectLightSlot * 8u + 1u;
+            count = objectLights[first - 1u];
+        }
+        else
+        {
+            uvec2 tile = uvec2(clamp(gl_FragCoord.xy / clusterViewport, 0.0, 0.9999) * vec2(clusterGridSize.xy));
+            float slice = clamp(log(max(viewDepth, 1e-4)) * clusterSliceScale + clusterSliceBias, 0.0, float(clusterGridSize.z - 1u));
+            uint cluster = tile.x + clusterGridSize.x * (tile.y + clusterGridSize.y * uint(slice));
+            first = clusterRanges[cluster].x;
+            count = clusterRanges[cluster].y;
+        }
+
+        // Only the lights on the list are evaluated
+        vec3 lighting = vec3(0.0);
+        if (sunDirection.w > 0.0)
+            lighting += CalcDirLight(norm, fragPos, viewDir, viewDepth, specularIntensity, highlightSize);
+        for (uint i = 0u; i < count; ++i)
+        {
+            PointLight light = lights[perObjectLights ? objectLights[first + i] : lightIndices[first + i]];
+            if (light.spotDirection.w < -1.0)
+                lighting += CalcPointLight(light, norm, fragPos, viewDir, specularIntensity, highlightSize, bakedSurface, occlusion);
+            else
+                lighting += CalcSpotLight(light, norm, fragPos, viewDir, specularIntensity, highlightSize, bakedSurface, occlusion);
+        }
+        return lighting;
+    }
+);
+
+/* Baked light shared by the forward and G-buffer fragment shaders: lightmaps for static objects, spherical
+   harmonics from the light probes for dynamic ones*/
+const GLchar* bakedLightingShaderChunk = GLSL_CHUNK(
+    uniform sampler2D lightmapTexture;  // Baked diffuse lighting of the static lights
+    uniform bool hasLightmap;           // Whether the object being drawn has a lightmap
+    uniform bool hasProbeLighting;      // Whether the object being drawn is lit by the light probes
+    uniform vec3 probeIrradiance[9];    // Irradiance around the object as L2 spherical harmonics (see probes.h)
+
+    // Lightmaps are RGBM encoded with a range of 8 (LIGHTMAP_RGBM_RANGE in lightmap.h); the probe light is
+    // evaluated for the surface normal
+    vec3 SampleBakedLighting(vec2 coord, vec3 norm)
+    {
+        if (hasLightmap)
+        {
+            vec4 rgbm = texture(lightmapTexture, coord);
+            return rgbm.rgb * rgbm.a * 8.0;
+        }
+        if (hasProbeLighting)
+        {
+            vec3 irradiance = probeIrradiance[0] * 0.282095
+                + probeIrradiance[1] * (0.488603 * norm.y) + probeIrradiance[2] * (0.488603 * norm.z) + probeIrradiance[3] * (0.488603 * norm.x)
+                + probeIrradiance[4] * (1.092548 * norm.x * norm.y) + probeIrradiance[5] * (1.092548 * norm.y * norm.z)
+                + probeIrradiance[6] * (0.315392 * (3.0 * norm.z * norm.z - 1.0)) + probeIrradiance[7] * (1.092548 * norm.x * norm.z)
+                + probeIrradiance[8] * (0.546274 * (norm.x * norm.x - norm.y * norm.y));
+            return max(irradiance, vec3(0.0));
+        }
+        return vec3(0.0);
     }
 );
 
-/* Fragment Shader Source Code*/
+/* Material texture lookup shared by the fragment shaders that draw the scene: the coordinates are tiled by uvScale,
+   then wrapped into the image's rectangle of its atlas page (the whole texture for one of its own). The gradients
+   are taken before the wrap, so the mip level does not jump where the tiles meet.
+   A material on the virtual texture (see virtualtexture.h) instead picks its detail level from the gradients, looks
+   up which cache tile holds that part of the image in the indirection texture (a coarser one while the tile it
+   wants is still streaming in) and samples the tile cache*/
+const GLchar* materialTextureShaderChunk = GLSL_CHUNK(
+    uniform sampler2D ourTexture;       // Material texture, or the atlas page holding it
+    uniform vec2 uvScale;               // Texture coordinate scale, for tiling
+    uniform vec4 atlasRect;             // Offset (xy) and scale (zw) of the image in ourTexture
+
+    uniform bool hasVirtualTexture;     // Whether the material is the virtual texture instead
+    uniform sampler2D virtualPhysical;  // Tile cache of the virtual texture
+    uniform usampler2D virtualIndirection;  // Cache tile and its level for every tile, the levels stacked
+    uniform ivec2 virtualSize;          // Size of the virtual texture's largest level, in texels
+    uniform int virtualLevels;          // Its level count
+    uniform int virtualLevelRows[16];   // First indirection row of each level
+    uniform float virtualLodBias;       // Added to the detail level, for passes at a lower resolution
+
+    const int VT_TILE_SIZE = 128;       // VT_TILE_SIZE, VT_TILE_BORDER and VT_TILE_STRIDE of virtualtexture.h
+    const int VT_TILE_BORDER = 4;
+    const int VT_TILE_STRIDE = 136;
+
+    ivec2 VirtualLevelSize(int level)
+    {
+        return max(virtualSize >> level, ivec2(1));
+    }
+
+    // Detail level the coordinates want, from their screen space gradients (before any wrapping)
+    int VirtualLevel(vec2 uv)
+    {
+        vec2 dx = dFdx(uv) * vec2(virtualSize);
+        vec2 dy = dFdy(uv) * vec2(virtualSize);
+        float lod = 0.5 * log2(max(max(dot(dx, dx), dot(dy, dy)), 1e-8)) + virtualLodBias;
+        return clamp(int(floor(lod)), 0, virtualLevels - 1);
+    }
+
+    // Tile of a level holding wrapped coordinates
+    ivec2 VirtualTile(vec2 wrapped, int level)
+    {
+        ivec2 size = VirtualLevelSize(level);
+        return min(ivec2(wrapped * vec2(size)) / VT_TILE_SIZE, (size + VT_TILE_SIZE - 1) / VT_TILE_SIZE - 1);
+    }
+
+    vec4 SampleVirtualTexture(vec2 uv)
+    {
+        int level = VirtualLevel(uv);
+        vec2 wrapped = fract(uv);
+        ivec2 tile = VirtualTile(wrapped, level);
+        uvec4 entry = texelFetch(virtualIndirection, ivec2(tile.x, virtualLevelRows[level] + tile.y), 0);
+
+        // The resident tile is the one holding the center of this tile's part of the image, found in the same
+        // integer steps as VirtualTextureLayout::Ancestor
+        int resident = int(entry.z);
+        ivec2 size = VirtualLevelSize(level);
+        ivec2 residentSize = VirtualLevelSize(resident);
+        ivec2 center = tile * VT_TILE_SIZE + min(ivec2(VT_TILE_SIZE / 2), (size - tile * VT_TILE_SIZE) / 2);
+        ivec2 residentTile = min(center * residentSize / size / VT_TILE_SIZE, (residentSize + VT_TILE_SIZE - 1) / VT_TILE_SIZE - 1);
+        vec2 local = wrapped * vec2(residentSize) - vec2(residentTile * VT_TILE_SIZE);
+        vec2 physical = (vec2(entry.xy) * float(VT_TILE_STRIDE) + float(VT_TILE_BORDER) + local) / vec2(textureSize(virtualPhysical, 0));
+        return textureLod(virtualPhysical, physical, 0.0);
+    }
+
+    vec4 SampleMaterialTexture(vec2 coord)
+    {
+        if (hasVirtualTexture)
+            return SampleVirtualTexture(coord * uvScale);
+        vec2 uv = coord * uvScale;
+        vec2 atlasUv = atlasRect.xy + fract(uv) * atlasRect.zw;
+        return textureGrad(ourTexture, atlasUv, dFdx(uv) * atlasRect.zw, dFdy(uv) * atlasRect.zw);
+    }
+);
+
+/* Fragment Shader Source Code (forward shading, composed with lightingShaderChunk, bakedLightingShaderChunk and
+   materialTextureShaderChunk)*/
 const GLchar* fragmentShaderSource = GLSL(440,
     in vec3 vertexNormal;              // For incoming normals
     in vec3 vertexFragmentPos;         // For incoming fragment position
     in vec2 TextureCoord; //Variable to hold incoming texture data from vertex shader
+    in float vertexViewDepth;          // For incoming distance in front of the camera
+    in vec2 LightmapCoord;             // For incoming lightmap coordinates
     
     out vec4 fragmentColor;            // For outgoing pyramid color to the GPU
 
     // Uniform 
-    uniform vec3 lightColor;           // Global variable for key light color
-    uniform vec3 light2Color;          // Global variable for fill light color
-    uniform vec3 lightPos;             // Global variable for key light position
-    uniform vec3 light2Pos;            // Global variable for fill position
-    uniform vec3 viewPosition;         // Global variable for view position
-    uniform sampler2D ourTexture;      // Useful when working with multiple textures
-    uniform vec2 uvScale;           
+    uniform float specularIntensity;   // Set specular light strength
+    uniform float highlightSize;       // Set specular highlight size
 
     void main()
     {
-        // Phong lighting model calculations to generate ambient, diffuse, and specular components
+        vec3 norm = normalize(vertexNormal);                         // Normalize vectors to 1 unit
+        vec3 lighting = CalcLighting(norm, vertexFragmentPos, vertexViewDepth, specularIntensity, highlightSize, hasLightmap || hasProbeLighting);
+        lighting += SampleBakedLighting(LightmapCoord, norm);
 
-        //Calculate Ambient lighting
-        float ambientStrength = 1.0f;                   // Set ambient or global lighting strength for key light
-        float ambient2Strength = 0.1f;                  // Set ambient or global lighting strength for fill light
+        // Texture holds the color to be used for all three components
+        vec4 textureColor = SampleMaterialTexture(TextureCoord);
 
-        vec3 ambient = ambientStrength * lightColor;    // Generate ambient light color for key light
-        vec3 ambient2 = ambient2Strength * light2Color; // Generate ambient light color for fill light
+        fragmentColor = vec4(lighting * textureColor.xyz, 1.0); // Send lighting results to GPU
+    }
+);
 
-        //Calculate Diffuse lighting
-        vec3 norm = normalize(vertexNormal);                             // Normalize vectors to 1 unit
-        vec3 lightDirection = normalize(lightPos - vertexFragmentPos);   // Calculate distance (light direction) between light source and fragments/pixels on the pyramid
-        vec3 light2Direction = normalize(light2Pos - vertexFragmentPos); // Calculate distance (light direction) between light source and fragments/pixels on the pyramid
+/* G-buffer Fragment Shader Source Code (composed with bakedLightingShaderChunk and materialTextureShaderChunk): stores
+   the surface attributes instead of lighting them (see gbuffer.h)*/
+const GLchar* gBufferFragmentShaderSource = GLSL(440,
+    in vec3 vertexNormal;              // For incoming normals
+    in vec2 TextureCoord;              // For incoming texture coordinates
+    in vec2 LightmapCoord;             // For incoming lightmap coordinates
 
-        float impact = max(dot(norm, lightDirection), 0.0);              // Calculate diffuse impact by generating dot product of normal and light
-        float impact2 = max(dot(norm, light2Direction), 0.0);            // Calculate diffuse impact by generating dot product of normal and light
+    layout(location = 0) out vec4 gAlbedoSpecular;   // albedo color, specular intensity
+    layout(location = 1) out vec4 gNormalGloss;      // octahedral normal, highlight size / 256, baked lighting flag
+    layout(location = 2) out vec3 gBakedLight;       // light from the lightmap or the probes
 
-        vec3 diffuse = impact * lightColor;          // Generate diffuse light color for key light
-        vec3 diffuse2 = impact2 * light2Color;       // Generate diffuse light color for fill light
+    uniform float specularIntensity;
+    uniform float highlightSize;
 
-        //Calculate Specular lighting
-        float specularIntensity = 0.8f;         // Set specular light strength
-        float highlightSize = 16.0f;            // Set specular highlight size
-        vec3 viewDir = normalize(viewPosition - vertexFragmentPos);  // Calculate view direction
-        vec3 reflectDir = reflect(-lightDirection, norm);            // Calculate reflection vector
-        //Calculate specular component
-        float specularComponent = pow(max(dot(viewDir, reflectDir), 0.0), highlightSize);
-        vec3 specular = specularIntensity * specularComponent * lightColor;   // Generate specular intensity, component, and color for key light
-        vec3 specular2 = specularIntensity * specularComponent * light2Color; // Generate specular intensity, component, and color for fill light
+    // Folds the unit sphere onto a square so the normal fits in two channels
+    vec2 OctahedralEncode(vec3 n)
+    {
+        n /= abs(n.x) + abs(n.y) + abs(n.z);
+        vec2 encoded = n.xy;
+        if (n.z < 0.0)
+            encoded = (1.0 - abs(n.yx)) * vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+        return encoded;
+    }
 
-        // Texture holds the color to be used for all three components
-        vec4 textureColor = texture(ourTexture, TextureCoord * uvScale);
+    void main()
+    {
+        vec3 norm = normalize(vertexNormal);
+        gAlbedoSpecular = vec4(SampleMaterialTexture(TextureCoord).rgb, specularIntensity);
+        gNormalGloss = vec4(OctahedralEncode(norm) * 0.5 + 0.5, highlightSize / 256.0, hasLightmap || hasProbeLighting ? 1.0 : 0.0);
+        gBakedLight = SampleBakedLighting(LightmapCoord, norm);
+    }
+);
+
+/* Translucent Fragment Shader Source Code (composed with lightingShaderChunk, bakedLightingShaderChunk and
+   materialTextureShaderChunk): lit like the forward shader, then accumulated for weighted blended order-independent
+   transparency (see oit.h)*/
+const GLchar* transparentFragmentShaderSource = GLSL(440,
+    in vec3 vertexNormal;
+    in vec3 vertexFragmentPos;
+    in vec2 TextureCoord;
+    in float vertexViewDepth;
+    in vec2 LightmapCoord;
+
+    layout(location = 0) out vec4 accumulation;   // premultiplied color * weight, alpha * weight
+    layout(location = 1) out float revealage;     // alpha, multiplied into the revealage as (1 - alpha)
+
+    uniform float specularIntensity;
+    uniform float highlightSize;
+    uniform float opacity;             // Material opacity, times the texture's alpha
+
+    void main()
+    {
+        vec3 norm = normalize(vertexNormal);
+        vec3 lighting = CalcLighting(norm, vertexFragmentPos, vertexViewDepth, specularIntensity, highlightSize, hasLightmap || hasProbeLighting);
+        lighting += SampleBakedLighting(LightmapCoord, norm);
+        vec4 textureColor = SampleMaterialTexture(TextureCoord);
+        float alpha = opacity * textureColor.a;
+
+        // Nearer surfaces get more weight, so they dominate the average where several overlap
+        float depthScale = vertexViewDepth / 5.0;
+        float farScale = vertexViewDepth / 200.0;
+        float weight = alpha * clamp(10.0 / (1e-5 + depthScale * depthScale + farScale * farScale * farScale * farScale * farScale * farScale), 1e-2, 3e3);
+        accumulation = vec4(lighting * textureColor.rgb * alpha, alpha) * weight;
+        revealage = alpha;
+    }
+);
+
+/* Virtual texture feedback Fragment Shader Source Code (composed with materialTextureShaderChunk): the tile and
+   level each pixel of the virtual texture wants, drawn at low resolution and read back to drive the streaming*/
+const GLchar* virtualTextureFeedbackFragmentShaderSource = GLSL(440,
+    in vec2 TextureCoord;
+
+    out uvec4 feedback;                // tile x, y, level, and 1 where the virtual texture is seen
+
+    void main()
+    {
+        if (!hasVirtualTexture)
+        {
+            feedback = uvec4(0u);
+            return;
+        }
+        vec2 uv = TextureCoord * uvScale;
+        int level = VirtualLevel(uv);
+        feedback = uvec4(uvec2(VirtualTile(fract(uv), level)), uint(level), 1u);
+    }
+);
+
+/* Transparency composite Fragment Shader Source Code: the weighted average of the translucent colors, blended over
+   the opaque scene by how much of it they cover*/
+const GLchar* oitCompositeFragmentShaderSource = GLSL(440,
+    out vec4 fragmentColor;
+
+    uniform sampler2D accumulationTexture;
+    uniform sampler2D revealageTexture;
+
+    void main()
+    {
+        ivec2 pixel = ivec2(gl_FragCoord.xy);
+        float revealage = texelFetch(revealageTexture, pixel, 0).r;
+        if (revealage >= 1.0)
+            discard;   // nothing translucent here
+
+        vec4 accumulation = texelFetch(accumulationTexture, pixel, 0);
+        vec3 average = accumulation.rgb / max(accumulation.a, 1e-5);
+        fragmentColor = vec4(average, 1.0 - revealage);
+    }
+);
+
+/* Fullscreen triangle Vertex Shader Source Code: three vertices from gl_VertexID cover the viewport*/
+const GLchar* fullscreenVertexShaderSource = GLSL(440,
+    void main()
+    {
+        vec2 corner = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);
+        gl_Position = vec4(corner * 2.0 - 1.0, 0.0, 1.0);
+    }
+);
+
+/* Deferred lighting Fragment Shader Source Code (composed with lightingShaderChunk): rebuilds the position from
+   depth, decodes the G-buffer and runs the same cluster lighting as the forward shader*/
+const GLchar* deferredLightingFragmentShaderSource = GLSL(440,
+    out vec4 fragmentColor;
+
+    uniform sampler2D gAlbedoSpecular;
+    uniform sampler2D gNormalGloss;
+    uniform sampler2D gDepth;
+    uniform sampler2D gBakedLight;
+    uniform mat4 inverseProjection;    // clip to view space
+    uniform mat4 inverseView;          // view to world space
+
+    vec3 OctahedralDecode(vec2 encoded)
+    {
+        vec3 n = vec3(encoded, 1.0 - abs(encoded.x) - abs(encoded.y));
+        float fold = max(-n.z, 0.0);
+        n.x += n.x >= 0.0 ? -fold : fold;
+        n.y += n.y >= 0.0 ? -fold : fold;
+        return normalize(n);
+    }
+
+    void main()
+    {
+        ivec2 pixel = ivec2(gl_FragCoord.xy);
+        float depth = texelFetch(gDepth, pixel, 0).r;
+        if (depth == 1.0)
+            discard;   // nothing was drawn here, keep the background
+
+        vec4 albedoSpecular = texelFetch(gAlbedoSpecular, pixel, 0);
+        vec4 normalGloss = texelFetch(gNormalGloss, pixel, 0);
+        vec3 norm = OctahedralDecode(normalGloss.xy * 2.0 - 1.0);
+
+        vec4 viewSpace = inverseProjection * vec4(gl_FragCoord.xy / clusterViewport * 2.0 - 1.0, depth * 2.0 - 1.0, 1.0);
+        viewSpace /= viewSpace.w;
+        vec3 fragPos = vec3(inverseView * viewSpace);
+
+        vec3 lighting = CalcLighting(norm, fragPos, -viewSpace.z, albedoSpecular.a, normalGloss.z * 256.0, normalGloss.a > 0.5);
+        lighting += texelFetch(gBakedLight, pixel, 0).rgb;
+        fragmentColor = vec4(lighting * albedoSpecular.rgb, 1.0);
+    }
+);
+
+/* Depth pre-pass Vertex Shader Source Code: reads only the position stream and computes the clip position exactly
+   like vertexShaderSource, so the shading pass can test against the depth with GL_EQUAL*/
+const GLchar* depthPrepassVertexShaderSource = GLSL(440,
+    layout(location = 0) in vec3 position; // Position-only stream of the depth VAO
+    invariant gl_Position;
+
+    uniform mat4 model;
+    uniform mat4 view;
+    uniform mat4 projection;
+
+    void main()
+    {
+        gl_Position = projection * view * model * vec4(position, 1.0f);
+    }
+);
+
+/* Ambient occlusion Fragment Shader Source Code: one reduced resolution pixel per invocation. The view space
+   position and normal come from the depth buffer; samples on a disc around the pixel that rise above the
+   surface's tangent plane occlude it (Alchemy ambient obscurance). The disc is rotated per pixel and per frame,
+   and the resolve pass averages the rotations over time*/
+const GLchar* ambientOcclusionFragmentShaderSource = GLSL(440,
+    out float occlusion;
+
+    uniform sampler2D depthTexture;    // full resolution
+    uniform mat4 projection;
+    uniform mat4 inverseProjection;
+    uniform vec2 viewportSize;         // full resolution area being rendered
+    uniform int divisor;               // full resolution pixels per reduced pixel along each axis
+    uniform int sampleCount;
+    uniform float radius;              // world units
+    uniform float intensity;
+    uniform uint frameIndex;
+
+    vec3 ViewPosition(ivec2 pixel)
+    {
+        float depth = texelFetch(depthTexture, pixel, 0).r;
+        vec4 viewSpace = inverseProjection * vec4((vec2(pixel) + 0.5) / viewportSize * 2.0 - 1.0, depth * 2.0 - 1.0, 1.0);
+        return viewSpace.xyz / viewSpace.w;
+    }
+
+    void main()
+    {
+        ivec2 maxPixel = ivec2(viewportSize) - 1;
+        ivec2 pixel = min(ivec2(gl_FragCoord.xy) * divisor + divisor / 2, maxPixel);
+        if (texelFetch(depthTexture, pixel, 0).r == 1.0)
+        {
+            occlusion = 1.0;   // background
+            return;
+        }
+        vec3 position = ViewPosition(pixel);
+
+        // Normal from the neighbors, taking the smaller depth step on each axis so edges do not bend it
+        vec3 right = ViewPosition(min(pixel + ivec2(1, 0), maxPixel)) - position;
+        vec3 left = position - ViewPosition(max(pixel - ivec2(1, 0), ivec2(0)));
+        vec3 up = ViewPosition(min(pixel + ivec2(0, 1), maxPixel)) - position;
+        vec3 down = position - ViewPosition(max(pixel - ivec2(0, 1), ivec2(0)));
+        vec3 normal = normalize(cross(abs(right.z) < abs(left.z) ? right : left, abs(up.z) < abs(down.z) ? up : down));
+
+        // Radius in pixels (perspective shrinks it with distance), capped to keep the reads near each other
+        float distanceScale = projection[2][3] != 0.0 ? -position.z : 1.0;
+        float pixelRadius = min(radius * projection[1][1] * 0.5 * viewportSize.y / distanceScale, viewportSize.y * 0.1);
+        float rotation = fract(52.9829189 * fract(dot(gl_FragCoord.xy, vec2(0.06711056, 0.00583715))) + float(frameIndex) * 0.618034);
+
+        float sum = 0.0;
+        for (int i = 0; i < sampleCount; ++i)
+        {
+            float t = (float(i) + 0.5) / float(sampleCount);
+            float angle = (float(i) * 2.399963 + rotation * 6.283185);   // golden angle spiral
+            vec2 offset = vec2(cos(angle), sin(angle)) * sqrt(t) * pixelRadius;
+            vec3 toSample = ViewPosition(clamp(pixel + ivec2(offset), ivec2(0), maxPixel)) - position;
+            float lengthSquared = dot(toSample, toSample);
+            if (lengthSquared < radius * radius * 4.0)
+                sum += max(dot(toSample, normal) + position.z * 0.002, 0.0) / (lengthSquared + 0.01);
+        }
+        occlusion = clamp(1.0 - 2.0 * intensity * radius * sum / float(sampleCount), 0.0, 1.0);
+    }
+);
+
+/* Ambient occlusion resolve Fragment Shader Source Code: full resolution. The four reduced resolution results
+   around the pixel are blended bilinearly, each weighted down by how far its depth is from the pixel's, so
+   occlusion does not bleed across edges; then last frame's result is reprojected, clamped to the range of
+   those four and blended in*/
+const GLchar* ambientOcclusionResolveFragmentShaderSource = GLSL(440,
+    out float occlusion;
+
+    uniform sampler2D depthTexture;        // full resolution
+    uniform sampler2D rawOcclusion;        // reduced resolution
+    uniform sampler2D historyOcclusion;    // last frame's result
+    uniform vec2 viewportSize;
+    uniform int divisor;
+    uniform mat4 inverseProjection;
+    uniform mat4 inverseView;
+    uniform mat4 previousViewProjection;
+    uniform vec2 historyScale;             // last frame's rendered area / allocated size
+    uniform bool historyValid;
+    uniform float historyWeight;
+
+    float ViewDepth(ivec2 pixel)
+    {
+        vec4 viewSpace = inverseProjection * vec4(0.0, 0.0, texelFetch(depthTexture, pixel, 0).r * 2.0 - 1.0, 1.0);
+        return -viewSpace.z / viewSpace.w;
+    }
+
+    void main()
+    {
+        ivec2 pixel = ivec2(gl_FragCoord.xy);
+        ivec2 maxPixel = ivec2(viewportSize) - 1;
+        float depth = texelFetch(depthTexture, pixel, 0).r;
+        if (depth == 1.0)
+        {
+            occlusion = 1.0;
+            return;
+        }
+        float viewDepth = ViewDepth(pixel);
+
+        // Bilateral upsample
+        vec2 lowCoord = (vec2(pixel) + 0.5) / float(divisor) - 0.5;
+        ivec2 base = ivec2(floor(lowCoord));
+        vec2 fraction = lowCoord - vec2(base);
+        ivec2 lowMax = maxPixel / divisor;
+        float total = 0.0;
+        float weightSum = 0.0;
+        float lowest = 1.0;
+        float highest = 0.0;
+        for (int i = 0; i < 4; ++i)
+        {
+            ivec2 corner = ivec2(i & 1, i >> 1);
+            ivec2 low = clamp(base + corner, ivec2(0), lowMax);
+            float sampleDepth = ViewDepth(min(low * divisor + divisor / 2, maxPixel));
+            vec2 bilinear = mix(1.0 - fraction, fraction, vec2(corner));
+            float weight = max(bilinear.x * bilinear.y, 1e-3) / (1e-3 + abs(sampleDepth - viewDepth) / viewDepth);
+            float value = texelFetch(rawOcclusion, low, 0).r;
+            total += value * weight;
+            weightSum += weight;
+            lowest = min(lowest, value);
+            highest = max(highest, value);
+        }
+        float current = total / weightSum;
+
+        // Temporal accumulation
+        if (historyValid)
+        {
+            vec4 viewSpace = inverseProjection * vec4((vec2(pixel) + 0.5) / viewportSize * 2.0 - 1.0, depth * 2.0 - 1.0, 1.0);
+            vec4 previous = previousViewProjection * (inverseView * (viewSpace / viewSpace.w));
+            vec2 previousCoord = previous.xy / previous.w * 0.5 + 0.5;
+            if (all(greaterThanEqual(previousCoord, vec2(0.0))) && all(lessThanEqual(previousCoord, vec2(1.0))))
+            {
+                float history = clamp(texture(historyOcclusion, previousCoord * historyScale).r, lowest, highest);
+                current = mix(current, history, historyWeight);
+            }
+        }
+        occlusion = current;
+    }
+);
 
-        // Calculate phong result
-        vec3 phong = (ambient + ambient2 + diffuse + specular) * textureColor.xyz;
+/* Shadow Vertex Shader Source Code: depth passes read only the position stream*/
+const GLchar* shadowVertexShaderSource = GLSL(440,
+    layout(location = 0) in vec3 position; // Position-only stream of the depth VAO
 
-        fragmentColor = texture(ourTexture, TextureCoord); // Send lighting results to GPU
+    out vec3 worldPosition;
+
+    uniform mat4 model;
+    uniform mat4 lightViewProjection;   // One cube face or cascade
+
+    void main()
+    {
+        vec4 world = model * vec4(position, 1.0f);
+        worldPosition = world.xyz;
+        gl_Position = lightViewProjection * world;
+    }
+);
+
+/* Point Shadow Fragment Shader Source Code: stores the distance to the light, so one range covers all six faces*/
+const GLchar* pointShadowFragmentShaderSource = GLSL(440,
+    in vec3 worldPosition;
+
+    uniform vec3 lightPosition;
+    uniform float farPlane;
+
+    void main()
+    {
+        gl_FragDepth = length(worldPosition - lightPosition) / farPlane;
+    }
+);
+
+/* Cascade Shadow Fragment Shader Source Code: plain depth*/
+const GLchar* cascadeShadowFragmentShaderSource = GLSL(440,
+    void main()
+    {
     }
 );
 
@@ -244,6 +1077,154 @@ const GLchar* lampFragmentShaderSource = GLSL(440,
     }
 );
 
+/* Particle simulation Compute Shader Source Code: one invocation per particle. Particles age and move under
+   their kind's lift and drag; when one dies it is reborn at its emitter (see particles.h)*/
+const GLchar* particleComputeShaderSource = GLSL(440,
+    layout(local_size_x = 256) in;   // PARTICLE_GROUP_SIZE
+
+    struct Particle
+    {
+        vec4 positionAge;        // world position, age in seconds (negative while waiting to be born)
+        vec4 velocityLifetime;   // velocity, lifetime in seconds
+    };
+    layout(std430, binding = 3) buffer ParticleBuffer { Particle particles[]; };
+    layout(std430, binding = 4) readonly buffer EmitterBuffer { vec4 emitters[]; };
+
+    uniform uint particleCount;
+    uniform uint particlesPerEmitter;
+    uniform uvec2 kindStart;         // first ember and first smoke particle of an emitter's block
+    uniform vec4 kindParams[6];      // per kind: lifetime range and birth speed, then spread, spawn height, lift, drag
+    uniform float deltaTime;
+    uniform uint frameSeed;
+
+    // Same hash as ParticleHash in particles.h
+    uint Hash(uint x)
+    {
+        x = x * 747796405u + 2891336453u;
+        uint word = ((x >> ((x >> 28u) + 4u)) ^ x) * 277803737u;
+        return (word >> 22u) ^ word;
+    }
+
+    float Random(inout uint state)
+    {
+        state = Hash(state);
+        return float(state >> 8u) / 16777216.0;
+    }
+
+    void main()
+    {
+        uint index = gl_GlobalInvocationID.x;
+        if (index >= particleCount)
+            return;
+
+        uint local = index % particlesPerEmitter;
+        int kind = local < kindStart.x ? 0 : (local < kindStart.y ? 1 : 2);
+        vec4 life = kindParams[kind * 2];
+        vec4 motion = kindParams[kind * 2 + 1];
+        Particle particle = particles[index];
+
+        particle.positionAge.w += deltaTime;
+        if (particle.positionAge.w >= particle.velocityLifetime.w)
+        {
+            // reborn at the emitter, moving up and outward at a random speed
+            uint state = Hash(index ^ Hash(frameSeed));
+            float angle = Random(state) * 6.283185;
+            float radius = Random(state);
+            vec3 horizontal = vec3(cos(angle), 0.0, sin(angle)) * radius * motion.x;
+            vec3 emitter = emitters[index / particlesPerEmitter].xyz;
+            particle.positionAge = vec4(emitter + horizontal * 0.2 + vec3(0.0, motion.y, 0.0), 0.0);
+            float speed = life.z + Random(state) * life.w;
+            particle.velocityLifetime = vec4(horizontal.x, speed, horizontal.z, mix(life.x, life.y, Random(state)));
+        }
+        else
+        {
+            float damping = max(1.0 - motion.w * deltaTime, 0.0);
+            vec3 velocity = particle.velocityLifetime.xyz;
+            velocity.y += motion.z * deltaTime;
+            velocity *= damping;
+            particle.positionAge.xyz += velocity * deltaTime;
+            particle.velocityLifetime.xyz = velocity;
+        }
+        particles[index] = particle;
+    }
+);
+
+/* Particle billboard Vertex Shader Source Code: a camera facing quad per instance, read straight from the
+   particle buffer. Size and color follow the particle's kind and age*/
+const GLchar* particleVertexShaderSource = GLSL(440,
+    struct Particle
+    {
+        vec4 positionAge;
+        vec4 velocityLifetime;
+    };
+    layout(std430, binding = 3) readonly buffer ParticleBuffer { Particle particles[]; };
+
+    out vec2 cornerCoord;      // -1 to 1 across the quad
+    out vec4 particleColor;    // premultiplied; alpha 0 adds light, alpha above 0 covers what is behind
+
+    uniform mat4 view;
+    uniform mat4 projection;
+    uniform uint particlesPerEmitter;
+    uniform uvec2 kindStart;
+
+    void main()
+    {
+        Particle particle = particles[gl_InstanceID];
+        cornerCoord = vec2(gl_VertexID & 1, gl_VertexID >> 1) * 2.0 - 1.0;
+        particleColor = vec4(0.0);
+
+        float age = particle.positionAge.w;
+        float lifetime = particle.velocityLifetime.w;
+        if (age < 0.0 || age >= lifetime)
+        {
+            gl_Position = vec4(0.0, 0.0, 2.0, 1.0);   // not alive: outside the clip volume
+            return;
+        }
+
+        float t = age / lifetime;
+        uint local = uint(gl_InstanceID) % particlesPerEmitter;
+        float size;
+        if (local < kindStart.x)
+        {
+            // flame: white-yellow core cooling to orange, shrinking as it rises
+            size = mix(0.05, 0.01, t);
+            particleColor = vec4(mix(vec3(1.0, 0.85, 0.5), vec3(1.0, 0.3, 0.05), t) * (1.0 - t) * 0.6, 0.0);
+        }
+        else if (local < kindStart.y)
+        {
+            // ember: a small bright spark fading out
+            size = 0.008;
+            particleColor = vec4(vec3(1.0, 0.45, 0.1) * (1.0 - t) * 2.0, 0.0);
+        }
+        else
+        {
+            // smoke: thin grey puff growing as it rises, faded in and out
+            size = mix(0.03, 0.15, t);
+            float alpha = 0.3 * t * (1.0 - t);
+            particleColor = vec4(vec3(0.3) * alpha, alpha);
+        }
+
+        vec3 cameraRight = vec3(view[0][0], view[1][0], view[2][0]);
+        vec3 cameraUp = vec3(view[0][1], view[1][1], view[2][1]);
+        vec3 world = particle.positionAge.xyz + (cameraRight * cornerCoord.x + cameraUp * cornerCoord.y) * size;
+        gl_Position = projection * view * vec4(world, 1.0);
+    }
+);
+
+/* Particle billboard Fragment Shader Source Code: a soft round spot*/
+const GLchar* particleFragmentShaderSource = GLSL(440,
+    in vec2 cornerCoord;
+    in vec4 particleColor;
+
+    out vec4 fragmentColor;
+
+    void main()
+    {
+        float falloff = max(1.0 - dot(cornerCoord, cornerCoord), 0.0);
+        fragmentColor = particleColor * falloff * falloff;
+    }
+);
+
 // Images are loaded with Y axis going down, but OpenGL's Y axis goes up, so let's flip it
 void flipImageVertically(unsigned char* image, int width, int height, int channels)
 {
@@ -269,27 +1250,202 @@ int main(int argc, char* argv[])
     if (!UInitialize(argc, argv, &gWindow))
         return EXIT_FAILURE;
 
-    //Coordinates for planes
-    struct GLCoord topLeft = { -5.0f, -0.3f, -5.0f };
-    struct GLCoord topRight = { 5.0f, -0.3f, -5.0f };
-    struct GLCoord bottomLeft = { -5.0f, -0.3f, 5.0f };
-    struct GLCoord bottomRight = { 5.0f, -0.3f, 5.0f };
-    UCreatePlaneMesh(tableMesh, topRight, topLeft, bottomLeft, bottomRight);
-    UCreateUpperCandlestickMesh(upperCandlestickMesh);
-    UCreateLowerCandlestickMesh(lowerCandlestickMesh);
-    UCreateCandleMesh(candleMesh);
-    UCreateCandleWickMesh(candleWickMesh);
-    UCreateNapkinMesh(napkinMesh);
-    UCreateKnifeMesh(knifeMesh);
-    UCreateKnifeTipMesh(knifeTipMesh);
-
-    // Create the shader program
-    if (!UCreateShaderProgram(vertexShaderSource, fragmentShaderSource, gProgramId))
-        return EXIT_FAILURE;
+    // --on-demand: only draw when the camera, the window, an animation, or an asset changes
+    // --fps N: target frame rate (0 for no cap)
+    // --gpu-budget MS: GPU time per frame the dynamic resolution controller aims for
+    // --lights N: scatter N extra small point lights over the table to stress the light culling
+    // --deferred: start with the deferred shading path
+    // --sun: add a directional light with cascaded shadows
+    // --bake-lightmaps: rebake the lightmaps and light probes that are out of date and save them before starting
+    // --flames N: scatter N extra candle flames over the table to stress the particle simulation
+    // --cpu-particles: simulate the particles on the worker threads instead of in a compute shader
+    // --object-lights: forward lit draws loop over their own short light list instead of their cluster's
+    // --depth-prepass: write the opaque depth first, then shade with an equal depth test
+    // --ao N: ambient occlusion quality, 0 (off) to 3
+    // --cook-textures: compress the textures that changed into KTX2 files next to them before starting (and with
+    //     --virtual-texture, cut the table's texture into its tile file)
+    // --cook-bc7: cook to BC7 instead of BC1
+    // --cook-quality N: block compression quality, 0 (fast) to 2 (high)
+    // --texture-budget MB: GPU memory the material textures may take before their largest levels are dropped
+    // --no-decoded-cache: decode every texture, without reading or writing the cache of decoded images
+    // --decoded-cache-size MB: disk space the decoded images may take, least recently used deleted first
+    // --decoded-cache-lz4: store newly decoded images LZ4 compressed instead of raw
+    // --clear-decoded-cache: delete the decoded images before starting
+    // --atlas: pack the small material textures into atlas pages
+    // --virtual-texture: stream the table's texture in tiles from the tile file next to it (see --cook-textures)
+    // --bc-benchmark: compress every texture with each format and quality, print speed and PSNR, and exit
+    int testLights = 0;
+    int testFlames = 0;
+    bool cpuParticles = false;
+    bool cookTextures = false;
+    BcFormat cookFormat = BC_FORMAT_BC1;
+    BcQuality cookQuality = BC_QUALITY_NORMAL;
+    bool decodedCache = true;
+    size_t decodedCacheBytes = DECODED_CACHE_DEFAULT_BYTES;
+    bool decodedCacheCompress = false;
+    bool clearDecodedCache = false;
+    bool bcBenchmark = false;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--on-demand") == 0)
+            gRenderMode = RENDER_ON_DEMAND;
+        else if (strcmp(argv[i], "--fps") == 0 && i + 1 < argc)
+            gFramePacer.SetTargetFrameRate(atof(argv[++i]));
+        else if (strcmp(argv[i], "--gpu-budget") == 0 && i + 1 < argc)
+            gDynamicResolution.BudgetMs = atof(argv[++i]);
+        else if (strcmp(argv[i], "--lights") == 0 && i + 1 < argc)
+            testLights = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--deferred") == 0)
+            gRenderPath = RENDER_DEFERRED;
+        else if (strcmp(argv[i], "--sun") == 0)
+            gSunEnabled = true;
+        else if (strcmp(argv[i], "--bake-lightmaps") == 0)
+            gBakeLightmaps = true;
+        else if (strcmp(argv[i], "--flames") == 0 && i + 1 < argc)
+            testFlames = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--cpu-particles") == 0)
+            cpuParticles = true;
+        else if (strcmp(argv[i], "--object-lights") == 0)
+            gPerObjectLights = true;
+        else if (strcmp(argv[i], "--depth-prepass") == 0)
+            gDepthPrepass = true;
+        else if (strcmp(argv[i], "--ao") == 0 && i + 1 < argc)
+            gAmbientOcclusionQuality = std::min(std::max(atoi(argv[++i]), 0), 3);
+        else if (strcmp(argv[i], "--cook-textures") == 0)
+            cookTextures = true;
+        else if (strcmp(argv[i], "--cook-bc7") == 0)
+            cookFormat = BC_FORMAT_BC7;
+        else if (strcmp(argv[i], "--cook-quality") == 0 && i + 1 < argc)
+            cookQuality = (BcQuality)std::min(std::max(atoi(argv[++i]), 0), (int)BC_QUALITY_COUNT - 1);
+        else if (strcmp(argv[i], "--texture-budget") == 0 && i + 1 < argc)
+            gTextureCache.SetBudget((size_t)(std::max(atof(argv[++i]), 0.0) * 1024 * 1024));
+        else if (strcmp(argv[i], "--no-decoded-cache") == 0)
+            decodedCache = false;
+        else if (strcmp(argv[i], "--decoded-cache-size") == 0 && i + 1 < argc)
+            decodedCacheBytes = (size_t)(std::max(atof(argv[++i]), 0.0) * 1024 * 1024);
+        else if (strcmp(argv[i], "--decoded-cache-lz4") == 0)
+            decodedCacheCompress = true;
+        else if (strcmp(argv[i], "--clear-decoded-cache") == 0)
+            clearDecodedCache = true;
+        else if (strcmp(argv[i], "--atlas") == 0)
+            gAtlasTextures = true;
+        else if (strcmp(argv[i], "--virtual-texture") == 0)
+            gVirtualTextureEnabled = true;
+        else if (strcmp(argv[i], "--bc-benchmark") == 0)
+            bcBenchmark = true;
+    }
 
-    //generate the textures
+    // The benchmark only needs the texture files; nothing has been created yet but the window
+    if (bcBenchmark)
+    {
+        UBenchmarkTextureEncoder();
+        glfwDestroyWindow(gWindow);
+        glfwTerminate();
+        exit(EXIT_SUCCESS);
+    }
+
+    // generate the textures first, so their decoding overlaps with compiling the shaders and building the scene
+    if (decodedCache && gDecodedImageCache.Open(DECODED_CACHE_DIRECTORY, decodedCacheBytes, decodedCacheCompress, clearDecodedCache))
+        gTextureCache.SetDiskCache(&gDecodedImageCache);
+    else if (decodedCache)
+        cout << "failed to open the decoded image cache " << DECODED_CACHE_DIRECTORY << endl;
+    if (cookTextures)
+        UCookTextures(cookFormat, cookQuality);
     generateTextures();
 
+    // Create the shader programs: forward, and the two deferred passes. The fragment shaders that light
+    // surfaces share the lighting chunk, the ones that read lightmaps the lightmap chunk
+    std::string forwardSource = UComposeShader(UComposeShader(UComposeShader(fragmentShaderSource, lightingShaderChunk).c_str(),
+        bakedLightingShaderChunk).c_str(), materialTextureShaderChunk);
+    if (!UCreateShaderProgram(vertexShaderSource, forwardSource.c_str(), gProgramId))
+        return EXIT_FAILURE;
+    std::string gBufferSource = UComposeShader(UComposeShader(gBufferFragmentShaderSource, bakedLightingShaderChunk).c_str(), materialTextureShaderChunk);
+    if (!UCreateShaderProgram(vertexShaderSource, gBufferSource.c_str(), gGBufferProgramId))
+        return EXIT_FAILURE;
+    if (!UCreateShaderProgram(fullscreenVertexShaderSource, UComposeShader(deferredLightingFragmentShaderSource, lightingShaderChunk).c_str(), gDeferredLightingProgramId))
+        return EXIT_FAILURE;
+
+    // Translucent surfaces are lit like forward ones, then composited with a fullscreen pass
+    std::string transparentSource = UComposeShader(UComposeShader(UComposeShader(transparentFragmentShaderSource, lightingShaderChunk).c_str(),
+        bakedLightingShaderChunk).c_str(), materialTextureShaderChunk);
+    if (!UCreateShaderProgram(vertexShaderSource, transparentSource.c_str(), gTransparentProgramId))
+        return EXIT_FAILURE;
+    if (!UCreateShaderProgram(fullscreenVertexShaderSource, oitCompositeFragmentShaderSource, gOitCompositeProgramId))
+        return EXIT_FAILURE;
+    glUniform1i(glGetUniformLocation(gOitCompositeProgramId, "accumulationTexture"), 0);
+    glUniform1i(glGetUniformLocation(gOitCompositeProgramId, "revealageTexture"), 1);
+    glUseProgram(gTransparentProgramId);
+    glUniform1i(glGetUniformLocation(gTransparentProgramId, "lightmapTexture"), LIGHTMAP_TEXTURE_UNIT);
+
+    // Every program with the material chunk gets the virtual texture's units, in use or not, so its integer
+    // sampler never shares a unit with ourTexture. The feedback pass corrects its detail level for its resolution
+    if (!UCreateShaderProgram(vertexShaderSource, UComposeShader(virtualTextureFeedbackFragmentShaderSource, materialTextureShaderChunk).c_str(), gVirtualTextureFeedbackProgramId))
+        return EXIT_FAILURE;
+    USetVirtualTextureSamplers(gProgramId, 0.0f);
+    USetVirtualTextureSamplers(gGBufferProgramId, 0.0f);
+    USetVirtualTextureSamplers(gTransparentProgramId, 0.0f);
+    USetVirtualTextureSamplers(gVirtualTextureFeedbackProgramId, -std::log2((float)VT_FEEDBACK_DIVISOR));
+
+    // The G-buffer textures sit on units 0 to 3 during the lighting pass; lightmaps are read from unit 3
+    glUseProgram(gDeferredLightingProgramId);
+    glUniform1i(glGetUniformLocation(gDeferredLightingProgramId, "gAlbedoSpecular"), 0);
+    glUniform1i(glGetUniformLocation(gDeferredLightingProgramId, "gNormalGloss"), 1);
+    glUniform1i(glGetUniformLocation(gDeferredLightingProgramId, "gDepth"), 2);
+    glUniform1i(glGetUniformLocation(gDeferredLightingProgramId, "gBakedLight"), 3);
+    glUseProgram(gProgramId);
+    glUniform1i(glGetUniformLocation(gProgramId, "lightmapTexture"), LIGHTMAP_TEXTURE_UNIT);
+    glUseProgram(gGBufferProgramId);
+    glUniform1i(glGetUniformLocation(gGBufferProgramId, "lightmapTexture"), LIGHTMAP_TEXTURE_UNIT);
+    glGenVertexArrays(1, &gFullscreenVao);
+
+    // Depth pre-pass: nothing to do per fragment, so it shares the cascades' empty fragment shader
+    if (!UCreateShaderProgram(depthPrepassVertexShaderSource, cascadeShadowFragmentShaderSource, gDepthPrepassProgramId))
+        return EXIT_FAILURE;
+
+    // Ambient occlusion passes, and where the lighting programs find the result
+    if (!UCreateShaderProgram(fullscreenVertexShaderSource, ambientOcclusionFragmentShaderSource, gAmbientOcclusionProgramId))
+        return EXIT_FAILURE;
+    if (!UCreateShaderProgram(fullscreenVertexShaderSource, ambientOcclusionResolveFragmentShaderSource, gAmbientOcclusionResolveProgramId))
+        return EXIT_FAILURE;
+    glUseProgram(gProgramId);
+    glUniform1i(glGetUniformLocation(gProgramId, "ambientOcclusionTexture"), AMBIENT_OCCLUSION_TEXTURE_UNIT);
+    glUseProgram(gDeferredLightingProgramId);
+    glUniform1i(glGetUniformLocation(gDeferredLightingProgramId, "ambientOcclusionTexture"), AMBIENT_OCCLUSION_TEXTURE_UNIT);
+    gAmbientOcclusion.SetQuality(gAmbientOcclusionQuality);
+
+    // Shadow depth programs and maps; the lighting programs read the maps from their own texture units
+    if (!UCreateShaderProgram(shadowVertexShaderSource, pointShadowFragmentShaderSource, gPointShadowProgramId))
+        return EXIT_FAILURE;
+    if (!UCreateShaderProgram(shadowVertexShaderSource, cascadeShadowFragmentShaderSource, gCascadeShadowProgramId))
+        return EXIT_FAILURE;
+    gPointShadows.Create(GL_TEXTURE_CUBE_MAP_ARRAY, POINT_SHADOW_SIZE, MAX_POINT_SHADOWS * 6);
+    glEnable(GL_TEXTURE_CUBE_MAP_SEAMLESS);     // filter across cube face edges
+    if (gSunEnabled)
+        gCascadeShadows.Create(GL_TEXTURE_2D_ARRAY, CASCADE_SIZE, CASCADE_COUNT);
+    USetShadowSamplers(gProgramId);
+    USetShadowSamplers(gDeferredLightingProgramId);
+    USetShadowSamplers(gTransparentProgramId);
+
+    // Particle simulation and billboard programs
+    if (!cpuParticles && !UCreateComputeProgram(particleComputeShaderSource, gParticleComputeProgramId))
+        return EXIT_FAILURE;
+    if (!UCreateShaderProgram(particleVertexShaderSource, particleFragmentShaderSource, gParticleProgramId))
+        return EXIT_FAILURE;
+
+    // Create the meshes, transform hierarchy, and entities of the scene
+    UCreateScene();
+    UCreateTestLights(testLights);
+    UCreateTestFlames(testFlames);
+
+    // One particle emitter per flame. The flames never stop moving, so they count as a running animation
+    gParticles.Create((int)gFlameNodes.size(), !cpuParticles);
+    gFlamePositions.resize(gFlameNodes.size());
+    if (gParticles.EmitterCount() > 0)
+        ++gActiveAnimations;
+
+    // Offscreen target the scene is rendered into
+    gSceneTarget.Resize(gWindowWidth, gWindowHeight);
+
     // tell opengl for each sampler to which texture unit it belongs to (only has to be done once)
     glUseProgram(gProgramId);
 
@@ -300,62 +1456,110 @@ int main(int argc, char* argv[])
     // -----------
     while (!glfwWindowShouldClose(gWindow))
     {
-        //set perspective and ortho projections and enables nuanced camera controls such as in the mouse scroll and mouse cursor
-        perspective = glm::perspective(glm::radians(gCamera.Zoom), (GLfloat)WINDOW_WIDTH / (GLfloat)WINDOW_HEIGHT, 0.1f, 100.0f);
-        ortho = glm::ortho(-2.0f, 2.0f, -2.0f, 2.0f, 0.1f, 100.0f);
-
-        // per-frame timing
+        // per-frame timing: wait for this frame's slot before reading input, so the input is as fresh as possible
         // --------------------
-        float currentFrame = glfwGetTime();
-        gDeltaTime = currentFrame - gLastFrame;
-        gLastFrame = currentFrame;
-
-        rotation = glm::rotate(glm::radians(0.0f), glm::vec3(1.0f, 0.0f, 0.0f));
-        rotation = glm::rotate(glm::radians(0.0f), glm::vec3(0.0f, -1.0f, 0.0f));
-        translation = glm::translate(glm::vec3(0.0f, 0.0f, 0.0f));
-
-        // Model matrix: transformations are applied right-to-left order
-        model = translation * rotation;
-
-        view = gCamera.GetViewMatrix();
-
-        // Retrieves and passes transform matrices to the Shader program
-        GLint modelLoc = glGetUniformLocation(gProgramId, "model");
-        GLint viewLoc = glGetUniformLocation(gProgramId, "view");
-        GLint projLoc = glGetUniformLocation(gProgramId, "projection");
-
-        glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
-        glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-        glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
+        gDeltaTime = (float)gFramePacer.WaitForNextFrame();
 
         // input
         // -----
+        glfwPollEvents();
         UProcessInput(gWindow);
+        UUpdateTextures();
+
+        // On-demand mode: when nothing changed, sleep until an event arrives instead of drawing the same frame again.
+        // A minimized window has nothing to draw into either
+        if (!UFrameNeeded() || gWindowWidth == 0 || gWindowHeight == 0)
+        {
+            ++gFramesSkipped;
+            glfwWaitEventsTimeout(IDLE_WAIT_TIMEOUT);
+            gFramePacer.Resync();   // time spent idle must not turn into camera movement or a missed deadline
+            continue;
+        }
+        gRedrawRequested = false;
+
+        //set perspective and ortho projections and enables nuanced camera controls such as in the mouse scroll and mouse cursor
+        perspective = glm::perspective(glm::radians(gCamera.Zoom), (GLfloat)gWindowWidth / (GLfloat)gWindowHeight, NEAR_PLANE, FAR_PLANE);
+        ortho = glm::ortho(-2.0f, 2.0f, -2.0f, 2.0f, NEAR_PLANE, FAR_PLANE);
 
         if (isPerspective)
             projection = perspective;
         else
             projection = ortho;
 
+        view = gCamera.GetViewMatrix();
+
+        // Fit the directional light's cascades to this view
+        if (gSunEnabled)
+            ComputeCascades(view, projection, NEAR_PLANE, CASCADE_SHADOW_DISTANCE, SUN_DIRECTION, gCascades);
+
+        // Recompute the world matrices of anything that moved, then cull and collect this frame's draws
+        UUpdateTransforms();
+        UBuildDrawList(projection * view);
+        UNoteTextureUse();
+
+        // Sort the lights into clusters for this view
+        UUpdateLights(view, projection);
+
+        // Move the flame particles
+        UUpdateParticles();
+
         // Render this frame
         URender();
-
-        glfwPollEvents();
+        if (++gFramesRendered == 1)
+            cout << "INFO: First frame after " << glfwGetTime() << " s, " << gTextureCache.Pending() << " textures still loading" << endl;
     }
 
-    // Release shader program
+    UPrintFrameStats();
+
+    // Release the offscreen targets, GPU timers and light buffers
+    gSceneTarget.Destroy();
+    gGBuffer.Destroy();
+    gLightingTimer.Destroy();
+    gPrepassTimer.Destroy();
+    gAmbientOcclusion.Destroy();
+    gAmbientOcclusionTimer.Destroy();
+    gOitBuffer.Destroy();
+    gTransparentTimer.Destroy();
+    gPointShadows.Destroy();
+    gCascadeShadows.Destroy();
+    gShadowTimer.Destroy();
+    gClusteredLighting.Destroy();
+    gObjectLights.Destroy();
+    gParticles.Destroy();
+    gParticleTimer.Destroy();
+    glDeleteVertexArrays(1, &gFullscreenVao);
+    gSceneTimer.Destroy();
+
+    // Release shader programs
     UDestroyShaderProgram(gProgramId);
+    UDestroyShaderProgram(gGBufferProgramId);
+    UDestroyShaderProgram(gDeferredLightingProgramId);
+    UDestroyShaderProgram(gDepthPrepassProgramId);
+    UDestroyShaderProgram(gAmbientOcclusionProgramId);
+    UDestroyShaderProgram(gVirtualTextureFeedbackProgramId);
+    UDestroyShaderProgram(gAmbientOcclusionResolveProgramId);
+    UDestroyShaderProgram(gTransparentProgramId);
+    UDestroyShaderProgram(gOitCompositeProgramId);
+    UDestroyShaderProgram(gPointShadowProgramId);
+    UDestroyShaderProgram(gCascadeShadowProgramId);
+    if (!cpuParticles)
+        UDestroyShaderProgram(gParticleComputeProgramId);
+    UDestroyShaderProgram(gParticleProgramId);
 
     // Release mesh program
-    UDestroyMesh(candleMesh);
-    UDestroyMesh(candleWickMesh);
-    UDestroyMesh(tableMesh);
-    UDestroyMesh(upperCandlestickMesh);
-    UDestroyMesh(lowerCandlestickMesh);
-    UDestroyMesh(napkinMesh);
-    UDestroyMesh(knifeMesh);
-    UDestroyMesh(knifeTipMesh);
-
+    for (GLMesh& mesh : gMeshes)
+        UDestroyMesh(mesh);
+
+    // Release textures
+    for (GLuint texture : gTextures)
+        gTextureCache.Release(texture);
+    gTextureCache.Destroy();
+    gTextureAtlas.Destroy();
+    gVirtualTexture.Destroy();
+    glDeleteTextures((GLsizei)gLightmapTextures.size(), gLightmapTextures.data());
+
+    glfwDestroyWindow(gWindow);
+    glfwTerminate();
     exit(EXIT_SUCCESS); // Terminates the program successfully
 }
 
@@ -388,6 +1592,8 @@ bool UInitialize(int argc, char* argv[], GLFWwindow** window)
     glfwSetCursorPosCallback(*window, UMousePositionCallback);
     glfwSetScrollCallback(*window, UMouseScrollCallback);
     glfwSetMouseButtonCallback(*window, UMouseButtonCallback);
+    glfwSetKeyCallback(*window, UKeyCallback);
+    glfwSetWindowRefreshCallback(*window, URefreshCallback);
 
     // tell GLFW to capture our mouse
     glfwSetInputMode(*window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
@@ -406,6 +1612,9 @@ bool UInitialize(int argc, char* argv[], GLFWwindow** window)
     // Displays GPU OpenGL version
     cout << "INFO: OpenGL Version: " << glGetString(GL_VERSION) << endl;
 
+    // The framebuffer can be larger than the requested window size on high DPI displays
+    glfwGetFramebufferSize(*window, &gWindowWidth, &gWindowHeight);
+
     return true;
 }
 
@@ -434,16 +1643,180 @@ void UProcessInput(GLFWwindow* window)
     if (glfwGetKey(window, GLFW_KEY_E) == GLFW_PRESS)
         gCamera.ProcessKeyboard(DOWN, gDeltaTime);
     // P key: Used to change the view of the scene between 2D and 3D views at will
+    bool wasPerspective = isPerspective;
     if (glfwGetKey(window, GLFW_KEY_P) == GLFW_PRESS)
         isPerspective = true;
     if (glfwGetKey(window, GLFW_KEY_O) == GLFW_PRESS)
         isPerspective = false;
+    if (isPerspective != wasPerspective)
+        URequestRedraw();
+
+    // A held movement key moves the camera, so the next frame has to be drawn
+    static const int movementKeys[] = { GLFW_KEY_W, GLFW_KEY_S, GLFW_KEY_A, GLFW_KEY_D, GLFW_KEY_Q, GLFW_KEY_E };
+    for (int key : movementKeys)
+    {
+        if (glfwGetKey(window, key) == GLFW_PRESS)
+        {
+            URequestRedraw();
+            break;
+        }
+    }
+}
+
+// glfw: keyboard events that toggle settings (held keys are polled in UProcessInput)
+void UKeyCallback(GLFWwindow* window, int key, int scancode, int action, int mods)
+{
+    if (action != GLFW_PRESS)
+        return;
+
+    // M key: switch between continuous and on-demand rendering
+    if (key == GLFW_KEY_M)
+    {
+        gRenderMode = gRenderMode == RENDER_CONTINUOUS ? RENDER_ON_DEMAND : RENDER_CONTINUOUS;
+        cout << "INFO: Rendering mode: " << (gRenderMode == RENDER_ON_DEMAND ? "on demand" : "continuous") << endl;
+        UPrintFrameStats();
+    }
+
+    // R key: turn dynamic resolution scaling on or off
+    if (key == GLFW_KEY_R)
+    {
+        gDynamicResolution.Enabled = !gDynamicResolution.Enabled;
+        cout << "INFO: Dynamic resolution " << (gDynamicResolution.Enabled ? "on" : "off") << endl;
+    }
+
+    // G key: switch between forward and deferred shading
+    if (key == GLFW_KEY_G)
+    {
+        gRenderPath = gRenderPath == RENDER_FORWARD ? RENDER_DEFERRED : RENDER_FORWARD;
+        cout << "INFO: Shading: " << (gRenderPath == RENDER_DEFERRED ? "deferred" : "forward") << endl;
+    }
+
+    // L key: switch between baked (lightmaps and probes) and fully dynamic lighting
+    if (key == GLFW_KEY_L)
+    {
+        gBakedLightingEnabled = !gBakedLightingEnabled;
+        cout << "INFO: Baked lighting " << (gBakedLightingEnabled ? "on" : "off") << endl;
+    }
+
+    // Z key: turn the depth pre-pass on or off
+    if (key == GLFW_KEY_Z)
+    {
+        gDepthPrepass = !gDepthPrepass;
+        cout << "INFO: Depth pre-pass " << (gDepthPrepass ? "on" : "off") << endl;
+    }
+
+    // V key: cycle the ambient occlusion quality (off, then 1 to 3)
+    if (key == GLFW_KEY_V)
+    {
+        gAmbientOcclusionQuality = (gAmbientOcclusionQuality + 1) % 4;
+        if (gAmbientOcclusionQuality > 0)
+            gAmbientOcclusion.SetQuality(gAmbientOcclusionQuality);
+        gAmbientOcclusion.Invalidate();
+        cout << "INFO: Ambient occlusion quality " << gAmbientOcclusionQuality << endl;
+    }
+
+    // K key: switch forward light lists between the clusters and per-object assignment
+    if (key == GLFW_KEY_K)
+    {
+        gPerObjectLights = !gPerObjectLights;
+        cout << "INFO: Forward light lists: " << (gPerObjectLights ? "per object" : "clustered") << endl;
+    }
+
+    // C key: turn the candle flame particles on or off; while they run, on-demand mode keeps drawing
+    if (key == GLFW_KEY_C && gParticles.EmitterCount() > 0)
+    {
+        gParticlesEnabled = !gParticlesEnabled;
+        gActiveAnimations += gParticlesEnabled ? 1 : -1;
+        cout << "INFO: Candle flames " << (gParticlesEnabled ? "on" : "off") << endl;
+    }
+
+    // F key: print the frame pacing statistics and start a new measurement
+    if (key == GLFW_KEY_F)
+    {
+        UPrintFrameStats();
+        gFramePacer.ResetStats();
+    }
+
+    URequestRedraw();
+}
+
+// glfw: the window contents were damaged (uncovered, restored, ...) and must be drawn again
+void URefreshCallback(GLFWwindow* window)
+{
+    URequestRedraw();
+}
+
+// Asks for a new frame. Anything that changes what is on screen (input, resize, animation, asset loads) calls this
+void URequestRedraw()
+{
+    gRedrawRequested = true;
+}
+
+// Continuous mode always draws; on-demand mode only draws when a redraw was requested or an animation runs
+bool UFrameNeeded()
+{
+    return gRenderMode == RENDER_CONTINUOUS || gRedrawRequested || gActiveAnimations > 0;
+}
+
+// Prints how many frames were drawn, how many loop iterations were skipped while idle, and the frame pacing statistics
+void UPrintFrameStats()
+{
+    cout << "INFO: Frames rendered: " << gFramesRendered << ", frames skipped: " << gFramesSkipped << endl;
+    cout << "INFO: Frame time: mean " << gFramePacer.MeanFrameTimeMs() << " ms, variance " << gFramePacer.FrameTimeVarianceMs2()
+         << " ms^2, max " << gFramePacer.MaxFrameTimeMs() << " ms, missed deadlines " << gFramePacer.MissedDeadlines()
+         << " of " << gFramePacer.FrameCount() << " frames (target " << gFramePacer.TargetFrameRate() << " fps)" << endl;
+    cout << "INFO: Render scale: " << gDynamicResolution.Scale() << ", scene GPU time " << gDynamicResolution.SmoothedMs()
+         << " ms (budget " << gDynamicResolution.BudgetMs << " ms)" << endl;
+    cout << "INFO: Shadow passes: " << gShadowTimer.LastMs() << " ms" << endl;
+    cout << "INFO: Textures: " << gTextureCache.TextureCount() << " for " << TEXTURE_COUNT << " slots, " << gTextureCache.PathHits()
+         << " path hits, " << gTextureCache.ContentHits() << " content hits, " << gTextureCache.BytesSaved() / 1024 << " KB saved" << endl;
+    if (gDecodedImageCache.IsOpen())
+        cout << "INFO: Decoded image cache: " << gDecodedImageCache.Hits() << " hits, " << gDecodedImageCache.Misses() << " misses, "
+             << gDecodedImageCache.Stores() << " stored, " << gDecodedImageCache.Evictions() << " evicted, "
+             << gDecodedImageCache.Bytes() / 1024 << " of " << gDecodedImageCache.MaxBytes() / 1024 << " KB" << endl;
+    cout << "INFO: Texture residency: " << gTextureCache.ResidentBytes() / 1024 << " KB resident";
+    if (gTextureCache.Budget() != SIZE_MAX)
+        cout << " of a " << gTextureCache.Budget() / 1024 << " KB budget";
+    cout << ", " << gTextureCache.Evictions() << " evictions (" << gTextureCache.EvictedLevels() << " levels), "
+         << gTextureCache.Restores() << " restores" << endl;
+    if (gTextureAtlas.PageCount() > 0)
+        cout << "INFO: Atlas: " << gTextureAtlas.EntryCount() << " images on " << gTextureAtlas.PageCount() << " pages, "
+             << gTextureAtlas.Overhead() << "x their texels, built in " << gTextureAtlas.BuildSeconds() << " s" << endl;
+    if (gVirtualTexture.IsOpen())
+        cout << "INFO: Virtual texture: " << gVirtualTexture.ResidentTiles() << " of " << gVirtualTexture.TileCount() << " tiles in a "
+             << gVirtualTexture.CacheBytes() / 1024 << " KB cache, " << gVirtualTexture.RequestedTiles() << " requested, "
+             << gVirtualTexture.UploadedTiles() << " uploaded, " << gVirtualTexture.EvictedTiles() << " evicted, "
+             << gVirtualTexture.DroppedTiles() << " dropped" << endl;
+    if (gRenderPath == RENDER_DEFERRED)
+        cout << "INFO: Deferred: geometry pass " << gSceneTimer.LastMs() << " ms, lighting pass " << gLightingTimer.LastMs() << " ms" << endl;
+    else
+        cout << "INFO: Forward: scene pass " << gSceneTimer.LastMs() << " ms" << endl;
+    if (gDepthPrepass || (gAmbientOcclusionQuality > 0 && gRenderPath == RENDER_FORWARD))
+        cout << "INFO: Depth pre-pass: " << gPrepassTimer.LastMs() << " ms" << endl;
+    if (gAmbientOcclusionQuality > 0)
+        cout << "INFO: Ambient occlusion: quality " << gAmbientOcclusionQuality << " (1/" << gAmbientOcclusion.Divisor << " resolution, "
+             << gAmbientOcclusion.SampleCount << " samples), " << gAmbientOcclusionTimer.LastMs() << " ms" << endl;
+    if (gPerObjectLights)
+        cout << "INFO: Per-object lights: " << gObjectLights.AverageLightsPerObject() << " per draw (at most " << MAX_OBJECT_LIGHTS
+             << "), assigned in " << gObjectLights.CpuMs() << " ms" << endl;
+    cout << "INFO: Transparency: " << gTransparentDrawList.size() << " translucent draws, " << gTransparentTimer.LastMs() << " ms" << endl;
+    if (gParticles.EmitterCount() > 0)
+        cout << "INFO: Particles: " << gParticles.ParticleCount() << " from " << gParticles.EmitterCount() << " flames, simulation "
+             << (gParticles.UseCompute ? "GPU " : "CPU ") << (gParticles.UseCompute ? gParticleTimer.LastMs() : gParticles.CpuMs()) << " ms" << endl;
 }
 
 // glfw: whenever the window size changed (by OS or user resize) this callback function executes
 void UResizeWindow(GLFWwindow* window, int width, int height)
 {
+    gWindowWidth = width;
+    gWindowHeight = height;
     glViewport(0, 0, width, height);
+
+    // The offscreen target follows the window size (it is not resized while minimized)
+    if (width > 0 && height > 0)
+        gSceneTarget.Resize(width, height);
+
+    URequestRedraw();
 }
 
 // glfw: whenever the mouse moves, this callback is called
@@ -464,6 +1837,7 @@ void UMousePositionCallback(GLFWwindow* window, double xpos, double ypos)
     gLastY = ypos;
 
     gCamera.ProcessMouseMovement(xoffset, yoffset);
+    URequestRedraw();
 }
 
 // glfw: whenever the mouse scroll wheel scrolls, this callback is called
@@ -471,6 +1845,7 @@ void UMousePositionCallback(GLFWwindow* window, double xpos, double ypos)
 void UMouseScrollCallback(GLFWwindow* window, double xoffset, double yoffset)
 {
     gCamera.ProcessMouseScroll(yoffset);
+    URequestRedraw();
 }
 
 // glfw: handle mouse button events
@@ -515,66 +1890,318 @@ void UMouseButtonCallback(GLFWwindow* window, int button, int action, int mods)
 // Functioned called to render a frame
 void URender()
 {
+    // Bring the shadow maps up to date before they are sampled, and ask for the virtual texture tiles in view
+    UShadowPass();
+    UVirtualTextureFeedbackPass();
+
+    // Draw into the offscreen target at the resolution picked by the dynamic resolution controller
+    gSceneTarget.Bind(gDynamicResolution.Scale());
+    glm::vec2 viewportSize(gSceneTarget.ViewportWidth, gSceneTarget.ViewportHeight);
+
     // Enable z-depth
     glEnable(GL_DEPTH_TEST);
 
-    // Clear the frame and z buffers
-    glClearColor(1.0f, 0.0784314f, 0.576471f, 1.0f); // Color set to deep pink
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-    
-    // Set the shader to be used
-    glUseProgram(gProgramId);
+    // Light lists for the clusters of this frame's (scaled) viewport, and the shadow maps
+    gClusteredLighting.Bind();
+    gObjectLights.Bind();
+    gPointShadows.Bind(POINT_SHADOW_TEXTURE_UNIT);
+    if (gSunEnabled)
+        gCascadeShadows.Bind(CASCADE_SHADOW_TEXTURE_UNIT);
+    if (gVirtualTexture.IsOpen())
+        gVirtualTexture.Bind(VIRTUAL_TEXTURE_PHYSICAL_UNIT, VIRTUAL_TEXTURE_INDIRECTION_UNIT);
+
+    bool ambientOcclusion = gAmbientOcclusionQuality > 0;
+    if (gRenderPath == RENDER_FORWARD)
+    {
+        // The pre-pass clears and fills the depth buffer itself. Ambient occlusion needs that depth before shading
+        bool prepass = gDepthPrepass || ambientOcclusion;
+        if (prepass)
+            UDepthPrepass();
+        if (ambientOcclusion)
+        {
+            UAmbientOcclusionPass(gSceneTarget.DepthTexture);
+            gSceneTarget.Bind(gDynamicResolution.Scale());
+        }
+        gSceneTimer.Begin();
+
+        // Clear the frame and z buffers
+        glClearColor(1.0f, 0.0784314f, 0.576471f, 1.0f); // Color set to deep pink
+        glClear(prepass ? GL_COLOR_BUFFER_BIT : GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+        // Set the shader to be used
+        glUseProgram(gProgramId);
+        USetCameraUniforms(gProgramId);
+        gClusteredLighting.SetUniforms(gProgramId, viewportSize);
+        glUniform1i(glGetUniformLocation(gProgramId, "perObjectLights"), gPerObjectLights);
+        glUniform1i(glGetUniformLocation(gProgramId, "hasAmbientOcclusion"), ambientOcclusion);
+        USetShadowUniforms(gProgramId);
+        UDrawScene(gProgramId, gDrawList);
+        UEndDepthPrepass();
+
+        gSceneTimer.End();
+    }
+    else
+    {
+        // Geometry pass: surface attributes into the G-buffer. Every pixel that matters gets written,
+        // so only depth needs clearing
+        gGBuffer.Resize(gSceneTarget.Width, gSceneTarget.Height);
+        gGBuffer.Bind(gSceneTarget.ViewportWidth, gSceneTarget.ViewportHeight);
+        if (gDepthPrepass)
+            UDepthPrepass();
+        gSceneTimer.Begin();
+
+        if (!gDepthPrepass)
+            glClear(GL_DEPTH_BUFFER_BIT);
+        glUseProgram(gGBufferProgramId);
+        USetCameraUniforms(gGBufferProgramId);
+        UDrawScene(gGBufferProgramId, gDrawList);
+        UEndDepthPrepass();
+
+        gSceneTimer.End();
+
+        // Occlusion from the G-buffer depth, for the lighting pass
+        if (ambientOcclusion)
+            UAmbientOcclusionPass(gGBuffer.DepthTexture);
+
+        // Lighting pass: one fullscreen triangle into the scene target, each pixel lit by its cluster's lights
+        gSceneTarget.Bind(gDynamicResolution.Scale());
+        gLightingTimer.Begin();
+
+        glClearColor(1.0f, 0.0784314f, 0.576471f, 1.0f); // Color set to deep pink
+        glClear(GL_COLOR_BUFFER_BIT);
+        glDisable(GL_DEPTH_TEST);
+
+        glUseProgram(gDeferredLightingProgramId);
+        glUniform3fv(glGetUniformLocation(gDeferredLightingProgramId, "viewPosition"), 1, glm::value_ptr(gCamera.Position));
+        glUniformMatrix4fv(glGetUniformLocation(gDeferredLightingProgramId, "inverseProjection"), 1, GL_FALSE, glm::value_ptr(glm::inverse(projection)));
+        glUniformMatrix4fv(glGetUniformLocation(gDeferredLightingProgramId, "inverseView"), 1, GL_FALSE, glm::value_ptr(glm::inverse(view)));
+        gClusteredLighting.SetUniforms(gDeferredLightingProgramId, viewportSize);
+        glUniform1i(glGetUniformLocation(gDeferredLightingProgramId, "hasAmbientOcclusion"), ambientOcclusion);
+        USetShadowUniforms(gDeferredLightingProgramId);
+        gGBuffer.BindTextures(0);
+
+        glBindVertexArray(gFullscreenVao);
+        glDrawArrays(GL_TRIANGLES, 0, 3);
+        glBindVertexArray(0);
+
+        // Later passes draw into the scene target with the scene's depth
+        gGBuffer.BlitDepthTo(gSceneTarget.Framebuffer, gSceneTarget.ViewportWidth, gSceneTarget.ViewportHeight);
+        glEnable(GL_DEPTH_TEST);
+
+        gLightingTimer.End();
+    }
 
-    // Table
-    glBindTexture(GL_TEXTURE_2D, tableTexture);
-    glBindVertexArray(tableMesh.vao);
-    glDrawElements(GL_TRIANGLES, tableMesh.nIndices, GL_UNSIGNED_SHORT, NULL); // Draws the triangle
-    glBindVertexArray(0);   // Deactivate Vertex Array Object
-
-    // Candle
-    glBindTexture(GL_TEXTURE_2D, candleTexture);
-    glBindVertexArray(candleMesh.vao);
-    glDrawElements(GL_TRIANGLES, candleMesh.nIndices, GL_UNSIGNED_SHORT, NULL); // Draws the triangle
-    glBindVertexArray(0);    // Deactivate Vertex Array Object
+    // Translucent surfaces over the opaque result
+    UTransparentPass();
 
-    // Candle Wick
-    glBindTexture(GL_TEXTURE_2D, candleWickTexture);
-    glBindVertexArray(candleWickMesh.vao);
-    glDrawElements(GL_TRIANGLES, candleWickMesh.nIndices, GL_UNSIGNED_SHORT, NULL); // Draws the triangle
-    glBindVertexArray(0);    // Deactivate Vertex Array Object
+    // Flames over the lit scene
+    UDrawParticles();
 
-    // Upper Candlestick
-    glBindTexture(GL_TEXTURE_2D, upperCandlestickTexture);
-    glBindVertexArray(upperCandlestickMesh.vao);
-    glDrawElements(GL_TRIANGLES, upperCandlestickMesh.nIndices, GL_UNSIGNED_SHORT, NULL); // Draws the triangle
-    glBindVertexArray(0);    // Deactivate Vertex Array Object
+    // Upscale the scene to the window
+    gSceneTarget.BlitToScreen(gWindowWidth, gWindowHeight);
 
-    // Lower Candlestick
-    glBindTexture(GL_TEXTURE_2D, lowerCandlestickTexture);
-    glBindVertexArray(lowerCandlestickMesh.vao);
-    glDrawElements(GL_TRIANGLES, lowerCandlestickMesh.nIndices, GL_UNSIGNED_SHORT, NULL); // Draws the triangle
-    glBindVertexArray(0);    // Deactivate Vertex Array Object
+    // glfw: swap buffers and poll IO events (keys pressed/released, mouse moved etc.)
+    glfwSwapBuffers(gWindow);    // Flips the the back buffer with the front buffer every frame.
 
-    // Napkin
-    glBindTexture(GL_TEXTURE_2D, napkinTexture);
-    glBindVertexArray(napkinMesh.vao);
-    glDrawElements(GL_TRIANGLES, napkinMesh.nIndices, GL_UNSIGNED_SHORT, NULL); // Draws the triangle
-    glBindVertexArray(0);    // Deactivate Vertex Array Object
+    // Feed the GPU times that have come back into the resolution controller; deferred frames cost both passes
+    // The depth pre-pass and ambient occlusion count toward the scene when they run
+    double gpuMs, lightingMs, prepassMs, occlusionMs;
+    gPrepassTimer.Poll(prepassMs);
+    gAmbientOcclusionTimer.Poll(occlusionMs);
+    double extraMs = 0.0;
+    if (gDepthPrepass || (ambientOcclusion && gRenderPath == RENDER_FORWARD))
+        extraMs += gPrepassTimer.LastMs();
+    if (ambientOcclusion)
+        extraMs += gAmbientOcclusionTimer.LastMs();
+    bool lightingReady = gLightingTimer.Poll(lightingMs);
+    if (gSceneTimer.Poll(gpuMs))
+        gDynamicResolution.Update(gRenderPath == RENDER_DEFERRED ? gpuMs + gLightingTimer.LastMs() + extraMs : gpuMs + extraMs);
+    else if (lightingReady && gRenderPath == RENDER_DEFERRED)
+        gDynamicResolution.Update(gSceneTimer.LastMs() + lightingMs + extraMs);
+    double particleMs, transparentMs;
+    gParticleTimer.Poll(particleMs);
+    gTransparentTimer.Poll(transparentMs);
+}
 
-    // Butter knife handle
-    glBindTexture(GL_TEXTURE_2D, knifeTexture);
-    glBindVertexArray(knifeMesh.vao);
-    glDrawElements(GL_TRIANGLES, knifeMesh.nIndices, GL_UNSIGNED_SHORT, NULL); // Draws the triangle
-    glBindVertexArray(0);    // Deactivate Vertex Array Object
+// Depth pre-pass: clears depth and draws the opaque draws from their position-only streams with no color
+// writes, then leaves the depth test at GL_EQUAL without depth writes, so the shading pass that follows runs its
+// fragment shader once per pixel. UEndDepthPrepass restores the usual depth state afterwards
+void UDepthPrepass()
+{
+    gPrepassTimer.Begin();
+
+    glClear(GL_DEPTH_BUFFER_BIT);
+    glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+    glUseProgram(gDepthPrepassProgramId);
+    USetCameraUniforms(gDepthPrepassProgramId);
+    GLint modelLoc = glGetUniformLocation(gDepthPrepassProgramId, "model");
+    for (const DrawItem& item : gDrawList)
+    {
+        glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(item.model));
+        glBindVertexArray(item.depthVao);
+        glDrawElements(GL_TRIANGLES, item.nIndices, GL_UNSIGNED_SHORT, NULL);
+    }
+    glBindVertexArray(0);
+    glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
 
-    // Butter knife tip
-    glBindTexture(GL_TEXTURE_2D, knifeTipTexture);
-    glBindVertexArray(knifeTipMesh.vao);
-    glDrawElements(GL_TRIANGLES, knifeTipMesh.nIndices, GL_UNSIGNED_SHORT, NULL); // Draws the triangle
-    glBindVertexArray(0);    // Deactivate Vertex Array Object
+    glDepthFunc(GL_EQUAL);
+    glDepthMask(GL_FALSE);
 
-    // glfw: swap buffers and poll IO events (keys pressed/released, mouse moved etc.)
-    glfwSwapBuffers(gWindow);    // Flips the the back buffer with the front buffer every frame.
+    gPrepassTimer.End();
+}
+
+void UEndDepthPrepass()
+{
+    glDepthFunc(GL_LESS);
+    glDepthMask(GL_TRUE);
+}
+
+// Ambient occlusion from the opaque depth of this frame, at the quality's reduced resolution, resolved to full
+// resolution and bound for the lighting shaders. Leaves the occlusion targets bound
+void UAmbientOcclusionPass(GLuint depthTexture)
+{
+    gAmbientOcclusion.Resize(gSceneTarget.Width, gSceneTarget.Height);
+    gAmbientOcclusionTimer.Begin();
+
+    glDisable(GL_DEPTH_TEST);
+    gAmbientOcclusion.Compute(depthTexture, gSceneTarget.ViewportWidth, gSceneTarget.ViewportHeight, projection, view,
+        gAmbientOcclusionProgramId, gAmbientOcclusionResolveProgramId, gFullscreenVao);
+    glEnable(GL_DEPTH_TEST);
+
+    gAmbientOcclusionTimer.End();
+    gAmbientOcclusion.Bind(AMBIENT_OCCLUSION_TEXTURE_UNIT);
+}
+
+// Virtual texture feedback: the opaque draws, at a fraction of the scene's resolution, writing the tile each pixel of
+// the virtual texture wants. The result is read back asynchronously and consumed by UUpdateTextures; while the last
+// one is still on its way, the pass is skipped
+void UVirtualTextureFeedbackPass()
+{
+    if (!gVirtualTexture.IsOpen() || !gVirtualTexture.BeginFeedback(gSceneTarget.ViewportWidth, gSceneTarget.ViewportHeight))
+        return;
+    glEnable(GL_DEPTH_TEST);
+    glUseProgram(gVirtualTextureFeedbackProgramId);
+    USetCameraUniforms(gVirtualTextureFeedbackProgramId);
+    UDrawScene(gVirtualTextureFeedbackProgramId, gDrawList);
+    gVirtualTexture.EndFeedback();
+}
+
+// Reports the textures this frame draws to the cache, with roughly how many pixels one repeat of each covers: the
+// screen height of the object's bounding sphere over its texture coordinate scale. The cache drops the levels no
+// draw needs first when it is over its budget
+void UNoteTextureUse()
+{
+    bool orthographic = projection[3][3] == 1.0f;
+    float pixelsPerUnit = projection[1][1] * 0.5f * (float)gWindowHeight;
+    for (const std::vector<DrawItem>* draws : { &gDrawList, &gTransparentDrawList })
+        for (const DrawItem& item : *draws)
+        {
+            if (item.virtualTexture)
+                continue;
+            float diameter = 2.0f * glm::length(item.extent);
+            float distance = glm::length(glm::vec3(view * glm::vec4(item.center, 1.0f))) - 0.5f * diameter;
+            float screenSize = orthographic ? diameter * pixelsPerUnit : diameter * pixelsPerUnit / std::max(distance, NEAR_PLANE);
+            gTextureCache.NoteUse(item.texture, screenSize / std::max(item.uvScale.x, item.uvScale.y), gFramesRendered);
+        }
+}
+
+// Weighted blended order-independent transparency: the translucent draws are lit and accumulated in any order
+// against the opaque depth, then one fullscreen pass blends their weighted average over the scene target. The
+// cost grows with the covered pixels only, never with a per-frame sort
+void UTransparentPass()
+{
+    if (gTransparentDrawList.empty())
+        return;
+
+    gOitBuffer.Resize(gSceneTarget.Width, gSceneTarget.Height, gSceneTarget.DepthTexture);
+    gTransparentTimer.Begin();
+
+    // Accumulation: same lighting as the forward pass
+    gOitBuffer.Begin(gSceneTarget.ViewportWidth, gSceneTarget.ViewportHeight);
+    glUseProgram(gTransparentProgramId);
+    USetCameraUniforms(gTransparentProgramId);
+    gClusteredLighting.SetUniforms(gTransparentProgramId, glm::vec2(gSceneTarget.ViewportWidth, gSceneTarget.ViewportHeight));
+    glUniform1i(glGetUniformLocation(gTransparentProgramId, "perObjectLights"), gPerObjectLights);
+    USetShadowUniforms(gTransparentProgramId);
+    UDrawScene(gTransparentProgramId, gTransparentDrawList);
+    gOitBuffer.End();
+
+    // Composite over the opaque result
+    gSceneTarget.Bind(gDynamicResolution.Scale());
+    glDisable(GL_DEPTH_TEST);
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+    glUseProgram(gOitCompositeProgramId);
+    gOitBuffer.BindTextures(0);
+    glBindVertexArray(gFullscreenVao);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+    glBindVertexArray(0);
+
+    glDisable(GL_BLEND);
+    glEnable(GL_DEPTH_TEST);
+    gTransparentTimer.End();
+}
+
+// Passes the camera matrices and position to a program that draws the scene geometry
+void USetCameraUniforms(GLuint programId)
+{
+    glUniformMatrix4fv(glGetUniformLocation(programId, "view"), 1, GL_FALSE, glm::value_ptr(view));
+    glUniformMatrix4fv(glGetUniformLocation(programId, "projection"), 1, GL_FALSE, glm::value_ptr(projection));
+    glUniform3fv(glGetUniformLocation(programId, "viewPosition"), 1, glm::value_ptr(gCamera.Position));
+}
+
+// Draws visible objects collected by UBuildDrawList with the current program
+void UDrawScene(GLuint programId, const std::vector<DrawItem>& draws)
+{
+    GLint modelLoc = glGetUniformLocation(programId, "model");
+    GLint uvScaleLoc = glGetUniformLocation(programId, "uvScale");
+    GLint atlasRectLoc = glGetUniformLocation(programId, "atlasRect");
+    GLint hasVirtualTextureLoc = glGetUniformLocation(programId, "hasVirtualTexture");
+    GLint specularIntensityLoc = glGetUniformLocation(programId, "specularIntensity");
+    GLint highlightSizeLoc = glGetUniformLocation(programId, "highlightSize");
+    GLint opacityLoc = glGetUniformLocation(programId, "opacity");
+    GLint objectLightSlotLoc = glGetUniformLocation(programId, "objectLightSlot");
+    GLint hasLightmapLoc = glGetUniformLocation(programId, "hasLightmap");
+    GLint hasProbeLightingLoc = glGetUniformLocation(programId, "hasProbeLighting");
+    GLint probeIrradianceLoc = glGetUniformLocation(programId, "probeIrradiance");
+    GLuint boundTexture = 0;
+    GLuint boundLightmap = 0;
+
+    for (const DrawItem& item : draws)
+    {
+        glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(item.model));
+        glUniform2fv(uvScaleLoc, 1, glm::value_ptr(item.uvScale));
+        glUniform4fv(atlasRectLoc, 1, glm::value_ptr(item.atlasRect));
+        glUniform1i(hasVirtualTextureLoc, item.virtualTexture);
+        glUniform1f(specularIntensityLoc, item.specularIntensity);
+        glUniform1f(highlightSizeLoc, item.highlightSize);
+        glUniform1f(opacityLoc, item.opacity);
+        glUniform1ui(objectLightSlotLoc, item.lightSlot);
+        glUniform1i(hasLightmapLoc, item.lightmap != 0);
+        glUniform1i(hasProbeLightingLoc, item.probe != nullptr);
+        if (item.probe)
+            glUniform3fv(probeIrradianceLoc, SH_COEFFICIENTS, item.probe->coefficients);
+
+        if (item.lightmap != 0 && item.lightmap != boundLightmap)
+        {
+            glActiveTexture(GL_TEXTURE0 + LIGHTMAP_TEXTURE_UNIT);
+            glBindTexture(GL_TEXTURE_2D, item.lightmap);
+            glActiveTexture(GL_TEXTURE0);
+            boundLightmap = item.lightmap;
+        }
+
+        // The list is sorted by texture, so only bind when it changes
+        if (item.texture != boundTexture)
+        {
+            glBindTexture(GL_TEXTURE_2D, item.texture);
+            boundTexture = item.texture;
+        }
+
+        glBindVertexArray(item.vao);
+        glDrawElements(GL_TRIANGLES, item.nIndices, GL_UNSIGNED_SHORT, NULL); // Draws the triangle
+    }
+    glBindVertexArray(0);    // Deactivate Vertex Array Object
 }
 
 // Implements the UCreatePlaneMesh function to create the plane to represent the table
@@ -612,6 +2239,9 @@ void UCreatePlaneMesh(GLMesh& mesh, GLCoord topRight, GLCoord topLeft, GLCoord b
 
     // Strides between vertex coordinates is 6 (x, y, z, r, g, b, s, t). A tightly packed stride is 0.
     GLint stride = sizeof(float) * (floatsPerVertex + floatsPerColor + floatsPerUV);// The number of floats before each
+    UComputeMeshBounds(mesh, verts, sizeof(verts) / sizeof(verts[0]), stride / sizeof(float));
+    UCreateDepthStream(mesh, verts, sizeof(verts) / sizeof(verts[0]), stride / sizeof(float));
+    URetainMeshData(mesh, verts, sizeof(verts) / sizeof(verts[0]), stride / sizeof(float), floatsPerVertex + floatsPerColor, indices, sizeof(indices) / sizeof(indices[0]));
 
     // Create Vertex Attribute Pointers
     glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
@@ -659,6 +2289,9 @@ void UCreateNapkinMesh(GLMesh& mesh) {
 
     // Strides between vertex coordinates is 6 (x, y, z, r, g, b, s, t). A tightly packed stride is 0.
     GLint stride = sizeof(float) * (floatsPerVertex + floatsPerColor + floatsPerUV);// The number of floats before each
+    UComputeMeshBounds(mesh, verts, sizeof(verts) / sizeof(verts[0]), stride / sizeof(float));
+    UCreateDepthStream(mesh, verts, sizeof(verts) / sizeof(verts[0]), stride / sizeof(float));
+    URetainMeshData(mesh, verts, sizeof(verts) / sizeof(verts[0]), stride / sizeof(float), floatsPerVertex + floatsPerColor, indices, sizeof(indices) / sizeof(indices[0]));
 
     // Create Vertex Attribute Pointers
     glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
@@ -713,6 +2346,9 @@ void UCreateUpperCandlestickMesh(GLMesh& mesh) {
 
     // Strides between vertex coordinates is 6 (x, y, z, r, g, b, a). A tightly packed stride is 0.
     GLint stride = sizeof(float) * (floatsPerVertex + floatsPerColor);// The number of floats before each
+    UComputeMeshBounds(mesh, verts, sizeof(verts) / sizeof(verts[0]), stride / sizeof(float));
+    UCreateDepthStream(mesh, verts, sizeof(verts) / sizeof(verts[0]), stride / sizeof(float));
+    URetainMeshData(mesh, verts, sizeof(verts) / sizeof(verts[0]), stride / sizeof(float), floatsPerVertex + floatsPerColor, indices, sizeof(indices) / sizeof(indices[0]));
 
     // Create Vertex Attribute Pointers
     glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
@@ -776,6 +2412,9 @@ void UCreateCandleMesh(GLMesh& mesh)
 
     // Strides between vertex coordinates is 6 (x, y, z, r, g, b, a). A tightly packed stride is 0.
     GLint stride = sizeof(float) * (floatsPerVertex + floatsPerColor);// The number of floats before each
+    UComputeMeshBounds(mesh, verts, sizeof(verts) / sizeof(verts[0]), stride / sizeof(float));
+    UCreateDepthStream(mesh, verts, sizeof(verts) / sizeof(verts[0]), stride / sizeof(float));
+    URetainMeshData(mesh, verts, sizeof(verts) / sizeof(verts[0]), stride / sizeof(float), floatsPerVertex + floatsPerColor, indices, sizeof(indices) / sizeof(indices[0]));
 
     // Create Vertex Attribute Pointers
     glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
@@ -838,6 +2477,9 @@ void UCreateCandleWickMesh(GLMesh& mesh)
 
     // Strides between vertex coordinates is 6 (x, y, z, r, g, b, a). A tightly packed stride is 0.
     GLint stride = sizeof(float) * (floatsPerVertex + floatsPerColor);// The number of floats before each
+    UComputeMeshBounds(mesh, verts, sizeof(verts) / sizeof(verts[0]), stride / sizeof(float));
+    UCreateDepthStream(mesh, verts, sizeof(verts) / sizeof(verts[0]), stride / sizeof(float));
+    URetainMeshData(mesh, verts, sizeof(verts) / sizeof(verts[0]), stride / sizeof(float), floatsPerVertex + floatsPerColor, indices, sizeof(indices) / sizeof(indices[0]));
 
     // Create Vertex Attribute Pointers
     glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
@@ -892,6 +2534,9 @@ void UCreateLowerCandlestickMesh(GLMesh& mesh)
 
     // Strides between vertex coordinates is 6 (x, y, z, r, g, b, a). A tightly packed stride is 0.
     GLint stride = sizeof(float) * (floatsPerVertex + floatsPerColor);// The number of floats before each
+    UComputeMeshBounds(mesh, verts, sizeof(verts) / sizeof(verts[0]), stride / sizeof(float));
+    UCreateDepthStream(mesh, verts, sizeof(verts) / sizeof(verts[0]), stride / sizeof(float));
+    URetainMeshData(mesh, verts, sizeof(verts) / sizeof(verts[0]), stride / sizeof(float), floatsPerVertex + floatsPerColor, indices, sizeof(indices) / sizeof(indices[0]));
 
     // Create Vertex Attribute Pointers
     glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
@@ -955,6 +2600,9 @@ void UCreateKnifeMesh(GLMesh& mesh)
 
     // Strides between vertex coordinates is 6 (x, y, z, r, g, b, a). A tightly packed stride is 0.
     GLint stride = sizeof(float) * (floatsPerVertex + floatsPerColor);// The number of floats before each
+    UComputeMeshBounds(mesh, verts, sizeof(verts) / sizeof(verts[0]), stride / sizeof(float));
+    UCreateDepthStream(mesh, verts, sizeof(verts) / sizeof(verts[0]), stride / sizeof(float));
+    URetainMeshData(mesh, verts, sizeof(verts) / sizeof(verts[0]), stride / sizeof(float), floatsPerVertex + floatsPerColor, indices, sizeof(indices) / sizeof(indices[0]));
 
     // Create Vertex Attribute Pointers
     glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
@@ -1018,6 +2666,9 @@ void UCreateKnifeTipMesh(GLMesh& mesh)
 
     // Strides between vertex coordinates is 6 (x, y, z, r, g, b, a). A tightly packed stride is 0.
     GLint stride = sizeof(float) * (floatsPerVertex + floatsPerColor);// The number of floats before each
+    UComputeMeshBounds(mesh, verts, sizeof(verts) / sizeof(verts[0]), stride / sizeof(float));
+    UCreateDepthStream(mesh, verts, sizeof(verts) / sizeof(verts[0]), stride / sizeof(float));
+    URetainMeshData(mesh, verts, sizeof(verts) / sizeof(verts[0]), stride / sizeof(float), floatsPerVertex + floatsPerColor, indices, sizeof(indices) / sizeof(indices[0]));
 
     // Create Vertex Attribute Pointers
     glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
@@ -1034,182 +2685,993 @@ void UCreateKnifeTipMesh(GLMesh& mesh)
 void UDestroyMesh(GLMesh& mesh)
 {
     glDeleteVertexArrays(1, &mesh.vao);
-    glDeleteBuffers(1, mesh.vbos);
+    glDeleteBuffers(2, mesh.vbos);
+    glDeleteVertexArrays(1, &mesh.depthVao);
+    glDeleteBuffers(1, &mesh.depthVbo);
+    if (mesh.lightmapVao)
+    {
+        glDeleteVertexArrays(1, &mesh.lightmapVao);
+        glDeleteBuffers(2, mesh.lightmapVbos);
+    }
+}
+
+// Records the model space bounding box of a mesh from its interleaved vertex data
+void UComputeMeshBounds(GLMesh& mesh, const GLfloat* verts, GLuint nFloats, GLuint floatsPerVertex)
+{
+    mesh.boundsMin = glm::vec3(verts[0], verts[1], verts[2]);
+    mesh.boundsMax = mesh.boundsMin;
+    for (GLuint i = floatsPerVertex; i + 2 < nFloats; i += floatsPerVertex)
+    {
+        glm::vec3 position(verts[i], verts[i + 1], verts[i + 2]);
+        mesh.boundsMin = glm::min(mesh.boundsMin, position);
+        mesh.boundsMax = glm::max(mesh.boundsMax, position);
+    }
+}
+
+// Copies the positions out of the interleaved vertex data into their own buffer and builds a VAO that reads
+// only those, sharing the mesh's index buffer. Depth-only passes then fetch 12 bytes per vertex instead of the
+// whole vertex. Called while the mesh's own VAO is being set up, so its bindings are restored afterwards
+void UCreateDepthStream(GLMesh& mesh, const GLfloat* verts, GLuint nFloats, GLuint floatsPerVertex)
+{
+    std::vector<GLfloat> positions;
+    for (GLuint i = 0; i + 2 < nFloats; i += floatsPerVertex)
+        positions.insert(positions.end(), verts + i, verts + i + 3);
+
+    glGenVertexArrays(1, &mesh.depthVao);
+    glBindVertexArray(mesh.depthVao);
+
+    glGenBuffers(1, &mesh.depthVbo);
+    glBindBuffer(GL_ARRAY_BUFFER, mesh.depthVbo);
+    glBufferData(GL_ARRAY_BUFFER, positions.size() * sizeof(GLfloat), positions.data(), GL_STATIC_DRAW);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(GLfloat), 0);
+    glEnableVertexAttribArray(0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.vbos[1]);
+
+    glBindVertexArray(mesh.vao);
+    glBindBuffer(GL_ARRAY_BUFFER, mesh.vbos[0]);
+}
+
+// Keeps a CPU copy of the vertices and indices, which the lightmap baker traces against and unwraps
+void URetainMeshData(GLMesh& mesh, const GLfloat* verts, GLuint nFloats, GLuint floatsPerVertex, GLuint uvOffset, const GLushort* indices, GLuint nIndices)
+{
+    mesh.vertexData.assign(verts, verts + nFloats);
+    mesh.indexData.assign(indices, indices + nIndices);
+    mesh.floatsPerVertex = floatsPerVertex;
+    mesh.uvOffset = uvOffset;
+    mesh.lightmapVao = 0;
+}
+
+// Builds the lightmapped version of a mesh. The unwrap splits vertices along the chart seams, so every vertex
+// copies position, normal and texture coordinates from its source vertex and adds its lightmap coordinates
+// (10 floats per vertex, lightmap coordinates in attribute 3). Meshes without texture coordinates get 0, 0
+void UCreateLightmapStream(GLMesh& mesh, const LightmapUnwrap& unwrap)
+{
+    const GLuint floatsPerLightmapVertex = 10;
+    std::vector<GLfloat> vertices;
+    vertices.reserve(unwrap.sourceVertex.size() * floatsPerLightmapVertex);
+    for (size_t v = 0; v < unwrap.sourceVertex.size(); ++v)
+    {
+        const GLfloat* source = &mesh.vertexData[unwrap.sourceVertex[v] * mesh.floatsPerVertex];
+        vertices.insert(vertices.end(), source, source + 6);
+        if (mesh.uvOffset + 2 <= mesh.floatsPerVertex)
+            vertices.insert(vertices.end(), source + mesh.uvOffset, source + mesh.uvOffset + 2);
+        else
+            vertices.insert(vertices.end(), 2, 0.0f);
+        vertices.push_back(unwrap.uvs[v].x);
+        vertices.push_back(unwrap.uvs[v].y);
+    }
+    std::vector<GLushort> indices(unwrap.indices.begin(), unwrap.indices.end());
+
+    if (mesh.lightmapVao)
+    {
+        glDeleteVertexArrays(1, &mesh.lightmapVao);
+        glDeleteBuffers(2, mesh.lightmapVbos);
+    }
+    glGenVertexArrays(1, &mesh.lightmapVao);
+    glBindVertexArray(mesh.lightmapVao);
+
+    glGenBuffers(2, mesh.lightmapVbos);
+    glBindBuffer(GL_ARRAY_BUFFER, mesh.lightmapVbos[0]);
+    glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(GLfloat), vertices.data(), GL_STATIC_DRAW);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.lightmapVbos[1]);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(GLushort), indices.data(), GL_STATIC_DRAW);
+
+    GLint stride = sizeof(float) * floatsPerLightmapVertex;
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, stride, 0);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, stride, (char*)(sizeof(float) * 3));
+    glEnableVertexAttribArray(1);
+    glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, stride, (char*)(sizeof(float) * 6));
+    glEnableVertexAttribArray(2);
+    glVertexAttribPointer(3, 2, GL_FLOAT, GL_FALSE, stride, (char*)(sizeof(float) * 8));
+    glEnableVertexAttribArray(3);
+
+    glBindVertexArray(0);
+}
+
+// Builds the scene: the transform hierarchy, one entity per object, and the lights.
+// The mesh vertices are already authored in table space, so every node starts with an identity
+// local transform; moving a node carries its children along
+void UCreateScene()
+{
+    //Coordinates for planes
+    struct GLCoord topLeft = { -5.0f, -0.3f, -5.0f };
+    struct GLCoord topRight = { 5.0f, -0.3f, -5.0f };
+    struct GLCoord bottomLeft = { -5.0f, -0.3f, 5.0f };
+    struct GLCoord bottomRight = { 5.0f, -0.3f, 5.0f };
+
+    GLMesh mesh;
+
+    // Table
+    SceneNode tableNode = gSceneGraph.AddNode(NO_PARENT);
+    UCreatePlaneMesh(mesh, topRight, topLeft, bottomLeft, bottomRight);
+    UCreateRenderable(mesh, TABLE_TEXTURE, tableNode);
+
+    // Candlestick stack: table -> lower candlestick -> upper candlestick -> candle -> wick
+    SceneNode lowerCandlestickNode = gSceneGraph.AddNode(tableNode);
+    UCreateLowerCandlestickMesh(mesh);
+    UCreateRenderable(mesh, LOWER_CANDLESTICK_TEXTURE, lowerCandlestickNode);
+
+    SceneNode upperCandlestickNode = gSceneGraph.AddNode(lowerCandlestickNode);
+    UCreateUpperCandlestickMesh(mesh);
+    UCreateRenderable(mesh, UPPER_CANDLESTICK_TEXTURE, upperCandlestickNode);
+
+    SceneNode candleNode = gSceneGraph.AddNode(upperCandlestickNode);
+    UCreateCandleMesh(mesh);
+    UCreateRenderable(mesh, CANDLE_TEXTURE, candleNode);
+
+    SceneNode candleWickNode = gSceneGraph.AddNode(candleNode);
+    UCreateCandleWickMesh(mesh);
+    Entity candleWick = UCreateRenderable(mesh, CANDLE_WICK_TEXTURE, candleWickNode);
+    gWorld.Get<MaterialComponent>(candleWick).opacity = 0.75f;   // the flame glow lets the background through
+
+    // The flame's particles rise from the top of the wick
+    gFlameNodes.push_back(gSceneGraph.AddNode(candleWickNode, glm::vec3(0.0f, 1.7f, 0.0f)));
+
+    // Place setting: table -> napkin -> knife handle -> knife tip
+    SceneNode napkinNode = gSceneGraph.AddNode(tableNode);
+    UCreateNapkinMesh(mesh);
+    Entity napkin = UCreateRenderable(mesh, NAPKIN_TEXTURE, napkinNode);
+    gWorld.Get<MaterialComponent>(napkin).opacity = 0.85f;       // thin cloth, the table shows through a little
+
+    // The knife is a prop that can be picked up, so it is dynamic: lit by the light probes, not lightmapped
+    SceneNode knifeNode = gSceneGraph.AddNode(napkinNode);
+    UCreateKnifeMesh(mesh);
+    UCreateRenderable(mesh, KNIFE_TEXTURE, knifeNode, false);
+
+    SceneNode knifeTipNode = gSceneGraph.AddNode(knifeNode);
+    UCreateKnifeTipMesh(mesh);
+    UCreateRenderable(mesh, KNIFE_TIP_TEXTURE, knifeTipNode, false);
+
+    // Key light: pink, and fill light: red. Neither fades with distance, and both cast shadows.
+    // The scene's own lights are static, so their diffuse light can be baked into lightmaps
+    Entity keyLight = UCreateLight(NO_PARENT, glm::vec3(-3.5f, 2.0f, 3.0f), glm::vec3(1.0f, 0.2f, 0.75f), 1.0f, glm::vec3(1.0f, 0.0f, 0.0f), true);
+    Entity fillLight = UCreateLight(NO_PARENT, glm::vec3(4.0f, 0.0f, 1.0f), glm::vec3(1.0f, 0.0f, 0.0f), 0.1f, glm::vec3(1.0f, 0.0f, 0.0f), true);
+    gWorld.Get<LightComponent>(keyLight).shadowIndex = 0;
+    gWorld.Get<LightComponent>(fillLight).shadowIndex = 1;
+
+    // Candle flame: a small warm light that follows the wick
+    UCreateLight(candleWickNode, glm::vec3(0.0f, 1.8f, 0.0f), glm::vec3(1.0f, 0.6f, 0.2f), 0.0f, glm::vec3(1.0f, 0.7f, 1.8f), true);
+
+    UUpdateTransforms();
+}
+
+// Takes ownership of a mesh and creates the entity that draws it. Static objects are tagged so their
+// shadows can be cached
+Entity UCreateRenderable(GLMesh& mesh, TextureSlot slot, SceneNode node, bool isStatic)
+{
+    gMeshes.push_back(mesh);
+
+    ComponentMask components = COMPONENT_TRANSFORM | COMPONENT_BOUNDS | COMPONENT_MESH | COMPONENT_MATERIAL;
+    Entity entity = gWorld.CreateEntity(isStatic ? components | COMPONENT_STATIC : components);
+
+    TransformComponent& transform = gWorld.Get<TransformComponent>(entity);
+    transform.node = node;
+    transform.world = glm::mat4(1.0f);
+
+    BoundsComponent& bounds = gWorld.Get<BoundsComponent>(entity);
+    bounds.localMin = mesh.boundsMin;
+    bounds.localMax = mesh.boundsMax;
+
+    MeshComponent& meshComponent = gWorld.Get<MeshComponent>(entity);
+    meshComponent.vao = mesh.vao;
+    meshComponent.depthVao = mesh.depthVao;
+    meshComponent.lightmapVao = 0;
+    meshComponent.indexCount = mesh.nIndices;
+    meshComponent.meshIndex = (unsigned int)gMeshes.size() - 1;
+
+    MaterialComponent& material = gWorld.Get<MaterialComponent>(entity);
+    material.texture = gTextures[slot];
+    material.uvScale = glm::vec2(1.0f, 1.0f);
+    material.atlasRect = gTextureRects[slot];
+    material.virtualTexture = gVirtualTexture.IsOpen() && slot == VIRTUAL_TEXTURE_SLOT;
+    material.specularIntensity = 0.8f;
+    material.highlightSize = 16.0f;
+    material.opacity = 1.0f;
+    material.lightmap = 0;
+
+    return entity;
+}
+
+// Creates a point light entity on a new node below parent (NO_PARENT for a free standing light).
+// attenuation holds the constant, linear and quadratic falloff terms. Static lights are baked into the lightmaps
+Entity UCreateLight(SceneNode parent, glm::vec3 position, glm::vec3 color, float ambientStrength, glm::vec3 attenuation, bool isStatic)
+{
+    Entity entity = gWorld.CreateEntity(isStatic ? COMPONENT_TRANSFORM | COMPONENT_LIGHT | COMPONENT_STATIC : COMPONENT_TRANSFORM | COMPONENT_LIGHT);
+
+    TransformComponent& transform = gWorld.Get<TransformComponent>(entity);
+    transform.node = gSceneGraph.AddNode(parent, position);
+    transform.world = glm::mat4(1.0f);
+
+    LightComponent& light = gWorld.Get<LightComponent>(entity);
+    light.color = color;
+    light.scale = glm::vec3(0.3f);
+    light.ambientStrength = ambientStrength;
+    light.constant = attenuation.x;
+    light.linear = attenuation.y;
+    light.quadratic = attenuation.z;
+    light.spotDirection = glm::vec3(0.0f, -1.0f, 0.0f);
+    light.innerCutoff = NO_SPOT_CUTOFF;
+    light.outerCutoff = NO_SPOT_CUTOFF;
+    light.shadowIndex = -1;
+
+    return entity;
+}
+
+// Creates a free standing spot light. The cone angles are in degrees from the direction
+Entity UCreateSpotLight(glm::vec3 position, glm::vec3 direction, glm::vec3 color, glm::vec3 attenuation, float innerAngle, float outerAngle)
+{
+    Entity entity = UCreateLight(NO_PARENT, position, color, 0.0f, attenuation);
+
+    LightComponent& light = gWorld.Get<LightComponent>(entity);
+    light.spotDirection = glm::normalize(direction);
+    light.innerCutoff = cos(glm::radians(innerAngle));
+    light.outerCutoff = cos(glm::radians(outerAngle));
+
+    return entity;
+}
+
+// Scatters count small colored lights just above the table, every fourth one a spot pointing down
+// (fixed seed, so runs are comparable)
+void UCreateTestLights(int count)
+{
+    unsigned int seed = 12345u;
+    auto random = [&seed]() { seed = seed * 1664525u + 1013904223u; return (seed >> 8) / 16777216.0f; };
+
+    for (int i = 0; i < count; ++i)
+    {
+        glm::vec3 position(random() * 10.0f - 5.0f, -0.1f + random() * 0.5f, random() * 10.0f - 5.0f);
+        glm::vec3 color(0.5f + random() * 0.5f, 0.3f + random() * 0.5f, random() * 0.5f);
+        if (i % 4 == 3)
+            UCreateSpotLight(position + glm::vec3(0.0f, 1.0f, 0.0f), glm::vec3(0.0f, -1.0f, 0.0f), color, glm::vec3(1.0f, 0.7f, 1.8f), 20.0f, 30.0f);
+        else
+            UCreateLight(NO_PARENT, position, color, 0.0f, glm::vec3(1.0f, 4.5f, 30.0f));
+    }
+    if (count > 0)
+        cout << "INFO: Added " << count << " test lights" << endl;
+}
+
+// Scatters count extra candle flames on the table (fixed seed, so runs are comparable)
+void UCreateTestFlames(int count)
+{
+    unsigned int seed = 54321u;
+    auto random = [&seed]() { seed = seed * 1664525u + 1013904223u; return (seed >> 8) / 16777216.0f; };
+
+    for (int i = 0; i < count; ++i)
+        gFlameNodes.push_back(gSceneGraph.AddNode(NO_PARENT, glm::vec3(random() * 10.0f - 5.0f, -0.3f, random() * 10.0f - 5.0f)));
+    if (count > 0)
+        cout << "INFO: Added " << count << " test flames" << endl;
+}
+
+// Baked lighting system: hands the static objects and static lights to the baker, then either rebakes the
+// lightmaps and probes that are out of date and saves them (bake), or just loads the saved ones. Baked data is
+// only used when it was baked from the scene as it is now; everything else keeps its fully dynamic lighting
+void ULoadBakedLighting(bool bake)
+{
+    const ComponentMask staticRenderable = COMPONENT_TRANSFORM | COMPONENT_BOUNDS | COMPONENT_MESH | COMPONENT_MATERIAL | COMPONENT_STATIC;
+    std::vector<LightmapObject> objects;
+    std::vector<Entity> entities;
+    gWorld.ForEachChunk(staticRenderable, [&objects, &entities](Chunk& chunk, size_t)
+    {
+        for (uint32_t i = 0; i < chunk.count; ++i)
+        {
+            const GLMesh& mesh = gMeshes[chunk.meshes[i].meshIndex];
+            LightmapObject object;
+            object.vertices = mesh.vertexData.data();
+            object.vertexCount = mesh.vertexData.size() / mesh.floatsPerVertex;
+            object.floatsPerVertex = mesh.floatsPerVertex;
+            object.indices = mesh.indexData.data();
+            object.indexCount = mesh.indexData.size();
+            object.world = chunk.transforms[i].world;
+            // atlas slots share their page, so the image is told apart by its rectangle
+            for (size_t slot = 0; slot < gTextures.size(); ++slot)
+                if (gTextures[slot] == chunk.materials[i].texture && gTextureRects[slot] == chunk.materials[i].atlasRect)
+                {
+                    object.albedo = gTextureAlbedo[slot];
+                    break;
+                }
+            objects.push_back(object);
+            entities.push_back(chunk.entities[i]);
+        }
+    });
+
+    std::vector<LightmapLight> lights;
+    gWorld.ForEachChunk(COMPONENT_TRANSFORM | COMPONENT_LIGHT | COMPONENT_STATIC, [&lights](Chunk& chunk, size_t)
+    {
+        for (uint32_t i = 0; i < chunk.count; ++i)
+        {
+            const LightComponent& light = chunk.lights[i];
+            LightmapLight baked;
+            baked.position = glm::vec3(chunk.transforms[i].world[3]);
+            baked.color = light.color;
+            baked.ambientStrength = light.ambientStrength;
+            baked.attenuation = glm::vec3(light.constant, light.linear, light.quadratic);
+            baked.radius = LightInfluenceRadius(light.color, light.constant, light.linear, light.quadratic, FAR_PLANE);
+            baked.spotDirection = light.spotDirection;
+            baked.innerCutoff = light.innerCutoff;
+            baked.outerCutoff = light.outerCutoff;
+            lights.push_back(baked);
+        }
+    });
+
+    LightmapBaker baker;
+    baker.SetScene(objects, lights);
+
+    // Probe volume over the static objects for the dynamic ones; any change to the static scene rebakes it
+    uint64_t sceneKey = baker.SceneKey();
+    bool probesLoaded = LoadProbeVolume(PROBE_PATH, gProbeVolume);
+    if (bake && (!probesLoaded || gProbeVolume.Key != sceneKey))
+    {
+        glm::vec3 sceneMin, sceneMax;
+        baker.SceneBounds(sceneMin, sceneMax);
+        gProbeVolume.Create(sceneMin, sceneMax, PROBE_SPACING);
+        double start = glfwGetTime();
+        baker.BakeProbes(gThreadPool, gProbeVolume, PROBE_SAMPLES);
+        gProbeVolume.Key = sceneKey;
+        cout << "INFO: Baked " << gProbeVolume.Probes.size() << " light probes in " << glfwGetTime() - start << " s" << endl;
+        if (!SaveProbeVolume(PROBE_PATH, gProbeVolume))
+            cout << "failed to save light probes " << PROBE_PATH << endl;
+    }
+    else if (probesLoaded && gProbeVolume.Key != sceneKey)
+    {
+        cout << "INFO: Light probes are out of date, rebake them with --bake-lightmaps" << endl;
+        gProbeVolume.Probes.clear();
+    }
+    else if (!probesLoaded)
+        gProbeVolume.Probes.clear();
+
+    std::vector<Lightmap> maps;
+    uint64_t lightingHash = 0;
+    bool loaded = LoadLightmaps(LIGHTMAP_PATH, objects.size(), lightingHash, maps);
+    if (!loaded)
+        maps.clear();
+
+    if (bake)
+    {
+        // Only objects that changed, and their neighbours, are baked again
+        std::vector<bool> dirty = baker.FindDirty(maps, lightingHash);
+        size_t dirtyCount = std::count(dirty.begin(), dirty.end(), true);
+        double start = glfwGetTime();
+        baker.Bake(gThreadPool, dirty, maps);
+        lightingHash = baker.LightingHash();
+        cout << "INFO: Baked " << dirtyCount << " of " << maps.size() << " lightmaps in " << glfwGetTime() - start << " s" << endl;
+        if (!SaveLightmaps(LIGHTMAP_PATH, lightingHash, maps))
+            cout << "failed to save lightmaps " << LIGHTMAP_PATH << endl;
+    }
+    else if (!loaded)
+        return;     // nothing baked yet
+
+    if (lightingHash != baker.LightingHash() || maps.size() != objects.size())
+    {
+        cout << "INFO: Lightmaps are out of date, rebake them with --bake-lightmaps" << endl;
+        return;
+    }
+
+    size_t applied = 0;
+    for (size_t o = 0; o < objects.size(); ++o)
+    {
+        const Lightmap& map = maps[o];
+        const LightmapUnwrap& unwrap = baker.Unwrap(o);
+        if (map.key != baker.ObjectKey(o) || map.width != unwrap.width || map.height != unwrap.height)
+            continue;   // the object changed since it was baked
+
+        // RGBM texels, filtered linearly; the charts are padded so filtering stays inside them
+        GLuint texture;
+        glGenTextures(1, &texture);
+        glBindTexture(GL_TEXTURE_2D, texture);
+        glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA8, map.width, map.height);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, map.width, map.height, GL_RGBA, GL_UNSIGNED_BYTE, map.rgbm.data());
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glBindTexture(GL_TEXTURE_2D, 0);
+        gLightmapTextures.push_back(texture);
+
+        // Every static object has its own mesh, so the split vertices can live with the mesh
+        MeshComponent& meshComponent = gWorld.Get<MeshComponent>(entities[o]);
+        GLMesh& mesh = gMeshes[meshComponent.meshIndex];
+        UCreateLightmapStream(mesh, unwrap);
+        meshComponent.lightmapVao = mesh.lightmapVao;
+        gWorld.Get<MaterialComponent>(entities[o]).lightmap = texture;
+        ++applied;
+    }
+    cout << "INFO: Lightmaps applied to " << applied << " of " << objects.size() << " static objects" << endl;
+}
+
+// Transform system: updates the scene graph, then copies the world matrices that changed into the
+// entities and refreshes their world space bounds
+void UUpdateTransforms()
+{
+    if (gSceneGraph.Update() == 0)
+        return;     // nothing moved, so every cached transform is still valid
+
+    std::atomic<bool> staticMoved(false);
+    gWorld.ParallelForEachChunk(gThreadPool, COMPONENT_TRANSFORM, [&staticMoved](Chunk& chunk, size_t)
+    {
+        TransformComponent* transforms = chunk.transforms.get();
+        BoundsComponent* bounds = chunk.bounds.get();
+
+        for (uint32_t i = 0; i < chunk.count; ++i)
+        {
+            if (!gSceneGraph.WorldChanged(transforms[i].node))
+                continue;
+
+            const glm::mat4& world = gSceneGraph.GetWorldMatrix(transforms[i].node);
+            transforms[i].world = world;
+            if (chunk.mask & COMPONENT_STATIC)
+                staticMoved = true;
+
+            if (bounds)
+            {
+                // Transform the box center, and grow the half extent by the absolute rotation/scale
+                glm::vec3 localCenter = (bounds[i].localMin + bounds[i].localMax) * 0.5f;
+                glm::vec3 localExtent = (bounds[i].localMax - bounds[i].localMin) * 0.5f;
+                bounds[i].center = glm::vec3(world * glm::vec4(localCenter, 1.0f));
+                bounds[i].extent = glm::abs(glm::vec3(world[0])) * localExtent.x
+                                 + glm::abs(glm::vec3(world[1])) * localExtent.y
+                                 + glm::abs(glm::vec3(world[2])) * localExtent.z;
+            }
+        }
+    });
+
+    // Cached shadows of the static casters are stale now
+    if (staticMoved)
+        ++gStaticCasterVersion;
+}
+
+// Culling and draw list system: tests every renderable against the view frustum on the worker threads,
+// then merges the per-chunk results and sorts them by texture and mesh to cut down on state changes
+void UBuildDrawList(const glm::mat4& viewProjection)
+{
+    // Frustum planes (left, right, bottom, top, near, far) taken from the rows of the view-projection matrix
+    glm::vec4 planes[6];
+    for (int i = 0; i < 3; ++i)
+    {
+        glm::vec4 row(viewProjection[0][i], viewProjection[1][i], viewProjection[2][i], viewProjection[3][i]);
+        glm::vec4 row3(viewProjection[0][3], viewProjection[1][3], viewProjection[2][3], viewProjection[3][3]);
+        planes[i * 2] = row3 + row;
+        planes[i * 2 + 1] = row3 - row;
+    }
+
+    const ComponentMask renderable = COMPONENT_TRANSFORM | COMPONENT_BOUNDS | COMPONENT_MESH | COMPONENT_MATERIAL;
+    gChunkDrawLists.resize(gWorld.ChunkCount(renderable));
+    gChunkProbes.resize(gChunkDrawLists.size());
+
+    gWorld.ParallelForEachChunk(gThreadPool, renderable, [&planes](Chunk& chunk, size_t chunkIndex)
+    {
+        std::vector<DrawItem>& draws = gChunkDrawLists[chunkIndex];
+        draws.clear();
+
+        // Dynamic objects blend the probes around their center; reserved up front so the draws can point into it
+        std::vector<ShProbe>& probes = gChunkProbes[chunkIndex];
+        probes.clear();
+        bool probeLit = gBakedLightingEnabled && !(chunk.mask & COMPONENT_STATIC) && !gProbeVolume.Empty();
+        if (probeLit)
+            probes.reserve(chunk.count);
+
+        for (uint32_t i = 0; i < chunk.count; ++i)
+        {
+            const BoundsComponent& bounds = chunk.bounds[i];
+
+            bool visible = true;
+            for (int p = 0; p < 6 && visible; ++p)
+            {
+                glm::vec3 normal(planes[p]);
+                float radius = glm::dot(bounds.extent, glm::abs(normal));
+                visible = glm::dot(normal, bounds.center) + planes[p].w >= -radius;
+            }
+            if (!visible)
+                continue;
+
+            // Lightmapped objects draw their lightmap stream
+            bool lightmapped = gBakedLightingEnabled && chunk.materials[i].lightmap != 0;
+
+            DrawItem item;
+            item.vao = lightmapped ? chunk.meshes[i].lightmapVao : chunk.meshes[i].vao;
+            item.depthVao = chunk.meshes[i].depthVao;
+            item.nIndices = chunk.meshes[i].indexCount;
+            item.texture = chunk.materials[i].texture;
+            item.uvScale = chunk.materials[i].uvScale;
+            item.atlasRect = chunk.materials[i].atlasRect;
+            item.virtualTexture = chunk.materials[i].virtualTexture;
+            item.specularIntensity = chunk.materials[i].specularIntensity;
+            item.highlightSize = chunk.materials[i].highlightSize;
+            item.opacity = chunk.materials[i].opacity;
+            item.lightmap = lightmapped ? chunk.materials[i].lightmap : 0;
+            item.probe = nullptr;
+            item.model = chunk.transforms[i].world;
+            item.center = bounds.center;
+            item.extent = bounds.extent;
+            item.lightSlot = 0;
+            if (probeLit)
+            {
+                probes.push_back(ShProbe());
+                gProbeVolume.Sample(bounds.center, probes.back());
+                item.probe = &probes.back();
+            }
+            draws.push_back(item);
+        }
+    });
+
+    // Translucent draws go to their own list; they are blended order-independently, so no back-to-front sort
+    gDrawList.clear();
+    gTransparentDrawList.clear();
+    for (std::vector<DrawItem>& draws : gChunkDrawLists)
+        for (const DrawItem& item : draws)
+            (item.opacity < 1.0f ? gTransparentDrawList : gDrawList).push_back(item);
+
+    auto byState = [](const DrawItem& a, const DrawItem& b)
+    {
+        return a.texture != b.texture ? a.texture < b.texture : a.vao < b.vao;
+    };
+    std::sort(gDrawList.begin(), gDrawList.end(), byState);
+    std::sort(gTransparentDrawList.begin(), gTransparentDrawList.end(), byState);
+}
+
+// Light system: gathers every light entity into the light buffer, then has the clustered culling assign
+// them to the view space clusters they reach
+void UUpdateLights(const glm::mat4& viewMatrix, const glm::mat4& projectionMatrix)
+{
+    gLightData.clear();
+    gShadowedLights.clear();
+    gWorld.ForEachChunk(COMPONENT_TRANSFORM | COMPONENT_LIGHT, [](Chunk& chunk, size_t)
+    {
+        for (uint32_t i = 0; i < chunk.count; ++i)
+        {
+            const LightComponent& light = chunk.lights[i];
+            float radius = LightInfluenceRadius(light.color, light.constant, light.linear, light.quadratic, FAR_PLANE);
+
+            GpuPointLight data;
+            data.positionRadius = glm::vec4(glm::vec3(chunk.transforms[i].world[3]), radius);
+            data.colorAmbient = glm::vec4(light.color, light.ambientStrength);
+            data.attenuation = glm::vec4(light.constant, light.linear, light.quadratic, light.outerCutoff);
+            data.spotDirection = glm::vec4(light.spotDirection, light.innerCutoff);
+            float baked = (chunk.mask & COMPONENT_STATIC) ? 1.0f : 0.0f;   // lightmapped surfaces already hold its diffuse light
+            data.shadow = glm::vec4(-1.0f, 1.0f, 0.0f, baked);
+
+            // Shadowed lights get a cube map covering their range (capped for lights that never fade)
+            if (light.shadowIndex >= 0 && light.shadowIndex < MAX_POINT_SHADOWS)
+            {
+                ShadowedLight shadowed;
+                shadowed.slot = light.shadowIndex;
+                shadowed.position = glm::vec3(data.positionRadius);
+                shadowed.farPlane = radius < POINT_SHADOW_RANGE ? radius : POINT_SHADOW_RANGE;
+                gShadowedLights.push_back(shadowed);
+                data.shadow = glm::vec4((float)shadowed.slot, shadowed.farPlane, 0.05f / shadowed.farPlane, baked);
+            }
+            gLightData.push_back(data);
+        }
+    });
+
+    gClusteredLighting.SetProjection(projectionMatrix, NEAR_PLANE, FAR_PLANE);
+    gClusteredLighting.Build(gLightData, viewMatrix, gThreadPool);
+
+    if (gPerObjectLights)
+        UAssignObjectLights();
 }
 
-// build and create the textures used
+// Per-object light assignment: gives every forward lit draw (opaque ones when shading forward, translucent
+// ones always) a slot and fills it with the lights whose influence reaches the draw's bounds
+void UAssignObjectLights()
+{
+    gObjectBounds.clear();
+    std::vector<DrawItem>* lists[2] = { &gDrawList, &gTransparentDrawList };
+    for (std::vector<DrawItem>* list : lists)
+    {
+        if (list == &gDrawList && gRenderPath == RENDER_DEFERRED)
+            continue;   // lit per pixel by the clusters
+        for (DrawItem& item : *list)
+        {
+            item.lightSlot = (GLuint)gObjectBounds.size();
+            gObjectBounds.push_back({ item.center, item.extent });
+        }
+    }
+    gObjectLights.Assign(gLightData, gObjectBounds, gThreadPool);
+}
+
+// Particle system: moves the emitters along with their nodes and steps the simulation by the frame time
+void UUpdateParticles()
+{
+    if (!gParticlesEnabled || gParticles.EmitterCount() == 0)
+        return;
+
+    for (size_t i = 0; i < gFlameNodes.size(); ++i)
+        gFlamePositions[i] = glm::vec3(gSceneGraph.GetWorldMatrix(gFlameNodes[i])[3]);
+
+    gParticleTimer.Begin();
+    gParticles.Simulate(gFlamePositions, std::min(gDeltaTime, MAX_PARTICLE_STEP), gParticleComputeProgramId, gThreadPool);
+    gParticleTimer.End();
+}
+
+// Draws the particles over the scene with premultiplied alpha blending: flames and embers have zero alpha and
+// simply add their light, smoke covers a little of what is behind it. Neither needs the particles sorted
+// (for the faint smoke the order makes no visible difference); depth is tested but not written
+void UDrawParticles()
+{
+    if (!gParticlesEnabled || gParticles.EmitterCount() == 0)
+        return;
+
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+    glDepthMask(GL_FALSE);
+
+    glUseProgram(gParticleProgramId);
+    USetCameraUniforms(gParticleProgramId);
+    gParticles.Draw(gParticleProgramId);
+
+    glDepthMask(GL_TRUE);
+    glDisable(GL_BLEND);
+}
+
+// Shadow system: brings the shadow maps of the shadowed lights (and the directional light's cascades) up to date.
+// Static casters are drawn into the cache only when they or the light moved; dynamic casters are drawn over a
+// copy of the cache every frame. With nothing moving and no dynamic casters, no shadow pass runs at all
+void UShadowPass()
+{
+    const ComponentMask renderable = COMPONENT_TRANSFORM | COMPONENT_BOUNDS | COMPONENT_MESH | COMPONENT_MATERIAL;
+    uint64_t staticVersion = gStaticCasterVersion + gWorld.StructureVersion();
+
+    bool hasDynamicCasters = false;
+    gWorld.ForEachChunk(renderable, [&hasDynamicCasters](Chunk& chunk, size_t)
+    {
+        if (!(chunk.mask & COMPONENT_STATIC))
+            hasDynamicCasters = true;
+    });
+
+    gShadowTimer.Begin();
+    glEnable(GL_DEPTH_TEST);
+
+    // Point lights: six faces per light, depth is the distance to the light
+    glUseProgram(gPointShadowProgramId);
+    for (const ShadowedLight& light : gShadowedLights)
+    {
+        glm::mat4 key = glm::translate(light.position) * glm::scale(glm::vec3(light.farPlane));
+        bool staticDirty = gPointShadows.NeedsStaticRender(light.slot, key, staticVersion);
+        if (!staticDirty && !hasDynamicCasters)
+            continue;
+
+        glUniform3fv(glGetUniformLocation(gPointShadowProgramId, "lightPosition"), 1, glm::value_ptr(light.position));
+        glUniform1f(glGetUniformLocation(gPointShadowProgramId, "farPlane"), light.farPlane);
+        int firstLayer = light.slot * 6;
+
+        if (staticDirty)
+        {
+            for (int face = 0; face < 6; ++face)
+            {
+                gPointShadows.BeginLayer(true, firstLayer + face, true);
+                UDrawShadowCasters(gPointShadowProgramId, CubeFaceViewProjection(light.position, face, light.farPlane), true, light.position, light.farPlane);
+            }
+            gPointShadows.MarkStaticRendered(light.slot, key, staticVersion);
+        }
+
+        gPointShadows.CopyStaticLayers(firstLayer, 6);
+        if (hasDynamicCasters)
+        {
+            for (int face = 0; face < 6; ++face)
+            {
+                gPointShadows.BeginLayer(false, firstLayer + face, false);
+                UDrawShadowCasters(gPointShadowProgramId, CubeFaceViewProjection(light.position, face, light.farPlane), false, light.position, light.farPlane);
+            }
+        }
+    }
+
+    // Directional light: one depth pass per cascade. The slope scaled offset keeps the lit surfaces from shadowing themselves
+    if (gSunEnabled)
+    {
+        glUseProgram(gCascadeShadowProgramId);
+        glEnable(GL_POLYGON_OFFSET_FILL);
+        glPolygonOffset(2.0f, 4.0f);
+
+        for (int cascade = 0; cascade < CASCADE_COUNT; ++cascade)
+        {
+            const glm::mat4& viewProjection = gCascades.viewProjection[cascade];
+            bool staticDirty = gCascadeShadows.NeedsStaticRender(cascade, viewProjection, staticVersion);
+            if (!staticDirty && !hasDynamicCasters)
+                continue;
+
+            if (staticDirty)
+            {
+                gCascadeShadows.BeginLayer(true, cascade, true);
+                UDrawShadowCasters(gCascadeShadowProgramId, viewProjection, true, glm::vec3(0.0f), 1e30f);
+                gCascadeShadows.MarkStaticRendered(cascade, viewProjection, staticVersion);
+            }
+
+            gCascadeShadows.CopyStaticLayers(cascade, 1);
+            if (hasDynamicCasters)
+            {
+                gCascadeShadows.BeginLayer(false, cascade, false);
+                UDrawShadowCasters(gCascadeShadowProgramId, viewProjection, false, glm::vec3(0.0f), 1e30f);
+            }
+        }
+        glDisable(GL_POLYGON_OFFSET_FILL);
+    }
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    gShadowTimer.End();
+
+    double shadowMs;
+    gShadowTimer.Poll(shadowMs);
+}
+
+// Draws the static or the dynamic renderables within range of center into the bound shadow map, using the
+// position-only depth VAOs
+void UDrawShadowCasters(GLuint programId, const glm::mat4& lightViewProjection, bool staticCasters, glm::vec3 center, float range)
+{
+    glUniformMatrix4fv(glGetUniformLocation(programId, "lightViewProjection"), 1, GL_FALSE, glm::value_ptr(lightViewProjection));
+    GLint modelLoc = glGetUniformLocation(programId, "model");
+
+    gWorld.ForEachChunk(COMPONENT_TRANSFORM | COMPONENT_BOUNDS | COMPONENT_MESH, [&](Chunk& chunk, size_t)
+    {
+        if (((chunk.mask & COMPONENT_STATIC) != 0) != staticCasters)
+            return;
+
+        for (uint32_t i = 0; i < chunk.count; ++i)
+        {
+            // Skip casters whose box is out of the light's reach
+            const BoundsComponent& bounds = chunk.bounds[i];
+            glm::vec3 outside = glm::max(glm::abs(center - bounds.center) - bounds.extent, glm::vec3(0.0f));
+            if (glm::dot(outside, outside) > range * range)
+                continue;
+
+            glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(chunk.transforms[i].world));
+            glBindVertexArray(chunk.meshes[i].depthVao);
+            glDrawElements(GL_TRIANGLES, chunk.meshes[i].indexCount, GL_UNSIGNED_SHORT, NULL);
+        }
+    });
+    glBindVertexArray(0);
+}
+
+// Points a lighting program's shadow samplers at the shadow texture units (only has to be done once)
+void USetShadowSamplers(GLuint programId)
+{
+    glUseProgram(programId);
+    glUniform1i(glGetUniformLocation(programId, "pointShadowMaps"), POINT_SHADOW_TEXTURE_UNIT);
+    glUniform1i(glGetUniformLocation(programId, "cascadeShadowMaps"), CASCADE_SHADOW_TEXTURE_UNIT);
+}
+
+// Points a program with the material chunk at the virtual texture's units and, when there is one, passes its layout.
+// lodBias corrects the detail level for passes drawn at a lower resolution
+void USetVirtualTextureSamplers(GLuint programId, float lodBias)
+{
+    glUseProgram(programId);
+    glUniform1i(glGetUniformLocation(programId, "virtualPhysical"), VIRTUAL_TEXTURE_PHYSICAL_UNIT);
+    glUniform1i(glGetUniformLocation(programId, "virtualIndirection"), VIRTUAL_TEXTURE_INDIRECTION_UNIT);
+    if (gVirtualTexture.IsOpen())
+        gVirtualTexture.SetUniforms(programId, lodBias);
+}
+
+// Passes the directional light and its cascades to a lighting program
+void USetShadowUniforms(GLuint programId)
+{
+    glUniform4fv(glGetUniformLocation(programId, "sunDirection"), 1, glm::value_ptr(glm::vec4(glm::normalize(SUN_DIRECTION), gSunEnabled ? 1.0f : 0.0f)));
+    glUniform3fv(glGetUniformLocation(programId, "sunColor"), 1, glm::value_ptr(SUN_COLOR));
+    if (!gSunEnabled)
+        return;
+
+    glUniformMatrix4fv(glGetUniformLocation(programId, "cascadeViewProjection"), CASCADE_COUNT, GL_FALSE, glm::value_ptr(gCascades.viewProjection[0]));
+    glUniform3f(glGetUniformLocation(programId, "cascadeSplits"), gCascades.splitDepth[0], gCascades.splitDepth[1], gCascades.splitDepth[2]);
+}
+
+// build and create the textures used: every file starts decoding on the workers at once, and its texture holds a
+// placeholder until UUpdateTextures swaps the image in. With --atlas the atlased slots are packed first (from the
+// file sizes alone), so their pages and rectangles are known before the scene is built; a file the atlas could
+// not take gets a texture of its own. With --virtual-texture the table's image is streamed from its tile file
+// instead, when that has been cut (by --cook-textures)
 void generateTextures() {
-    // Table texture
-    glGenTextures(1, &tableTexture);
-    glBindTexture(GL_TEXTURE_2D, tableTexture);
-    //set texture wrapping params
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-    //set texture filtering params
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    //load image, create texture and generate mipmaps
-    int width, height, channels;
-    stbi_set_flip_vertically_on_load(true); //flip texture on y-axis
-    unsigned char* image = stbi_load("../resources/textures/pinktable.png", &width, &height, &channels, 0);
-    if (image) {
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, image);
-        glGenerateMipmap(GL_TEXTURE_2D);
-    }
-    else {
-        std::cout << "failed to load texture ../resources/textures/pinktable.png" << std::endl;
-    }
-    stbi_image_free(image);
-
-    // Candle texture
-    glGenTextures(1, &candleTexture);
-    glBindTexture(GL_TEXTURE_2D, candleTexture);
-    //set texture wrapping params
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-    //set texture filtering params
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    //load image, create texture and generate mipmaps
-    stbi_set_flip_vertically_on_load(true); //flip texture on y-axis
-    unsigned char* image2 = stbi_load("../resources/textures/candle.png", &width, &height, &channels, 0);
-    if (image2) {
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, image2);
-        glGenerateMipmap(GL_TEXTURE_2D);
-    }
-    else {
-        std::cout << "failed to load texture ../resources/textures/candle.png" << std::endl;
-    }
-    stbi_image_free(image2);
-
-    // Upper candlestick holder texture
-    glGenTextures(1, &upperCandlestickTexture);
-    glBindTexture(GL_TEXTURE_2D, upperCandlestickTexture);
-    //set texture wrapping params
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-    //set texture filtering params
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    //load image, create texture and generate mipmaps
-    stbi_set_flip_vertically_on_load(true); //flip texture on y-axis
-    unsigned char* image3 = stbi_load("../resources/textures/silver1.jpg", &width, &height, &channels, 0);
-    if (image3) {
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, image3);
-        glGenerateMipmap(GL_TEXTURE_2D);
-    }
-    else {
-        std::cout << "failed to load texture ../resources/textures/silver1.jpg" << std::endl;
-    }
-    stbi_image_free(image3);
-
-    // Lower candlestick holder texture
-    glGenTextures(1, &lowerCandlestickTexture);
-    glBindTexture(GL_TEXTURE_2D, lowerCandlestickTexture);
-    //set texture wrapping params
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-    //set texture filtering params
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    //load image, create texture and generate mipmaps
-    stbi_set_flip_vertically_on_load(true); //flip texture on y-axis
-    unsigned char* image4 = stbi_load("../resources/textures/silver1.jpg", &width, &height, &channels, 0);
-    if (image4) {
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, image4);
-        glGenerateMipmap(GL_TEXTURE_2D);
-    }
-    else {
-        std::cout << "failed to load texture ../resources/textures/silver1.jpg" << std::endl;
-    }
-    stbi_image_free(image4);
-
-    // Candle Wick texture
-    glGenTextures(1, &candleWickTexture);
-    glBindTexture(GL_TEXTURE_2D, candleWickTexture);
-    //set texture wrapping params
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-    //set texture filtering params
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    //load image, create texture and generate mipmaps
-    stbi_set_flip_vertically_on_load(true); //flip texture on y-axis
-    unsigned char* image5 = stbi_load("../resources/textures/wickflame.png", &width, &height, &channels, 0);
-    if (image5) {
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, image5);
-        glGenerateMipmap(GL_TEXTURE_2D);
-    }
-    else {
-        std::cout << "failed to load texture ../resources/textures/wickflame.png" << std::endl;
-    }
-    stbi_image_free(image5);
-
-    // Napkin
-    glGenTextures(1, &napkinTexture);
-    glBindTexture(GL_TEXTURE_2D, napkinTexture);
-    //set texture wrapping params
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-    //set texture filtering params
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    //load image, create texture and generate mipmaps
-    stbi_set_flip_vertically_on_load(true); //flip texture on y-axis
-    unsigned char* image6 = stbi_load("../resources/textures/napkin.png", &width, &height, &channels, 0);
-    if (image6) {
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, image6);
-        glGenerateMipmap(GL_TEXTURE_2D);
-    }
-    else {
-        std::cout << "failed to load texture ../resources/textures/napkin.png" << std::endl;
-    }
-    stbi_image_free(image6);
-
-    // Butter Knife Handle
-    glGenTextures(1, &knifeTexture);
-    glBindTexture(GL_TEXTURE_2D, knifeTexture);
-    //set texture wrapping params
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-    //set texture filtering params
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    //load image, create texture and generate mipmaps
-    stbi_set_flip_vertically_on_load(true); //flip texture on y-axis
-    unsigned char* image7 = stbi_load("../resources/textures/butterknife.jpg", &width, &height, &channels, 0);
-    if (image7) {
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, image7);
-        glGenerateMipmap(GL_TEXTURE_2D);
-    }
-    else {
-        std::cout << "failed to load texture ../resources/textures/butterknife.jpg" << std::endl;
-    }
-    stbi_image_free(image7);
-
-    // Butter Knife tip
-    glGenTextures(1, &knifeTipTexture);
-    glBindTexture(GL_TEXTURE_2D, knifeTipTexture);
-    //set texture wrapping params
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-    //set texture filtering params
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    //load image, create texture and generate mipmaps
-    stbi_set_flip_vertically_on_load(true); //flip texture on y-axis
-    unsigned char* image8 = stbi_load("../resources/textures/butterknife.jpg", &width, &height, &channels, 0);
-    if (image8) {
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, image8);
-        glGenerateMipmap(GL_TEXTURE_2D);
-    }
-    else {
-        std::cout << "failed to load texture ../resources/textures/butterknife.jpg" << std::endl;
-    }
-    stbi_image_free(image8);
+    gTextures.assign(TEXTURE_COUNT, 0);
+    gTextureRects.assign(TEXTURE_COUNT, glm::vec4(0.0f, 0.0f, 1.0f, 1.0f));
+    gTextureAlbedo.assign(TEXTURE_COUNT, glm::vec3(0.5f));
+    gTextureCache.SetDecodedCallback([] { glfwPostEmptyEvent(); });    // wakes an idle on-demand loop
+
+    int atlasEntries[TEXTURE_COUNT];
+    if (gAtlasTextures)
+    {
+        gTextureAtlas.OnBuilt = [] { glfwPostEmptyEvent(); };
+        for (int slot = 0; slot < TEXTURE_COUNT; ++slot)
+            if (TEXTURE_ATLASED[slot])
+                atlasEntries[slot] = gTextureAtlas.Add(TEXTURE_PATHS[slot], &gTextureAlbedo[slot]);
+        gTextureAtlas.Build(gThreadPool);
+        for (int slot = 0; slot < TEXTURE_COUNT; ++slot)
+            if (TEXTURE_ATLASED[slot])
+            {
+                AtlasRegion region = gTextureAtlas.Region(atlasEntries[slot]);
+                gTextures[slot] = region.texture;
+                gTextureRects[slot] = region.rect;
+            }
+    }
+    if (gVirtualTextureEnabled)
+    {
+        const char* path = TEXTURE_PATHS[VIRTUAL_TEXTURE_SLOT];
+        if (gVirtualTexture.Open(VirtualTexturePath(path)))
+        {
+            gVirtualTexture.OnTileLoaded = [] { glfwPostEmptyEvent(); };
+            gTextures[VIRTUAL_TEXTURE_SLOT] = gVirtualTexture.PhysicalTexture();
+            gTextureAlbedo[VIRTUAL_TEXTURE_SLOT] = gVirtualTexture.AverageColor();
+        }
+        else
+            cout << "failed to open the virtual texture of " << path << " (cut it with --cook-textures)" << endl;
+    }
+    for (int slot = 0; slot < TEXTURE_COUNT; ++slot)
+        if (gTextures[slot] == 0)
+            gTextures[slot] = gTextureCache.Acquire(TEXTURE_PATHS[slot], gThreadPool, &gTextureAlbedo[slot]);
+}
+
+// Offline texture cooking: every texture file whose source changed since it was last cooked is compressed into
+// its KTX2 file, one file per worker (and each file's blocks spread over the workers again). With
+// --virtual-texture the table's image is cut into its tile file as well, when that is missing or out of date
+void UCookTextures(BcFormat format, BcQuality quality)
+{
+    double start = glfwGetTime();
+    std::atomic<int> cooked(0);
+    std::vector<char> failed(TEXTURE_COUNT, 0);     // one byte per slot, so the workers never share one
+    stbi_set_flip_vertically_on_load(true);
+    gThreadPool.ParallelFor(TEXTURE_COUNT, 1, [&cooked, &failed, format, quality](size_t begin, size_t end)
+    {
+        for (size_t slot = begin; slot < end; ++slot)
+        {
+            // slots sharing a file cook it once
+            if (std::find(TEXTURE_PATHS, TEXTURE_PATHS + slot, std::string(TEXTURE_PATHS[slot])) != TEXTURE_PATHS + slot)
+                continue;
+            bool written;
+            if (!CookTexture(TEXTURE_PATHS[slot], format, quality, gThreadPool, written))
+                failed[slot] = 1;
+            else if (written)
+                ++cooked;
+        }
+    });
+    for (int slot = 0; slot < TEXTURE_COUNT; ++slot)
+        if (failed[slot])
+            cout << "failed to cook texture " << TEXTURE_PATHS[slot] << endl;
+    cout << "INFO: Cooked " << cooked << " textures in " << glfwGetTime() - start << " s" << endl;
+
+    if (gVirtualTextureEnabled)
+    {
+        const char* path = TEXTURE_PATHS[VIRTUAL_TEXTURE_SLOT];
+        start = glfwGetTime();
+        bool cut;
+        if (!CookVirtualTexture(path, cut))
+            cout << "failed to cut the virtual texture of " << path << endl;
+        else if (cut)
+            cout << "INFO: Cut " << path << " into its tile file in " << glfwGetTime() - start << " s" << endl;
+    }
+}
+
+// Block compression benchmark: the top level of every texture, compressed with each format and quality preset
+// on all the workers; prints the throughput and the PSNR of the decoded result over all of the textures
+void UBenchmarkTextureEncoder()
+{
+    std::vector<MipLevel> images;
+    stbi_set_flip_vertically_on_load(true);
+    for (int slot = 0; slot < TEXTURE_COUNT; ++slot)
+    {
+        if (std::find(TEXTURE_PATHS, TEXTURE_PATHS + slot, std::string(TEXTURE_PATHS[slot])) != TEXTURE_PATHS + slot)
+            continue;
+        int width, height, channels;
+        unsigned char* pixels = stbi_load(TEXTURE_PATHS[slot], &width, &height, &channels, 0);
+        if (!pixels)
+        {
+            cout << "failed to load texture " << TEXTURE_PATHS[slot] << endl;
+            continue;
+        }
+        images.push_back(ToMipLevel(pixels, width, height, channels));
+        stbi_image_free(pixels);
+    }
+
+    const BcFormat formats[2] = { BC_FORMAT_BC1, BC_FORMAT_BC7 };
+    const char* const formatNames[2] = { "BC1", "BC7" };
+    cout << "INFO: Block compression of " << images.size() << " textures on " << gThreadPool.WorkerCount() + 1 << " threads" << endl;
+    for (int f = 0; f < 2; ++f)
+        for (int quality = 0; quality < BC_QUALITY_COUNT; ++quality)
+        {
+            double seconds = 0.0, squaredError = 0.0, pixels = 0.0;
+            for (const MipLevel& image : images)
+            {
+                double start = glfwGetTime();
+                std::vector<uint8_t> blocks = EncodeBc(image, formats[f], (BcQuality)quality, gThreadPool);
+                seconds += glfwGetTime() - start;
+
+                // accumulate the squared error, so the PSNR is over all of the pixels
+                double count = (double)image.width * image.height;
+                double psnr = ColorPsnr(image, DecodeBc(blocks, formats[f], image.width, image.height));
+                squaredError += 255.0 * 255.0 / std::pow(10.0, psnr / 10.0) * count;
+                pixels += count;
+            }
+            cout << "INFO: " << formatNames[f] << " " << BC_QUALITY_NAMES[quality] << ": " << pixels / 1e6 / std::max(seconds, 1e-9)
+                 << " MP/s, PSNR " << 10.0 * std::log10(255.0 * 255.0 * pixels / std::max(squaredError, 1e-9)) << " dB" << endl;
+        }
+}
+
+// Texture system: uploads the images that finished decoding (a few per frame, so a burst of them does not stall
+// one frame) and the atlas pages that are complete, and asks for a redraw to show them. Materials whose image
+// turned out to be a copy of another texture's are switched over to it. Once the last one is in, the baked
+// lighting can be matched against the scene
+void UUpdateTextures()
+{
+    std::vector<TextureRedirect> redirects;
+    if (gTextureCache.Update(MAX_TEXTURE_UPLOAD_BYTES_PER_FRAME, redirects) > 0)
+        gRedrawRequested = true;
+    if (gTextureCache.UpdateResidency(gThreadPool, gFramesRendered, redirects) > 0)
+        gRedrawRequested = true;
+    std::vector<AtlasRegion> droppedRegions;
+    if (gTextureAtlas.Update(droppedRegions) > 0)
+        gRedrawRequested = true;
+    // an image the atlas could not take after all is loaded on its own, like those it never took
+    for (const AtlasRegion& region : droppedRegions)
+        for (int slot = 0; slot < TEXTURE_COUNT; ++slot)
+        {
+            if (gTextures[slot] != region.texture || gTextureRects[slot] != region.rect)
+                continue;
+            GLuint texture = gTextureCache.Acquire(TEXTURE_PATHS[slot], gThreadPool, &gTextureAlbedo[slot]);
+            gWorld.ForEachChunk(COMPONENT_MATERIAL, [&region, texture](Chunk& chunk, size_t)
+            {
+                for (uint32_t i = 0; i < chunk.count; ++i)
+                    if (chunk.materials[i].texture == region.texture && chunk.materials[i].atlasRect == region.rect)
+                    {
+                        chunk.materials[i].texture = texture;
+                        chunk.materials[i].atlasRect = glm::vec4(0.0f, 0.0f, 1.0f, 1.0f);
+                    }
+            });
+            gTextures[slot] = texture;
+            gTextureRects[slot] = glm::vec4(0.0f, 0.0f, 1.0f, 1.0f);
+        }
+    if (gVirtualTexture.IsOpen())
+    {
+        if (gVirtualTexture.Update(gThreadPool, MAX_VIRTUAL_TILE_UPLOADS_PER_FRAME) > 0)
+            gRedrawRequested = true;
+        if (gVirtualTexture.ReadbackPending())
+            glfwPostEmptyEvent();   // come back for the feedback as soon as it can have landed
+    }
+    for (const TextureRedirect& redirect : redirects)
+    {
+        std::replace(gTextures.begin(), gTextures.end(), redirect.From, redirect.To);
+        gWorld.ForEachChunk(COMPONENT_MATERIAL, [&redirect](Chunk& chunk, size_t)
+        {
+            for (uint32_t i = 0; i < chunk.count; ++i)
+                if (chunk.materials[i].texture == redirect.From)
+                    chunk.materials[i].texture = redirect.To;
+        });
+    }
+    if (gTextureCache.Pending() == 0 && gTextureAtlas.Pending() == 0 && !gBakedLightingLoaded)
+    {
+        cout << "INFO: Textures loaded in " << gTextureCache.LoadSeconds() << " s" << endl;
+        ULoadBakedLighting(gBakeLightmaps);
+        gBakedLightingLoaded = true;
+        gRedrawRequested = true;
+    }
+}
+
+// Inserts a shared chunk of shader code right after the #version line of source
+std::string UComposeShader(const char* source, const char* chunk)
+{
+    std::string composed(source);
+    size_t bodyStart = composed.find('\n') + 1;
+    composed.insert(bodyStart, std::string(chunk) + "\n");
+    return composed;
 }
 
 // Implements the UCreateShaders function
+
 bool UCreateShaderProgram(const char* vtxShaderSource, const char* fragShaderSource, GLuint& programId)
 {
     // Compilation and linkage error reporting
@@ -1270,6 +3732,40 @@ bool UCreateShaderProgram(const char* vtxShaderSource, const char* fragShaderSou
     return true;
 }
 
+// Compiles and links a program made of a single compute shader
+bool UCreateComputeProgram(const char* computeShaderSource, GLuint& programId)
+{
+    int success = 0;
+    char infoLog[512];
+
+    programId = glCreateProgram();
+    GLuint computeShaderId = glCreateShader(GL_COMPUTE_SHADER);
+    glShaderSource(computeShaderId, 1, &computeShaderSource, NULL);
+
+    glCompileShader(computeShaderId);
+    glGetShaderiv(computeShaderId, GL_COMPILE_STATUS, &success);
+    if (!success)
+    {
+        glGetShaderInfoLog(computeShaderId, sizeof(infoLog), NULL, infoLog);
+        std::cout << "ERROR::SHADER::COMPUTE::COMPILATION_FAILED\n" << infoLog << std::endl;
+
+        return false;
+    }
+
+    glAttachShader(programId, computeShaderId);
+    glLinkProgram(programId);
+    glGetProgramiv(programId, GL_LINK_STATUS, &success);
+    if (!success)
+    {
+        glGetProgramInfoLog(programId, sizeof(infoLog), NULL, infoLog);
+        std::cout << "ERROR::SHADER::PROGRAM::LINKING_FAILED\n" << infoLog << std::endl;
+
+        return false;
+    }
+
+    return true;
+}
+
 void UDestroyShaderProgram(GLuint programId)
 {
     glDeleteProgram(programId);
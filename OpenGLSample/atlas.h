@@ -0,0 +1,459 @@
+#ifndef ATLAS_H
+#define ATLAS_H
+
+#include <GL/glew.h>
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "mipgen.h"
+#include "stb_image.h"      // declarations only, the implementation is compiled in Source.cpp
+#include "texturecook.h"    // AverageColor
+#include "threadpool.h"
+
+const int ATLAS_PAGE_SIZE = 2048;       // largest page, in texels; pages are trimmed to what they use
+const int ATLAS_MAX_ENTRY_SIZE = 1024;  // larger images go in at the first mip level that fits
+const int ATLAS_PADDING = 16;           // gutter around each image at level 0, halved with each mip level
+const int ATLAS_ALIGNMENT = 16;         // cells start and end on this grid, so every page mip level down to
+const int ATLAS_LEVELS = 5;             // log2(ATLAS_ALIGNMENT) keeps each image inside its own cell
+
+// Skyline bottom-left rectangle packing: the packed area is kept as the height of its top edge across the page,
+// and each rectangle goes where that edge is lowest for its width (the leftmost such place on ties)
+class SkylinePacker
+{
+public:
+	SkylinePacker(int width, int height) : pageWidth(width), pageHeight(height)
+	{
+		segments.push_back({ 0, 0, width });
+	}
+
+	// finds a place for a width x height rectangle and takes it; false when the page has no room left
+	bool Insert(int width, int height, int& x, int& y)
+	{
+		size_t best = segments.size();
+		int bestY = pageHeight, bestX = 0;
+		for (size_t i = 0; i < segments.size(); ++i)
+		{
+			int top;
+			if (fits(i, width, height, top) && top < bestY)
+			{
+				best = i;
+				bestY = top;
+				bestX = segments[i].x;
+			}
+		}
+		if (best == segments.size())
+			return false;
+
+		// the new top edge replaces the segments the rectangle covers, the last of them possibly only in part
+		Segment placed = { bestX, bestY + height, width };
+		size_t end = best;
+		while (end < segments.size() && segments[end].x + segments[end].width <= bestX + width)
+			++end;
+		if (end < segments.size() && segments[end].x < bestX + width)
+		{
+			int cut = bestX + width - segments[end].x;
+			segments[end].x += cut;
+			segments[end].width -= cut;
+		}
+		segments.erase(segments.begin() + best, segments.begin() + end);
+		segments.insert(segments.begin() + best, placed);
+		merge();
+
+		x = bestX;
+		y = bestY;
+		usedWidth = std::max(usedWidth, bestX + width);
+		usedHeight = std::max(usedHeight, bestY + height);
+		return true;
+	}
+
+	// extent of everything placed so far
+	int UsedWidth() const { return usedWidth; }
+	int UsedHeight() const { return usedHeight; }
+
+private:
+	struct Segment
+	{
+		int x, y, width;
+	};
+
+	std::vector<Segment> segments;   // left to right, covering the page's width
+	int pageWidth, pageHeight;
+	int usedWidth = 0, usedHeight = 0;
+
+	// whether a rectangle starting at segment i fits, and the height it would sit at (the highest segment under it)
+	bool fits(size_t i, int width, int height, int& top) const
+	{
+		if (segments[i].x + width > pageWidth)
+			return false;
+		top = 0;
+		int remaining = width;
+		for (size_t j = i; remaining > 0; ++j)
+		{
+			top = std::max(top, segments[j].y);
+			if (top + height > pageHeight)
+				return false;
+			remaining -= segments[j].width;
+		}
+		return true;
+	}
+
+	void merge()
+	{
+		for (size_t i = 0; i + 1 < segments.size(); )
+		{
+			if (segments[i].y == segments[i + 1].y)
+			{
+				segments[i].width += segments[i + 1].width;
+				segments.erase(segments.begin() + i + 1);
+			}
+			else
+				++i;
+		}
+	}
+};
+
+// Where a texture ended up: the page holding it, and its rectangle there as offset (xy) and scale (zw) of the
+// texture coordinates. The shaders wrap the coordinates into the rectangle themselves, as the page cannot repeat
+struct AtlasRegion
+{
+	GLuint texture = 0;
+	glm::vec4 rect = glm::vec4(0.0f, 0.0f, 1.0f, 1.0f);
+};
+
+// Small textures packed into shared pages, so the objects using them bind one texture between them and can be
+// drawn in one batch. Add() every file, then Build() packs them from their sizes alone, creates the pages with a
+// placeholder and returns; the images are decoded and composed into their pages on the thread pool, and Update()
+// uploads each page once it is complete.
+// Every image sits in a cell of its own with a gutter of its wrapped-around edges, so filtering near its border
+// reads what GL_REPEAT would. The page's mip levels are built from each image's own mip chain rather than from
+// the page, and only down to the level where the gutter is a texel wide, so no level mixes neighbouring images
+class TextureAtlas
+{
+public:
+	// called on a worker thread whenever a page is complete, e.g. to wake up an idle render loop
+	std::function<void()> OnBuilt;
+
+	// adds path, once however often it is added; returns its entry. averageColor, when given, receives the mean
+	// color of the image when its page is uploaded and must stay valid until then
+	int Add(const std::string& path, glm::vec3* averageColor = nullptr)
+	{
+		for (size_t i = 0; i < entries.size(); ++i)
+			if (entries[i].path == path)
+			{
+				if (averageColor)
+					entries[i].colorTargets.push_back(averageColor);
+				return (int)i;
+			}
+		Entry entry;
+		entry.path = path;
+		if (averageColor)
+			entry.colorTargets.push_back(averageColor);
+		entries.push_back(entry);
+		return (int)entries.size() - 1;
+	}
+
+	// packs every entry whose file can be read into as few pages as it takes and starts filling them. Entries
+	// left out keep an empty region, for the caller to load on its own
+	void Build(ThreadPool& pool)
+	{
+		startTime = std::chrono::steady_clock::now();
+		std::vector<size_t> order;
+		for (size_t i = 0; i < entries.size(); ++i)
+		{
+			Entry& entry = entries[i];
+			int width, height, channels;
+			if (!stbi_info(entry.path.c_str(), &width, &height, &channels))
+				continue;
+			while (std::max(width, height) > ATLAS_MAX_ENTRY_SIZE)
+			{
+				width = std::max(width / 2, 1);
+				height = std::max(height / 2, 1);
+				++entry.firstLevel;
+			}
+			entry.width = width;
+			entry.height = height;
+			order.push_back(i);
+		}
+
+		// tallest (then widest) first, which keeps the skyline flat
+		std::stable_sort(order.begin(), order.end(), [this](size_t a, size_t b)
+		{
+			return entries[a].height != entries[b].height ? entries[a].height > entries[b].height : entries[a].width > entries[b].width;
+		});
+		std::vector<SkylinePacker> packers;
+		for (size_t i : order)
+		{
+			Entry& entry = entries[i];
+			int cellWidth = alignUp(entry.width + 2 * ATLAS_PADDING), cellHeight = alignUp(entry.height + 2 * ATLAS_PADDING);
+			int x = 0, y = 0;
+			size_t page = 0;
+			while (page < packers.size() && !packers[page].Insert(cellWidth, cellHeight, x, y))
+				++page;
+			if (page == packers.size())
+			{
+				packers.push_back(SkylinePacker(ATLAS_PAGE_SIZE, ATLAS_PAGE_SIZE));
+				packers.back().Insert(cellWidth, cellHeight, x, y);
+				pages.push_back(Page());
+			}
+			entry.page = (int)page;
+			entry.x = x + ATLAS_PADDING;
+			entry.y = y + ATLAS_PADDING;
+			pages[page].entries.push_back(i);
+		}
+
+		// before the jobs start (see TextureLoader::Load)
+		stbi_set_flip_vertically_on_load(true);
+		for (size_t p = 0; p < pages.size(); ++p)
+		{
+			Page& page = pages[p];
+			page.width = packers[p].UsedWidth();
+			page.height = packers[p].UsedHeight();
+			page.texture = createPlaceholder();
+			std::vector<Entry*> pageEntries;
+			for (size_t i : page.entries)
+				pageEntries.push_back(&entries[i]);
+			int width = page.width, height = page.height;
+			std::function<void()> notify = OnBuilt;
+			page.levels = pool.Submit([pageEntries, width, height, notify, &pool]
+			{
+				std::vector<MipLevel> levels = composePage(pageEntries, width, height, pool);
+				if (notify)
+					notify();
+				return levels;
+			});
+		}
+	}
+
+	// the page and rectangle of an entry; an empty texture when it is not in the atlas
+	AtlasRegion Region(int entry) const
+	{
+		AtlasRegion region;
+		const Entry& source = entries[entry];
+		if (source.page < 0)
+			return region;
+		const Page& page = pages[source.page];
+		region.texture = page.texture;
+		region.rect = glm::vec4((float)source.x / page.width, (float)source.y / page.height,
+			(float)source.width / page.width, (float)source.height / page.height);
+		return region;
+	}
+
+	// uploads the pages that are complete; returns how many were. An image that could not be decoded leaves
+	// the atlas: its cell stays empty, and the region Region() gave for it is appended to dropped, for the
+	// caller to load the file on its own
+	int Update(std::vector<AtlasRegion>& dropped)
+	{
+		int uploaded = 0;
+		for (Page& page : pages)
+		{
+			if (!page.levels.valid() || page.levels.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+				continue;
+			upload(page.texture, page.levels.get());
+			for (size_t i : page.entries)
+			{
+				Entry& entry = entries[i];
+				if (entry.failed)
+				{
+					std::cout << "failed to load texture " << entry.path << " into the atlas, loading it on its own" << std::endl;
+					dropped.push_back(Region((int)i));
+					entry.page = -1;
+					continue;
+				}
+				for (glm::vec3* target : entry.colorTargets)
+					*target = entry.averageColor;
+			}
+			++uploaded;
+			if (Pending() == 0)
+				buildSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+		}
+		return uploaded;
+	}
+
+	// pages still showing their placeholder
+	size_t Pending() const
+	{
+		size_t pending = 0;
+		for (const Page& page : pages)
+			if (page.levels.valid())
+				++pending;
+		return pending;
+	}
+
+	size_t PageCount() const { return pages.size(); }
+
+	// entries packed into a page
+	size_t EntryCount() const
+	{
+		size_t count = 0;
+		for (const Entry& entry : entries)
+			if (entry.page >= 0)
+				++count;
+		return count;
+	}
+
+	// texels of all pages over those of their images, 1 for a perfect packing
+	float Overhead() const
+	{
+		double used = 0.0, total = 0.0;
+		for (const Entry& entry : entries)
+			if (entry.page >= 0)
+				used += (double)entry.width * entry.height;
+		for (const Page& page : pages)
+			total += (double)page.width * page.height;
+		return used > 0.0 ? (float)(total / used) : 1.0f;
+	}
+
+	// time from Build() until the last page was uploaded
+	double BuildSeconds() const { return buildSeconds; }
+
+	// waits for the pages still being composed and deletes them all
+	void Destroy()
+	{
+		for (Page& page : pages)
+		{
+			if (page.levels.valid())
+				page.levels.wait();
+			glDeleteTextures(1, &page.texture);
+		}
+		pages.clear();
+		entries.clear();
+	}
+
+private:
+	struct Entry
+	{
+		std::string path;
+		std::vector<glm::vec3*> colorTargets;
+		glm::vec3 averageColor = glm::vec3(0.5f);   // written by the page's job
+		bool failed = false;                        // the job could not decode the file
+		int firstLevel = 0;     // mip level of the file that goes into the page
+		int width = 0;          // size of that level
+		int height = 0;
+		int page = -1;
+		int x = 0;              // where it starts in the page, inside its gutter
+		int y = 0;
+	};
+
+	struct Page
+	{
+		GLuint texture = 0;
+		int width = 0;
+		int height = 0;
+		std::vector<size_t> entries;
+		std::future<std::vector<MipLevel>> levels;  // invalid once uploaded
+	};
+
+	std::vector<Entry> entries;
+	std::vector<Page> pages;
+	std::chrono::steady_clock::time_point startTime;
+	double buildSeconds = 0.0;
+
+	static int alignUp(int size)
+	{
+		return (size + ATLAS_ALIGNMENT - 1) / ATLAS_ALIGNMENT * ATLAS_ALIGNMENT;
+	}
+
+	static GLuint createPlaceholder()
+	{
+		static const unsigned char placeholder[3] = { 128, 128, 128 };
+		GLuint texture;
+		glGenTextures(1, &texture);
+		glBindTexture(GL_TEXTURE_2D, texture);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, 1, 1, 0, GL_RGB, GL_UNSIGNED_BYTE, placeholder);
+		glBindTexture(GL_TEXTURE_2D, 0);
+		return texture;
+	}
+
+	// runs on a worker: decodes the page's images in parallel and copies each of their mip levels, with its
+	// wrapped gutter, into the matching level of the page. Cells do not overlap, so the images write side by side
+	static std::vector<MipLevel> composePage(const std::vector<Entry*>& pageEntries, int width, int height, ThreadPool& pool)
+	{
+		std::vector<MipLevel> levels;
+		for (int level = 0; level < ATLAS_LEVELS; ++level)
+		{
+			MipLevel page;
+			page.width = std::max(width >> level, 1);
+			page.height = std::max(height >> level, 1);
+			page.rgba.assign((size_t)page.width * page.height * 4, 0);
+			bool smallest = page.width == 1 && page.height == 1;
+			levels.push_back(std::move(page));
+			if (smallest)
+				break;
+		}
+
+		pool.ParallelFor(pageEntries.size(), 1, [&pageEntries, &levels](size_t begin, size_t end)
+		{
+			for (size_t i = begin; i < end; ++i)
+			{
+				Entry& entry = *pageEntries[i];
+				int width, height, channels;
+				uint8_t* pixels = stbi_load(entry.path.c_str(), &width, &height, &channels, 0);
+				if (!pixels)
+				{
+					entry.failed = true;    // reported by Update(), on the GL thread
+					continue;
+				}
+				MipLevel top = ToMipLevel(pixels, width, height, channels);
+				stbi_image_free(pixels);
+				entry.averageColor = AverageColor(top);
+
+				std::vector<MipLevel> chain = GenerateMipChain(top);
+				for (size_t level = 0; level < levels.size(); ++level)
+				{
+					const MipLevel& source = chain[std::min((size_t)entry.firstLevel + level, chain.size() - 1)];
+					int gutter = ATLAS_PADDING >> level;
+					blit(source, levels[level], entry.x >> level, entry.y >> level, gutter);
+				}
+			}
+		});
+		return levels;
+	}
+
+	// copies source to (x, y) of target, surrounded by gutter texels taken from its opposite edges
+	static void blit(const MipLevel& source, MipLevel& target, int x, int y, int gutter)
+	{
+		for (int row = -gutter; row < source.height + gutter; ++row)
+		{
+			int sourceRow = ((row % source.height) + source.height) % source.height;
+			int targetRow = y + row;
+			if (targetRow < 0 || targetRow >= target.height)
+				continue;
+			for (int column = -gutter; column < source.width + gutter; ++column)
+			{
+				int targetColumn = x + column;
+				if (targetColumn < 0 || targetColumn >= target.width)
+					continue;
+				int sourceColumn = ((column % source.width) + source.width) % source.width;
+				const uint8_t* from = &source.rgba[((size_t)sourceRow * source.width + sourceColumn) * 4];
+				std::copy(from, from + 4, &target.rgba[((size_t)targetRow * target.width + targetColumn) * 4]);
+			}
+		}
+	}
+
+	static void upload(GLuint texture, const std::vector<MipLevel>& levels)
+	{
+		glBindTexture(GL_TEXTURE_2D, texture);
+		glTexStorage2D(GL_TEXTURE_2D, (GLsizei)levels.size(), GL_RGB8, levels[0].width, levels[0].height);
+		for (size_t level = 0; level < levels.size(); ++level)
+			glTexSubImage2D(GL_TEXTURE_2D, (GLint)level, 0, 0, levels[level].width, levels[level].height, GL_RGBA, GL_UNSIGNED_BYTE, levels[level].rgba.data());
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, (GLint)levels.size() - 1);
+		// the composed levels are what the gutters are for: a page is minified trilinearly, so small props read
+		// the level matching their size on screen (through the gradients SampleMaterialTexture passes)
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+		glBindTexture(GL_TEXTURE_2D, 0);
+	}
+};
+#endif
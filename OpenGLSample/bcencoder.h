@@ -0,0 +1,615 @@
+#ifndef BCENCODER_H
+#define BCENCODER_H
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include <emmintrin.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#include "mipgen.h"         // MipLevel
+#include "threadpool.h"
+
+// Block compression formats the encoder writes; the values are the KTX2 vkFormat ones (see ktx2.h)
+enum BcFormat : uint32_t
+{
+	BC_FORMAT_BC1 = 131,    // RGB, 8 bytes per block, 565 endpoints and 4 colors
+	BC_FORMAT_BC7 = 145     // RGBA, 16 bytes per block; mode 6: 7777 endpoints with p-bits and 16 colors
+};
+
+// Quality presets, from fast enough to compress at load time to slow enough for final assets:
+//   fast:   endpoints from the block's bounding box
+//   normal: endpoints along the principal axis of the block's colors
+//   high:   principal axis, then endpoints refit by least squares to the chosen indices, twice
+enum BcQuality
+{
+	BC_QUALITY_FAST,
+	BC_QUALITY_NORMAL,
+	BC_QUALITY_HIGH,
+	BC_QUALITY_COUNT
+};
+
+const char* const BC_QUALITY_NAMES[BC_QUALITY_COUNT] = { "fast", "normal", "high" };
+
+namespace bcdetail
+{
+	// 16 texels of a block, one array per channel, so four (SSE) or eight (AVX2) texels are handled at once
+	struct alignas(32) Block
+	{
+		float r[16], g[16], b[16], a[16];
+	};
+
+	// palette entries a block's indices choose from, in the decoder's exact integer colors
+	struct Palette
+	{
+		float colors[16][4];
+		float weights[16];      // share of the second endpoint in each entry, for the refit
+		int size;
+	};
+
+	// BC1 has only four colors, so its endpoints are pulled in from the extremes; BC7's sixteen cover them fine
+	const float BC1_INSET = 1.0f / 16.0f;
+
+	// weights of BC7's 4-bit indices, out of 64
+	const int BC7_WEIGHTS[16] = { 0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64 };
+
+	inline void loadBlock(const MipLevel& level, int blockX, int blockY, Block& block)
+	{
+		for (int i = 0; i < 16; ++i)
+		{
+			int x = std::min(blockX * 4 + (i & 3), level.width - 1);
+			int y = std::min(blockY * 4 + (i >> 2), level.height - 1);
+			const uint8_t* texel = &level.rgba[((size_t)y * level.width + x) * 4];
+			block.r[i] = texel[0];
+			block.g[i] = texel[1];
+			block.b[i] = texel[2];
+			block.a[i] = texel[3];
+		}
+	}
+
+	// picks the nearest palette entry for every texel; returns the block's summed squared error. Alpha only
+	// counts when alphaWeight is 1
+	inline float findIndices(const Block& block, const Palette& palette, float alphaWeight, uint8_t indices[16])
+	{
+		float total = 0.0f;
+#ifdef __AVX2__
+		alignas(32) float bestErrors[8];
+		alignas(32) int bestIndices[8];
+		for (int t = 0; t < 16; t += 8)
+		{
+			__m256 r = _mm256_load_ps(block.r + t), g = _mm256_load_ps(block.g + t), b = _mm256_load_ps(block.b + t);
+			__m256 a = _mm256_mul_ps(_mm256_load_ps(block.a + t), _mm256_set1_ps(alphaWeight));
+			__m256 best = _mm256_set1_ps(FLT_MAX);
+			__m256i bestIndex = _mm256_setzero_si256();
+			for (int p = 0; p < palette.size; ++p)
+			{
+				__m256 dr = _mm256_sub_ps(r, _mm256_set1_ps(palette.colors[p][0]));
+				__m256 dg = _mm256_sub_ps(g, _mm256_set1_ps(palette.colors[p][1]));
+				__m256 db = _mm256_sub_ps(b, _mm256_set1_ps(palette.colors[p][2]));
+				__m256 da = _mm256_sub_ps(a, _mm256_set1_ps(palette.colors[p][3] * alphaWeight));
+				__m256 error = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dr, dr), _mm256_mul_ps(dg, dg)),
+					_mm256_add_ps(_mm256_mul_ps(db, db), _mm256_mul_ps(da, da)));
+				__m256 closer = _mm256_cmp_ps(error, best, _CMP_LT_OQ);
+				best = _mm256_min_ps(error, best);
+				bestIndex = _mm256_blendv_epi8(bestIndex, _mm256_set1_epi32(p), _mm256_castps_si256(closer));
+			}
+			_mm256_store_ps(bestErrors, best);
+			_mm256_store_si256((__m256i*)bestIndices, bestIndex);
+			for (int i = 0; i < 8; ++i)
+			{
+				indices[t + i] = (uint8_t)bestIndices[i];
+				total += bestErrors[i];
+			}
+		}
+#else
+		alignas(16) float bestErrors[4];
+		alignas(16) int bestIndices[4];
+		for (int t = 0; t < 16; t += 4)
+		{
+			__m128 r = _mm_load_ps(block.r + t), g = _mm_load_ps(block.g + t), b = _mm_load_ps(block.b + t);
+			__m128 a = _mm_mul_ps(_mm_load_ps(block.a + t), _mm_set1_ps(alphaWeight));
+			__m128 best = _mm_set1_ps(FLT_MAX);
+			__m128i bestIndex = _mm_setzero_si128();
+			for (int p = 0; p < palette.size; ++p)
+			{
+				__m128 dr = _mm_sub_ps(r, _mm_set1_ps(palette.colors[p][0]));
+				__m128 dg = _mm_sub_ps(g, _mm_set1_ps(palette.colors[p][1]));
+				__m128 db = _mm_sub_ps(b, _mm_set1_ps(palette.colors[p][2]));
+				__m128 da = _mm_sub_ps(a, _mm_set1_ps(palette.colors[p][3] * alphaWeight));
+				__m128 error = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dr, dr), _mm_mul_ps(dg, dg)), _mm_add_ps(_mm_mul_ps(db, db), _mm_mul_ps(da, da)));
+				__m128i closer = _mm_castps_si128(_mm_cmplt_ps(error, best));
+				best = _mm_min_ps(error, best);
+				bestIndex = _mm_or_si128(_mm_and_si128(closer, _mm_set1_epi32(p)), _mm_andnot_si128(closer, bestIndex));
+			}
+			_mm_store_ps(bestErrors, best);
+			_mm_store_si128((__m128i*)bestIndices, bestIndex);
+			for (int i = 0; i < 4; ++i)
+			{
+				indices[t + i] = (uint8_t)bestIndices[i];
+				total += bestErrors[i];
+			}
+		}
+#endif
+		return total;
+	}
+
+	inline float horizontalSum(__m128 v)
+	{
+		alignas(16) float lanes[4];
+		_mm_store_ps(lanes, v);
+		return lanes[0] + lanes[1] + lanes[2] + lanes[3];
+	}
+
+	// endpoints at the corners of the block's bounding box, pulled in by inset of its size so outliers do not
+	// waste the range of a format with few palette entries
+	inline void boundingBoxEndpoints(const Block& block, float inset, float e0[4], float e1[4])
+	{
+		const float* channels[4] = { block.r, block.g, block.b, block.a };
+		for (int c = 0; c < 4; ++c)
+		{
+			__m128 low = _mm_load_ps(channels[c]), high = low;
+			for (int t = 4; t < 16; t += 4)
+			{
+				low = _mm_min_ps(low, _mm_load_ps(channels[c] + t));
+				high = _mm_max_ps(high, _mm_load_ps(channels[c] + t));
+			}
+			alignas(16) float lows[4], highs[4];
+			_mm_store_ps(lows, low);
+			_mm_store_ps(highs, high);
+			float minimum = std::min(std::min(lows[0], lows[1]), std::min(lows[2], lows[3]));
+			float maximum = std::max(std::max(highs[0], highs[1]), std::max(highs[2], highs[3]));
+			e0[c] = minimum + (maximum - minimum) * inset;
+			e1[c] = maximum - (maximum - minimum) * inset;
+		}
+	}
+
+	// endpoints where the color line through the block's mean, along its principal axis (power iteration on
+	// the covariance), leaves the block's colors, pulled in like the bounding box's; alpha takes its own range
+	inline void principalAxisEndpoints(const Block& block, float inset, float e0[4], float e1[4])
+	{
+		__m128 sumR = _mm_setzero_ps(), sumG = _mm_setzero_ps(), sumB = _mm_setzero_ps();
+		for (int t = 0; t < 16; t += 4)
+		{
+			sumR = _mm_add_ps(sumR, _mm_load_ps(block.r + t));
+			sumG = _mm_add_ps(sumG, _mm_load_ps(block.g + t));
+			sumB = _mm_add_ps(sumB, _mm_load_ps(block.b + t));
+		}
+		float mean[3] = { horizontalSum(sumR) / 16.0f, horizontalSum(sumG) / 16.0f, horizontalSum(sumB) / 16.0f };
+
+		__m128 meanR = _mm_set1_ps(mean[0]), meanG = _mm_set1_ps(mean[1]), meanB = _mm_set1_ps(mean[2]);
+		__m128 rr = _mm_setzero_ps(), rg = _mm_setzero_ps(), rb = _mm_setzero_ps(), gg = _mm_setzero_ps(), gb = _mm_setzero_ps(), bb = _mm_setzero_ps();
+		for (int t = 0; t < 16; t += 4)
+		{
+			__m128 r = _mm_sub_ps(_mm_load_ps(block.r + t), meanR);
+			__m128 g = _mm_sub_ps(_mm_load_ps(block.g + t), meanG);
+			__m128 b = _mm_sub_ps(_mm_load_ps(block.b + t), meanB);
+			rr = _mm_add_ps(rr, _mm_mul_ps(r, r));
+			rg = _mm_add_ps(rg, _mm_mul_ps(r, g));
+			rb = _mm_add_ps(rb, _mm_mul_ps(r, b));
+			gg = _mm_add_ps(gg, _mm_mul_ps(g, g));
+			gb = _mm_add_ps(gb, _mm_mul_ps(g, b));
+			bb = _mm_add_ps(bb, _mm_mul_ps(b, b));
+		}
+		float covariance[3][3];
+		covariance[0][0] = horizontalSum(rr);
+		covariance[0][1] = covariance[1][0] = horizontalSum(rg);
+		covariance[0][2] = covariance[2][0] = horizontalSum(rb);
+		covariance[1][1] = horizontalSum(gg);
+		covariance[1][2] = covariance[2][1] = horizontalSum(gb);
+		covariance[2][2] = horizontalSum(bb);
+
+		float axis[3] = { 1.0f, 1.0f, 1.0f };
+		for (int iteration = 0; iteration < 8; ++iteration)
+		{
+			float next[3];
+			for (int i = 0; i < 3; ++i)
+				next[i] = covariance[i][0] * axis[0] + covariance[i][1] * axis[1] + covariance[i][2] * axis[2];
+			float length = std::sqrt(next[0] * next[0] + next[1] * next[1] + next[2] * next[2]);
+			if (length < 1e-6f)
+				break;      // a flat block; any axis will do
+			for (int i = 0; i < 3; ++i)
+				axis[i] = next[i] / length;
+		}
+
+		__m128 axisR = _mm_set1_ps(axis[0]), axisG = _mm_set1_ps(axis[1]), axisB = _mm_set1_ps(axis[2]);
+		__m128 low = _mm_set1_ps(FLT_MAX), high = _mm_set1_ps(-FLT_MAX);
+		__m128 lowA = _mm_set1_ps(FLT_MAX), highA = _mm_set1_ps(-FLT_MAX);
+		for (int t = 0; t < 16; t += 4)
+		{
+			__m128 projection = _mm_add_ps(_mm_add_ps(
+				_mm_mul_ps(_mm_sub_ps(_mm_load_ps(block.r + t), meanR), axisR),
+				_mm_mul_ps(_mm_sub_ps(_mm_load_ps(block.g + t), meanG), axisG)),
+				_mm_mul_ps(_mm_sub_ps(_mm_load_ps(block.b + t), meanB), axisB));
+			low = _mm_min_ps(low, projection);
+			high = _mm_max_ps(high, projection);
+			lowA = _mm_min_ps(lowA, _mm_load_ps(block.a + t));
+			highA = _mm_max_ps(highA, _mm_load_ps(block.a + t));
+		}
+		alignas(16) float lows[4], highs[4], lowsA[4], highsA[4];
+		_mm_store_ps(lows, low);
+		_mm_store_ps(highs, high);
+		_mm_store_ps(lowsA, lowA);
+		_mm_store_ps(highsA, highA);
+		float tMin = std::min(std::min(lows[0], lows[1]), std::min(lows[2], lows[3]));
+		float tMax = std::max(std::max(highs[0], highs[1]), std::max(highs[2], highs[3]));
+		float pull = (tMax - tMin) * inset;
+		tMin += pull;
+		tMax -= pull;
+		for (int c = 0; c < 3; ++c)
+		{
+			e0[c] = std::min(std::max(mean[c] + axis[c] * tMin, 0.0f), 255.0f);
+			e1[c] = std::min(std::max(mean[c] + axis[c] * tMax, 0.0f), 255.0f);
+		}
+		e0[3] = std::min(std::min(lowsA[0], lowsA[1]), std::min(lowsA[2], lowsA[3]));
+		e1[3] = std::max(std::max(highsA[0], highsA[1]), std::max(highsA[2], highsA[3]));
+	}
+
+	// least squares endpoints for the indices chosen: each texel is (1 - w) * e0 + w * e1 with its entry's w
+	inline void refitEndpoints(const Block& block, const Palette& palette, const uint8_t indices[16], float e0[4], float e1[4])
+	{
+		float aa = 0.0f, ab = 0.0f, bb = 0.0f;
+		float ax[4] = { 0.0f, 0.0f, 0.0f, 0.0f }, bx[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+		const float* channels[4] = { block.r, block.g, block.b, block.a };
+		for (int i = 0; i < 16; ++i)
+		{
+			float w = palette.weights[indices[i]], v = 1.0f - w;
+			aa += v * v;
+			ab += v * w;
+			bb += w * w;
+			for (int c = 0; c < 4; ++c)
+			{
+				ax[c] += v * channels[c][i];
+				bx[c] += w * channels[c][i];
+			}
+		}
+		float determinant = aa * bb - ab * ab;
+		if (std::fabs(determinant) < 1e-6f)
+			return;     // every texel on one entry: nothing to fit
+		for (int c = 0; c < 4; ++c)
+		{
+			e0[c] = std::min(std::max((bb * ax[c] - ab * bx[c]) / determinant, 0.0f), 255.0f);
+			e1[c] = std::min(std::max((aa * bx[c] - ab * ax[c]) / determinant, 0.0f), 255.0f);
+		}
+	}
+
+	// ---- BC1 ----
+
+	inline uint16_t packRgb565(const float color[4])
+	{
+		int r = (int)(color[0] * 31.0f / 255.0f + 0.5f), g = (int)(color[1] * 63.0f / 255.0f + 0.5f), b = (int)(color[2] * 31.0f / 255.0f + 0.5f);
+		return (uint16_t)(std::min(std::max(r, 0), 31) << 11 | std::min(std::max(g, 0), 63) << 5 | std::min(std::max(b, 0), 31));
+	}
+
+	inline void unpackRgb565(uint16_t color, int rgb[3])
+	{
+		int r = (color >> 11) & 31, g = (color >> 5) & 63, b = color & 31;
+		rgb[0] = (r << 3) | (r >> 2);
+		rgb[1] = (g << 2) | (g >> 4);
+		rgb[2] = (b << 3) | (b >> 2);
+	}
+
+	// the four color palette of color0 > color1; entries 2 and 3 lie a third of the way from each end
+	inline void bc1Palette(uint16_t color0, uint16_t color1, Palette& palette)
+	{
+		int c0[3], c1[3];
+		unpackRgb565(color0, c0);
+		unpackRgb565(color1, c1);
+		for (int c = 0; c < 3; ++c)
+		{
+			palette.colors[0][c] = (float)c0[c];
+			palette.colors[1][c] = (float)c1[c];
+			palette.colors[2][c] = (float)((2 * c0[c] + c1[c]) / 3);
+			palette.colors[3][c] = (float)((c0[c] + 2 * c1[c]) / 3);
+		}
+		for (int p = 0; p < 4; ++p)
+			palette.colors[p][3] = 255.0f;
+		palette.weights[0] = 0.0f;
+		palette.weights[1] = 1.0f;
+		palette.weights[2] = 1.0f / 3.0f;
+		palette.weights[3] = 2.0f / 3.0f;
+		palette.size = 4;
+	}
+
+	// quantizes the endpoints and picks the indices; returns the error
+	inline float bc1Try(const Block& block, const float e0[4], const float e1[4], uint16_t& color0, uint16_t& color1, Palette& palette, uint8_t indices[16])
+	{
+		color0 = packRgb565(e1);   // the larger one first, for the four color mode
+		color1 = packRgb565(e0);
+		if (color0 < color1)
+			std::swap(color0, color1);
+		if (color0 == color1)
+		{
+			// a single color; the three color mode would be selected, so every index stays on color0
+			bc1Palette(color0, color1, palette);
+			palette.size = 1;
+		}
+		else
+			bc1Palette(color0, color1, palette);
+		return findIndices(block, palette, 0.0f, indices);
+	}
+
+	inline void encodeBc1Block(const Block& block, BcQuality quality, uint8_t out[8])
+	{
+		float e0[4], e1[4];
+		if (quality == BC_QUALITY_FAST)
+			boundingBoxEndpoints(block, BC1_INSET, e0, e1);
+		else
+			principalAxisEndpoints(block, BC1_INSET, e0, e1);
+
+		uint16_t color0, color1;
+		Palette palette;
+		uint8_t indices[16];
+		float error = bc1Try(block, e0, e1, color0, color1, palette, indices);
+		for (int iteration = 0; quality == BC_QUALITY_HIGH && iteration < 2 && palette.size == 4; ++iteration)
+		{
+			// refit in the order the palette was built: entry 0 is color0
+			float f0[4], f1[4];
+			std::memcpy(f0, palette.colors[0], sizeof(f0));
+			std::memcpy(f1, palette.colors[1], sizeof(f1));
+			refitEndpoints(block, palette, indices, f0, f1);
+			uint16_t refit0, refit1;
+			Palette refitPalette;
+			uint8_t refitIndices[16];
+			float refitError = bc1Try(block, f1, f0, refit0, refit1, refitPalette, refitIndices);
+			if (refitError >= error)
+				break;
+			error = refitError;
+			color0 = refit0;
+			color1 = refit1;
+			palette = refitPalette;
+			std::memcpy(indices, refitIndices, sizeof(indices));
+		}
+
+		uint32_t bits = 0;
+		for (int i = 0; i < 16; ++i)
+			bits |= (uint32_t)indices[i] << (i * 2);
+		out[0] = (uint8_t)color0;
+		out[1] = (uint8_t)(color0 >> 8);
+		out[2] = (uint8_t)color1;
+		out[3] = (uint8_t)(color1 >> 8);
+		for (int i = 0; i < 4; ++i)
+			out[4 + i] = (uint8_t)(bits >> (i * 8));
+	}
+
+	inline void decodeBc1Block(const uint8_t in[8], uint8_t texels[16 * 4])
+	{
+		uint16_t color0 = (uint16_t)(in[0] | in[1] << 8), color1 = (uint16_t)(in[2] | in[3] << 8);
+		int c0[3], c1[3], palette[4][4];
+		unpackRgb565(color0, c0);
+		unpackRgb565(color1, c1);
+		for (int c = 0; c < 3; ++c)
+		{
+			palette[0][c] = c0[c];
+			palette[1][c] = c1[c];
+			palette[2][c] = color0 > color1 ? (2 * c0[c] + c1[c]) / 3 : (c0[c] + c1[c]) / 2;
+			palette[3][c] = color0 > color1 ? (c0[c] + 2 * c1[c]) / 3 : 0;
+		}
+		for (int p = 0; p < 4; ++p)
+			palette[p][3] = (color0 <= color1 && p == 3) ? 0 : 255;
+		uint32_t bits = (uint32_t)in[4] | (uint32_t)in[5] << 8 | (uint32_t)in[6] << 16 | (uint32_t)in[7] << 24;
+		for (int i = 0; i < 16; ++i)
+			for (int c = 0; c < 4; ++c)
+				texels[i * 4 + c] = (uint8_t)palette[(bits >> (i * 2)) & 3][c];
+	}
+
+	// ---- BC7, mode 6 ----
+
+	// an 8-bit endpoint from its 7 stored bits and p-bit
+	inline void bc7Quantize(const float color[4], int quantized[4], int& pBit)
+	{
+		float bestError = FLT_MAX;
+		for (int p = 0; p < 2; ++p)
+		{
+			int candidate[4];
+			float error = 0.0f;
+			for (int c = 0; c < 4; ++c)
+			{
+				int stored = std::min(std::max((int)((color[c] - p) / 2.0f + 0.5f), 0), 127);
+				candidate[c] = stored << 1 | p;
+				error += (candidate[c] - color[c]) * (candidate[c] - color[c]);
+			}
+			if (error < bestError)
+			{
+				bestError = error;
+				pBit = p;
+				std::memcpy(quantized, candidate, sizeof(candidate));
+			}
+		}
+	}
+
+	inline void bc7Palette(const int e0[4], const int e1[4], Palette& palette)
+	{
+		for (int p = 0; p < 16; ++p)
+		{
+			for (int c = 0; c < 4; ++c)
+				palette.colors[p][c] = (float)(((64 - BC7_WEIGHTS[p]) * e0[c] + BC7_WEIGHTS[p] * e1[c] + 32) >> 6);
+			palette.weights[p] = BC7_WEIGHTS[p] / 64.0f;
+		}
+		palette.size = 16;
+	}
+
+	inline float bc7Try(const Block& block, const float e0[4], const float e1[4], int q0[4], int q1[4], int pBits[2], Palette& palette, uint8_t indices[16])
+	{
+		bc7Quantize(e0, q0, pBits[0]);
+		bc7Quantize(e1, q1, pBits[1]);
+		bc7Palette(q0, q1, palette);
+		return findIndices(block, palette, 1.0f, indices);
+	}
+
+	// writes value's low count bits at bit offset position of a 128-bit block
+	inline void writeBits(uint8_t out[16], int& position, uint32_t value, int count)
+	{
+		for (int i = 0; i < count; ++i, ++position)
+			if (value >> i & 1)
+				out[position >> 3] |= (uint8_t)(1 << (position & 7));
+	}
+
+	inline uint32_t readBits(const uint8_t in[16], int& position, int count)
+	{
+		uint32_t value = 0;
+		for (int i = 0; i < count; ++i, ++position)
+			value |= (uint32_t)(in[position >> 3] >> (position & 7) & 1) << i;
+		return value;
+	}
+
+	inline void encodeBc7Block(const Block& block, BcQuality quality, uint8_t out[16])
+	{
+		float e0[4], e1[4];
+		if (quality == BC_QUALITY_FAST)
+			boundingBoxEndpoints(block, 0.0f, e0, e1);
+		else
+			principalAxisEndpoints(block, 0.0f, e0, e1);
+
+		int q0[4], q1[4], pBits[2];
+		Palette palette;
+		uint8_t indices[16];
+		float error = bc7Try(block, e0, e1, q0, q1, pBits, palette, indices);
+		for (int iteration = 0; quality == BC_QUALITY_HIGH && iteration < 2; ++iteration)
+		{
+			float f0[4] = { (float)q0[0], (float)q0[1], (float)q0[2], (float)q0[3] };
+			float f1[4] = { (float)q1[0], (float)q1[1], (float)q1[2], (float)q1[3] };
+			refitEndpoints(block, palette, indices, f0, f1);
+			int r0[4], r1[4], refitPBits[2];
+			Palette refitPalette;
+			uint8_t refitIndices[16];
+			float refitError = bc7Try(block, f0, f1, r0, r1, refitPBits, refitPalette, refitIndices);
+			if (refitError >= error)
+				break;
+			error = refitError;
+			std::memcpy(q0, r0, sizeof(q0));
+			std::memcpy(q1, r1, sizeof(q1));
+			std::memcpy(pBits, refitPBits, sizeof(pBits));
+			palette = refitPalette;
+			std::memcpy(indices, refitIndices, sizeof(indices));
+		}
+
+		// the first texel's index is stored with its top bit implied 0: swap the endpoints when it is 1
+		if (indices[0] & 8)
+		{
+			for (int c = 0; c < 4; ++c)
+				std::swap(q0[c], q1[c]);
+			std::swap(pBits[0], pBits[1]);
+			for (int i = 0; i < 16; ++i)
+				indices[i] = (uint8_t)(15 - indices[i]);
+		}
+
+		std::memset(out, 0, 16);
+		int position = 0;
+		writeBits(out, position, 1 << 6, 7);    // mode 6
+		for (int c = 0; c < 4; ++c)
+		{
+			writeBits(out, position, (uint32_t)q0[c] >> 1, 7);
+			writeBits(out, position, (uint32_t)q1[c] >> 1, 7);
+		}
+		writeBits(out, position, (uint32_t)pBits[0], 1);
+		writeBits(out, position, (uint32_t)pBits[1], 1);
+		for (int i = 0; i < 16; ++i)
+			writeBits(out, position, indices[i], i == 0 ? 3 : 4);
+	}
+
+	// decodes a mode 6 block; other modes (which this encoder never writes) come out black
+	inline void decodeBc7Block(const uint8_t in[16], uint8_t texels[16 * 4])
+	{
+		std::memset(texels, 0, 16 * 4);
+		int position = 0;
+		if (readBits(in, position, 7) != 1 << 6)
+			return;
+		int e0[4], e1[4];
+		for (int c = 0; c < 4; ++c)
+		{
+			e0[c] = (int)readBits(in, position, 7) << 1;
+			e1[c] = (int)readBits(in, position, 7) << 1;
+		}
+		int p0 = (int)readBits(in, position, 1), p1 = (int)readBits(in, position, 1);
+		for (int c = 0; c < 4; ++c)
+		{
+			e0[c] |= p0;
+			e1[c] |= p1;
+		}
+		for (int i = 0; i < 16; ++i)
+		{
+			int weight = BC7_WEIGHTS[readBits(in, position, i == 0 ? 3 : 4)];
+			for (int c = 0; c < 4; ++c)
+				texels[i * 4 + c] = (uint8_t)(((64 - weight) * e0[c] + weight * e1[c] + 32) >> 6);
+		}
+	}
+}
+
+inline uint32_t BcBlockBytes(BcFormat format)
+{
+	return format == BC_FORMAT_BC1 ? 8 : 16;
+}
+
+// Compresses a whole image, rows of blocks spread across the pool; edge blocks repeat the last row and column
+inline std::vector<uint8_t> EncodeBc(const MipLevel& level, BcFormat format, BcQuality quality, ThreadPool& pool)
+{
+	int blocksX = (level.width + 3) / 4, blocksY = (level.height + 3) / 4;
+	uint32_t blockBytes = BcBlockBytes(format);
+	std::vector<uint8_t> blocks((size_t)blocksX * blocksY * blockBytes);
+	size_t rowsPerBatch = (size_t)std::max(1, 256 / blocksX);
+	pool.ParallelFor((size_t)blocksY, rowsPerBatch, [&](size_t begin, size_t end)
+	{
+		bcdetail::Block block;
+		for (size_t by = begin; by < end; ++by)
+			for (int bx = 0; bx < blocksX; ++bx)
+			{
+				bcdetail::loadBlock(level, bx, (int)by, block);
+				uint8_t* out = &blocks[(by * blocksX + bx) * blockBytes];
+				if (format == BC_FORMAT_BC1)
+					bcdetail::encodeBc1Block(block, quality, out);
+				else
+					bcdetail::encodeBc7Block(block, quality, out);
+			}
+	});
+	return blocks;
+}
+
+// Expands compressed blocks back to RGBA8, e.g. to measure the encoder's error
+inline MipLevel DecodeBc(const std::vector<uint8_t>& blocks, BcFormat format, int width, int height)
+{
+	MipLevel level;
+	level.width = width;
+	level.height = height;
+	level.rgba.resize((size_t)width * height * 4);
+	int blocksX = (width + 3) / 4, blocksY = (height + 3) / 4;
+	uint32_t blockBytes = BcBlockBytes(format);
+	uint8_t texels[16 * 4];
+	for (int by = 0; by < blocksY; ++by)
+		for (int bx = 0; bx < blocksX; ++bx)
+		{
+			const uint8_t* in = &blocks[((size_t)by * blocksX + bx) * blockBytes];
+			if (format == BC_FORMAT_BC1)
+				bcdetail::decodeBc1Block(in, texels);
+			else
+				bcdetail::decodeBc7Block(in, texels);
+			for (int i = 0; i < 16; ++i)
+			{
+				int x = bx * 4 + (i & 3), y = by * 4 + (i >> 2);
+				if (x < width && y < height)
+					std::memcpy(&level.rgba[((size_t)y * width + x) * 4], &texels[i * 4], 4);
+			}
+		}
+	return level;
+}
+
+// Peak signal to noise ratio of the color channels of decoded against original, in dB
+inline double ColorPsnr(const MipLevel& original, const MipLevel& decoded)
+{
+	double squaredError = 0.0;
+	size_t count = (size_t)original.width * original.height;
+	for (size_t i = 0; i < count; ++i)
+		for (int c = 0; c < 3; ++c)
+		{
+			double difference = (double)original.rgba[i * 4 + c] - decoded.rgba[i * 4 + c];
+			squaredError += difference * difference;
+		}
+	double meanSquaredError = squaredError / (count * 3.0);
+	return meanSquaredError > 0.0 ? 10.0 * std::log10(255.0 * 255.0 / meanSquaredError) : 99.0;
+}
+#endif
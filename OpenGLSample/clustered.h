@@ -0,0 +1,306 @@
+#ifndef CLUSTERED_H
+#define CLUSTERED_H
+
+#include <GL/glew.h>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "threadpool.h"
+
+#if defined(_M_X64) || defined(_M_AMD64) || defined(__SSE2__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <xmmintrin.h>
+#define CLUSTERED_USE_SSE 1
+#endif
+
+// Cluster grid: screen tiles in x and y, exponentially spaced depth slices in z
+const int CLUSTER_X = 16;
+const int CLUSTER_Y = 9;
+const int CLUSTER_Z = 24;
+const int CLUSTER_TILES = CLUSTER_X * CLUSTER_Y;
+const int CLUSTER_COUNT = CLUSTER_TILES * CLUSTER_Z;
+
+// SSBO binding points shared with the shaders
+const GLuint LIGHT_BUFFER_BINDING = 0;
+const GLuint CLUSTER_BUFFER_BINDING = 1;
+const GLuint LIGHT_INDEX_BUFFER_BINDING = 2;
+
+// std430 layout of one point or spot light, mirrored by the PointLight struct in the shaders
+struct GpuPointLight
+{
+	glm::vec4 positionRadius;   // world position, influence radius
+	glm::vec4 colorAmbient;     // color, ambient strength
+	glm::vec4 attenuation;      // constant, linear, quadratic, cos of the spot outer cutoff
+	glm::vec4 spotDirection;    // direction the spot cone points, cos of the inner cutoff (below -1 for point lights)
+	glm::vec4 shadow;           // shadow map slot (-1 for none), shadow far plane, depth bias, 1 if baked into the lightmaps
+};
+
+// Distance at which a light with the given attenuation falls below 1/256 of its brightest channel.
+// Lights that never fall off (no linear or quadratic term) get maxRange
+inline float LightInfluenceRadius(glm::vec3 color, float constant, float linear, float quadratic, float maxRange)
+{
+	float brightest = color.r > color.g ? (color.r > color.b ? color.r : color.b) : (color.g > color.b ? color.g : color.b);
+	float limit = brightest * 256.0f;   // solve constant + linear * d + quadratic * d^2 = limit
+
+	float radius;
+	if (quadratic > 0.0f)
+		radius = (-linear + std::sqrt(linear * linear - 4.0f * quadratic * (constant - limit))) / (2.0f * quadratic);
+	else if (linear > 0.0f)
+		radius = (limit - constant) / linear;
+	else
+		radius = maxRange;
+
+	return radius < maxRange ? (radius > 0.0f ? radius : 0.0f) : maxRange;
+}
+
+
+// Clustered light culling. Every frame the lights are assigned to the view space clusters their influence
+// sphere touches, so a fragment only evaluates the lights listed for its own cluster. The assignment runs on
+// the CPU, one depth slice per job on the thread pool, with the sphere/box tests done four tiles at a time.
+// Results go to three SSBOs: the lights, one (offset, count) pair per cluster, and the packed light indices.
+class ClusteredLighting
+{
+public:
+	// recomputes the cluster boxes when the projection changes. near and far must match the projection
+	void SetProjection(const glm::mat4& projection, float nearPlane, float farPlane)
+	{
+		if (projection == cachedProjection && nearPlane == zNear && farPlane == zFar)
+			return;
+
+		cachedProjection = projection;
+		zNear = nearPlane;
+		zFar = farPlane;
+		computeClusterBounds();
+	}
+
+	// assigns the lights (world space) to clusters for the given view and uploads the result
+	void Build(const std::vector<GpuPointLight>& lights, const glm::mat4& view, ThreadPool& pool)
+	{
+		createBuffers();
+		size_t lightCount = lights.size();
+
+		// light spheres in view space, and the depth slices each one can touch
+		viewLights.resize(lightCount);
+		sliceLights.assign(CLUSTER_Z, std::vector<uint32_t>());
+		for (size_t i = 0; i < lightCount; ++i)
+		{
+			glm::vec3 position = glm::vec3(view * glm::vec4(glm::vec3(lights[i].positionRadius), 1.0f));
+			float radius = lights[i].positionRadius.w;
+			viewLights[i] = glm::vec4(position, radius);
+
+			float nearDepth = -position.z - radius;
+			float farDepth = -position.z + radius;
+			if (farDepth < zNear || nearDepth > zFar)
+				continue;
+			for (int slice = sliceOf(nearDepth); slice <= sliceOf(farDepth); ++slice)
+				sliceLights[slice].push_back((uint32_t)i);
+		}
+
+		// each slice fills its own per-tile lists
+		pool.ParallelFor(CLUSTER_Z, 1, [this](size_t begin, size_t end)
+		{
+			for (size_t slice = begin; slice < end; ++slice)
+				assignSlice((int)slice);
+		});
+
+		// pack the lists: offsets follow cluster order
+		clusterRanges.resize(CLUSTER_COUNT * 2);
+		lightIndices.clear();
+		for (int cluster = 0; cluster < CLUSTER_COUNT; ++cluster)
+		{
+			const std::vector<uint32_t>& list = clusterLists[cluster];
+			clusterRanges[cluster * 2] = (uint32_t)lightIndices.size();
+			clusterRanges[cluster * 2 + 1] = (uint32_t)list.size();
+			lightIndices.insert(lightIndices.end(), list.begin(), list.end());
+		}
+		if (lightIndices.empty())
+			lightIndices.push_back(0);   // keep the buffer non-empty
+
+		// orphan and refill the buffers
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, lightBuffer);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, (lightCount > 0 ? lightCount : 1) * sizeof(GpuPointLight), NULL, GL_STREAM_DRAW);
+		if (lightCount > 0)
+			glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, lightCount * sizeof(GpuPointLight), lights.data());
+
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, clusterBuffer);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, clusterRanges.size() * sizeof(uint32_t), clusterRanges.data(), GL_STREAM_DRAW);
+
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, indexBuffer);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, lightIndices.size() * sizeof(uint32_t), lightIndices.data(), GL_STREAM_DRAW);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+		assignedIndices = lightIndices.size();
+	}
+
+	// binds the SSBOs to their binding points
+	void Bind() const
+	{
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, LIGHT_BUFFER_BINDING, lightBuffer);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, CLUSTER_BUFFER_BINDING, clusterBuffer);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, LIGHT_INDEX_BUFFER_BINDING, indexBuffer);
+	}
+
+	// sets the uniforms a shader needs to find the cluster of a fragment. viewportSize is the rendered area in pixels
+	void SetUniforms(GLuint programId, glm::vec2 viewportSize) const
+	{
+		float sliceScale = CLUSTER_Z / std::log(zFar / zNear);
+		glUniform3ui(glGetUniformLocation(programId, "clusterGridSize"), CLUSTER_X, CLUSTER_Y, CLUSTER_Z);
+		glUniform2f(glGetUniformLocation(programId, "clusterViewport"), viewportSize.x, viewportSize.y);
+		glUniform1f(glGetUniformLocation(programId, "clusterSliceScale"), sliceScale);
+		glUniform1f(glGetUniformLocation(programId, "clusterSliceBias"), -std::log(zNear) * sliceScale);
+	}
+
+	// total light/cluster pairs written by the last Build()
+	size_t AssignedIndexCount() const { return assignedIndices; }
+
+	void Destroy()
+	{
+		if (lightBuffer)
+		{
+			GLuint buffers[3] = { lightBuffer, clusterBuffer, indexBuffer };
+			glDeleteBuffers(3, buffers);
+		}
+		lightBuffer = clusterBuffer = indexBuffer = 0;
+	}
+
+private:
+	glm::mat4 cachedProjection = glm::mat4(0.0f);
+	float zNear = 0.1f;
+	float zFar = 100.0f;
+
+	// view space bounds of every cluster, one array per axis so four tiles can be tested at once
+	struct SliceBounds
+	{
+		float minX[CLUSTER_TILES], minY[CLUSTER_TILES], minZ[CLUSTER_TILES];
+		float maxX[CLUSTER_TILES], maxY[CLUSTER_TILES], maxZ[CLUSTER_TILES];
+	};
+	std::vector<SliceBounds> slices = std::vector<SliceBounds>(CLUSTER_Z);
+
+	std::vector<glm::vec4> viewLights;                  // view space position and radius per light
+	std::vector<std::vector<uint32_t>> sliceLights;     // lights overlapping each depth slice
+	std::vector<std::vector<uint32_t>> clusterLists = std::vector<std::vector<uint32_t>>(CLUSTER_COUNT);
+	std::vector<uint32_t> clusterRanges;                // offset, count per cluster
+	std::vector<uint32_t> lightIndices;
+	size_t assignedIndices = 0;
+
+	GLuint lightBuffer = 0;
+	GLuint clusterBuffer = 0;
+	GLuint indexBuffer = 0;
+
+	void createBuffers()
+	{
+		if (lightBuffer)
+			return;
+		glGenBuffers(1, &lightBuffer);
+		glGenBuffers(1, &clusterBuffer);
+		glGenBuffers(1, &indexBuffer);
+	}
+
+	// slice k covers view depths near * (far / near)^(k / CLUSTER_Z) to near * (far / near)^((k + 1) / CLUSTER_Z)
+	float sliceDepth(int slice) const
+	{
+		return zNear * std::pow(zFar / zNear, (float)slice / CLUSTER_Z);
+	}
+
+	int sliceOf(float depth) const
+	{
+		if (depth <= zNear)
+			return 0;
+		int slice = (int)(std::log(depth / zNear) / std::log(zFar / zNear) * CLUSTER_Z);
+		return slice < CLUSTER_Z ? slice : CLUSTER_Z - 1;
+	}
+
+	// view space boxes of all clusters: each tile corner is unprojected to a ray, which is cut at the slice depths.
+	// This works for both the perspective and the orthographic projection
+	void computeClusterBounds()
+	{
+		glm::mat4 inverseProjection = glm::inverse(cachedProjection);
+
+		for (int slice = 0; slice < CLUSTER_Z; ++slice)
+		{
+			float depths[2] = { sliceDepth(slice), sliceDepth(slice + 1) };
+			SliceBounds& bounds = slices[slice];
+
+			for (int y = 0; y < CLUSTER_Y; ++y)
+			{
+				for (int x = 0; x < CLUSTER_X; ++x)
+				{
+					glm::vec3 boxMin(1e30f), boxMax(-1e30f);
+					for (int corner = 0; corner < 4; ++corner)
+					{
+						float ndcX = -1.0f + 2.0f * (x + (corner & 1)) / CLUSTER_X;
+						float ndcY = -1.0f + 2.0f * (y + (corner >> 1)) / CLUSTER_Y;
+						glm::vec4 nearPoint = inverseProjection * glm::vec4(ndcX, ndcY, -1.0f, 1.0f);
+						glm::vec4 farPoint = inverseProjection * glm::vec4(ndcX, ndcY, 1.0f, 1.0f);
+						glm::vec3 a = glm::vec3(nearPoint) / nearPoint.w;
+						glm::vec3 b = glm::vec3(farPoint) / farPoint.w;
+
+						for (float depth : depths)
+						{
+							float t = (depth + a.z) / (a.z - b.z);   // where the ray reaches view z = -depth
+							glm::vec3 point = a + (b - a) * t;
+							boxMin = glm::min(boxMin, point);
+							boxMax = glm::max(boxMax, point);
+						}
+					}
+
+					int tile = x + y * CLUSTER_X;
+					bounds.minX[tile] = boxMin.x;
+					bounds.minY[tile] = boxMin.y;
+					bounds.minZ[tile] = boxMin.z;
+					bounds.maxX[tile] = boxMax.x;
+					bounds.maxY[tile] = boxMax.y;
+					bounds.maxZ[tile] = boxMax.z;
+				}
+			}
+		}
+	}
+
+	// sphere vs. box tests for every light overlapping one depth slice
+	void assignSlice(int slice)
+	{
+		const SliceBounds& bounds = slices[slice];
+		std::vector<uint32_t>* lists = &clusterLists[slice * CLUSTER_TILES];
+		for (int tile = 0; tile < CLUSTER_TILES; ++tile)
+			lists[tile].clear();
+
+		for (uint32_t lightIndex : sliceLights[slice])
+		{
+			const glm::vec4& sphere = viewLights[lightIndex];
+			float radiusSquared = sphere.w * sphere.w;
+			int tile = 0;
+
+#ifdef CLUSTERED_USE_SSE
+			__m128 cx = _mm_set1_ps(sphere.x), cy = _mm_set1_ps(sphere.y), cz = _mm_set1_ps(sphere.z);
+			__m128 r2 = _mm_set1_ps(radiusSquared);
+			__m128 zero = _mm_setzero_ps();
+			for (; tile + 4 <= CLUSTER_TILES; tile += 4)
+			{
+				// distance from the center to each box, per axis: max(min - c, c - max, 0)
+				__m128 dx = _mm_max_ps(_mm_max_ps(_mm_sub_ps(_mm_loadu_ps(bounds.minX + tile), cx), _mm_sub_ps(cx, _mm_loadu_ps(bounds.maxX + tile))), zero);
+				__m128 dy = _mm_max_ps(_mm_max_ps(_mm_sub_ps(_mm_loadu_ps(bounds.minY + tile), cy), _mm_sub_ps(cy, _mm_loadu_ps(bounds.maxY + tile))), zero);
+				__m128 dz = _mm_max_ps(_mm_max_ps(_mm_sub_ps(_mm_loadu_ps(bounds.minZ + tile), cz), _mm_sub_ps(cz, _mm_loadu_ps(bounds.maxZ + tile))), zero);
+				__m128 distanceSquared = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+				int hits = _mm_movemask_ps(_mm_cmple_ps(distanceSquared, r2));
+				for (int lane = 0; hits; ++lane, hits >>= 1)
+					if (hits & 1)
+						lists[tile + lane].push_back(lightIndex);
+			}
+#endif
+			for (; tile < CLUSTER_TILES; ++tile)
+			{
+				float dx = std::fmax(std::fmax(bounds.minX[tile] - sphere.x, sphere.x - bounds.maxX[tile]), 0.0f);
+				float dy = std::fmax(std::fmax(bounds.minY[tile] - sphere.y, sphere.y - bounds.maxY[tile]), 0.0f);
+				float dz = std::fmax(std::fmax(bounds.minZ[tile] - sphere.z, sphere.z - bounds.maxZ[tile]), 0.0f);
+				if (dx * dx + dy * dy + dz * dz <= radiusSquared)
+					lists[tile].push_back(lightIndex);
+			}
+		}
+	}
+};
+#endif
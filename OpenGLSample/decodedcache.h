@@ -0,0 +1,388 @@
+#ifndef DECODEDCACHE_H
+#define DECODEDCACHE_H
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "hash.h"
+#include "ktx2.h"           // ktx2detail byte helpers
+#include "lz4block.h"
+#include "mappedfile.h"
+#include "mipgen.h"
+
+// Where the decoded images are kept, and how much of the disk they may take by default
+const char* const DECODED_CACHE_DIRECTORY = "../resources/decoded";
+const size_t DECODED_CACHE_DEFAULT_BYTES = (size_t)512 * 1024 * 1024;
+const uint8_t DECODED_CACHE_IDENTIFIER[8] = { 'O', 'G', 'S', 'D', 'I', 'M', 'G', '1' };
+const uint32_t DECODED_CACHE_LZ4 = 1;       // header flag: the levels are LZ4 blocks
+
+// Size and modification time of a file, which decide whether a cached image was made from it as it is now
+struct SourceStamp
+{
+	uint64_t size = 0;
+	uint64_t time = 0;      // in the platform's own units, only ever compared
+
+	bool operator==(const SourceStamp& other) const { return size == other.size && time == other.time; }
+};
+
+inline bool StatSource(const std::string& path, SourceStamp& stamp)
+{
+#ifdef _WIN32
+	WIN32_FILE_ATTRIBUTE_DATA attributes;
+	if (!GetFileAttributesExA(path.c_str(), GetFileExInfoStandard, &attributes))
+		return false;
+	stamp.size = ((uint64_t)attributes.nFileSizeHigh << 32) | attributes.nFileSizeLow;
+	stamp.time = ((uint64_t)attributes.ftLastWriteTime.dwHighDateTime << 32) | attributes.ftLastWriteTime.dwLowDateTime;
+#else
+	struct stat status;
+	if (stat(path.c_str(), &status) != 0)
+		return false;
+	stamp.size = (uint64_t)status.st_size;
+	stamp.time = (uint64_t)status.st_mtime;
+#endif
+	return true;
+}
+
+// A cached image, mapped: the levels point into the file, and are LZ4 blocks when compressed
+struct DecodedCacheEntry
+{
+	std::shared_ptr<MappedFile> file;
+	int width = 0;
+	int height = 0;
+	int levelCount = 0;
+	bool compressed = false;
+	const uint8_t* levels[16] = {};
+	size_t storedBytes[16] = {};
+	uint64_t sourceHash = 0;
+	uint64_t contentHash = 0;
+	glm::vec3 averageColor = glm::vec3(0.5f);
+
+	int LevelWidth(int level) const { return std::max(width >> level, 1); }
+	int LevelHeight(int level) const { return std::max(height >> level, 1); }
+	size_t LevelBytes(int level) const { return (size_t)LevelWidth(level) * LevelHeight(level) * 4; }
+};
+
+// Decoded images kept on disk between runs, so a warm start skips decoding the JPEG and PNG files and building
+// their mip chains: every image is stored flipped, as RGBA8 with its whole chain, under the hash of its path,
+// with the size and modification time of the file it was made from. Find() only takes an entry whose stamp
+// matches the file's, so editing a texture invalidates its entry; the next Store() replaces it (on Windows, the
+// first one made while no other run has the old entry mapped). Uncompressed entries are mapped and their levels
+// go to the upload without a copy; compressed ones (LZ4, see lz4block.h) take a quarter to a half of the disk
+// and cost a decompression, still far cheaper than decoding. The directory is kept under its size limit by
+// deleting the entries used least recently. Find() and Store() are called from the loader's workers, so the
+// index and the counters are guarded by a mutex
+//   header: identifier, flags, width, height, level count, path length, source size, time and hash, content
+//   hash, average color, stored bytes per level; then the path, then the levels
+class DecodedImageCache
+{
+public:
+	DecodedImageCache() = default;
+	DecodedImageCache(const DecodedImageCache&) = delete;
+	DecodedImageCache& operator=(const DecodedImageCache&) = delete;
+
+	// uses directory, creating it when missing, and trims it to maxBytes; new entries are compressed when
+	// compress is set. clear deletes every entry first. False when the directory cannot be used
+	bool Open(const std::string& directory, size_t maxBytes, bool compress, bool clear = false)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		this->directory = directory;
+		this->maxBytes = maxBytes;
+		this->compress = compress;
+		index.clear();
+		totalBytes = 0;
+#ifdef _WIN32
+		CreateDirectoryA(directory.c_str(), nullptr);
+		WIN32_FIND_DATAA found;
+		HANDLE search = FindFirstFileA((directory + "/*.dimg").c_str(), &found);
+		if (search == INVALID_HANDLE_VALUE && GetLastError() != ERROR_FILE_NOT_FOUND)
+			return false;
+		if (search != INVALID_HANDLE_VALUE)
+		{
+			do
+			{
+				uint64_t time = ((uint64_t)found.ftLastWriteTime.dwHighDateTime << 32) | found.ftLastWriteTime.dwLowDateTime;
+				add(found.cFileName, ((uint64_t)found.nFileSizeHigh << 32) | found.nFileSizeLow, time);
+			} while (FindNextFileA(search, &found));
+			FindClose(search);
+		}
+		// writes a run stopped halfway through (see Store)
+		search = FindFirstFileA((directory + "/*.tmp").c_str(), &found);
+		if (search != INVALID_HANDLE_VALUE)
+		{
+			do
+				DeleteFileA((directory + "/" + found.cFileName).c_str());
+			while (FindNextFileA(search, &found));
+			FindClose(search);
+		}
+#else
+		mkdir(directory.c_str(), 0755);
+		DIR* listing = opendir(directory.c_str());
+		if (!listing)
+			return false;
+		while (dirent* found = readdir(listing))
+		{
+			std::string name = found->d_name;
+			struct stat status;
+			if (name.size() > 5 && name.compare(name.size() - 5, 5, ".dimg") == 0 && stat((directory + "/" + name).c_str(), &status) == 0)
+				add(name, (uint64_t)status.st_size, (uint64_t)status.st_mtime);
+			else if (name.size() > 4 && name.compare(name.size() - 4, 4, ".tmp") == 0)
+				std::remove((directory + "/" + name).c_str());     // a write a run stopped halfway through
+		}
+		closedir(listing);
+#endif
+		open = true;
+		if (clear)
+			trim(0);
+		trim(maxBytes);
+		return true;
+	}
+
+	bool IsOpen() const { return open; }
+
+	// maps the entry of path when it was made from the file as it is now (see StatSource)
+	bool Find(const std::string& path, const SourceStamp& stamp, DecodedCacheEntry& entry)
+	{
+		if (!open)
+			return false;
+		std::string name = entryName(path);
+		std::shared_ptr<MappedFile> file = std::make_shared<MappedFile>();
+		if (!file->Open(directory + "/" + name) || !parse(file->Data(), file->Size(), path, stamp, entry))
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			++misses;
+			return false;
+		}
+		entry.file = file;
+
+		std::lock_guard<std::mutex> lock(mutex);
+		++hits;
+		auto found = index.find(name);
+		if (found != index.end())
+			found->second.lastUse = ++useCounter;
+		return true;
+	}
+
+	// decompresses the level of a compressed entry into out (LevelBytes(level) long)
+	static bool Expand(const DecodedCacheEntry& entry, int level, uint8_t* out)
+	{
+		return Lz4Decompress(entry.levels[level], entry.storedBytes[level], out, entry.LevelBytes(level));
+	}
+
+	// writes the decoded chain of path, replacing its entry, then trims the directory back under its limit
+	void Store(const std::string& path, const SourceStamp& stamp, uint64_t sourceHash, uint64_t contentHash,
+		glm::vec3 averageColor, const std::vector<MipLevel>& mips)
+	{
+		using namespace ktx2detail;
+		if (!open || mips.empty() || mips.size() > 16)
+			return;
+
+		std::vector<std::vector<uint8_t>> stored(mips.size());
+		if (compress)
+			for (size_t level = 0; level < mips.size(); ++level)
+				Lz4Compress(mips[level].rgba.data(), mips[level].rgba.size(), stored[level]);
+
+		std::vector<uint8_t> header(DECODED_CACHE_IDENTIFIER, DECODED_CACHE_IDENTIFIER + 8);
+		put32(header, compress ? DECODED_CACHE_LZ4 : 0);
+		put32(header, (uint32_t)mips[0].width);
+		put32(header, (uint32_t)mips[0].height);
+		put32(header, (uint32_t)mips.size());
+		put32(header, (uint32_t)path.size());
+		put32(header, 0);
+		put64(header, stamp.size);
+		put64(header, stamp.time);
+		put64(header, sourceHash);
+		put64(header, contentHash);
+		uint32_t colorBits[3];
+		std::memcpy(colorBits, &averageColor, sizeof(colorBits));
+		for (uint32_t bits : colorBits)
+			put32(header, bits);
+		put32(header, 0);
+		for (size_t level = 0; level < mips.size(); ++level)
+			put64(header, compress ? stored[level].size() : mips[level].rgba.size());
+		header.insert(header.end(), path.begin(), path.end());
+
+		// written next to the entry, then moved over it, so a run that stops halfway leaves no broken entry. An
+		// image another run still has mapped from the old entry keeps its pages on POSIX; Windows does not replace
+		// a mapped file, so there the move fails and this store is dropped. The old entry stays out of date,
+		// which Find() turns away, until a store made while nothing maps it replaces it
+		std::string name = entryName(path);
+		std::string filePath = directory + "/" + name;
+		std::string writePath = filePath + ".tmp";
+		size_t bytes = header.size();
+		{
+			std::ofstream file(writePath, std::ios::binary | std::ios::trunc);
+			if (!file)
+				return;
+			file.write((const char*)header.data(), header.size());
+			for (size_t level = 0; level < mips.size(); ++level)
+			{
+				const std::vector<uint8_t>& data = compress ? stored[level] : mips[level].rgba;
+				file.write((const char*)data.data(), data.size());
+				bytes += data.size();
+			}
+			if (!file)
+			{
+				file.close();
+				std::remove(writePath.c_str());
+				return;
+			}
+		}
+#ifdef _WIN32
+		bool moved = MoveFileExA(writePath.c_str(), filePath.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+		bool moved = std::rename(writePath.c_str(), filePath.c_str()) == 0;
+#endif
+		if (!moved)
+		{
+			std::remove(writePath.c_str());
+			return;
+		}
+
+		std::lock_guard<std::mutex> lock(mutex);
+		++stores;
+		auto found = index.find(name);
+		if (found != index.end())
+			totalBytes -= found->second.bytes;
+		index[name] = { bytes, ++useCounter };
+		totalBytes += bytes;
+		trim(maxBytes);
+	}
+
+	size_t Hits() const { return counter(hits); }
+	size_t Misses() const { return counter(misses); }            // lookups that had to decode, missing or out of date
+	size_t Stores() const { return counter(stores); }
+	size_t Evictions() const { return counter(evictions); }      // entries deleted for the size limit
+	size_t Bytes() const { return counter(totalBytes); }
+	size_t MaxBytes() const { return maxBytes; }
+
+private:
+	struct IndexEntry
+	{
+		size_t bytes;
+		uint64_t lastUse;       // order of use; entries found on disk start in the order they were written
+	};
+
+	mutable std::mutex mutex;
+	std::string directory;
+	size_t maxBytes = DECODED_CACHE_DEFAULT_BYTES;
+	bool compress = false;
+	bool open = false;
+	std::unordered_map<std::string, IndexEntry> index;
+	size_t totalBytes = 0;
+	uint64_t useCounter = 0;
+	size_t hits = 0;
+	size_t misses = 0;
+	size_t stores = 0;
+	size_t evictions = 0;
+
+	// the counters change on the workers, so they are read under the lock too
+	size_t counter(const size_t& value) const
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return value;
+	}
+
+	// one file per path, whatever its spelling
+	static std::string entryName(const std::string& path)
+	{
+		std::string key = path;
+		std::replace(key.begin(), key.end(), '\\', '/');
+		char name[24];
+		std::snprintf(name, sizeof(name), "%016llx.dimg", (unsigned long long)HashBytes(key.data(), key.size()));
+		return name;
+	}
+
+	// the files on disk get use orders below every one handed out this run, oldest write first
+	void add(const std::string& name, uint64_t bytes, uint64_t time)
+	{
+		index[name] = { (size_t)bytes, time };
+		totalBytes += (size_t)bytes;
+		useCounter = std::max(useCounter, time);
+	}
+
+	// deletes the least recently used entries until the rest fit in limit. An entry another run still has
+	// mapped may not delete (on Windows): it stays in the index, still counted, for a later trim to retry, and
+	// the next oldest goes instead. One already gone from the disk only leaves the index
+	void trim(size_t limit)
+	{
+		if (totalBytes <= limit)
+			return;
+		std::vector<std::pair<uint64_t, std::string>> order;
+		for (const auto& entry : index)
+			order.push_back({ entry.second.lastUse, entry.first });
+		std::sort(order.begin(), order.end());
+		for (size_t i = 0; i < order.size() && totalBytes > limit; ++i)
+		{
+			bool deleted = std::remove((directory + "/" + order[i].second).c_str()) == 0;
+			if (!deleted && errno != ENOENT)
+				continue;
+			auto found = index.find(order[i].second);
+			totalBytes -= found->second.bytes;
+			index.erase(found);
+			if (deleted)
+				++evictions;
+		}
+	}
+
+	// checks the header against path and its stamp, and that every level is in the file
+	static bool parse(const uint8_t* data, size_t size, const std::string& path, const SourceStamp& stamp, DecodedCacheEntry& entry)
+	{
+		using namespace ktx2detail;
+		const size_t fixedBytes = 80;
+		if (size < fixedBytes || std::memcmp(data, DECODED_CACHE_IDENTIFIER, 8) != 0)
+			return false;
+		entry.compressed = (get32(data + 8) & DECODED_CACHE_LZ4) != 0;
+		entry.width = (int)get32(data + 12);
+		entry.height = (int)get32(data + 16);
+		entry.levelCount = (int)get32(data + 20);
+		size_t pathLength = get32(data + 24);
+		SourceStamp stored;
+		stored.size = get64(data + 32);
+		stored.time = get64(data + 40);
+		if (entry.width <= 0 || entry.height <= 0 || entry.levelCount <= 0 || entry.levelCount > 16 || !(stored == stamp))
+			return false;
+		entry.sourceHash = get64(data + 48);
+		entry.contentHash = get64(data + 56);
+		std::memcpy(&entry.averageColor, data + 64, sizeof(float) * 3);
+
+		size_t offset = fixedBytes + (size_t)entry.levelCount * 8;
+		if (size < offset + pathLength || pathLength != path.size() || std::memcmp(data + offset, path.data(), pathLength) != 0)
+			return false;
+		offset += pathLength;
+		for (int level = 0; level < entry.levelCount; ++level)
+		{
+			entry.storedBytes[level] = (size_t)get64(data + fixedBytes + level * 8);
+			if ((!entry.compressed && entry.storedBytes[level] != entry.LevelBytes(level)) || size - offset < entry.storedBytes[level])
+				return false;
+			entry.levels[level] = data + offset;
+			offset += entry.storedBytes[level];
+		}
+		return true;
+	}
+};
+#endif
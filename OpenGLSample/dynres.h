@@ -0,0 +1,138 @@
+#ifndef DYNRES_H
+#define DYNRES_H
+
+#include <GL/glew.h>
+
+#include <cmath>
+
+// Picks the render scale (fraction of the window size per axis) from measured GPU frame times.
+// GPU cost follows the pixel count, i.e. scale squared, so the correction is the square root of
+// budget / time. Drops react quickly so spikes don't miss frames; raises are slow and only happen
+// with head room to spare, so the scale does not oscillate.
+class DynamicResolution
+{
+public:
+	float MinScale = 0.5f;
+	float MaxScale = 1.0f;
+	double BudgetMs = 14.0;      // GPU time the scene may take per frame
+	bool Enabled = true;
+
+	float Scale() const { return Enabled ? scale : MaxScale; }
+
+	// feeds one GPU frame time in milliseconds
+	void Update(double gpuMs)
+	{
+		if (gpuMs <= 0.0)
+			return;
+
+		// smooth out single-frame noise, but let increases through faster than decreases
+		double weight = gpuMs > smoothedMs ? 0.5 : 0.1;
+		smoothedMs = smoothedMs <= 0.0 ? gpuMs : smoothedMs + (gpuMs - smoothedMs) * weight;
+
+		double ratio = BudgetMs / smoothedMs;
+		float target = (float)(scale * std::sqrt(ratio));
+
+		if (ratio < 1.0)
+			scale += (target - scale) * 0.5f;      // over budget: move halfway there this frame
+		else if (ratio > 1.2)
+			scale += (target - scale) * 0.05f;     // comfortably under budget: creep back up
+		// otherwise we are inside the dead band and keep the current scale
+
+		if (scale < MinScale)
+			scale = MinScale;
+		if (scale > MaxScale)
+			scale = MaxScale;
+	}
+
+	double SmoothedMs() const { return smoothedMs; }
+
+private:
+	float scale = 1.0f;
+	double smoothedMs = 0.0;
+};
+
+
+// Offscreen color + depth target allocated at the full window size. The scene is drawn into the lower left
+// scaled sub-rectangle, so changing the scale never reallocates; only a window resize does.
+class ScaledRenderTarget
+{
+public:
+	GLuint Framebuffer = 0;
+	GLuint ColorTexture = 0;
+	GLuint DepthTexture = 0;
+	int Width = 0;           // allocated (window) size
+	int Height = 0;
+	int ViewportWidth = 0;   // scaled size used for the current frame
+	int ViewportHeight = 0;
+
+	// (re)allocates the attachments for a new window size
+	void Resize(int width, int height)
+	{
+		width = width > 0 ? width : 1;
+		height = height > 0 ? height : 1;
+		if (Framebuffer && width == Width && height == Height)
+			return;
+
+		Destroy();
+		Width = width;
+		Height = height;
+
+		glGenTextures(1, &ColorTexture);
+		glBindTexture(GL_TEXTURE_2D, ColorTexture);
+		glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA8, width, height);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+		glGenTextures(1, &DepthTexture);
+		glBindTexture(GL_TEXTURE_2D, DepthTexture);
+		glTexStorage2D(GL_TEXTURE_2D, 1, GL_DEPTH_COMPONENT24, width, height);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glBindTexture(GL_TEXTURE_2D, 0);
+
+		glGenFramebuffers(1, &Framebuffer);
+		glBindFramebuffer(GL_FRAMEBUFFER, Framebuffer);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, ColorTexture, 0);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, DepthTexture, 0);
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	}
+
+	// binds the target and sets the viewport to the scaled rectangle for this frame
+	void Bind(float scale)
+	{
+		ViewportWidth = (int)(Width * scale + 0.5f);
+		ViewportHeight = (int)(Height * scale + 0.5f);
+		ViewportWidth = ViewportWidth > 0 ? ViewportWidth : 1;
+		ViewportHeight = ViewportHeight > 0 ? ViewportHeight : 1;
+
+		glBindFramebuffer(GL_FRAMEBUFFER, Framebuffer);
+		glViewport(0, 0, ViewportWidth, ViewportHeight);
+	}
+
+	// upscales the rendered rectangle to the whole default framebuffer with bilinear filtering
+	void BlitToScreen(int screenWidth, int screenHeight)
+	{
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, Framebuffer);
+		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+		GLenum filter = ViewportWidth == screenWidth && ViewportHeight == screenHeight ? GL_NEAREST : GL_LINEAR;
+		glBlitFramebuffer(0, 0, ViewportWidth, ViewportHeight, 0, 0, screenWidth, screenHeight, GL_COLOR_BUFFER_BIT, filter);
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		glViewport(0, 0, screenWidth, screenHeight);
+	}
+
+	void Destroy()
+	{
+		if (Framebuffer)
+			glDeleteFramebuffers(1, &Framebuffer);
+		if (ColorTexture)
+			glDeleteTextures(1, &ColorTexture);
+		if (DepthTexture)
+			glDeleteTextures(1, &DepthTexture);
+		Framebuffer = ColorTexture = DepthTexture = 0;
+	}
+};
+#endif
@@ -0,0 +1,360 @@
+#ifndef ECS_H
+#define ECS_H
+
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "scenegraph.h"
+#include "threadpool.h"
+
+// Component types. Each one is stored in its own contiguous array inside a chunk
+typedef uint32_t ComponentMask;
+
+const ComponentMask COMPONENT_TRANSFORM = 1 << 0;
+const ComponentMask COMPONENT_BOUNDS = 1 << 1;
+const ComponentMask COMPONENT_MESH = 1 << 2;
+const ComponentMask COMPONENT_MATERIAL = 1 << 3;
+const ComponentMask COMPONENT_LIGHT = 1 << 4;
+const ComponentMask COMPONENT_STATIC = 1 << 5;   // tag without data: never moves in normal play, so derived data can be cached
+
+// world placement: the scene graph node driving the entity and a copy of its world matrix
+struct TransformComponent
+{
+	SceneNode node;
+	glm::mat4 world;
+};
+
+// axis aligned box in model space, plus its world space center and half extent for culling
+struct BoundsComponent
+{
+	glm::vec3 localMin;
+	glm::vec3 localMax;
+	glm::vec3 center;
+	glm::vec3 extent;
+};
+
+// GL geometry to draw
+struct MeshComponent
+{
+	unsigned int vao;
+	unsigned int depthVao;     // position-only stream for depth passes
+	unsigned int lightmapVao;  // vertices split along the lightmap charts, with lightmap coordinates; 0 without a lightmap
+	unsigned int indexCount;
+	unsigned int meshIndex;    // the mesh this was created from
+};
+
+// surface appearance
+struct MaterialComponent
+{
+	unsigned int texture;
+	glm::vec2 uvScale;
+	glm::vec4 atlasRect;       // offset (xy) and scale (zw) of the image in its texture, an atlas page or its own
+	bool virtualTexture;       // sampled from the virtual texture (see virtualtexture.h) instead of texture
+	float specularIntensity;   // Phong specular strength
+	float highlightSize;       // Phong specular exponent
+	unsigned int lightmap;     // baked diffuse lighting (RGBM), or 0
+	float opacity;             // 1 for opaque; translucent surfaces are drawn in the transparency pass
+};
+
+// point or spot light; the position comes from the transform. Brightness falls off as
+// 1 / (constant + linear * d + quadratic * d^2), so 1, 0, 0 never fades
+struct LightComponent
+{
+	glm::vec3 color;
+	glm::vec3 scale;
+	float ambientStrength;
+	float constant;
+	float linear;
+	float quadratic;
+	glm::vec3 spotDirection;   // spot lights only: direction the cone points
+	float innerCutoff;         // cosines of the full brightness and the outer cone angles; -2 for point lights
+	float outerCutoff;
+	int shadowIndex;           // slot in the point shadow maps, or -1 for a light without shadows
+};
+
+// innerCutoff / outerCutoff value marking a point light
+const float NO_SPOT_CUTOFF = -2.0f;
+
+// Entity handle. The generation detects handles that outlived their entity
+struct Entity
+{
+	uint32_t index;
+	uint32_t generation;
+};
+
+const uint32_t CHUNK_CAPACITY = 1024;   // entities per chunk
+
+// A block of entities that all have the same component set, stored as one array per component.
+// Arrays for components the archetype does not have are left unallocated
+struct Chunk
+{
+	ComponentMask mask = 0;
+	uint32_t count = 0;
+	std::unique_ptr<Entity[]> entities;
+	std::unique_ptr<TransformComponent[]> transforms;
+	std::unique_ptr<BoundsComponent[]> bounds;
+	std::unique_ptr<MeshComponent[]> meshes;
+	std::unique_ptr<MaterialComponent[]> materials;
+	std::unique_ptr<LightComponent[]> lights;
+};
+
+// maps a component type to its mask bit and its array inside a chunk
+template <typename T> struct ComponentTraits;
+
+template <> struct ComponentTraits<TransformComponent>
+{
+	static const ComponentMask Bit = COMPONENT_TRANSFORM;
+	static std::unique_ptr<TransformComponent[]>& Array(Chunk& chunk) { return chunk.transforms; }
+};
+
+template <> struct ComponentTraits<BoundsComponent>
+{
+	static const ComponentMask Bit = COMPONENT_BOUNDS;
+	static std::unique_ptr<BoundsComponent[]>& Array(Chunk& chunk) { return chunk.bounds; }
+};
+
+template <> struct ComponentTraits<MeshComponent>
+{
+	static const ComponentMask Bit = COMPONENT_MESH;
+	static std::unique_ptr<MeshComponent[]>& Array(Chunk& chunk) { return chunk.meshes; }
+};
+
+template <> struct ComponentTraits<MaterialComponent>
+{
+	static const ComponentMask Bit = COMPONENT_MATERIAL;
+	static std::unique_ptr<MaterialComponent[]>& Array(Chunk& chunk) { return chunk.materials; }
+};
+
+template <> struct ComponentTraits<LightComponent>
+{
+	static const ComponentMask Bit = COMPONENT_LIGHT;
+	static std::unique_ptr<LightComponent[]>& Array(Chunk& chunk) { return chunk.lights; }
+};
+
+
+// Entity-component store. Entities are grouped into archetypes by their exact component set and packed
+// into fixed size chunks, so systems walk plain arrays instead of chasing pointers. Chunks are the unit of
+// work for ParallelForEachChunk.
+class World
+{
+public:
+	// creates an entity with value initialised components for every bit in mask. It goes into the first chunk
+	// of its archetype with room, so the rows destroyed entities left are filled before a chunk is added
+	Entity CreateEntity(ComponentMask mask)
+	{
+		Archetype& archetype = findOrCreateArchetype(mask);
+		size_t chunkIndex = 0;
+		while (chunkIndex < archetype.chunks.size() && archetype.chunks[chunkIndex]->count == CHUNK_CAPACITY)
+			++chunkIndex;
+		if (chunkIndex == archetype.chunks.size())
+			archetype.chunks.push_back(allocateChunk(mask));
+
+		uint32_t index;
+		if (!freeIndices.empty())
+		{
+			index = freeIndices.back();
+			freeIndices.pop_back();
+		}
+		else
+		{
+			index = (uint32_t)records.size();
+			records.push_back(EntityRecord());
+		}
+
+		Chunk& chunk = *archetype.chunks[chunkIndex];
+		uint32_t row = chunk.count++;
+		// the row may have held an entity destroyed since
+		resetRow<TransformComponent>(chunk, row);
+		resetRow<BoundsComponent>(chunk, row);
+		resetRow<MeshComponent>(chunk, row);
+		resetRow<MaterialComponent>(chunk, row);
+		resetRow<LightComponent>(chunk, row);
+		EntityRecord& record = records[index];
+		record.archetype = archetype.index;
+		record.chunk = (uint32_t)chunkIndex;
+		record.row = row;
+		record.alive = true;
+
+		Entity entity = { index, record.generation };
+		chunk.entities[row] = entity;
+		++entityCount;
+		++structureVersion;
+		return entity;
+	}
+
+	// removes an entity; the last entity of its chunk is moved into the hole
+	void DestroyEntity(Entity entity)
+	{
+		if (!IsAlive(entity))
+			return;
+
+		EntityRecord& record = records[entity.index];
+		Archetype& archetype = *archetypes[record.archetype];
+		Chunk& chunk = *archetype.chunks[record.chunk];
+		uint32_t last = chunk.count - 1;
+
+		if (record.row != last)
+		{
+			moveRow<TransformComponent>(chunk, last, record.row);
+			moveRow<BoundsComponent>(chunk, last, record.row);
+			moveRow<MeshComponent>(chunk, last, record.row);
+			moveRow<MaterialComponent>(chunk, last, record.row);
+			moveRow<LightComponent>(chunk, last, record.row);
+			chunk.entities[record.row] = chunk.entities[last];
+			records[chunk.entities[record.row].index].row = record.row;
+		}
+		--chunk.count;
+
+		record.alive = false;
+		++record.generation;
+		freeIndices.push_back(entity.index);
+		--entityCount;
+		++structureVersion;
+	}
+
+	bool IsAlive(Entity entity) const
+	{
+		return entity.index < records.size() && records[entity.index].alive && records[entity.index].generation == entity.generation;
+	}
+
+	bool Has(Entity entity, ComponentMask mask) const
+	{
+		return (archetypes[records[entity.index].archetype]->mask & mask) == mask;
+	}
+
+	// direct access to one component of one entity (the entity must have it)
+	template <typename T>
+	T& Get(Entity entity)
+	{
+		const EntityRecord& record = records[entity.index];
+		Chunk& chunk = *archetypes[record.archetype]->chunks[record.chunk];
+		return ComponentTraits<T>::Array(chunk)[record.row];
+	}
+
+	size_t EntityCount() const { return entityCount; }
+
+	// bumped whenever entities are created or destroyed, so callers can rebuild per-chunk caches
+	uint64_t StructureVersion() const { return structureVersion; }
+
+	// total number of chunks holding at least every component in mask
+	size_t ChunkCount(ComponentMask mask) const
+	{
+		size_t total = 0;
+		for (const std::unique_ptr<Archetype>& archetype : archetypes)
+			if ((archetype->mask & mask) == mask)
+				total += archetype->chunks.size();
+		return total;
+	}
+
+	// calls fn(chunk, chunkIndex) for every chunk holding at least the components in mask.
+	// chunkIndex counts the matching chunks from 0 to ChunkCount(mask) - 1
+	template <typename F>
+	void ForEachChunk(ComponentMask mask, F fn)
+	{
+		size_t chunkIndex = 0;
+		for (std::unique_ptr<Archetype>& archetype : archetypes)
+		{
+			if ((archetype->mask & mask) != mask)
+				continue;
+			for (std::unique_ptr<Chunk>& chunk : archetype->chunks)
+			{
+				if (chunk->count > 0)
+					fn(*chunk, chunkIndex);
+				++chunkIndex;
+			}
+		}
+	}
+
+	// same as ForEachChunk, with the chunks spread across the thread pool. fn must only write to its own chunk
+	// (or to per-chunkIndex outputs)
+	template <typename F>
+	void ParallelForEachChunk(ThreadPool& pool, ComponentMask mask, F fn)
+	{
+		std::vector<Chunk*> matching;
+		for (std::unique_ptr<Archetype>& archetype : archetypes)
+			if ((archetype->mask & mask) == mask)
+				for (std::unique_ptr<Chunk>& chunk : archetype->chunks)
+					matching.push_back(chunk.get());
+
+		pool.ParallelFor(matching.size(), 1, [&](size_t begin, size_t end)
+		{
+			for (size_t chunkIndex = begin; chunkIndex < end; ++chunkIndex)
+				if (matching[chunkIndex]->count > 0)
+					fn(*matching[chunkIndex], chunkIndex);
+		});
+	}
+
+private:
+	struct Archetype
+	{
+		ComponentMask mask;
+		uint32_t index;
+		std::vector<std::unique_ptr<Chunk>> chunks;
+	};
+
+	struct EntityRecord
+	{
+		uint32_t archetype = 0;
+		uint32_t chunk = 0;
+		uint32_t row = 0;
+		uint32_t generation = 0;
+		bool alive = false;
+	};
+
+	std::vector<std::unique_ptr<Archetype>> archetypes;
+	std::vector<EntityRecord> records;
+	std::vector<uint32_t> freeIndices;
+	size_t entityCount = 0;
+	uint64_t structureVersion = 0;
+
+	Archetype& findOrCreateArchetype(ComponentMask mask)
+	{
+		for (std::unique_ptr<Archetype>& archetype : archetypes)
+			if (archetype->mask == mask)
+				return *archetype;
+
+		std::unique_ptr<Archetype> archetype(new Archetype());
+		archetype->mask = mask;
+		archetype->index = (uint32_t)archetypes.size();
+		archetypes.push_back(std::move(archetype));
+		return *archetypes.back();
+	}
+
+	static std::unique_ptr<Chunk> allocateChunk(ComponentMask mask)
+	{
+		std::unique_ptr<Chunk> chunk(new Chunk());
+		chunk->mask = mask;
+		chunk->entities.reset(new Entity[CHUNK_CAPACITY]);
+		allocateArray<TransformComponent>(*chunk);
+		allocateArray<BoundsComponent>(*chunk);
+		allocateArray<MeshComponent>(*chunk);
+		allocateArray<MaterialComponent>(*chunk);
+		allocateArray<LightComponent>(*chunk);
+		return chunk;
+	}
+
+	template <typename T>
+	static void allocateArray(Chunk& chunk)
+	{
+		if (chunk.mask & ComponentTraits<T>::Bit)
+			ComponentTraits<T>::Array(chunk).reset(new T[CHUNK_CAPACITY]());
+	}
+
+	template <typename T>
+	static void moveRow(Chunk& chunk, uint32_t from, uint32_t to)
+	{
+		if (chunk.mask & ComponentTraits<T>::Bit)
+			ComponentTraits<T>::Array(chunk)[to] = ComponentTraits<T>::Array(chunk)[from];
+	}
+
+	template <typename T>
+	static void resetRow(Chunk& chunk, uint32_t row)
+	{
+		if (chunk.mask & ComponentTraits<T>::Bit)
+			ComponentTraits<T>::Array(chunk)[row] = T();
+	}
+};
+#endif
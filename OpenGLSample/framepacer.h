@@ -0,0 +1,135 @@
+#ifndef FRAMEPACER_H
+#define FRAMEPACER_H
+
+#include <chrono>
+#include <cstdint>
+#include <thread>
+
+// Schedules frame starts at a fixed target rate using the monotonic steady clock in integer nanoseconds.
+// WaitForNextFrame() sleeps for most of the remaining time and spins for the last stretch, because OS sleeps
+// routinely overshoot by a millisecond or more. Calling it at the top of the loop, before input is read, keeps
+// the time between sampling input and presenting the frame as short as possible.
+class FramePacer
+{
+public:
+	typedef std::chrono::steady_clock Clock;
+
+	// targetFrameRate of 0 disables the cap (frames are still timed)
+	explicit FramePacer(double targetFrameRate = 60.0)
+	{
+		SetTargetFrameRate(targetFrameRate);
+		Resync();
+	}
+
+	void SetTargetFrameRate(double targetFrameRate)
+	{
+		frameRate = targetFrameRate > 0.0 ? targetFrameRate : 0.0;
+		periodNs = frameRate > 0.0 ? (int64_t)(1e9 / frameRate) : 0;
+	}
+
+	double TargetFrameRate() const { return frameRate; }
+
+	// restarts the schedule from now, e.g. after the loop sat idle: the next frame starts immediately and
+	// the gap is not counted in the statistics
+	void Resync()
+	{
+		lastFrameStart = Clock::now();
+		nextDeadline = lastFrameStart;
+		resynced = true;
+	}
+
+	// blocks until the next frame is due and returns the seconds elapsed since the previous frame started
+	double WaitForNextFrame()
+	{
+		Clock::time_point now = Clock::now();
+
+		if (periodNs > 0)
+		{
+			if (now > nextDeadline + std::chrono::nanoseconds(periodNs / 10))
+			{
+				// the previous frame ran long: start right away and re-anchor instead of trying to catch up
+				++missedDeadlines;
+				nextDeadline = now;
+			}
+			else
+			{
+				waitUntil(nextDeadline);
+				now = Clock::now();
+			}
+			nextDeadline += std::chrono::nanoseconds(periodNs);
+		}
+
+		int64_t frameNs = std::chrono::duration_cast<std::chrono::nanoseconds>(now - lastFrameStart).count();
+		lastFrameStart = now;
+		if (!resynced)
+			recordFrameTime(frameNs);
+		resynced = false;
+		return frameNs * 1e-9;
+	}
+
+	// frame statistics since the last ResetStats()
+	uint64_t FrameCount() const { return frameCount; }
+	uint64_t MissedDeadlines() const { return missedDeadlines; }
+	double MeanFrameTimeMs() const { return meanMs; }
+	double FrameTimeVarianceMs2() const { return frameCount > 1 ? m2 / (double)(frameCount - 1) : 0.0; }
+	double MaxFrameTimeMs() const { return maxMs; }
+
+	void ResetStats()
+	{
+		frameCount = 0;
+		missedDeadlines = 0;
+		meanMs = 0.0;
+		m2 = 0.0;
+		maxMs = 0.0;
+	}
+
+private:
+	double frameRate = 0.0;
+	int64_t periodNs = 0;
+	Clock::time_point nextDeadline;
+	Clock::time_point lastFrameStart;
+	bool resynced = false;
+
+	// estimated sleep overshoot; we wake up this much before the deadline and spin the rest
+	int64_t spinMarginNs = 2000000;
+
+	uint64_t frameCount = 0;
+	uint64_t missedDeadlines = 0;
+	double meanMs = 0.0;
+	double m2 = 0.0;      // running sum of squared deviations (Welford)
+	double maxMs = 0.0;
+
+	void waitUntil(Clock::time_point deadline)
+	{
+		Clock::time_point sleepUntil = deadline - std::chrono::nanoseconds(spinMarginNs);
+		Clock::time_point now = Clock::now();
+		if (now < sleepUntil)
+		{
+			std::this_thread::sleep_until(sleepUntil);
+
+			// learn how late the OS wakes us up: grow quickly, shrink slowly, and keep within 0.5 - 4 ms
+			int64_t overshootNs = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - sleepUntil).count();
+			int64_t wanted = overshootNs * 3 / 2;
+			spinMarginNs = wanted > spinMarginNs ? wanted : (spinMarginNs * 15 + wanted) / 16;
+			if (spinMarginNs < 500000)
+				spinMarginNs = 500000;
+			if (spinMarginNs > 4000000)
+				spinMarginNs = 4000000;
+		}
+
+		while (Clock::now() < deadline)
+			std::this_thread::yield();
+	}
+
+	void recordFrameTime(int64_t frameNs)
+	{
+		double ms = frameNs * 1e-6;
+		++frameCount;
+		double delta = ms - meanMs;
+		meanMs += delta / (double)frameCount;
+		m2 += delta * (ms - meanMs);
+		if (ms > maxMs)
+			maxMs = ms;
+	}
+};
+#endif
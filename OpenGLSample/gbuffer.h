@@ -0,0 +1,108 @@
+#ifndef GBUFFER_H
+#define GBUFFER_H
+
+#include <GL/glew.h>
+
+// Geometry buffer for deferred shading, 16 bytes per pixel:
+//   attachment 0, RGBA8:          albedo color, specular intensity
+//   attachment 1, RGB10_A2:       octahedral encoded normal (x, y), highlight size / 256, 1 if lightmapped
+//   attachment 2, R11F_G11F_B10F: baked lighting from the lightmap
+//   depth, DEPTH_COMPONENT24
+// The attachments are window sized; Bind() and BlitDepthTo() take the dynamic resolution's viewport, so the
+// geometry pass fills only its lower left corner and a resolution change never reallocates them.
+class GBuffer
+{
+public:
+	GLuint Framebuffer = 0;
+	GLuint AlbedoSpecularTexture = 0;
+	GLuint NormalGlossTexture = 0;
+	GLuint BakedLightTexture = 0;
+	GLuint DepthTexture = 0;
+	int Width = 0;
+	int Height = 0;
+
+	// (re)allocates the attachments for a new window size
+	void Resize(int width, int height)
+	{
+		width = width > 0 ? width : 1;
+		height = height > 0 ? height : 1;
+		if (Framebuffer && width == Width && height == Height)
+			return;
+
+		Destroy();
+		Width = width;
+		Height = height;
+
+		AlbedoSpecularTexture = createTexture(GL_RGBA8, width, height);
+		NormalGlossTexture = createTexture(GL_RGB10_A2, width, height);
+		BakedLightTexture = createTexture(GL_R11F_G11F_B10F, width, height);
+		DepthTexture = createTexture(GL_DEPTH_COMPONENT24, width, height);
+
+		glGenFramebuffers(1, &Framebuffer);
+		glBindFramebuffer(GL_FRAMEBUFFER, Framebuffer);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, AlbedoSpecularTexture, 0);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, NormalGlossTexture, 0);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT2, GL_TEXTURE_2D, BakedLightTexture, 0);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, DepthTexture, 0);
+		GLenum drawBuffers[3] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2 };
+		glDrawBuffers(3, drawBuffers);
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	}
+
+	// binds the G-buffer for the geometry pass with the given (scaled) viewport
+	void Bind(int viewportWidth, int viewportHeight)
+	{
+		glBindFramebuffer(GL_FRAMEBUFFER, Framebuffer);
+		glViewport(0, 0, viewportWidth, viewportHeight);
+	}
+
+	// binds albedo/specular, normal/gloss, depth and baked light to four consecutive texture units
+	void BindTextures(GLuint firstUnit) const
+	{
+		glActiveTexture(GL_TEXTURE0 + firstUnit);
+		glBindTexture(GL_TEXTURE_2D, AlbedoSpecularTexture);
+		glActiveTexture(GL_TEXTURE0 + firstUnit + 1);
+		glBindTexture(GL_TEXTURE_2D, NormalGlossTexture);
+		glActiveTexture(GL_TEXTURE0 + firstUnit + 2);
+		glBindTexture(GL_TEXTURE_2D, DepthTexture);
+		glActiveTexture(GL_TEXTURE0 + firstUnit + 3);
+		glBindTexture(GL_TEXTURE_2D, BakedLightTexture);
+		glActiveTexture(GL_TEXTURE0);
+	}
+
+	// copies the depth of the rendered rectangle into another framebuffer, so later forward passes can depth test
+	void BlitDepthTo(GLuint framebuffer, int viewportWidth, int viewportHeight) const
+	{
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, Framebuffer);
+		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, framebuffer);
+		glBlitFramebuffer(0, 0, viewportWidth, viewportHeight, 0, 0, viewportWidth, viewportHeight, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+		glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+	}
+
+	void Destroy()
+	{
+		if (Framebuffer)
+			glDeleteFramebuffers(1, &Framebuffer);
+		GLuint textures[4] = { AlbedoSpecularTexture, NormalGlossTexture, BakedLightTexture, DepthTexture };
+		glDeleteTextures(4, textures);
+		Framebuffer = AlbedoSpecularTexture = NormalGlossTexture = BakedLightTexture = DepthTexture = 0;
+		Width = Height = 0;
+	}
+
+private:
+	// the pixels are read back 1:1 with texelFetch, so no filtering or mipmaps
+	static GLuint createTexture(GLenum internalFormat, int width, int height)
+	{
+		GLuint texture;
+		glGenTextures(1, &texture);
+		glBindTexture(GL_TEXTURE_2D, texture);
+		glTexStorage2D(GL_TEXTURE_2D, 1, internalFormat, width, height);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glBindTexture(GL_TEXTURE_2D, 0);
+		return texture;
+	}
+};
+#endif
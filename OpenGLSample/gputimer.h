@@ -0,0 +1,85 @@
+#ifndef GPUTIMER_H
+#define GPUTIMER_H
+
+#include <GL/glew.h>
+
+// Measures GPU time spent between Begin() and End() with GL_TIME_ELAPSED queries.
+// A small ring of query objects is cycled so results are read a few frames late without ever stalling
+// the pipeline waiting for the GPU.
+class GpuTimer
+{
+public:
+	static const int QUERY_COUNT = 4;
+
+	// query objects need a GL context, so they are created on first use
+	void Begin()
+	{
+		if (!created)
+		{
+			glGenQueries(QUERY_COUNT, queries);
+			created = true;
+		}
+
+		// the slot's result was never collected; it is QUERY_COUNT frames old, so it is ready in practice
+		if (pending[writeIndex])
+		{
+			GLuint64 unused;
+			glGetQueryObjectui64v(queries[writeIndex], GL_QUERY_RESULT, &unused);
+			pending[writeIndex] = false;
+		}
+
+		glBeginQuery(GL_TIME_ELAPSED, queries[writeIndex]);
+	}
+
+	void End()
+	{
+		glEndQuery(GL_TIME_ELAPSED);
+		pending[writeIndex] = true;
+		writeIndex = (writeIndex + 1) % QUERY_COUNT;
+	}
+
+	// collects every finished query; returns true and the newest time in milliseconds if any was ready
+	bool Poll(double& milliseconds)
+	{
+		bool found = false;
+		for (int i = 0; i < QUERY_COUNT; ++i)
+		{
+			int index = (readIndex + i) % QUERY_COUNT;
+			if (!pending[index])
+				continue;
+
+			GLint available = 0;
+			glGetQueryObjectiv(queries[index], GL_QUERY_RESULT_AVAILABLE, &available);
+			if (!available)
+				break;      // later queries cannot be done before this one
+
+			GLuint64 elapsedNs = 0;
+			glGetQueryObjectui64v(queries[index], GL_QUERY_RESULT, &elapsedNs);
+			pending[index] = false;
+			lastMs = elapsedNs * 1e-6;
+			milliseconds = lastMs;
+			found = true;
+			readIndex = (index + 1) % QUERY_COUNT;
+		}
+		return found;
+	}
+
+	// the newest collected time in milliseconds (0 until one is available)
+	double LastMs() const { return lastMs; }
+
+	void Destroy()
+	{
+		if (created)
+			glDeleteQueries(QUERY_COUNT, queries);
+		created = false;
+	}
+
+private:
+	GLuint queries[QUERY_COUNT] = {};
+	bool pending[QUERY_COUNT] = {};
+	bool created = false;
+	int writeIndex = 0;
+	int readIndex = 0;
+	double lastMs = 0.0;
+};
+#endif
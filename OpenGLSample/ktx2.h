@@ -0,0 +1,281 @@
+#ifndef KTX2_H
+#define KTX2_H
+
+#include <GL/glew.h>
+
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// KTX2 containers for cooked textures: block compressed 2D images with their whole mip chain, as Khronos
+// specifies them, so any KTX2 tool can inspect them. Only what the cooker writes is read back: one layer,
+// one face, no supercompression. Two key/value entries of our own travel with the data, the hash of the
+// source file it was cooked from (to notice when the source changed) and its average color (for the baker)
+
+// vkFormat values of the supported block compressed formats
+enum Ktx2Format : uint32_t
+{
+	KTX2_BC1_RGB = 131,     // VK_FORMAT_BC1_RGB_UNORM_BLOCK
+	KTX2_BC3_RGBA = 137,    // VK_FORMAT_BC3_UNORM_BLOCK
+	KTX2_BC5_RG = 141,      // VK_FORMAT_BC5_UNORM_BLOCK
+	KTX2_BC7_RGBA = 145     // VK_FORMAT_BC7_UNORM_BLOCK
+};
+
+const uint8_t KTX2_IDENTIFIER[12] = { 0xAB, 'K', 'T', 'X', ' ', '2', '0', 0xBB, '\r', '\n', 0x1A, '\n' };
+const char* const KTX2_SOURCE_HASH_KEY = "OpenGLSample.sourceHash";
+const char* const KTX2_AVERAGE_COLOR_KEY = "OpenGLSample.averageColor";
+
+// bytes per 4x4 block, 0 for an unsupported format
+inline uint32_t Ktx2BlockBytes(uint32_t format)
+{
+	switch (format)
+	{
+	case KTX2_BC1_RGB: return 8;
+	case KTX2_BC3_RGBA:
+	case KTX2_BC5_RG:
+	case KTX2_BC7_RGBA: return 16;
+	default: return 0;
+	}
+}
+
+// the matching GL internal format; BC1 and BC3 need EXT_texture_compression_s3tc, the others are core
+inline GLenum Ktx2GlFormat(uint32_t format)
+{
+	switch (format)
+	{
+	case KTX2_BC1_RGB: return GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+	case KTX2_BC3_RGBA: return GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+	case KTX2_BC5_RG: return GL_COMPRESSED_RG_RGTC2;
+	case KTX2_BC7_RGBA: return GL_COMPRESSED_RGBA_BPTC_UNORM;
+	default: return 0;
+	}
+}
+
+inline bool Ktx2FormatSupported(uint32_t format, bool s3tcSupported)
+{
+	if (format == KTX2_BC1_RGB || format == KTX2_BC3_RGBA)
+		return s3tcSupported;
+	return Ktx2BlockBytes(format) != 0;
+}
+
+// size of one mip level of a block compressed image
+inline size_t Ktx2LevelBytes(uint32_t format, int width, int height)
+{
+	return (size_t)((width + 3) / 4) * ((height + 3) / 4) * Ktx2BlockBytes(format);
+}
+
+// the cooked file next to a source image: same name, .ktx2 extension
+inline std::string CookedTexturePath(const std::string& sourcePath)
+{
+	size_t dot = sourcePath.find_last_of('.');
+	size_t slash = sourcePath.find_last_of("/\\");
+	if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+		return sourcePath + ".ktx2";
+	return sourcePath.substr(0, dot) + ".ktx2";
+}
+
+// An image to write: every mip level, largest first, already block compressed
+struct Ktx2Image
+{
+	uint32_t format = KTX2_BC1_RGB;
+	int width = 0;
+	int height = 0;
+	std::vector<std::vector<uint8_t>> levels;
+	uint64_t sourceHash = 0;
+	glm::vec3 averageColor = glm::vec3(0.5f);
+};
+
+// A parsed file; the level pointers point into the memory it was parsed from
+struct Ktx2View
+{
+	uint32_t format = 0;
+	int width = 0;
+	int height = 0;
+	int levelCount = 0;
+	const uint8_t* levels[16] = {};   // largest first
+	size_t levelBytes[16] = {};
+	uint64_t sourceHash = 0;
+	glm::vec3 averageColor = glm::vec3(0.5f);
+};
+
+namespace ktx2detail
+{
+	inline void put32(std::vector<uint8_t>& out, uint32_t value)
+	{
+		for (int i = 0; i < 4; ++i)
+			out.push_back((uint8_t)(value >> (i * 8)));
+	}
+
+	inline void put64(std::vector<uint8_t>& out, uint64_t value)
+	{
+		put32(out, (uint32_t)value);
+		put32(out, (uint32_t)(value >> 32));
+	}
+
+	inline void pad(std::vector<uint8_t>& out, size_t alignment)
+	{
+		while (out.size() % alignment)
+			out.push_back(0);
+	}
+
+	inline uint32_t get32(const uint8_t* p)
+	{
+		return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+	}
+
+	inline uint64_t get64(const uint8_t* p)
+	{
+		return (uint64_t)get32(p) | ((uint64_t)get32(p + 4) << 32);
+	}
+
+	// one key/value entry: length, key with its terminator, value, padding to 4 bytes
+	inline void putKeyValue(std::vector<uint8_t>& out, const char* key, const void* value, size_t valueBytes)
+	{
+		size_t keyBytes = std::strlen(key) + 1;
+		put32(out, (uint32_t)(keyBytes + valueBytes));
+		out.insert(out.end(), key, key + keyBytes);
+		out.insert(out.end(), (const uint8_t*)value, (const uint8_t*)value + valueBytes);
+		pad(out, 4);
+	}
+}
+
+// Writes image as a KTX2 file. Rows go bottom-up, the way GL takes them, which the orientation entry records
+inline bool SaveKtx2(const std::string& path, const Ktx2Image& image)
+{
+	using namespace ktx2detail;
+	uint32_t blockBytes = Ktx2BlockBytes(image.format);
+	uint32_t levelCount = (uint32_t)image.levels.size();
+	if (blockBytes == 0 || levelCount == 0 || levelCount > 16)
+		return false;
+
+	// Data format descriptor: one basic block with a single sample covering the whole compressed block
+	uint8_t colorModel = image.format == KTX2_BC1_RGB ? 128 : (image.format == KTX2_BC3_RGBA ? 130 : (image.format == KTX2_BC5_RG ? 132 : 134));
+	std::vector<uint8_t> dfd;
+	put32(dfd, 44);                            // dfdTotalSize
+	put32(dfd, 0);                             // vendorId 0 (Khronos), descriptorType 0 (basic)
+	put32(dfd, 2 | (40u << 16));               // versionNumber 2, descriptorBlockSize 24 + 16 per sample
+	dfd.push_back(colorModel);
+	dfd.push_back(1);                          // BT.709 primaries
+	dfd.push_back(1);                          // linear transfer, as the textures have always been sampled
+	dfd.push_back(0);                          // straight alpha
+	dfd.push_back(3); dfd.push_back(3); dfd.push_back(0); dfd.push_back(0);   // 4x4x1x1 texel blocks
+	dfd.push_back((uint8_t)blockBytes);
+	for (int i = 0; i < 7; ++i)
+		dfd.push_back(0);
+	dfd.push_back(0); dfd.push_back(0);        // sample bit offset
+	dfd.push_back((uint8_t)(blockBytes * 8 - 1));   // bit length - 1
+	dfd.push_back(0);                          // channel: color
+	put32(dfd, 0);                             // sample position
+	put32(dfd, 0);                             // lower
+	put32(dfd, 0xFFFFFFFFu);                   // upper
+
+	// Key/value data, sorted by key
+	std::vector<uint8_t> kvd;
+	putKeyValue(kvd, "KTXorientation", "ru", 3);
+	putKeyValue(kvd, "KTXwriter", "OpenGLSample", 13);
+	putKeyValue(kvd, KTX2_AVERAGE_COLOR_KEY, &image.averageColor[0], sizeof(glm::vec3));
+	putKeyValue(kvd, KTX2_SOURCE_HASH_KEY, &image.sourceHash, sizeof(image.sourceHash));
+
+	size_t dfdOffset = 12 + 36 + 32 + 24 * (size_t)levelCount;
+	size_t kvdOffset = dfdOffset + dfd.size();
+
+	// Mip levels are stored smallest first, each aligned to the block size
+	std::vector<uint8_t> data(kvdOffset + kvd.size(), 0);
+	std::vector<uint64_t> levelOffsets(levelCount);
+	for (int level = (int)levelCount - 1; level >= 0; --level)
+	{
+		pad(data, blockBytes);
+		levelOffsets[level] = data.size();
+		data.insert(data.end(), image.levels[level].begin(), image.levels[level].end());
+	}
+
+	std::vector<uint8_t> header(KTX2_IDENTIFIER, KTX2_IDENTIFIER + 12);
+	put32(header, image.format);
+	put32(header, 1);                          // typeSize
+	put32(header, (uint32_t)image.width);
+	put32(header, (uint32_t)image.height);
+	put32(header, 0);                          // pixelDepth
+	put32(header, 0);                          // layerCount
+	put32(header, 1);                          // faceCount
+	put32(header, levelCount);
+	put32(header, 0);                          // no supercompression
+	put32(header, (uint32_t)dfdOffset);
+	put32(header, (uint32_t)dfd.size());
+	put32(header, (uint32_t)kvdOffset);
+	put32(header, (uint32_t)kvd.size());
+	put64(header, 0);                          // no supercompression global data
+	put64(header, 0);
+	for (uint32_t level = 0; level < levelCount; ++level)
+	{
+		put64(header, levelOffsets[level]);
+		put64(header, image.levels[level].size());
+		put64(header, image.levels[level].size());
+	}
+	header.insert(header.end(), dfd.begin(), dfd.end());
+	header.insert(header.end(), kvd.begin(), kvd.end());
+	std::memcpy(data.data(), header.data(), header.size());
+
+	std::ofstream file(path, std::ios::binary);
+	if (!file)
+		return false;
+	file.write((const char*)data.data(), data.size());
+	return (bool)file;
+}
+
+// Parses a KTX2 file in memory, checking every offset against size
+inline bool ParseKtx2(const uint8_t* data, size_t size, Ktx2View& view)
+{
+	using namespace ktx2detail;
+	if (size < 80 || std::memcmp(data, KTX2_IDENTIFIER, 12) != 0)
+		return false;
+
+	view.format = get32(data + 12);
+	view.width = (int)get32(data + 20);
+	view.height = (int)get32(data + 24);
+	uint32_t depth = get32(data + 28), layers = get32(data + 32), faces = get32(data + 36);
+	view.levelCount = (int)get32(data + 40);
+	uint32_t supercompression = get32(data + 44);
+	if (Ktx2BlockBytes(view.format) == 0 || view.width <= 0 || view.height <= 0 || depth != 0 || layers > 1 || faces != 1
+		|| supercompression != 0 || view.levelCount < 1 || view.levelCount > 16 || size < 80 + 24 * (size_t)view.levelCount)
+		return false;
+
+	for (int level = 0; level < view.levelCount; ++level)
+	{
+		const uint8_t* entry = data + 80 + 24 * level;
+		uint64_t offset = get64(entry), length = get64(entry + 8);
+		int width = view.width >> level, height = view.height >> level;
+		if (offset > size || length > size - offset
+			|| length != Ktx2LevelBytes(view.format, width > 0 ? width : 1, height > 0 ? height : 1))
+			return false;
+		view.levels[level] = data + offset;
+		view.levelBytes[level] = (size_t)length;
+	}
+
+	// our key/value entries, when present
+	uint32_t kvdOffset = get32(data + 56), kvdLength = get32(data + 60);
+	if (kvdOffset > size || kvdLength > size - kvdOffset)
+		return false;
+	for (uint32_t at = kvdOffset; at + 4 <= kvdOffset + kvdLength; )
+	{
+		uint32_t length = get32(data + at);
+		const char* key = (const char*)data + at + 4;
+		if (length > kvdOffset + kvdLength - at - 4)
+			return false;
+		const char* keyEnd = (const char*)std::memchr(key, 0, length);
+		if (!keyEnd)
+			return false;
+		const uint8_t* value = (const uint8_t*)keyEnd + 1;
+		size_t valueBytes = length - (size_t)(keyEnd + 1 - key);
+		if (std::strcmp(key, KTX2_SOURCE_HASH_KEY) == 0 && valueBytes == sizeof(uint64_t))
+			std::memcpy(&view.sourceHash, value, sizeof(uint64_t));
+		else if (std::strcmp(key, KTX2_AVERAGE_COLOR_KEY) == 0 && valueBytes == sizeof(glm::vec3))
+			std::memcpy(&view.averageColor[0], value, sizeof(glm::vec3));
+		at += (4 + length + 3) & ~3u;
+	}
+	return true;
+}
+#endif
@@ -0,0 +1,1044 @@
+#ifndef LIGHTMAP_H
+#define LIGHTMAP_H
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "hash.h"
+#include "probes.h"
+#include "threadpool.h"
+
+// Baked lighting is stored as RGBM: rgb = color / (a * LIGHTMAP_RGBM_RANGE), so 8 bit channels cover 0 - 8
+const float LIGHTMAP_RGBM_RANGE = 8.0f;
+
+// Empty texels kept around every chart, so bilinear filtering never reaches into a neighbouring chart
+const int LIGHTMAP_PADDING = 2;
+
+// One static object handed to the baker. Positions are the first three floats of each vertex
+struct LightmapObject
+{
+	const float* vertices = nullptr;
+	size_t vertexCount = 0;
+	unsigned int floatsPerVertex = 3;
+	int normalOffset = -1;              // float of each vertex its normal starts at, -1 when the mesh has none
+	const unsigned short* indices = nullptr;
+	size_t indexCount = 0;
+	glm::mat4 world = glm::mat4(1.0f);
+	glm::vec3 albedo = glm::vec3(0.5f);   // average surface color, used for light bouncing off the object
+};
+
+// One light, with the same terms the runtime shader evaluates
+struct LightmapLight
+{
+	glm::vec3 position;
+	glm::vec3 color;
+	float ambientStrength;
+	glm::vec3 attenuation;     // constant, linear, quadratic
+	float radius;              // influence radius
+	glm::vec3 spotDirection;
+	float innerCutoff;         // cosines; below -1 for point lights
+	float outerCutoff;
+};
+
+// Lightmap layout of one object: the mesh is split along chart seams, and every output vertex points back
+// to the source vertex it was copied from
+struct LightmapUnwrap
+{
+	std::vector<uint32_t> sourceVertex;
+	std::vector<glm::vec2> uvs;       // 0 - 1 across the object's lightmap
+	std::vector<uint32_t> indices;    // triangles over the output vertices
+	int width = 0;
+	int height = 0;
+};
+
+// Baked lighting of one object, and what it was baked from
+struct Lightmap
+{
+	int width = 0;
+	int height = 0;
+	std::vector<uint8_t> rgbm;
+	uint64_t key = 0;                 // object key at bake time
+	glm::vec3 boundsMin = glm::vec3(0.0f);
+	glm::vec3 boundsMax = glm::vec3(0.0f);
+};
+
+inline void EncodeRgbm(glm::vec3 color, uint8_t* out)
+{
+	float brightest = std::max(std::max(color.r, color.g), std::max(color.b, 1e-6f));
+	float m = std::min(brightest / LIGHTMAP_RGBM_RANGE, 1.0f);
+	m = std::ceil(m * 255.0f) / 255.0f;
+	glm::vec3 scaled = glm::clamp(color / (m * LIGHTMAP_RGBM_RANGE), 0.0f, 1.0f);
+	out[0] = (uint8_t)(scaled.r * 255.0f + 0.5f);
+	out[1] = (uint8_t)(scaled.g * 255.0f + 0.5f);
+	out[2] = (uint8_t)(scaled.b * 255.0f + 0.5f);
+	out[3] = (uint8_t)(m * 255.0f + 0.5f);
+}
+
+
+// Generates lightmap UVs. Triangles are grouped into charts of edge-connected triangles facing the same
+// major axis, each chart is projected onto that axis' plane at texelsPerUnit world scale, and the charts are
+// packed into one rectangle with shelf packing (tallest first).
+inline void UnwrapLightmap(const LightmapObject& object, float texelsPerUnit, LightmapUnwrap& unwrap)
+{
+	size_t triangleCount = object.indexCount / 3;
+	std::vector<glm::vec3> positions(object.vertexCount);
+	for (size_t v = 0; v < object.vertexCount; ++v)
+	{
+		const float* p = object.vertices + v * object.floatsPerVertex;
+		positions[v] = glm::vec3(object.world * glm::vec4(p[0], p[1], p[2], 1.0f));
+	}
+
+	// major axis of every triangle: 0 - 2 for +x, +y, +z, 3 - 5 for -x, -y, -z
+	std::vector<int> axes(triangleCount);
+	std::vector<uint32_t> parent(triangleCount);
+	for (size_t t = 0; t < triangleCount; ++t)
+	{
+		const unsigned short* tri = object.indices + t * 3;
+		glm::vec3 normal = glm::cross(positions[tri[1]] - positions[tri[0]], positions[tri[2]] - positions[tri[0]]);
+		glm::vec3 magnitude = glm::abs(normal);
+		int axis = magnitude.x >= magnitude.y && magnitude.x >= magnitude.z ? 0 : (magnitude.y >= magnitude.z ? 1 : 2);
+		axes[t] = normal[axis] >= 0.0f ? axis : axis + 3;
+		parent[t] = (uint32_t)t;
+	}
+
+	auto findRoot = [&parent](uint32_t t)
+	{
+		while (parent[t] != t)
+		{
+			parent[t] = parent[parent[t]];
+			t = parent[t];
+		}
+		return t;
+	};
+
+	// join triangles sharing an edge when they face the same way
+	std::vector<std::pair<uint64_t, uint32_t>> edges;
+	edges.reserve(triangleCount * 3);
+	for (size_t t = 0; t < triangleCount; ++t)
+	{
+		for (int e = 0; e < 3; ++e)
+		{
+			uint64_t a = object.indices[t * 3 + e];
+			uint64_t b = object.indices[t * 3 + (e + 1) % 3];
+			edges.push_back(std::make_pair(a < b ? (a << 32) | b : (b << 32) | a, (uint32_t)t));
+		}
+	}
+	std::sort(edges.begin(), edges.end());
+	for (size_t i = 1; i < edges.size(); ++i)
+	{
+		if (edges[i].first != edges[i - 1].first || axes[edges[i].second] != axes[edges[i - 1].second])
+			continue;
+		uint32_t rootA = findRoot(edges[i].second);
+		uint32_t rootB = findRoot(edges[i - 1].second);
+		if (rootA != rootB)
+			parent[rootA] = rootB;
+	}
+
+	// charts and their projected bounds in texels
+	struct Chart
+	{
+		std::vector<uint32_t> triangles;
+		int axis;
+		glm::vec2 min, max;
+		int x, y, width, height;
+	};
+	std::vector<Chart> charts;
+	std::vector<int> chartOfRoot(triangleCount, -1);
+	auto project = [&](glm::vec3 p, int axis)
+	{
+		int a = axis % 3;
+		return glm::vec2(p[(a + 1) % 3], p[(a + 2) % 3]) * texelsPerUnit;
+	};
+	for (size_t t = 0; t < triangleCount; ++t)
+	{
+		uint32_t root = findRoot((uint32_t)t);
+		if (chartOfRoot[root] < 0)
+		{
+			chartOfRoot[root] = (int)charts.size();
+			Chart chart;
+			chart.axis = axes[t];
+			chart.min = glm::vec2(1e30f);
+			chart.max = glm::vec2(-1e30f);
+			charts.push_back(chart);
+		}
+		Chart& chart = charts[chartOfRoot[root]];
+		chart.triangles.push_back((uint32_t)t);
+		for (int corner = 0; corner < 3; ++corner)
+		{
+			glm::vec2 uv = project(positions[object.indices[t * 3 + corner]], chart.axis);
+			chart.min = glm::min(chart.min, uv);
+			chart.max = glm::max(chart.max, uv);
+		}
+	}
+
+	int totalArea = 0;
+	for (Chart& chart : charts)
+	{
+		chart.width = (int)std::ceil(chart.max.x - chart.min.x) + 1 + 2 * LIGHTMAP_PADDING;
+		chart.height = (int)std::ceil(chart.max.y - chart.min.y) + 1 + 2 * LIGHTMAP_PADDING;
+		totalArea += chart.width * chart.height;
+	}
+
+	// shelf packing, growing the square until everything fits
+	std::vector<size_t> order(charts.size());
+	for (size_t i = 0; i < order.size(); ++i)
+		order[i] = i;
+	std::sort(order.begin(), order.end(), [&charts](size_t a, size_t b) { return charts[a].height > charts[b].height; });
+
+	int size = std::max(16, (int)std::ceil(std::sqrt(totalArea * 1.2f)));
+	for (;;)
+	{
+		int x = 0, y = 0, shelfHeight = 0;
+		bool fits = true;
+		for (size_t index : order)
+		{
+			Chart& chart = charts[index];
+			if (x + chart.width > size)
+			{
+				y += shelfHeight;
+				x = 0;
+				shelfHeight = 0;
+			}
+			if (chart.width > size || y + chart.height > size)
+			{
+				fits = false;
+				break;
+			}
+			chart.x = x;
+			chart.y = y;
+			x += chart.width;
+			shelfHeight = std::max(shelfHeight, chart.height);
+		}
+		if (fits)
+		{
+			unwrap.width = size;
+			unwrap.height = y + shelfHeight;
+			break;
+		}
+		size += size / 4 + 1;
+	}
+
+	// output vertices: one per source vertex per chart
+	unwrap.sourceVertex.clear();
+	unwrap.uvs.clear();
+	unwrap.indices.clear();
+	std::vector<int> remap(object.vertexCount, -1);
+	for (Chart& chart : charts)
+	{
+		std::vector<uint32_t> used;
+		for (uint32_t t : chart.triangles)
+		{
+			for (int corner = 0; corner < 3; ++corner)
+			{
+				uint32_t source = object.indices[t * 3 + corner];
+				if (remap[source] < 0)
+				{
+					remap[source] = (int)unwrap.sourceVertex.size();
+					used.push_back(source);
+					glm::vec2 texel = project(positions[source], chart.axis) - chart.min + glm::vec2(chart.x + LIGHTMAP_PADDING + 0.5f, chart.y + LIGHTMAP_PADDING + 0.5f);
+					unwrap.sourceVertex.push_back(source);
+					unwrap.uvs.push_back(texel / glm::vec2((float)unwrap.width, (float)unwrap.height));
+				}
+				unwrap.indices.push_back((uint32_t)remap[source]);
+			}
+		}
+		for (uint32_t source : used)
+			remap[source] = -1;
+	}
+}
+
+
+// Bounding volume hierarchy over the scene triangles, built with binned surface area heuristic splits
+class LightmapBvh
+{
+public:
+	struct Hit
+	{
+		float t;
+		uint32_t triangle;
+	};
+
+	// corners holds three points per triangle
+	void Build(const std::vector<glm::vec3>& corners)
+	{
+		triangles = corners;
+		size_t count = triangles.size() / 3;
+		order.resize(count);
+		centroids.resize(count);
+		for (size_t t = 0; t < count; ++t)
+		{
+			order[t] = (uint32_t)t;
+			centroids[t] = (triangles[t * 3] + triangles[t * 3 + 1] + triangles[t * 3 + 2]) / 3.0f;
+		}
+		nodes.clear();
+		nodes.reserve(count * 2 + 1);
+		nodes.push_back(Node());
+		if (count > 0)
+			build(0, 0, (uint32_t)count, 0);
+	}
+
+	// nearest hit along the ray, closer than maxT
+	bool Intersect(glm::vec3 origin, glm::vec3 direction, float maxT, Hit& hit) const
+	{
+		hit.t = maxT;
+		bool found = false;
+		traverse(origin, direction, hit, found, false);
+		return found;
+	}
+
+	// true if anything blocks the ray before maxT
+	bool Occluded(glm::vec3 origin, glm::vec3 direction, float maxT) const
+	{
+		Hit hit;
+		hit.t = maxT;
+		bool found = false;
+		traverse(origin, direction, hit, found, true);
+		return found;
+	}
+
+	glm::vec3 Normal(uint32_t triangle) const
+	{
+		const glm::vec3* p = &triangles[triangle * 3];
+		return glm::normalize(glm::cross(p[1] - p[0], p[2] - p[0]));
+	}
+
+private:
+	// binned splits do not bound the depth, so nodes this deep are leaves, however many triangles they hold;
+	// traverse's stack then never holds more than MAX_DEPTH + 1 nodes
+	static const int MAX_DEPTH = 63;
+
+	struct Node
+	{
+		glm::vec3 min = glm::vec3(1e30f);
+		glm::vec3 max = glm::vec3(-1e30f);
+		uint32_t first = 0;   // first triangle (leaf) or left child (inner node; the right one follows it)
+		uint32_t count = 0;   // triangles in a leaf, 0 for inner nodes
+	};
+
+	std::vector<glm::vec3> triangles;
+	std::vector<glm::vec3> centroids;
+	std::vector<uint32_t> order;
+	std::vector<Node> nodes;
+
+	void build(uint32_t nodeIndex, uint32_t first, uint32_t count, int depth)
+	{
+		Node node;
+		glm::vec3 centroidMin(1e30f), centroidMax(-1e30f);
+		for (uint32_t i = first; i < first + count; ++i)
+		{
+			uint32_t t = order[i];
+			for (int corner = 0; corner < 3; ++corner)
+			{
+				node.min = glm::min(node.min, triangles[t * 3 + corner]);
+				node.max = glm::max(node.max, triangles[t * 3 + corner]);
+			}
+			centroidMin = glm::min(centroidMin, centroids[t]);
+			centroidMax = glm::max(centroidMax, centroids[t]);
+		}
+		node.first = first;
+		node.count = count;
+
+		// split along the longest centroid axis at the cheapest of the bin boundaries
+		glm::vec3 extent = centroidMax - centroidMin;
+		int axis = extent.x > extent.y && extent.x > extent.z ? 0 : (extent.y > extent.z ? 1 : 2);
+		if (count <= 4 || extent[axis] <= 0.0f || depth >= MAX_DEPTH)
+		{
+			nodes[nodeIndex] = node;
+			return;
+		}
+
+		const int BINS = 8;
+		struct Bin
+		{
+			glm::vec3 min = glm::vec3(1e30f);
+			glm::vec3 max = glm::vec3(-1e30f);
+			uint32_t count = 0;
+		} bins[BINS];
+		float scale = BINS / extent[axis];
+		for (uint32_t i = first; i < first + count; ++i)
+		{
+			uint32_t t = order[i];
+			int bin = std::min(BINS - 1, (int)((centroids[t][axis] - centroidMin[axis]) * scale));
+			for (int corner = 0; corner < 3; ++corner)
+			{
+				bins[bin].min = glm::min(bins[bin].min, triangles[t * 3 + corner]);
+				bins[bin].max = glm::max(bins[bin].max, triangles[t * 3 + corner]);
+			}
+			++bins[bin].count;
+		}
+
+		float bestCost = 1e30f;
+		int bestSplit = -1;
+		for (int split = 1; split < BINS; ++split)
+		{
+			Bin left, right;
+			for (int b = 0; b < split; ++b)
+			{
+				left.min = glm::min(left.min, bins[b].min);
+				left.max = glm::max(left.max, bins[b].max);
+				left.count += bins[b].count;
+			}
+			for (int b = split; b < BINS; ++b)
+			{
+				right.min = glm::min(right.min, bins[b].min);
+				right.max = glm::max(right.max, bins[b].max);
+				right.count += bins[b].count;
+			}
+			if (left.count == 0 || right.count == 0)
+				continue;
+			float cost = area(left.min, left.max) * left.count + area(right.min, right.max) * right.count;
+			if (cost < bestCost)
+			{
+				bestCost = cost;
+				bestSplit = split;
+			}
+		}
+		if (bestSplit < 0 || bestCost >= area(node.min, node.max) * count)
+		{
+			nodes[nodeIndex] = node;
+			return;
+		}
+
+		float splitPosition = centroidMin[axis] + bestSplit / scale;
+		uint32_t* middle = std::partition(&order[first], &order[first] + count, [&](uint32_t t) { return centroids[t][axis] < splitPosition; });
+		uint32_t leftCount = (uint32_t)(middle - &order[first]);
+		if (leftCount == 0 || leftCount == count)
+		{
+			nodes[nodeIndex] = node;
+			return;
+		}
+
+		uint32_t leftChild = (uint32_t)nodes.size();
+		nodes.push_back(Node());
+		nodes.push_back(Node());
+		node.first = leftChild;
+		node.count = 0;
+		nodes[nodeIndex] = node;
+		build(leftChild, first, leftCount, depth + 1);
+		build(leftChild + 1, first + leftCount, count - leftCount, depth + 1);
+	}
+
+	static float area(glm::vec3 min, glm::vec3 max)
+	{
+		glm::vec3 d = glm::max(max - min, glm::vec3(0.0f));
+		return d.x * d.y + d.y * d.z + d.z * d.x;
+	}
+
+	static bool hitsBox(const Node& node, glm::vec3 origin, glm::vec3 inverseDirection, float maxT)
+	{
+		glm::vec3 t0 = (node.min - origin) * inverseDirection;
+		glm::vec3 t1 = (node.max - origin) * inverseDirection;
+		glm::vec3 entries = glm::min(t0, t1);
+		glm::vec3 exits = glm::max(t0, t1);
+		float enter = std::max(std::max(entries.x, entries.y), std::max(entries.z, 0.0f));
+		float leave = std::min(std::min(exits.x, exits.y), std::min(exits.z, maxT));
+		return enter <= leave;
+	}
+
+	// Moller-Trumbore, two sided
+	bool hitsTriangle(uint32_t triangle, glm::vec3 origin, glm::vec3 direction, float& t) const
+	{
+		const glm::vec3* p = &triangles[triangle * 3];
+		glm::vec3 edge1 = p[1] - p[0];
+		glm::vec3 edge2 = p[2] - p[0];
+		glm::vec3 h = glm::cross(direction, edge2);
+		float determinant = glm::dot(edge1, h);
+		if (std::fabs(determinant) < 1e-9f)
+			return false;
+		float inverse = 1.0f / determinant;
+		glm::vec3 s = origin - p[0];
+		float u = glm::dot(s, h) * inverse;
+		if (u < 0.0f || u > 1.0f)
+			return false;
+		glm::vec3 q = glm::cross(s, edge1);
+		float v = glm::dot(direction, q) * inverse;
+		if (v < 0.0f || u + v > 1.0f)
+			return false;
+		t = glm::dot(edge2, q) * inverse;
+		return t > 0.0f;
+	}
+
+	void traverse(glm::vec3 origin, glm::vec3 direction, Hit& hit, bool& found, bool anyHit) const
+	{
+		if (order.empty())
+			return;
+		glm::vec3 inverseDirection = 1.0f / direction;
+
+		uint32_t stack[MAX_DEPTH + 1];
+		int top = 0;
+		stack[top++] = 0;
+		while (top > 0)
+		{
+			const Node& node = nodes[stack[--top]];
+			if (!hitsBox(node, origin, inverseDirection, hit.t))
+				continue;
+
+			if (node.count == 0)
+			{
+				stack[top++] = node.first;
+				stack[top++] = node.first + 1;
+				continue;
+			}
+
+			for (uint32_t i = node.first; i < node.first + node.count; ++i)
+			{
+				float t;
+				if (hitsTriangle(order[i], origin, direction, t) && t < hit.t)
+				{
+					hit.t = t;
+					hit.triangle = order[i];
+					found = true;
+					if (anyHit)
+						return;
+				}
+			}
+		}
+	}
+};
+
+
+// Offline lightmap baker. Every static object occludes and bounces light; the objects flagged dirty get a new
+// lightmap holding the diffuse light of the static lights (ambient, direct with hard shadows, and indirect
+// bounces from a path tracer). Specular stays dynamic because it depends on the view. All texels of all dirty
+// objects are spread over the thread pool together.
+class LightmapBaker
+{
+public:
+	float TexelsPerUnit = 16.0f;
+	int SamplesPerTexel = 64;
+	int Bounces = 2;
+	float InfluenceDistance = 2.0f;   // how far from a moved object its shadows and bounce light still matter
+
+	// builds the BVH over every object and unwraps them all
+	void SetScene(const std::vector<LightmapObject>& sceneObjects, const std::vector<LightmapLight>& sceneLights)
+	{
+		objects = sceneObjects;
+		lights = sceneLights;
+
+		std::vector<glm::vec3> corners;
+		triangleObject.clear();
+		unwraps.assign(objects.size(), LightmapUnwrap());
+		keys.assign(objects.size(), 0);
+		boundsMin.assign(objects.size(), glm::vec3(1e30f));
+		boundsMax.assign(objects.size(), glm::vec3(-1e30f));
+
+		for (size_t o = 0; o < objects.size(); ++o)
+		{
+			const LightmapObject& object = objects[o];
+			for (size_t i = 0; i + 2 < object.indexCount; i += 3)
+			{
+				for (int corner = 0; corner < 3; ++corner)
+				{
+					const float* p = object.vertices + object.indices[i + corner] * object.floatsPerVertex;
+					glm::vec3 world = glm::vec3(object.world * glm::vec4(p[0], p[1], p[2], 1.0f));
+					corners.push_back(world);
+					boundsMin[o] = glm::min(boundsMin[o], world);
+					boundsMax[o] = glm::max(boundsMax[o], world);
+				}
+				triangleObject.push_back((uint32_t)o);
+			}
+
+			uint64_t key = HashBytes(object.vertices, object.vertexCount * object.floatsPerVertex * sizeof(float));
+			key = HashBytes(object.indices, object.indexCount * sizeof(unsigned short), key);
+			key = HashBytes(&object.world[0][0], sizeof(glm::mat4), key);
+			keys[o] = HashBytes(&object.albedo[0], sizeof(glm::vec3), key);
+
+			UnwrapLightmap(object, TexelsPerUnit, unwraps[o]);
+		}
+		bvh.Build(corners);
+	}
+
+	const LightmapUnwrap& Unwrap(size_t object) const { return unwraps[object]; }
+	uint64_t ObjectKey(size_t object) const { return keys[object]; }
+
+	// changes whenever any object, the lights or the settings change; probes depend on all of them
+	uint64_t SceneKey() const
+	{
+		uint64_t lightingHash = LightingHash();
+		return HashBytes(keys.data(), keys.size() * sizeof(uint64_t), HashBytes(&lightingHash, sizeof(lightingHash)));
+	}
+
+	// box around every static object
+	void SceneBounds(glm::vec3& sceneMin, glm::vec3& sceneMax) const
+	{
+		sceneMin = glm::vec3(1e30f);
+		sceneMax = glm::vec3(-1e30f);
+		for (size_t o = 0; o < objects.size(); ++o)
+		{
+			sceneMin = glm::min(sceneMin, boundsMin[o]);
+			sceneMax = glm::max(sceneMax, boundsMax[o]);
+		}
+	}
+
+	// changes whenever the lights or the bake settings change; every lightmap depends on it
+	uint64_t LightingHash() const
+	{
+		uint64_t hash = HashBytes(lights.data(), lights.size() * sizeof(LightmapLight));
+		float settings[4] = { TexelsPerUnit, (float)SamplesPerTexel, (float)Bounces, InfluenceDistance };
+		return HashBytes(settings, sizeof(settings), hash);
+	}
+
+	// Incremental rebake: given the previous maps, flags the objects that moved or changed, and every object
+	// close enough to one of them (at its old or its new place) to receive its shadows or bounce light.
+	// Everything is dirty when the lights changed or the object list does not match
+	std::vector<bool> FindDirty(const std::vector<Lightmap>& previous, uint64_t previousLightingHash) const
+	{
+		std::vector<bool> dirty(objects.size(), true);
+		if (previous.size() != objects.size() || previousLightingHash != LightingHash())
+			return dirty;
+
+		std::vector<size_t> moved;
+		for (size_t o = 0; o < objects.size(); ++o)
+		{
+			dirty[o] = previous[o].key != keys[o] || previous[o].rgbm.empty();
+			if (dirty[o])
+				moved.push_back(o);
+		}
+
+		glm::vec3 margin(InfluenceDistance);
+		for (size_t o = 0; o < objects.size(); ++o)
+		{
+			for (size_t m : moved)
+			{
+				if (dirty[o])
+					break;
+				dirty[o] = overlaps(boundsMin[o] - margin, boundsMax[o] + margin, boundsMin[m], boundsMax[m])
+					|| overlaps(boundsMin[o] - margin, boundsMax[o] + margin, previous[m].boundsMin, previous[m].boundsMax);
+			}
+		}
+		return dirty;
+	}
+
+	// bakes the flagged objects into maps (resized to the object count); the other maps are left untouched
+	void Bake(ThreadPool& pool, const std::vector<bool>& dirty, std::vector<Lightmap>& maps) const
+	{
+		maps.resize(objects.size());
+
+		// texel positions and normals of every dirty object, then one flat list of rows across all of them
+		struct Job
+		{
+			size_t object;
+			std::vector<glm::vec3> positions, normals, colors;
+			std::vector<uint8_t> covered;
+		};
+		std::vector<Job> jobs;
+		std::vector<std::pair<size_t, int>> rows;
+		for (size_t o = 0; o < objects.size(); ++o)
+		{
+			if (!dirty[o])
+				continue;
+			jobs.push_back(Job());
+			Job& job = jobs.back();
+			job.object = o;
+			rasterize(o, job.positions, job.normals, job.covered);
+			job.colors.assign(job.positions.size(), glm::vec3(0.0f));
+		}
+		for (size_t j = 0; j < jobs.size(); ++j)
+			for (int y = 0; y < unwraps[jobs[j].object].height; ++y)
+				rows.push_back(std::make_pair(j, y));
+
+		pool.ParallelFor(rows.size(), 1, [&](size_t begin, size_t end)
+		{
+			for (size_t r = begin; r < end; ++r)
+			{
+				Job& job = jobs[rows[r].first];
+				int width = unwraps[job.object].width;
+				for (int x = 0; x < width; ++x)
+				{
+					size_t texel = (size_t)rows[r].second * width + x;
+					if (job.covered[texel])
+						job.colors[texel] = bakeTexel(job.positions[texel], job.normals[texel], (uint32_t)(job.object * 7919u + texel));
+				}
+			}
+		});
+
+		for (Job& job : jobs)
+		{
+			const LightmapUnwrap& unwrap = unwraps[job.object];
+			dilate(unwrap.width, unwrap.height, job.colors, job.covered);
+
+			Lightmap& map = maps[job.object];
+			map.width = unwrap.width;
+			map.height = unwrap.height;
+			map.key = keys[job.object];
+			map.boundsMin = boundsMin[job.object];
+			map.boundsMax = boundsMax[job.object];
+			map.rgbm.resize(job.colors.size() * 4);
+			for (size_t texel = 0; texel < job.colors.size(); ++texel)
+				EncodeRgbm(job.colors[texel], &map.rgbm[texel * 4]);
+		}
+	}
+
+	// Fills every probe of the volume with the light arriving from all directions: the static lights directly
+	// (with shadow rays), their light bounced once off the static objects, and their ambient term
+	void BakeProbes(ThreadPool& pool, ProbeVolume& volume, int samples) const
+	{
+		pool.ParallelFor(volume.Probes.size(), 16, [&](size_t begin, size_t end)
+		{
+			for (size_t p = begin; p < end; ++p)
+				bakeProbe(volume.ProbePosition(p), samples, (uint32_t)p, volume.Probes[p]);
+		});
+	}
+
+private:
+	std::vector<LightmapObject> objects;
+	std::vector<LightmapLight> lights;
+	std::vector<LightmapUnwrap> unwraps;
+	std::vector<uint64_t> keys;
+	std::vector<glm::vec3> boundsMin, boundsMax;
+	std::vector<uint32_t> triangleObject;
+	LightmapBvh bvh;
+
+	static bool overlaps(glm::vec3 minA, glm::vec3 maxA, glm::vec3 minB, glm::vec3 maxB)
+	{
+		return minA.x <= maxB.x && maxA.x >= minB.x && minA.y <= maxB.y && maxA.y >= minB.y && minA.z <= maxB.z && maxA.z >= minB.z;
+	}
+
+	// world position and normal at the center of every texel a triangle covers. The normals are the mesh's own,
+	// interpolated, when it has them; otherwise the face normal, facing away from the object's center, or up
+	// for flat objects (table, napkin)
+	void rasterize(size_t o, std::vector<glm::vec3>& positions, std::vector<glm::vec3>& normals, std::vector<uint8_t>& covered) const
+	{
+		const LightmapObject& object = objects[o];
+		const LightmapUnwrap& unwrap = unwraps[o];
+		size_t texelCount = (size_t)unwrap.width * unwrap.height;
+		positions.assign(texelCount, glm::vec3(0.0f));
+		normals.assign(texelCount, glm::vec3(0.0f, 1.0f, 0.0f));
+		covered.assign(texelCount, 0);
+		glm::vec3 center = (boundsMin[o] + boundsMax[o]) * 0.5f;
+		float flatness = glm::length(boundsMax[o] - boundsMin[o]) * 0.01f;
+		glm::mat3 normalMatrix = glm::transpose(glm::inverse(glm::mat3(object.world)));
+
+		for (size_t i = 0; i + 2 < unwrap.indices.size(); i += 3)
+		{
+			glm::vec3 p[3], n[3];
+			glm::vec2 uv[3];
+			for (int corner = 0; corner < 3; ++corner)
+			{
+				uint32_t vertex = unwrap.indices[i + corner];
+				const float* source = object.vertices + unwrap.sourceVertex[vertex] * object.floatsPerVertex;
+				p[corner] = glm::vec3(object.world * glm::vec4(source[0], source[1], source[2], 1.0f));
+				if (object.normalOffset >= 0)
+					n[corner] = normalMatrix * glm::vec3(source[object.normalOffset], source[object.normalOffset + 1], source[object.normalOffset + 2]);
+				uv[corner] = unwrap.uvs[vertex] * glm::vec2((float)unwrap.width, (float)unwrap.height);
+			}
+
+			glm::vec3 normal = glm::cross(p[1] - p[0], p[2] - p[0]);
+			if (glm::dot(normal, normal) < 1e-12f)
+				continue;
+			normal = glm::normalize(normal);
+			float side = glm::dot(normal, (p[0] + p[1] + p[2]) / 3.0f - center);
+			if (side < -flatness || (std::fabs(side) <= flatness && normal.y < 0.0f))
+				normal = -normal;
+
+			float area = (uv[1].x - uv[0].x) * (uv[2].y - uv[0].y) - (uv[2].x - uv[0].x) * (uv[1].y - uv[0].y);
+			if (std::fabs(area) < 1e-8f)
+				continue;
+
+			int x0 = std::max(0, (int)std::floor(std::min(std::min(uv[0].x, uv[1].x), uv[2].x)));
+			int x1 = std::min(unwrap.width - 1, (int)std::ceil(std::max(std::max(uv[0].x, uv[1].x), uv[2].x)));
+			int y0 = std::max(0, (int)std::floor(std::min(std::min(uv[0].y, uv[1].y), uv[2].y)));
+			int y1 = std::min(unwrap.height - 1, (int)std::ceil(std::max(std::max(uv[0].y, uv[1].y), uv[2].y)));
+			for (int y = y0; y <= y1; ++y)
+			{
+				for (int x = x0; x <= x1; ++x)
+				{
+					glm::vec2 c(x + 0.5f, y + 0.5f);
+					float w0 = ((uv[1].x - c.x) * (uv[2].y - c.y) - (uv[2].x - c.x) * (uv[1].y - c.y)) / area;
+					float w1 = ((uv[2].x - c.x) * (uv[0].y - c.y) - (uv[0].x - c.x) * (uv[2].y - c.y)) / area;
+					float w2 = 1.0f - w0 - w1;
+					if (w0 < -1e-4f || w1 < -1e-4f || w2 < -1e-4f)
+						continue;
+
+					size_t texel = (size_t)y * unwrap.width + x;
+					positions[texel] = p[0] * w0 + p[1] * w1 + p[2] * w2;
+					glm::vec3 interpolated = n[0] * w0 + n[1] * w1 + n[2] * w2;
+					normals[texel] = object.normalOffset >= 0 && glm::dot(interpolated, interpolated) > 1e-12f ? glm::normalize(interpolated) : normal;
+					covered[texel] = 1;
+				}
+			}
+		}
+	}
+
+	// the light falloff, spot cone and radius fade of the runtime shader
+	static float lightFactor(const LightmapLight& light, glm::vec3 lightDirection, float distance)
+	{
+		float attenuation = 1.0f / (light.attenuation.x + light.attenuation.y * distance + light.attenuation.z * distance * distance);
+		float edge = distance / light.radius;
+		attenuation *= glm::clamp(1.0f - edge * edge * edge * edge, 0.0f, 1.0f);
+		if (light.innerCutoff >= -1.0f)
+		{
+			float theta = glm::dot(lightDirection, -glm::normalize(light.spotDirection));
+			attenuation *= glm::clamp((theta - light.outerCutoff) / (light.innerCutoff - light.outerCutoff), 0.0f, 1.0f);
+		}
+		return attenuation;
+	}
+
+	// diffuse light arriving at a point straight from the lights, with shadow rays
+	glm::vec3 directDiffuse(glm::vec3 position, glm::vec3 normal) const
+	{
+		glm::vec3 result(0.0f);
+		glm::vec3 origin = position + normal * 1e-3f;
+		for (const LightmapLight& light : lights)
+		{
+			glm::vec3 toLight = light.position - position;
+			float distance = glm::length(toLight);
+			if (distance >= light.radius || distance <= 0.0f)
+				continue;
+			glm::vec3 direction = toLight / distance;
+			float impact = glm::dot(normal, direction);
+			if (impact <= 0.0f)
+				continue;
+			float factor = lightFactor(light, direction, distance);
+			if (factor <= 0.0f || bvh.Occluded(origin, direction, distance - 2e-3f))
+				continue;
+			result += impact * factor * light.color;
+		}
+		return result;
+	}
+
+	// the lights' ambient term, which ignores the surface orientation and shadows
+	glm::vec3 ambientLight(glm::vec3 position) const
+	{
+		glm::vec3 result(0.0f);
+		for (const LightmapLight& light : lights)
+		{
+			glm::vec3 toLight = light.position - position;
+			float distance = glm::length(toLight);
+			if (distance < light.radius && distance > 0.0f)
+				result += light.ambientStrength * light.color * lightFactor(light, toLight / distance, distance);
+		}
+		return result;
+	}
+
+	// xorshift, seeded per texel or probe so bakes are repeatable
+	static float nextRandom(uint32_t& state)
+	{
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+		return (state >> 8) * (1.0f / 16777216.0f);
+	}
+
+	// ambient + direct + path traced indirect light for one texel
+	glm::vec3 bakeTexel(glm::vec3 position, glm::vec3 normal, uint32_t seed) const
+	{
+		glm::vec3 result = directDiffuse(position, normal) + ambientLight(position);
+
+		// cosine weighted paths; with that weighting the irradiance estimate is just the mean radiance
+		uint32_t state = seed * 747796405u + 2891336453u;
+		auto random = [&state]() { return nextRandom(state); };
+
+		glm::vec3 indirect(0.0f);
+		for (int sample = 0; sample < SamplesPerTexel; ++sample)
+		{
+			glm::vec3 origin = position + normal * 1e-3f;
+			glm::vec3 surfaceNormal = normal;
+			glm::vec3 throughput(1.0f);
+			for (int bounce = 0; bounce < Bounces; ++bounce)
+			{
+				glm::vec3 direction = cosineSample(surfaceNormal, random(), random());
+				LightmapBvh::Hit hit;
+				if (!bvh.Intersect(origin, direction, 1e30f, hit))
+					break;
+
+				glm::vec3 hitPosition = origin + direction * hit.t;
+				glm::vec3 hitNormal = bvh.Normal(hit.triangle);
+				if (glm::dot(hitNormal, direction) > 0.0f)
+					hitNormal = -hitNormal;
+
+				throughput *= objects[triangleObject[hit.triangle]].albedo;
+				indirect += throughput * directDiffuse(hitPosition, hitNormal);
+
+				origin = hitPosition + hitNormal * 1e-3f;
+				surfaceNormal = hitNormal;
+			}
+		}
+		return result + indirect / (float)SamplesPerTexel;
+	}
+
+	// Light arriving at a probe, projected onto spherical harmonics. Lights are exact directions; bounced light is
+	// gathered with uniformly distributed rays, each weighted by its share (4 pi / samples) of the sphere
+	void bakeProbe(glm::vec3 position, int samples, uint32_t seed, ShProbe& probe) const
+	{
+		std::memset(&probe, 0, sizeof(probe));
+		float basis[SH_COEFFICIENTS];
+		auto project = [&](glm::vec3 direction, glm::vec3 radiance)
+		{
+			ShBasis(direction, basis);
+			for (int i = 0; i < SH_COEFFICIENTS; ++i)
+				for (int c = 0; c < 3; ++c)
+					probe.coefficients[i * 3 + c] += radiance[c] * basis[i];
+		};
+
+		for (const LightmapLight& light : lights)
+		{
+			glm::vec3 toLight = light.position - position;
+			float distance = glm::length(toLight);
+			if (distance >= light.radius || distance <= 0.0f)
+				continue;
+			glm::vec3 direction = toLight / distance;
+			float factor = lightFactor(light, direction, distance);
+			if (factor > 0.0f && !bvh.Occluded(position, direction, distance - 2e-3f))
+				project(direction, light.color * factor);
+		}
+
+		// a surface lit with irradiance E sends back albedo * E / pi in every direction
+		uint32_t state = seed * 2654435761u + 12345u;
+		float weight = 4.0f / (float)samples;
+		for (int sample = 0; sample < samples; ++sample)
+		{
+			float z = 1.0f - 2.0f * nextRandom(state);
+			float radius = std::sqrt(std::max(0.0f, 1.0f - z * z));
+			float angle = 6.28318531f * nextRandom(state);
+			glm::vec3 direction(radius * std::cos(angle), radius * std::sin(angle), z);
+
+			LightmapBvh::Hit hit;
+			if (!bvh.Intersect(position, direction, 1e30f, hit))
+				continue;
+			glm::vec3 hitPosition = position + direction * hit.t;
+			glm::vec3 hitNormal = bvh.Normal(hit.triangle);
+			if (glm::dot(hitNormal, direction) > 0.0f)
+				hitNormal = -hitNormal;
+			glm::vec3 lighting = directDiffuse(hitPosition, hitNormal) + ambientLight(hitPosition);
+			project(direction, objects[triangleObject[hit.triangle]].albedo * lighting * weight);
+		}
+
+		// ambient light is the same in every direction, which only the constant coefficient can hold
+		ShConvolveCosine(probe);
+		glm::vec3 ambient = ambientLight(position) / 0.282095f;
+		for (int c = 0; c < 3; ++c)
+			probe.coefficients[c] += ambient[c];
+	}
+
+	static glm::vec3 cosineSample(glm::vec3 normal, float u1, float u2)
+	{
+		// orthonormal basis around the normal (Duff et al. 2017)
+		float sign = normal.z >= 0.0f ? 1.0f : -1.0f;
+		float a = -1.0f / (sign + normal.z);
+		float b = normal.x * normal.y * a;
+		glm::vec3 tangent(1.0f + sign * normal.x * normal.x * a, sign * b, -sign * normal.x);
+		glm::vec3 bitangent(b, sign + normal.y * normal.y * a, -normal.y);
+
+		float radius = std::sqrt(u1);
+		float angle = 6.28318531f * u2;
+		return tangent * (radius * std::cos(angle)) + bitangent * (radius * std::sin(angle)) + normal * std::sqrt(std::max(0.0f, 1.0f - u1));
+	}
+
+	// spreads covered texels into the empty ones around the charts, so filtering at chart edges picks up no black
+	static void dilate(int width, int height, std::vector<glm::vec3>& colors, std::vector<uint8_t>& covered)
+	{
+		for (int pass = 0; pass < LIGHTMAP_PADDING; ++pass)
+		{
+			std::vector<uint8_t> next = covered;
+			for (int y = 0; y < height; ++y)
+			{
+				for (int x = 0; x < width; ++x)
+				{
+					size_t texel = (size_t)y * width + x;
+					if (covered[texel])
+						continue;
+					glm::vec3 sum(0.0f);
+					int count = 0;
+					for (int dy = -1; dy <= 1; ++dy)
+					{
+						for (int dx = -1; dx <= 1; ++dx)
+						{
+							int nx = x + dx, ny = y + dy;
+							if (nx < 0 || ny < 0 || nx >= width || ny >= height || !covered[(size_t)ny * width + nx])
+								continue;
+							sum += colors[(size_t)ny * width + nx];
+							++count;
+						}
+					}
+					if (count > 0)
+					{
+						colors[texel] = sum / (float)count;
+						next[texel] = 1;
+					}
+				}
+			}
+			covered.swap(next);
+		}
+	}
+};
+
+
+// Lightmap file: "LMAP", version, lighting hash, object count, then per object its key, bounds, size and RGBM texels
+inline bool SaveLightmaps(const std::string& path, uint64_t lightingHash, const std::vector<Lightmap>& maps)
+{
+	std::ofstream file(path, std::ios::binary);
+	if (!file)
+		return false;
+
+	const uint32_t version = 1;
+	uint32_t count = (uint32_t)maps.size();
+	file.write("LMAP", 4);
+	file.write((const char*)&version, sizeof(version));
+	file.write((const char*)&lightingHash, sizeof(lightingHash));
+	file.write((const char*)&count, sizeof(count));
+	for (const Lightmap& map : maps)
+	{
+		file.write((const char*)&map.key, sizeof(map.key));
+		file.write((const char*)&map.boundsMin[0], sizeof(glm::vec3));
+		file.write((const char*)&map.boundsMax[0], sizeof(glm::vec3));
+		file.write((const char*)&map.width, sizeof(map.width));
+		file.write((const char*)&map.height, sizeof(map.height));
+		file.write((const char*)map.rgbm.data(), map.rgbm.size());
+	}
+	return (bool)file;
+}
+
+// Reads the lightmaps of objectCount objects; false when the file holds another count or is cut short
+inline bool LoadLightmaps(const std::string& path, size_t objectCount, uint64_t& lightingHash, std::vector<Lightmap>& maps)
+{
+	std::ifstream file(path, std::ios::binary);
+	if (!file)
+		return false;
+
+	char magic[4];
+	uint32_t version = 0, count = 0;
+	file.read(magic, 4);
+	file.read((char*)&version, sizeof(version));
+	file.read((char*)&lightingHash, sizeof(lightingHash));
+	file.read((char*)&count, sizeof(count));
+	if (!file || std::memcmp(magic, "LMAP", 4) != 0 || version != 1 || count != objectCount)
+		return false;
+
+	// every map needs its key, bounds and size at least, and then its texels
+	const size_t mapHeaderBytes = sizeof(uint64_t) + 2 * sizeof(glm::vec3) + 2 * sizeof(int);
+	std::streamoff position = file.tellg();
+	file.seekg(0, std::ios::end);
+	size_t remaining = (size_t)(file.tellg() - position);
+	file.seekg(position);
+	if (remaining / mapHeaderBytes < count)
+		return false;
+
+	maps.assign(count, Lightmap());
+	for (Lightmap& map : maps)
+	{
+		file.read((char*)&map.key, sizeof(map.key));
+		file.read((char*)&map.boundsMin[0], sizeof(glm::vec3));
+		file.read((char*)&map.boundsMax[0], sizeof(glm::vec3));
+		file.read((char*)&map.width, sizeof(map.width));
+		file.read((char*)&map.height, sizeof(map.height));
+		if (!file || map.width < 0 || map.height < 0 || map.width > 8192 || map.height > 8192)
+			return false;
+		size_t bytes = (size_t)map.width * map.height * 4;
+		remaining -= mapHeaderBytes;
+		if (bytes > remaining)
+			return false;
+		remaining -= bytes;
+		map.rgbm.resize(bytes);
+		file.read((char*)map.rgbm.data(), map.rgbm.size());
+	}
+	return (bool)file;
+}
+#endif
@@ -0,0 +1,137 @@
+#ifndef LZ4BLOCK_H
+#define LZ4BLOCK_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// The LZ4 block format (no frame around it), enough to store decoded images compactly: a greedy compressor
+// with a single hash table, which trades ratio for speed, and a decompressor that checks every length against
+// both buffers, so a damaged file fails to decompress instead of writing past them. The output reads with any
+// LZ4 block decoder, e.g. LZ4_decompress_safe
+//   sequence: token (literal count << 4 | match length - 4), more literal count, literals, 16 bit offset,
+//   more match length; counts of 15 continue in bytes of 255. The last sequence is literals only
+
+namespace lz4detail
+{
+	const int HASH_BITS = 16;
+	const size_t MIN_MATCH = 4;
+	const size_t LAST_LITERALS = 5;     // the block ends with at least this many literals
+	const size_t MATCH_SAFE = 12;       // and its last match starts at least this far from the end
+	const size_t MAX_OFFSET = 65535;
+
+	inline uint32_t read32(const uint8_t* p)
+	{
+		uint32_t value;
+		std::memcpy(&value, p, 4);
+		return value;
+	}
+
+	inline void putLength(std::vector<uint8_t>& out, size_t length)
+	{
+		for (; length >= 255; length -= 255)
+			out.push_back(255);
+		out.push_back((uint8_t)length);
+	}
+
+	inline void putSequence(std::vector<uint8_t>& out, const uint8_t* literals, size_t literalCount, size_t offset, size_t matchLength)
+	{
+		size_t matchCode = matchLength ? matchLength - MIN_MATCH : 0;
+		out.push_back((uint8_t)(((literalCount < 15 ? literalCount : 15) << 4) | (matchCode < 15 ? matchCode : 15)));
+		if (literalCount >= 15)
+			putLength(out, literalCount - 15);
+		out.insert(out.end(), literals, literals + literalCount);
+		if (!matchLength)
+			return;
+		out.push_back((uint8_t)offset);
+		out.push_back((uint8_t)(offset >> 8));
+		if (matchCode >= 15)
+			putLength(out, matchCode - 15);
+	}
+
+	// adds the continuation bytes of a count to length; false when they run past end
+	inline bool getLength(const uint8_t*& in, const uint8_t* end, size_t& length)
+	{
+		uint8_t byte;
+		do
+		{
+			if (in >= end)
+				return false;
+			byte = *in++;
+			length += byte;
+		} while (byte == 255);
+		return true;
+	}
+}
+
+// Appends the compressed size bytes at data to out
+inline void Lz4Compress(const uint8_t* data, size_t size, std::vector<uint8_t>& out)
+{
+	using namespace lz4detail;
+	size_t anchor = 0;
+	if (size > MATCH_SAFE)
+	{
+		std::vector<uint32_t> table((size_t)1 << HASH_BITS, 0);  // last position + 1 of every hashed 4 bytes
+		size_t matchEnd = size - LAST_LITERALS;
+		for (size_t i = 0; i < size - MATCH_SAFE; )
+		{
+			uint32_t sequence = read32(data + i);
+			uint32_t hash = (sequence * 2654435761u) >> (32 - HASH_BITS);
+			size_t candidate = table[hash];
+			table[hash] = (uint32_t)(i + 1);
+			if (candidate == 0 || i + 1 - candidate > MAX_OFFSET || read32(data + candidate - 1) != sequence)
+			{
+				++i;
+				continue;
+			}
+			size_t reference = candidate - 1;
+			size_t length = MIN_MATCH;
+			while (i + length < matchEnd && data[reference + length] == data[i + length])
+				++length;
+			putSequence(out, data + anchor, i - anchor, i - reference, length);
+			i += length;
+			anchor = i;
+		}
+	}
+	putSequence(out, data + anchor, size - anchor, 0, 0);
+}
+
+// Decompresses exactly size bytes into out; false when data is not a block of that size
+inline bool Lz4Decompress(const uint8_t* data, size_t dataSize, uint8_t* out, size_t size)
+{
+	using namespace lz4detail;
+	const uint8_t* in = data;
+	const uint8_t* end = data + dataSize;
+	size_t written = 0;
+	while (in < end)
+	{
+		uint8_t token = *in++;
+		size_t literalCount = token >> 4;
+		if (literalCount == 15 && !getLength(in, end, literalCount))
+			return false;
+		if ((size_t)(end - in) < literalCount || size - written < literalCount)
+			return false;
+		std::memcpy(out + written, in, literalCount);
+		in += literalCount;
+		written += literalCount;
+		if (in == end)
+			break;      // the last sequence has no match
+
+		if (end - in < 2)
+			return false;
+		size_t offset = in[0] | ((size_t)in[1] << 8);
+		in += 2;
+		size_t length = (token & 15);
+		if (length == 15 && !getLength(in, end, length))
+			return false;
+		length += MIN_MATCH;
+		if (offset == 0 || offset > written || size - written < length)
+			return false;
+		// byte by byte, as the match may overlap what it writes
+		for (size_t i = 0; i < length; ++i, ++written)
+			out[written] = out[written - offset];
+	}
+	return written == size;
+}
+#endif
@@ -0,0 +1,390 @@
+#ifndef MIPGEN_H
+#define MIPGEN_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include <emmintrin.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+// One RGBA8 image (or mip level), rows bottom-up like everything handed to GL
+struct MipLevel
+{
+	int width = 0;
+	int height = 0;
+	std::vector<uint8_t> rgba;
+};
+
+// Converts 8-bit pixels with 1 to 4 channels (as stbi_load returns them) to RGBA8
+inline MipLevel ToMipLevel(const uint8_t* pixels, int width, int height, int channels)
+{
+	MipLevel level;
+	level.width = width;
+	level.height = height;
+	level.rgba.resize((size_t)width * height * 4);
+	for (size_t i = 0; i < (size_t)width * height; ++i)
+		for (int c = 0; c < 4; ++c)
+			level.rgba[i * 4 + c] = c < 3 ? pixels[i * channels + (channels >= 3 ? c : 0)] : (channels == 4 ? pixels[i * 4 + 3] : 255);
+	return level;
+}
+
+// Downsampling filters: a 2x2 box, or an 8-tap Kaiser-windowed sinc per axis, which keeps the smaller levels
+// sharper without the box's aliasing
+enum MipFilter
+{
+	MIP_FILTER_BOX,
+	MIP_FILTER_KAISER
+};
+
+struct MipChainOptions
+{
+	MipFilter filter = MIP_FILTER_KAISER;
+	bool srgb = true;       // color channels hold sRGB values: filter them in linear space (alpha always is linear)
+	bool wrap = true;       // the texture repeats, so filters wrap around its edges instead of clamping
+};
+
+namespace mipdetail
+{
+	// 8-bit to linear: the first 256 entries decode sRGB, the next 256 are plain value / 255 (for alpha, or
+	// color when it is not sRGB), so one gather covers a whole RGBA pixel
+	inline const float* toLinearTable()
+	{
+		static const std::vector<float> table = []
+		{
+			std::vector<float> values(512);
+			for (int i = 0; i < 256; ++i)
+			{
+				float v = i / 255.0f;
+				values[i] = v <= 0.04045f ? v / 12.92f : std::pow((v + 0.055f) / 1.055f, 2.4f);
+				values[256 + i] = v;
+			}
+			return values;
+		}();
+		return table.data();
+	}
+
+	// linear in [0, 1], in 4096 steps, to 8-bit sRGB
+	const int LINEAR_STEPS = 4096;
+	inline const uint8_t* toSrgbTable()
+	{
+		static const std::vector<uint8_t> table = []
+		{
+			std::vector<uint8_t> values(LINEAR_STEPS);
+			for (int i = 0; i < LINEAR_STEPS; ++i)
+			{
+				float v = i / (float)(LINEAR_STEPS - 1);
+				float encoded = v <= 0.0031308f ? v * 12.92f : 1.055f * std::pow(v, 1.0f / 2.4f) - 0.055f;
+				values[i] = (uint8_t)(encoded * 255.0f + 0.5f);
+			}
+			return values;
+		}();
+		return table.data();
+	}
+
+	// 8-bit kernel: count RGBA8 bytes to linear float RGBA
+	inline void toLinear(const uint8_t* bytes, size_t count, bool srgb, float* out)
+	{
+		const float* table = toLinearTable();
+		size_t i = 0;
+#ifdef __AVX2__
+		// two pixels per gather; alpha lanes read the linear half of the table
+		const __m256i offsets = srgb ? _mm256_setr_epi32(0, 0, 0, 256, 0, 0, 0, 256) : _mm256_set1_epi32(256);
+		for (; i + 8 <= count; i += 8)
+		{
+			__m256i values = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(bytes + i)));
+			_mm256_storeu_ps(out + i, _mm256_i32gather_ps(table, _mm256_add_epi32(values, offsets), 4));
+		}
+#endif
+		for (; i < count; ++i)
+			out[i] = table[bytes[i] + ((srgb && (i & 3) != 3) ? 0 : 256)];
+	}
+
+	inline void toLinear(const MipLevel& level, bool srgb, std::vector<float>& out)
+	{
+		out.resize(level.rgba.size());
+		toLinear(level.rgba.data(), level.rgba.size(), srgb, out.data());
+	}
+
+	// float kernel: pixelCount linear float RGBA pixels back to RGBA8, clamped and rounded with SSE, color through
+	// the sRGB table
+	inline void toBytes(const float* pixels, size_t pixelCount, bool srgb, uint8_t* out)
+	{
+		const uint8_t* table = toSrgbTable();
+		const __m128 scale = srgb ? _mm_setr_ps(LINEAR_STEPS - 1.0f, LINEAR_STEPS - 1.0f, LINEAR_STEPS - 1.0f, 255.0f) : _mm_set1_ps(255.0f);
+		const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+		alignas(16) int values[4];
+		for (size_t p = 0; p < pixelCount; ++p)
+		{
+			__m128 pixel = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(pixels + p * 4), zero), one);
+			_mm_store_si128((__m128i*)values, _mm_cvtps_epi32(_mm_mul_ps(pixel, scale)));
+			for (int c = 0; c < 3; ++c)
+				out[p * 4 + c] = srgb ? table[values[c]] : (uint8_t)values[c];
+			out[p * 4 + 3] = (uint8_t)values[3];
+		}
+	}
+
+	inline void toBytes(const float* pixels, int width, int height, bool srgb, MipLevel& out)
+	{
+		out.width = width;
+		out.height = height;
+		out.rgba.resize((size_t)width * height * 4);
+		toBytes(pixels, (size_t)width * height, srgb, out.rgba.data());
+	}
+
+	inline int address(int i, int size, bool wrap)
+	{
+		if (wrap)
+			return ((i % size) + size) % size;
+		return i < 0 ? 0 : (i >= size ? size - 1 : i);
+	}
+
+	// 2x2 box: each output pixel is the average of the four source pixels it covers
+	inline void downsampleBox(const float* source, int sourceWidth, int sourceHeight, float* target, int width, int height, bool wrap)
+	{
+		const __m128 quarter = _mm_set1_ps(0.25f);
+		for (int y = 0; y < height; ++y)
+		{
+			const float* row0 = source + (size_t)address(y * 2, sourceHeight, wrap) * sourceWidth * 4;
+			const float* row1 = source + (size_t)address(y * 2 + 1, sourceHeight, wrap) * sourceWidth * 4;
+			float* out = target + (size_t)y * width * 4;
+			int x = 0;
+#ifdef __AVX2__
+			// two output pixels at once, while all four source columns are inside the row
+			for (; x + 2 <= width && x * 2 + 4 <= sourceWidth; x += 2)
+			{
+				// summed in the order of the loop below, (row0 left + right) + (row1 left + right), so both builds
+				// round alike
+				__m256 a0 = _mm256_loadu_ps(row0 + x * 8), b0 = _mm256_loadu_ps(row0 + x * 8 + 8);
+				__m256 a1 = _mm256_loadu_ps(row1 + x * 8), b1 = _mm256_loadu_ps(row1 + x * 8 + 8);
+				__m256 top = _mm256_add_ps(_mm256_permute2f128_ps(a0, b0, 0x20), _mm256_permute2f128_ps(a0, b0, 0x31));
+				__m256 bottom = _mm256_add_ps(_mm256_permute2f128_ps(a1, b1, 0x20), _mm256_permute2f128_ps(a1, b1, 0x31));
+				__m256 sum = _mm256_add_ps(top, bottom);
+				_mm256_storeu_ps(out + x * 4, _mm256_mul_ps(sum, _mm256_set1_ps(0.25f)));
+			}
+#endif
+			for (; x < width; ++x)
+			{
+				int x0 = address(x * 2, sourceWidth, wrap) * 4, x1 = address(x * 2 + 1, sourceWidth, wrap) * 4;
+				__m128 sum = _mm_add_ps(_mm_add_ps(_mm_loadu_ps(row0 + x0), _mm_loadu_ps(row0 + x1)),
+					_mm_add_ps(_mm_loadu_ps(row1 + x0), _mm_loadu_ps(row1 + x1)));
+				_mm_storeu_ps(out + x * 4, _mm_mul_ps(sum, quarter));
+			}
+		}
+	}
+
+	// the 8 taps of a Kaiser-windowed sinc (alpha 4) halving the resolution, at source offsets -3.5 to 3.5
+	inline const float* kaiserWeights()
+	{
+		static const std::vector<float> weights = []
+		{
+			auto besselI0 = [](double x)
+			{
+				double sum = 1.0, term = 1.0;
+				for (int k = 1; k < 20; ++k)
+				{
+					term *= (x / (2.0 * k)) * (x / (2.0 * k));
+					sum += term;
+				}
+				return sum;
+			};
+			const double alpha = 4.0, halfWidth = 2.0, pi = 3.14159265358979;
+			std::vector<float> values(8);
+			double total = 0.0;
+			for (int k = 0; k < 8; ++k)
+			{
+				double x = (k - 3.5) / 2.0;     // in target pixels
+				double sinc = std::sin(pi * x) / (pi * x);
+				double t = x / halfWidth;
+				double window = besselI0(alpha * std::sqrt(std::max(0.0, 1.0 - t * t))) / besselI0(alpha);
+				values[k] = (float)(sinc * window);
+				total += values[k];
+			}
+			for (float& value : values)
+				value = (float)(value / total);
+			return values;
+		}();
+		return weights.data();
+	}
+
+	// separable Kaiser: halve the width into scratch, then the height into target. Negative lobes can overshoot,
+	// which toBytes clamps
+	inline void downsampleKaiser(const float* source, int sourceWidth, int sourceHeight, float* target, int width, int height,
+		bool wrap, std::vector<float>& scratch)
+	{
+		const float* weights = kaiserWeights();
+		scratch.resize((size_t)width * sourceHeight * 4);
+
+		// horizontal: a single source column is copied
+		for (int y = 0; y < sourceHeight; ++y)
+		{
+			const float* row = source + (size_t)y * sourceWidth * 4;
+			float* out = &scratch[(size_t)y * width * 4];
+			if (sourceWidth == 1)
+			{
+				std::copy(row, row + 4, out);
+				continue;
+			}
+			int x = 0;
+#ifdef __AVX2__
+			for (; x + 2 <= width; x += 2)
+			{
+				__m256 sum = _mm256_setzero_ps();
+				for (int k = 0; k < 8; ++k)
+				{
+					__m128 first = _mm_loadu_ps(row + address(x * 2 - 3 + k, sourceWidth, wrap) * 4);
+					__m128 second = _mm_loadu_ps(row + address(x * 2 - 1 + k, sourceWidth, wrap) * 4);
+					sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_set1_ps(weights[k]), _mm256_insertf128_ps(_mm256_castps128_ps256(first), second, 1)));
+				}
+				_mm256_storeu_ps(out + x * 4, sum);
+			}
+#endif
+			for (; x < width; ++x)
+			{
+				__m128 sum = _mm_setzero_ps();
+				for (int k = 0; k < 8; ++k)
+					sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(weights[k]), _mm_loadu_ps(row + address(x * 2 - 3 + k, sourceWidth, wrap) * 4)));
+				_mm_storeu_ps(out + x * 4, sum);
+			}
+		}
+
+		// vertical: whole rows at once, four (or eight) floats per step
+		size_t rowFloats = (size_t)width * 4;
+		for (int y = 0; y < height; ++y)
+		{
+			float* out = target + (size_t)y * rowFloats;
+			if (sourceHeight == 1)
+			{
+				std::copy(scratch.begin(), scratch.begin() + rowFloats, out);
+				continue;
+			}
+			const float* rows[8];
+			for (int k = 0; k < 8; ++k)
+				rows[k] = &scratch[(size_t)address(y * 2 - 3 + k, sourceHeight, wrap) * rowFloats];
+			size_t i = 0;
+#ifdef __AVX2__
+			for (; i + 8 <= rowFloats; i += 8)
+			{
+				__m256 sum = _mm256_setzero_ps();
+				for (int k = 0; k < 8; ++k)
+					sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_set1_ps(weights[k]), _mm256_loadu_ps(rows[k] + i)));
+				_mm256_storeu_ps(out + i, sum);
+			}
+#endif
+			for (; i < rowFloats; i += 4)
+			{
+				__m128 sum = _mm_setzero_ps();
+				for (int k = 0; k < 8; ++k)
+					sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(weights[k]), _mm_loadu_ps(rows[k] + i)));
+				_mm_storeu_ps(out + i, sum);
+			}
+		}
+	}
+}
+
+// Builds the whole mip chain of top, down to 1x1, on the calling thread. Every level is filtered from the float
+// level above it, so the rounding to 8 bits happens once per level instead of accumulating down the chain.
+// Level 0 is top itself
+inline std::vector<MipLevel> GenerateMipChain(const MipLevel& top, const MipChainOptions& options = MipChainOptions())
+{
+	std::vector<MipLevel> chain(1, top);
+	std::vector<float> current, next, scratch;
+	mipdetail::toLinear(top, options.srgb, current);
+	int width = top.width, height = top.height;
+	while (width > 1 || height > 1)
+	{
+		int nextWidth = width > 1 ? width / 2 : 1, nextHeight = height > 1 ? height / 2 : 1;
+		next.resize((size_t)nextWidth * nextHeight * 4);
+		if (options.filter == MIP_FILTER_KAISER)
+			mipdetail::downsampleKaiser(current.data(), width, height, next.data(), nextWidth, nextHeight, options.wrap, scratch);
+		else
+			mipdetail::downsampleBox(current.data(), width, height, next.data(), nextWidth, nextHeight, options.wrap);
+
+		MipLevel level;
+		mipdetail::toBytes(next.data(), nextWidth, nextHeight, options.srgb, level);
+		chain.push_back(std::move(level));
+		current.swap(next);
+		width = nextWidth;
+		height = nextHeight;
+	}
+	return chain;
+}
+
+// Filters the level below an RGBA8 image straight from its bytes, a strip of target rows at a time, so only the
+// few source rows a strip reads are ever held as floats, however large the image. Meant for images too large for
+// GenerateMipChain's float copy of a whole level; each level is rounded to 8 bits before the next is filtered
+// from it, which GenerateMipChain avoids. The filters add up in the same order as GenerateMipChain's
+inline MipLevel NextMipLevel(const uint8_t* rgba, int sourceWidth, int sourceHeight, const MipChainOptions& options = MipChainOptions())
+{
+	using namespace mipdetail;
+	const int STRIP_ROWS = 64;
+	const float* weights = kaiserWeights();
+	bool kaiser = options.filter == MIP_FILTER_KAISER;
+	int first = kaiser ? -3 : 0, taps = kaiser ? 8 : 2;    // target row y reads the taps source rows from y * 2 + first
+	MipLevel next;
+	next.width = sourceWidth > 1 ? sourceWidth / 2 : 1;
+	next.height = sourceHeight > 1 ? sourceHeight / 2 : 1;
+	next.rgba.resize((size_t)next.width * next.height * 4);
+	size_t rowFloats = (size_t)next.width * 4;
+	std::vector<float> row((size_t)sourceWidth * 4), across, strip;
+
+	for (int top = 0; top < next.height; top += STRIP_ROWS)
+	{
+		int count = std::min(STRIP_ROWS, next.height - top);
+		int rowCount = (count - 1) * 2 + taps;
+
+		// the source rows of the strip, each to linear and filtered across
+		across.resize((size_t)rowCount * rowFloats);
+		for (int r = 0; r < rowCount; ++r)
+		{
+			int sourceY = address(top * 2 + first + r, sourceHeight, options.wrap);
+			toLinear(rgba + (size_t)sourceY * sourceWidth * 4, row.size(), options.srgb, row.data());
+			float* out = &across[(size_t)r * rowFloats];
+			for (int x = 0; x < next.width; ++x)
+			{
+				__m128 sum;
+				if (!kaiser)
+					sum = _mm_add_ps(_mm_loadu_ps(&row[address(x * 2, sourceWidth, options.wrap) * 4]),
+						_mm_loadu_ps(&row[address(x * 2 + 1, sourceWidth, options.wrap) * 4]));
+				else if (sourceWidth == 1)
+					sum = _mm_loadu_ps(row.data());
+				else
+				{
+					sum = _mm_setzero_ps();
+					for (int k = 0; k < 8; ++k)
+						sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(weights[k]), _mm_loadu_ps(&row[address(x * 2 - 3 + k, sourceWidth, options.wrap) * 4])));
+				}
+				_mm_storeu_ps(out + x * 4, sum);
+			}
+		}
+
+		// then down: target row y of the strip reads rows y * 2 onwards of across
+		strip.resize((size_t)count * rowFloats);
+		for (int y = 0; y < count; ++y)
+		{
+			const float* rows = &across[(size_t)y * 2 * rowFloats];
+			float* out = &strip[(size_t)y * rowFloats];
+			for (size_t i = 0; i < rowFloats; i += 4)
+			{
+				__m128 sum;
+				if (!kaiser)
+					sum = _mm_mul_ps(_mm_add_ps(_mm_loadu_ps(rows + i), _mm_loadu_ps(rows + rowFloats + i)), _mm_set1_ps(0.25f));
+				else if (sourceHeight == 1)
+					sum = _mm_loadu_ps(rows + i);
+				else
+				{
+					sum = _mm_setzero_ps();
+					for (int k = 0; k < 8; ++k)
+						sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(weights[k]), _mm_loadu_ps(rows + k * rowFloats + i)));
+				}
+				_mm_storeu_ps(out + i, sum);
+			}
+		}
+		toBytes(strip.data(), (size_t)count * next.width, options.srgb, &next.rgba[(size_t)top * rowFloats]);
+	}
+	return next;
+}
+#endif
@@ -0,0 +1,128 @@
+#ifndef OBJECTLIGHTS_H
+#define OBJECTLIGHTS_H
+
+#include <GL/glew.h>
+
+#include <glm/glm.hpp>
+
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "clustered.h"
+#include "threadpool.h"
+
+// SSBO binding point of the per-draw light lists (0 - 2 are the light buffers, 3 - 4 the particles)
+const GLuint OBJECT_LIGHT_BUFFER_BINDING = 5;
+
+// Each draw gets a fixed slot: a light count followed by up to MAX_OBJECT_LIGHTS light indices.
+// The shaders index the slots with the same size
+const int MAX_OBJECT_LIGHTS = 7;
+const int OBJECT_LIGHT_SLOT_SIZE = MAX_OBJECT_LIGHTS + 1;
+
+// World space box of one draw
+struct ObjectBounds
+{
+	glm::vec3 center;
+	glm::vec3 extent;   // half size
+};
+
+// Per-object light assignment for forward rendering: every light's influence sphere (the radius its
+// attenuation falls off in) is tested against every draw's bounds on the CPU, and each draw keeps the
+// MAX_OBJECT_LIGHTS lights that are brightest at its box. The fragment shader then only loops over its
+// draw's short list, so an object far from every candle evaluates no point lights at all. Cheaper than the
+// clusters when there are few objects and lights, and needs no depth slices or screen tiles
+class ObjectLightAssignment
+{
+public:
+	// assigns lights (world space, as uploaded by ClusteredLighting) to every object and uploads the slots;
+	// slot i belongs to objects[i]
+	void Assign(const std::vector<GpuPointLight>& lights, const std::vector<ObjectBounds>& objects, ThreadPool& pool)
+	{
+		auto start = std::chrono::steady_clock::now();
+		if (!buffer)
+			glGenBuffers(1, &buffer);
+
+		size_t objectCount = objects.size();
+		slots.assign((objectCount > 0 ? objectCount : 1) * OBJECT_LIGHT_SLOT_SIZE, 0);
+		pool.ParallelFor(objectCount, 64, [&](size_t begin, size_t end)
+		{
+			for (size_t i = begin; i < end; ++i)
+				assignObject(lights, objects[i], &slots[i * OBJECT_LIGHT_SLOT_SIZE]);
+		});
+
+		assignedLights = 0;
+		for (size_t i = 0; i < objectCount; ++i)
+			assignedLights += slots[i * OBJECT_LIGHT_SLOT_SIZE];
+		assignedObjects = objectCount;
+
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffer);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, slots.size() * sizeof(uint32_t), slots.data(), GL_STREAM_DRAW);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+		cpuMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	void Bind() const
+	{
+		if (buffer)
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, OBJECT_LIGHT_BUFFER_BINDING, buffer);
+	}
+
+	// lights per object in the last Assign(), and the time it took
+	double AverageLightsPerObject() const { return assignedObjects > 0 ? (double)assignedLights / assignedObjects : 0.0; }
+	double CpuMs() const { return cpuMs; }
+
+	void Destroy()
+	{
+		if (buffer)
+			glDeleteBuffers(1, &buffer);
+		buffer = 0;
+	}
+
+private:
+	GLuint buffer = 0;
+	std::vector<uint32_t> slots;
+	size_t assignedLights = 0;
+	size_t assignedObjects = 0;
+	double cpuMs = 0.0;
+
+	// fills one slot with the lights reaching the box, strongest first; when more than MAX_OBJECT_LIGHTS reach
+	// it, the ones with the least light at the box's nearest point are dropped
+	static void assignObject(const std::vector<GpuPointLight>& lights, const ObjectBounds& object, uint32_t* slot)
+	{
+		float scores[MAX_OBJECT_LIGHTS];
+		int count = 0;
+		for (size_t i = 0; i < lights.size(); ++i)
+		{
+			const GpuPointLight& light = lights[i];
+			glm::vec3 outside = glm::max(glm::abs(glm::vec3(light.positionRadius) - object.center) - object.extent, glm::vec3(0.0f));
+			float distanceSquared = glm::dot(outside, outside);
+			float radius = light.positionRadius.w;
+			if (distanceSquared > radius * radius)
+				continue;
+
+			float distance = std::sqrt(distanceSquared);
+			glm::vec3 color(light.colorAmbient);
+			float brightest = color.r > color.g ? (color.r > color.b ? color.r : color.b) : (color.g > color.b ? color.g : color.b);
+			float falloff = light.attenuation.x + light.attenuation.y * distance + light.attenuation.z * distance * distance;
+			float score = brightest / (falloff > 1e-4f ? falloff : 1e-4f);
+			if (count == MAX_OBJECT_LIGHTS && score <= scores[count - 1])
+				continue;
+
+			// insertion into the list, kept sorted by score
+			int at = count < MAX_OBJECT_LIGHTS ? count++ : MAX_OBJECT_LIGHTS - 1;
+			while (at > 0 && scores[at - 1] < score)
+			{
+				scores[at] = scores[at - 1];
+				slot[1 + at] = slot[at];
+				--at;
+			}
+			scores[at] = score;
+			slot[1 + at] = (uint32_t)i;
+		}
+		slot[0] = (uint32_t)count;
+	}
+};
+#endif
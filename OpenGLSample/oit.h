@@ -0,0 +1,114 @@
+#ifndef OIT_H
+#define OIT_H
+
+#include <GL/glew.h>
+
+// Targets for weighted blended order-independent transparency (McGuire and Bavoil):
+//   attachment 0, RGBA16F: sum of premultiplied color * weight, sum of alpha * weight
+//   attachment 1, R8:      product of (1 - alpha), how much of the opaque scene still shows through
+//   depth: the scene target's own depth texture, so translucent surfaces are hidden behind opaque ones
+// Every translucent fragment is blended in with commutative operations, so the draws can come in any order;
+// a fullscreen pass then divides out the weights and blends the average color over the opaque result.
+// Both targets are window sized, matching the scene target whose depth they share, and Begin() draws into the
+// frame's scaled viewport in their lower left corner.
+class OitBuffer
+{
+public:
+	GLuint Framebuffer = 0;
+	GLuint AccumulationTexture = 0;
+	GLuint RevealageTexture = 0;
+	int Width = 0;
+	int Height = 0;
+
+	// (re)allocates the targets for a new window size; depthTexture is the opaque pass's depth
+	void Resize(int width, int height, GLuint depthTexture)
+	{
+		width = width > 0 ? width : 1;
+		height = height > 0 ? height : 1;
+		if (Framebuffer && width == Width && height == Height && depthTexture == sharedDepth)
+			return;
+
+		Destroy();
+		Width = width;
+		Height = height;
+		sharedDepth = depthTexture;
+
+		AccumulationTexture = createTexture(GL_RGBA16F, width, height);
+		RevealageTexture = createTexture(GL_R8, width, height);
+
+		glGenFramebuffers(1, &Framebuffer);
+		glBindFramebuffer(GL_FRAMEBUFFER, Framebuffer);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, AccumulationTexture, 0);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, RevealageTexture, 0);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depthTexture, 0);
+		GLenum drawBuffers[2] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+		glDrawBuffers(2, drawBuffers);
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	}
+
+	// clears the targets and sets up the blending for the translucent draws: depth tested, not written
+	void Begin(int viewportWidth, int viewportHeight)
+	{
+		static const GLfloat noColor[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+		static const GLfloat fullyRevealed[4] = { 1.0f, 0.0f, 0.0f, 0.0f };
+
+		glBindFramebuffer(GL_FRAMEBUFFER, Framebuffer);
+		glViewport(0, 0, viewportWidth, viewportHeight);
+		glClearBufferfv(GL_COLOR, 0, noColor);
+		glClearBufferfv(GL_COLOR, 1, fullyRevealed);
+
+		glEnable(GL_DEPTH_TEST);
+		glDepthMask(GL_FALSE);
+		glEnable(GL_BLEND);
+		glBlendFunci(0, GL_ONE, GL_ONE);
+		glBlendFunci(1, GL_ZERO, GL_ONE_MINUS_SRC_COLOR);
+	}
+
+	// restores the default blend and depth write state
+	void End()
+	{
+		glBlendFunc(GL_ONE, GL_ZERO);
+		glDisable(GL_BLEND);
+		glDepthMask(GL_TRUE);
+	}
+
+	// binds accumulation and revealage to two consecutive texture units for the composite pass
+	void BindTextures(GLuint firstUnit) const
+	{
+		glActiveTexture(GL_TEXTURE0 + firstUnit);
+		glBindTexture(GL_TEXTURE_2D, AccumulationTexture);
+		glActiveTexture(GL_TEXTURE0 + firstUnit + 1);
+		glBindTexture(GL_TEXTURE_2D, RevealageTexture);
+		glActiveTexture(GL_TEXTURE0);
+	}
+
+	void Destroy()
+	{
+		if (Framebuffer)
+			glDeleteFramebuffers(1, &Framebuffer);
+		GLuint textures[2] = { AccumulationTexture, RevealageTexture };
+		glDeleteTextures(2, textures);
+		Framebuffer = AccumulationTexture = RevealageTexture = 0;
+		Width = Height = 0;
+		sharedDepth = 0;
+	}
+
+private:
+	GLuint sharedDepth = 0;    // owned by the scene target
+
+	// read back 1:1 with texelFetch, so no filtering or mipmaps
+	static GLuint createTexture(GLenum internalFormat, int width, int height)
+	{
+		GLuint texture;
+		glGenTextures(1, &texture);
+		glBindTexture(GL_TEXTURE_2D, texture);
+		glTexStorage2D(GL_TEXTURE_2D, 1, internalFormat, width, height);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glBindTexture(GL_TEXTURE_2D, 0);
+		return texture;
+	}
+};
+#endif
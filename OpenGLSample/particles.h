@@ -0,0 +1,302 @@
+#ifndef PARTICLES_H
+#define PARTICLES_H
+
+#include <GL/glew.h>
+
+#include <glm/glm.hpp>
+
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "threadpool.h"
+
+#if defined(_M_X64) || defined(_M_AMD64) || defined(__SSE2__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <xmmintrin.h>
+#define PARTICLES_USE_SSE 1
+#endif
+
+// SSBO binding points shared with the particle shaders (0 - 2 are the light buffers, see clustered.h)
+const GLuint PARTICLE_BUFFER_BINDING = 3;
+const GLuint EMITTER_BUFFER_BINDING = 4;
+
+// Every emitter owns a fixed block of particles, split between flames, embers and smoke
+const int PARTICLES_PER_EMITTER = 2048;
+const int PARTICLE_GROUP_SIZE = 256;    // local_size_x of the simulation compute shader
+
+enum ParticleKind
+{
+	PARTICLE_FLAME,
+	PARTICLE_EMBER,
+	PARTICLE_SMOKE,
+	PARTICLE_KIND_COUNT
+};
+
+// First particle of each kind inside an emitter's block. Multiples of four, so an SSE lane group never mixes kinds
+const int PARTICLE_KIND_START[PARTICLE_KIND_COUNT + 1] = { 0, 1232, 1436, PARTICLES_PER_EMITTER };
+
+// How one kind of particle moves. The compute shader gets this table as uniform vec4 pairs, so the CPU and
+// GPU simulations cannot drift apart
+struct ParticleKindParams
+{
+	float lifeMin, lifeMax;     // seconds
+	float speed, speedJitter;   // upward speed at birth
+	float spread;               // horizontal speed at birth
+	float spawnHeight;          // birth height above the emitter
+	float lift;                 // upward acceleration, negative falls
+	float drag;                 // fraction of the velocity lost per second
+};
+
+const ParticleKindParams PARTICLE_KINDS[PARTICLE_KIND_COUNT] =
+{
+	{ 0.25f, 0.5f, 0.35f, 0.25f, 0.12f, 0.0f, 1.2f, 2.0f },    // flame: short lived, rises quickly
+	{ 0.8f, 1.6f, 0.9f, 0.5f, 0.6f, 0.02f, -1.5f, 0.4f },      // ember: thrown up, falls back down
+	{ 2.0f, 3.5f, 0.2f, 0.1f, 0.08f, 0.1f, 0.15f, 0.3f }       // smoke: slow, drifts and spreads
+};
+
+// std430 layout of one particle, mirrored by the Particle struct in the shaders. A particle is alive while
+// 0 <= age < lifetime; a negative age waits to be born, which staggers the first spawns
+struct GpuParticle
+{
+	glm::vec4 positionAge;        // world position, age in seconds
+	glm::vec4 velocityLifetime;   // velocity, lifetime in seconds
+};
+
+// Integer hash used for the spawn randomness, the same function as in the compute shader
+inline uint32_t ParticleHash(uint32_t x)
+{
+	x = x * 747796405u + 2891336453u;
+	uint32_t word = ((x >> ((x >> 28u) + 4u)) ^ x) * 277803737u;
+	return (word >> 22u) ^ word;
+}
+
+
+// Flame, ember and smoke particles for a set of emitters (the candle wicks). Particles live in one SSBO that
+// the billboard shader reads directly. The simulation normally runs in a compute shader, so nothing crosses the
+// bus; without it (UseCompute off) the worker threads step a structure-of-arrays copy four particles at a time
+// with SSE and upload the result. Dead particles respawn in place, so the count never changes and nothing
+// has to be allocated, compacted or sorted
+class ParticleSystem
+{
+public:
+	bool UseCompute = true;
+
+	void Create(int emitterCount, bool useCompute)
+	{
+		Destroy();
+		UseCompute = useCompute;
+		emitters = emitterCount;
+		size_t count = ParticleCount();
+
+		// everything starts unborn, with birth delays spread over one lifetime of its kind
+		particles.resize(count);
+		for (size_t i = 0; i < count; ++i)
+		{
+			const ParticleKindParams& kind = PARTICLE_KINDS[kindOf(i)];
+			float delay = (ParticleHash((uint32_t)i) >> 8) / 16777216.0f * kind.lifeMax;
+			particles[i].positionAge = glm::vec4(0.0f, 0.0f, 0.0f, -delay);
+			particles[i].velocityLifetime = glm::vec4(0.0f);
+		}
+		if (!UseCompute)
+		{
+			px.assign(count, 0.0f); py.assign(count, 0.0f); pz.assign(count, 0.0f);
+			vx.assign(count, 0.0f); vy.assign(count, 0.0f); vz.assign(count, 0.0f);
+			age.resize(count);
+			life.assign(count, 0.0f);
+			for (size_t i = 0; i < count; ++i)
+				age[i] = particles[i].positionAge.w;
+		}
+
+		glGenBuffers(1, &particleBuffer);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, particleBuffer);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, (count > 0 ? count : 1) * sizeof(GpuParticle), particles.data(),
+			UseCompute ? GL_DYNAMIC_COPY : GL_STREAM_DRAW);
+		glGenBuffers(1, &emitterBuffer);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, emitterBuffer);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, (emitters > 0 ? emitters : 1) * sizeof(glm::vec4), NULL, GL_STREAM_DRAW);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+		glGenVertexArrays(1, &vao);
+		if (UseCompute)
+			particles.clear();   // the GPU owns the particles from here on
+	}
+
+	int EmitterCount() const { return emitters; }
+	size_t ParticleCount() const { return (size_t)emitters * PARTICLES_PER_EMITTER; }
+
+	// CPU time of the last simulation step (the dispatch alone when the compute shader runs it)
+	double CpuMs() const { return cpuMs; }
+
+	// advances every particle by deltaTime; emitterPositions holds the world position of each emitter
+	void Simulate(const std::vector<glm::vec3>& emitterPositions, float deltaTime, GLuint computeProgram, ThreadPool& pool)
+	{
+		if (emitters == 0)
+			return;
+		auto start = std::chrono::steady_clock::now();
+		++frame;
+
+		if (UseCompute)
+		{
+			std::vector<glm::vec4> packed(emitters);
+			for (int i = 0; i < emitters; ++i)
+				packed[i] = glm::vec4(emitterPositions[i], 1.0f);
+			glBindBuffer(GL_SHADER_STORAGE_BUFFER, emitterBuffer);
+			glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, packed.size() * sizeof(glm::vec4), packed.data());
+			glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+			glUseProgram(computeProgram);
+			SetUniforms(computeProgram);
+			glUniform1f(glGetUniformLocation(computeProgram, "deltaTime"), deltaTime);
+			glUniform1ui(glGetUniformLocation(computeProgram, "frameSeed"), frame);
+			glUniform1ui(glGetUniformLocation(computeProgram, "particleCount"), (GLuint)ParticleCount());
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, PARTICLE_BUFFER_BINDING, particleBuffer);
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, EMITTER_BUFFER_BINDING, emitterBuffer);
+			glDispatchCompute((GLuint)((ParticleCount() + PARTICLE_GROUP_SIZE - 1) / PARTICLE_GROUP_SIZE), 1, 1);
+
+			// the billboards read the particles in their vertex shader
+			glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+		}
+		else
+		{
+			// one emitter's block per batch item; each batch also packs its particles for the upload
+			pool.ParallelFor((size_t)emitters, 4, [&](size_t begin, size_t end)
+			{
+				for (size_t emitter = begin; emitter < end; ++emitter)
+					simulateEmitter(emitter, emitterPositions[emitter], deltaTime);
+			});
+			glBindBuffer(GL_SHADER_STORAGE_BUFFER, particleBuffer);
+			glBufferData(GL_SHADER_STORAGE_BUFFER, particles.size() * sizeof(GpuParticle), NULL, GL_STREAM_DRAW);  // orphan
+			glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, particles.size() * sizeof(GpuParticle), particles.data());
+			glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+		}
+
+		cpuMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	// the block layout and motion table, read by both the compute and the billboard shaders
+	void SetUniforms(GLuint programId) const
+	{
+		glUniform1ui(glGetUniformLocation(programId, "particlesPerEmitter"), (GLuint)PARTICLES_PER_EMITTER);
+		glUniform2ui(glGetUniformLocation(programId, "kindStart"), (GLuint)PARTICLE_KIND_START[PARTICLE_EMBER], (GLuint)PARTICLE_KIND_START[PARTICLE_SMOKE]);
+		glUniform4fv(glGetUniformLocation(programId, "kindParams"), PARTICLE_KIND_COUNT * 2, &PARTICLE_KINDS[0].lifeMin);
+	}
+
+	// one camera facing quad per particle, four vertices from gl_VertexID, the particle from gl_InstanceID.
+	// The caller sets the blend state and the camera uniforms
+	void Draw(GLuint programId) const
+	{
+		if (emitters == 0)
+			return;
+		SetUniforms(programId);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, PARTICLE_BUFFER_BINDING, particleBuffer);
+		glBindVertexArray(vao);
+		glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, (GLsizei)ParticleCount());
+		glBindVertexArray(0);
+	}
+
+	void Destroy()
+	{
+		if (particleBuffer)
+			glDeleteBuffers(1, &particleBuffer);
+		if (emitterBuffer)
+			glDeleteBuffers(1, &emitterBuffer);
+		if (vao)
+			glDeleteVertexArrays(1, &vao);
+		particleBuffer = emitterBuffer = vao = 0;
+		emitters = 0;
+	}
+
+private:
+	GLuint particleBuffer = 0;
+	GLuint emitterBuffer = 0;
+	GLuint vao = 0;              // empty, the billboard corners come from gl_VertexID
+	int emitters = 0;
+	uint32_t frame = 0;
+	double cpuMs = 0.0;
+
+	// CPU simulation state, one array per field; particles doubles as the upload staging copy
+	std::vector<float> px, py, pz, vx, vy, vz, age, life;
+	std::vector<GpuParticle> particles;
+
+	static int kindOf(size_t index)
+	{
+		int local = (int)(index % PARTICLES_PER_EMITTER);
+		return local < PARTICLE_KIND_START[PARTICLE_EMBER] ? PARTICLE_FLAME : (local < PARTICLE_KIND_START[PARTICLE_SMOKE] ? PARTICLE_EMBER : PARTICLE_SMOKE);
+	}
+
+	// a new particle at the emitter, moving up and outward at a random speed
+	void respawn(size_t i, const ParticleKindParams& kind, glm::vec3 emitter)
+	{
+		uint32_t state = ParticleHash((uint32_t)i ^ ParticleHash(frame));
+		auto random = [&state]() { state = ParticleHash(state); return (state >> 8) / 16777216.0f; };
+		float angle = random() * 6.283185f;
+		float radius = random();
+		float hx = std::cos(angle) * radius * kind.spread;
+		float hz = std::sin(angle) * radius * kind.spread;
+		px[i] = emitter.x + hx * 0.2f;
+		py[i] = emitter.y + kind.spawnHeight;
+		pz[i] = emitter.z + hz * 0.2f;
+		vx[i] = hx;
+		vy[i] = kind.speed + random() * kind.speedJitter;
+		vz[i] = hz;
+		age[i] = 0.0f;
+		life[i] = kind.lifeMin + (kind.lifeMax - kind.lifeMin) * random();
+	}
+
+	void simulateEmitter(size_t emitter, glm::vec3 position, float deltaTime)
+	{
+		size_t blockStart = emitter * PARTICLES_PER_EMITTER;
+		for (int k = 0; k < PARTICLE_KIND_COUNT; ++k)
+		{
+			const ParticleKindParams& kind = PARTICLE_KINDS[k];
+			float damping = 1.0f - kind.drag * deltaTime;
+			damping = damping > 0.0f ? damping : 0.0f;
+			size_t first = blockStart + PARTICLE_KIND_START[k];
+			size_t last = blockStart + PARTICLE_KIND_START[k + 1];
+
+			for (size_t i = first; i < last; i += 4)
+			{
+#ifdef PARTICLES_USE_SSE
+				__m128 dt = _mm_set1_ps(deltaTime);
+				__m128 damp = _mm_set1_ps(damping);
+				__m128 a = _mm_add_ps(_mm_loadu_ps(&age[i]), dt);
+				__m128 vxs = _mm_mul_ps(_mm_loadu_ps(&vx[i]), damp);
+				__m128 vys = _mm_mul_ps(_mm_add_ps(_mm_loadu_ps(&vy[i]), _mm_set1_ps(kind.lift * deltaTime)), damp);
+				__m128 vzs = _mm_mul_ps(_mm_loadu_ps(&vz[i]), damp);
+				_mm_storeu_ps(&px[i], _mm_add_ps(_mm_loadu_ps(&px[i]), _mm_mul_ps(vxs, dt)));
+				_mm_storeu_ps(&py[i], _mm_add_ps(_mm_loadu_ps(&py[i]), _mm_mul_ps(vys, dt)));
+				_mm_storeu_ps(&pz[i], _mm_add_ps(_mm_loadu_ps(&pz[i]), _mm_mul_ps(vzs, dt)));
+				_mm_storeu_ps(&vx[i], vxs);
+				_mm_storeu_ps(&vy[i], vys);
+				_mm_storeu_ps(&vz[i], vzs);
+				_mm_storeu_ps(&age[i], a);
+
+				// lanes that reached the end of their life start over
+				int expired = _mm_movemask_ps(_mm_cmpge_ps(a, _mm_loadu_ps(&life[i])));
+				for (int lane = 0; expired != 0; ++lane, expired >>= 1)
+					if (expired & 1)
+						respawn(i + lane, kind, position);
+#else
+				for (size_t j = i; j < i + 4; ++j)
+				{
+					age[j] += deltaTime;
+					vx[j] *= damping;
+					vy[j] = (vy[j] + kind.lift * deltaTime) * damping;
+					vz[j] *= damping;
+					px[j] += vx[j] * deltaTime;
+					py[j] += vy[j] * deltaTime;
+					pz[j] += vz[j] * deltaTime;
+					if (age[j] >= life[j])
+						respawn(j, kind, position);
+				}
+#endif
+				for (size_t j = i; j < i + 4; ++j)
+				{
+					particles[j].positionAge = glm::vec4(px[j], py[j], pz[j], age[j]);
+					particles[j].velocityLifetime = glm::vec4(vx[j], vy[j], vz[j], life[j]);
+				}
+			}
+		}
+	}
+};
+#endif
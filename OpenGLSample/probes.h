@@ -0,0 +1,172 @@
+#ifndef PROBES_H
+#define PROBES_H
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <xmmintrin.h>
+
+// L2 spherical harmonics: 9 coefficients per color channel
+const int SH_COEFFICIENTS = 9;
+
+// Irradiance of one probe as L2 spherical harmonics, already convolved with the cosine lobe, so the light
+// arriving at a surface with normal n is simply sum(c[i] * ShBasis(n)[i]). Stored coefficient by coefficient
+// (c0.rgb, c1.rgb, ...) the way the shaders take them, padded to a whole number of SSE registers. The probes
+// live in std::vector, which does not honor the alignment before C++17, so they are read and written unaligned
+struct alignas(16) ShProbe
+{
+	float coefficients[28];   // 27 used
+};
+
+// The 9 real spherical harmonics basis functions of a unit direction
+inline void ShBasis(glm::vec3 d, float basis[SH_COEFFICIENTS])
+{
+	basis[0] = 0.282095f;
+	basis[1] = 0.488603f * d.y;
+	basis[2] = 0.488603f * d.z;
+	basis[3] = 0.488603f * d.x;
+	basis[4] = 1.092548f * d.x * d.y;
+	basis[5] = 1.092548f * d.y * d.z;
+	basis[6] = 0.315392f * (3.0f * d.z * d.z - 1.0f);
+	basis[7] = 1.092548f * d.x * d.z;
+	basis[8] = 0.546274f * (d.x * d.x - d.y * d.y);
+}
+
+// Radiance projected onto the basis, turned into irradiance: band l is scaled by the cosine lobe's pi, 2pi/3, pi/4
+inline void ShConvolveCosine(ShProbe& probe)
+{
+	static const float bands[SH_COEFFICIENTS] = { 3.141593f, 2.094395f, 2.094395f, 2.094395f, 0.785398f, 0.785398f, 0.785398f, 0.785398f, 0.785398f };
+	for (int i = 0; i < SH_COEFFICIENTS; ++i)
+		for (int c = 0; c < 3; ++c)
+			probe.coefficients[i * 3 + c] *= bands[i];
+}
+
+
+// A regular grid of irradiance probes over a box of the scene. Dynamic objects are lit by the probes around
+// their center, blended trilinearly with SSE (seven 4-wide multiply-adds per probe)
+class ProbeVolume
+{
+public:
+	glm::vec3 Min = glm::vec3(0.0f);
+	glm::vec3 Max = glm::vec3(0.0f);
+	int ResolutionX = 0, ResolutionY = 0, ResolutionZ = 0;
+	std::vector<ShProbe> Probes;
+	uint64_t Key = 0;           // what the probes were baked from
+
+	// lays out a grid with roughly spacing between probes (at least two per axis) and clears it
+	void Create(glm::vec3 boundsMin, glm::vec3 boundsMax, float spacing)
+	{
+		Min = boundsMin;
+		Max = glm::max(boundsMax, boundsMin + glm::vec3(spacing));
+		glm::vec3 size = Max - Min;
+		ResolutionX = std::max(2, (int)(size.x / spacing) + 1);
+		ResolutionY = std::max(2, (int)(size.y / spacing) + 1);
+		ResolutionZ = std::max(2, (int)(size.z / spacing) + 1);
+		ShProbe empty;
+		std::memset(&empty, 0, sizeof(empty));
+		Probes.assign((size_t)ResolutionX * ResolutionY * ResolutionZ, empty);
+	}
+
+	bool Empty() const { return Probes.empty(); }
+
+	glm::vec3 ProbePosition(size_t index) const
+	{
+		int x = (int)(index % ResolutionX);
+		int y = (int)(index / ResolutionX % ResolutionY);
+		int z = (int)(index / ((size_t)ResolutionX * ResolutionY));
+		glm::vec3 t((float)x / (ResolutionX - 1), (float)y / (ResolutionY - 1), (float)z / (ResolutionZ - 1));
+		return Min + (Max - Min) * t;
+	}
+
+	// trilinear blend of the eight probes around position (clamped to the volume)
+	void Sample(glm::vec3 position, ShProbe& result) const
+	{
+		glm::vec3 cell = glm::clamp((position - Min) / (Max - Min), 0.0f, 1.0f)
+			* glm::vec3((float)(ResolutionX - 1), (float)(ResolutionY - 1), (float)(ResolutionZ - 1));
+		int x0 = std::min((int)cell.x, ResolutionX - 2);
+		int y0 = std::min((int)cell.y, ResolutionY - 2);
+		int z0 = std::min((int)cell.z, ResolutionZ - 2);
+		float fx = cell.x - x0, fy = cell.y - y0, fz = cell.z - z0;
+
+		__m128 sum[7];
+		for (int r = 0; r < 7; ++r)
+			sum[r] = _mm_setzero_ps();
+		for (int corner = 0; corner < 8; ++corner)
+		{
+			int dx = corner & 1, dy = (corner >> 1) & 1, dz = corner >> 2;
+			float weight = (dx ? fx : 1.0f - fx) * (dy ? fy : 1.0f - fy) * (dz ? fz : 1.0f - fz);
+			const ShProbe& probe = Probes[index(x0 + dx, y0 + dy, z0 + dz)];
+			__m128 w = _mm_set1_ps(weight);
+			for (int r = 0; r < 7; ++r)
+				sum[r] = _mm_add_ps(sum[r], _mm_mul_ps(w, _mm_loadu_ps(probe.coefficients + r * 4)));
+		}
+		for (int r = 0; r < 7; ++r)
+			_mm_storeu_ps(result.coefficients + r * 4, sum[r]);
+	}
+
+private:
+	size_t index(int x, int y, int z) const
+	{
+		return ((size_t)z * ResolutionY + y) * ResolutionX + x;
+	}
+};
+
+// Probe file: "PRBV", version, key, bounds, resolution, then the probes
+inline bool SaveProbeVolume(const std::string& path, const ProbeVolume& volume)
+{
+	std::ofstream file(path, std::ios::binary);
+	if (!file)
+		return false;
+
+	const uint32_t version = 1;
+	int resolution[3] = { volume.ResolutionX, volume.ResolutionY, volume.ResolutionZ };
+	file.write("PRBV", 4);
+	file.write((const char*)&version, sizeof(version));
+	file.write((const char*)&volume.Key, sizeof(volume.Key));
+	file.write((const char*)&volume.Min[0], sizeof(glm::vec3));
+	file.write((const char*)&volume.Max[0], sizeof(glm::vec3));
+	file.write((const char*)resolution, sizeof(resolution));
+	file.write((const char*)volume.Probes.data(), volume.Probes.size() * sizeof(ShProbe));
+	return (bool)file;
+}
+
+inline bool LoadProbeVolume(const std::string& path, ProbeVolume& volume)
+{
+	std::ifstream file(path, std::ios::binary);
+	if (!file)
+		return false;
+
+	char magic[4];
+	uint32_t version = 0;
+	int resolution[3] = { 0, 0, 0 };
+	file.read(magic, 4);
+	file.read((char*)&version, sizeof(version));
+	file.read((char*)&volume.Key, sizeof(volume.Key));
+	file.read((char*)&volume.Min[0], sizeof(glm::vec3));
+	file.read((char*)&volume.Max[0], sizeof(glm::vec3));
+	file.read((char*)resolution, sizeof(resolution));
+	if (!file || std::memcmp(magic, "PRBV", 4) != 0 || version != 1)
+		return false;
+	for (int axis = 0; axis < 3; ++axis)
+		if (resolution[axis] < 2 || resolution[axis] > 256)
+			return false;
+
+	volume.ResolutionX = resolution[0];
+	volume.ResolutionY = resolution[1];
+	volume.ResolutionZ = resolution[2];
+	volume.Probes.resize((size_t)resolution[0] * resolution[1] * resolution[2]);
+	file.read((char*)volume.Probes.data(), volume.Probes.size() * sizeof(ShProbe));
+	if (!file)
+	{
+		volume.Probes.clear();
+		return false;
+	}
+	return true;
+}
+#endif
@@ -0,0 +1,219 @@
+#ifndef SCENEGRAPH_H
+#define SCENEGRAPH_H
+
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <vector>
+
+// Handle to a node in the scene graph. Handles stay valid when the graph re-orders its storage
+typedef int SceneNode;
+
+const SceneNode NO_PARENT = -1;
+
+
+// A transform hierarchy that caches every node's world matrix. Node data is kept as a structure of arrays
+// sorted breadth-first (parents always before their children), so an update is a single forward pass that
+// only touches the nodes at or after the first dirty one and only recomputes the dirty subtrees.
+class SceneGraph
+{
+public:
+	// adds a node below parent (or at the root when parent is NO_PARENT) with the given local translation,
+	// rotation (euler angles in degrees) and scale, and returns its handle
+	SceneNode AddNode(SceneNode parent, glm::vec3 position = glm::vec3(0.0f), glm::vec3 rotation = glm::vec3(0.0f), glm::vec3 scale = glm::vec3(1.0f))
+	{
+		SceneNode node = (SceneNode)slotOf.size();
+		int slot = (int)parents.size();
+		int depth = parent == NO_PARENT ? 0 : depths[slotOf[parent]] + 1;
+
+		// appending keeps the breadth-first order only if nothing deeper has been added yet
+		if (slot > 0 && depth < depths[slot - 1])
+			orderDirty = true;
+
+		slotOf.push_back(slot);
+		nodeOf.push_back(node);
+		parents.push_back(parent == NO_PARENT ? NO_PARENT : slotOf[parent]);
+		depths.push_back(depth);
+		positions.push_back(position);
+		rotations.push_back(rotation);
+		scales.push_back(scale);
+		locals.push_back(glm::mat4(1.0f));
+		worlds.push_back(glm::mat4(1.0f));
+		dirtyFlags.push_back(1);
+		changedFlags.push_back(0);
+
+		markDirty(slot);
+		return node;
+	}
+
+	// local transform setters: they only flag the node, the matrices are rebuilt by Update()
+	void SetLocalPosition(SceneNode node, glm::vec3 position)
+	{
+		int slot = slotOf[node];
+		positions[slot] = position;
+		markDirty(slot);
+	}
+
+	void SetLocalRotation(SceneNode node, glm::vec3 rotation)
+	{
+		int slot = slotOf[node];
+		rotations[slot] = rotation;
+		markDirty(slot);
+	}
+
+	void SetLocalScale(SceneNode node, glm::vec3 scale)
+	{
+		int slot = slotOf[node];
+		scales[slot] = scale;
+		markDirty(slot);
+	}
+
+	glm::vec3 GetLocalPosition(SceneNode node) const { return positions[slotOf[node]]; }
+	glm::vec3 GetLocalRotation(SceneNode node) const { return rotations[slotOf[node]]; }
+	glm::vec3 GetLocalScale(SceneNode node) const { return scales[slotOf[node]]; }
+
+	// returns the cached world matrix computed by the last Update()
+	const glm::mat4& GetWorldMatrix(SceneNode node) const { return worlds[slotOf[node]]; }
+
+	// true if the node's world matrix was recomputed by the last Update()
+	bool WorldChanged(SceneNode node) const { return changedFlags[slotOf[node]] != 0; }
+
+	size_t NodeCount() const { return parents.size(); }
+
+	// recomputes the world matrices of the dirty subtrees and returns how many nodes were recomputed.
+	// When nothing was touched since the last call this returns straight away
+	int Update()
+	{
+		// clear the changed flags left over from the previous update
+		if (changedBegin < (int)changedFlags.size())
+		{
+			for (int slot = changedBegin; slot < (int)changedFlags.size(); ++slot)
+				changedFlags[slot] = 0;
+			changedBegin = (int)changedFlags.size();
+		}
+
+		if (firstDirty >= (int)parents.size())
+			return 0;
+
+		if (orderDirty)
+			sortBreadthFirst();
+
+		// nodes before the first dirty one cannot be affected: their ancestors come even earlier
+		int recomputed = 0;
+		int count = (int)parents.size();
+		for (int slot = firstDirty; slot < count; ++slot)
+		{
+			int parent = parents[slot];
+			bool parentChanged = parent != NO_PARENT && changedFlags[parent];
+			if (!dirtyFlags[slot] && !parentChanged)
+				continue;
+
+			if (dirtyFlags[slot])
+			{
+				locals[slot] = composeLocal(positions[slot], rotations[slot], scales[slot]);
+				dirtyFlags[slot] = 0;
+			}
+
+			worlds[slot] = parent == NO_PARENT ? locals[slot] : worlds[parent] * locals[slot];
+			changedFlags[slot] = 1;
+			++recomputed;
+		}
+
+		changedBegin = firstDirty;
+		firstDirty = count;
+		return recomputed;
+	}
+
+private:
+	// node attributes indexed by storage slot (breadth-first order)
+	std::vector<int> parents;          // slot of the parent node, or NO_PARENT
+	std::vector<int> depths;           // distance from the root
+	std::vector<glm::vec3> positions;  // local translation
+	std::vector<glm::vec3> rotations;  // local euler angles in degrees
+	std::vector<glm::vec3> scales;     // local scale
+	std::vector<glm::mat4> locals;     // cached local matrix
+	std::vector<glm::mat4> worlds;     // cached world matrix
+	std::vector<unsigned char> dirtyFlags;   // local transform edited since the last update
+	std::vector<unsigned char> changedFlags; // world matrix recomputed by the last update
+
+	// handle <-> slot mapping
+	std::vector<int> slotOf;
+	std::vector<SceneNode> nodeOf;
+
+	int firstDirty = 0;        // lowest dirty slot, or the node count when nothing is dirty
+	int changedBegin = 0;      // lowest slot whose changed flag may still be set
+	bool orderDirty = false;   // storage is no longer breadth-first and must be re-sorted
+
+	void markDirty(int slot)
+	{
+		dirtyFlags[slot] = 1;
+		if (slot < firstDirty)
+			firstDirty = slot;
+	}
+
+	// builds the local matrix: translation * rotation (y, x, z) * scale, skipping the identity parts
+	static glm::mat4 composeLocal(const glm::vec3& position, const glm::vec3& rotation, const glm::vec3& scale)
+	{
+		glm::mat4 local = glm::translate(glm::mat4(1.0f), position);
+		if (rotation.y != 0.0f)
+			local = glm::rotate(local, glm::radians(rotation.y), glm::vec3(0.0f, 1.0f, 0.0f));
+		if (rotation.x != 0.0f)
+			local = glm::rotate(local, glm::radians(rotation.x), glm::vec3(1.0f, 0.0f, 0.0f));
+		if (rotation.z != 0.0f)
+			local = glm::rotate(local, glm::radians(rotation.z), glm::vec3(0.0f, 0.0f, 1.0f));
+		if (scale != glm::vec3(1.0f))
+			local = glm::scale(local, scale);
+		return local;
+	}
+
+	template <typename T>
+	static void permute(std::vector<T>& values, const std::vector<int>& newSlotOf)
+	{
+		std::vector<T> sorted(values.size());
+		for (size_t slot = 0; slot < values.size(); ++slot)
+			sorted[newSlotOf[slot]] = values[slot];
+		values.swap(sorted);
+	}
+
+	// stable counting sort of the storage by depth, used when a node was added above an existing level
+	void sortBreadthFirst()
+	{
+		int count = (int)parents.size();
+		int maxDepth = 0;
+		for (int slot = 0; slot < count; ++slot)
+			maxDepth = depths[slot] > maxDepth ? depths[slot] : maxDepth;
+
+		std::vector<int> levelStart(maxDepth + 2, 0);
+		for (int slot = 0; slot < count; ++slot)
+			++levelStart[depths[slot] + 1];
+		for (int level = 1; level <= maxDepth + 1; ++level)
+			levelStart[level] += levelStart[level - 1];
+
+		std::vector<int> newSlot(count);
+		for (int slot = 0; slot < count; ++slot)
+			newSlot[slot] = levelStart[depths[slot]]++;
+
+		for (int slot = 0; slot < count; ++slot)
+			if (parents[slot] != NO_PARENT)
+				parents[slot] = newSlot[parents[slot]];
+
+		permute(parents, newSlot);
+		permute(depths, newSlot);
+		permute(positions, newSlot);
+		permute(rotations, newSlot);
+		permute(scales, newSlot);
+		permute(locals, newSlot);
+		permute(worlds, newSlot);
+		permute(dirtyFlags, newSlot);
+		permute(changedFlags, newSlot);
+		permute(nodeOf, newSlot);
+		for (int slot = 0; slot < count; ++slot)
+			slotOf[nodeOf[slot]] = slot;
+
+		// every node may have moved, so the next pass has to start from the top
+		firstDirty = 0;
+		changedBegin = 0;
+		orderDirty = false;
+	}
+};
+#endif
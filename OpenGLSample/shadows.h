@@ -0,0 +1,222 @@
+#ifndef SHADOWS_H
+#define SHADOWS_H
+
+#include <GL/glew.h>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+// Point light shadows: one cube map per shadowed light, all in one cube map array
+const int POINT_SHADOW_SIZE = 512;
+const int MAX_POINT_SHADOWS = 4;
+
+// Directional light shadows: cascades covering successive depth ranges of the view, in one 2D array
+const int CASCADE_COUNT = 3;
+const int CASCADE_SIZE = 1024;
+
+// Texture units the lighting shaders read the shadow maps from (0 - 3 are taken by material, lightmap and G-buffer textures)
+const GLuint POINT_SHADOW_TEXTURE_UNIT = 4;
+const GLuint CASCADE_SHADOW_TEXTURE_UNIT = 5;
+
+// View-projection of one cube face around a point light, in the GL face order +X, -X, +Y, -Y, +Z, -Z
+inline glm::mat4 CubeFaceViewProjection(glm::vec3 position, int face, float farPlane)
+{
+	static const glm::vec3 directions[6] = {
+		glm::vec3(1.0f, 0.0f, 0.0f), glm::vec3(-1.0f, 0.0f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f),
+		glm::vec3(0.0f, -1.0f, 0.0f), glm::vec3(0.0f, 0.0f, 1.0f), glm::vec3(0.0f, 0.0f, -1.0f)
+	};
+	static const glm::vec3 ups[6] = {
+		glm::vec3(0.0f, -1.0f, 0.0f), glm::vec3(0.0f, -1.0f, 0.0f), glm::vec3(0.0f, 0.0f, 1.0f),
+		glm::vec3(0.0f, 0.0f, -1.0f), glm::vec3(0.0f, -1.0f, 0.0f), glm::vec3(0.0f, -1.0f, 0.0f)
+	};
+	glm::mat4 projection = glm::perspective(glm::radians(90.0f), 1.0f, 0.05f, farPlane);
+	return projection * glm::lookAt(position, position + directions[face], ups[face]);
+}
+
+
+// Light space matrices and split depths of the cascades for one view
+struct Cascades
+{
+	glm::mat4 viewProjection[CASCADE_COUNT];
+	float splitDepth[CASCADE_COUNT];       // far view depth covered by each cascade
+};
+
+// Splits [nearPlane, shadowDistance] between the cascades (halfway between uniform and logarithmic spacing) and
+// fits an orthographic light view around each slice of the camera frustum. Each slice is enclosed in a sphere and
+// the light view is snapped to whole texels, so the maps stay put while the camera rotates or moves by less than
+// a texel; that is what lets the static casters stay cached. Works for perspective and orthographic projections.
+inline void ComputeCascades(const glm::mat4& view, const glm::mat4& projection, float nearPlane, float shadowDistance,
+	glm::vec3 lightDirection, Cascades& cascades)
+{
+	glm::mat4 inverseProjection = glm::inverse(projection);
+	glm::mat4 inverseView = glm::inverse(view);
+	lightDirection = glm::normalize(lightDirection);
+	glm::vec3 up = std::fabs(lightDirection.y) > 0.99f ? glm::vec3(0.0f, 0.0f, 1.0f) : glm::vec3(0.0f, 1.0f, 0.0f);
+
+	// view space rays through the four screen corners, from the near to the far plane
+	glm::vec3 rayStart[4], rayEnd[4];
+	for (int corner = 0; corner < 4; ++corner)
+	{
+		float x = (corner & 1) ? 1.0f : -1.0f;
+		float y = (corner & 2) ? 1.0f : -1.0f;
+		glm::vec4 a = inverseProjection * glm::vec4(x, y, -1.0f, 1.0f);
+		glm::vec4 b = inverseProjection * glm::vec4(x, y, 1.0f, 1.0f);
+		rayStart[corner] = glm::vec3(a) / a.w;
+		rayEnd[corner] = glm::vec3(b) / b.w;
+	}
+
+	float sliceNear = nearPlane;
+	for (int cascade = 0; cascade < CASCADE_COUNT; ++cascade)
+	{
+		float fraction = (float)(cascade + 1) / CASCADE_COUNT;
+		float logarithmic = nearPlane * std::pow(shadowDistance / nearPlane, fraction);
+		float uniform = nearPlane + (shadowDistance - nearPlane) * fraction;
+		float sliceFar = 0.5f * (logarithmic + uniform);
+
+		// world space corners of the slice
+		glm::vec3 corners[8];
+		glm::vec3 center(0.0f);
+		for (int corner = 0; corner < 4; ++corner)
+		{
+			glm::vec3 ray = rayEnd[corner] - rayStart[corner];
+			float depths[2] = { sliceNear, sliceFar };
+			for (int end = 0; end < 2; ++end)
+			{
+				float t = (depths[end] + rayStart[corner].z) / (-ray.z);
+				glm::vec3 point = glm::vec3(inverseView * glm::vec4(rayStart[corner] + ray * t, 1.0f));
+				corners[corner * 2 + end] = point;
+				center += point;
+			}
+		}
+		center /= 8.0f;
+
+		float radius = 0.0f;
+		for (const glm::vec3& corner : corners)
+			radius = std::fmax(radius, glm::length(corner - center));
+		radius = std::ceil(radius * 16.0f) / 16.0f;    // quantized, so the texel size does not flicker
+
+		// snap the center to the texel grid of the light view
+		glm::mat4 lightView = glm::lookAt(glm::vec3(0.0f), lightDirection, up);
+		glm::vec3 lightSpaceCenter = glm::vec3(lightView * glm::vec4(center, 1.0f));
+		float texelSize = 2.0f * radius / CASCADE_SIZE;
+		lightSpaceCenter.x = std::floor(lightSpaceCenter.x / texelSize) * texelSize;
+		lightSpaceCenter.y = std::floor(lightSpaceCenter.y / texelSize) * texelSize;
+
+		// casters up to 20 units beyond the slice toward the light still throw shadows into it
+		glm::mat4 lightProjection = glm::ortho(lightSpaceCenter.x - radius, lightSpaceCenter.x + radius,
+			lightSpaceCenter.y - radius, lightSpaceCenter.y + radius, -lightSpaceCenter.z - radius - 20.0f, -lightSpaceCenter.z + radius);
+
+		cascades.viewProjection[cascade] = lightProjection * lightView;
+		cascades.splitDepth[cascade] = sliceFar;
+		sliceNear = sliceFar;
+	}
+}
+
+
+// A layered depth texture with a second copy that only holds the static casters. The static copy is
+// re-rendered for a layer only when its key (the light's placement) or the static caster version changes;
+// every other frame the layer is refreshed by copying the static copy and drawing just the dynamic casters
+// on top, and when there are no dynamic casters nothing is drawn at all.
+class ShadowMapArray
+{
+public:
+	GLuint Texture = 0;         // sampled by the lighting shaders
+	GLuint StaticTexture = 0;   // static casters only
+	int Size = 0;
+	int Layers = 0;
+
+	// target is GL_TEXTURE_CUBE_MAP_ARRAY (six layers per map) or GL_TEXTURE_2D_ARRAY
+	void Create(GLenum textureTarget, int size, int layers)
+	{
+		Destroy();
+		target = textureTarget;
+		Size = size;
+		Layers = layers;
+		Texture = createTexture();
+		StaticTexture = createTexture();
+		keys.assign(layers, glm::mat4(0.0f));
+		versions.assign(layers, ~(uint64_t)0);
+		glGenFramebuffers(1, &framebuffer);
+	}
+
+	// true if the static casters of the layer have to be drawn again
+	bool NeedsStaticRender(int layer, const glm::mat4& key, uint64_t staticVersion) const
+	{
+		return versions[layer] != staticVersion || keys[layer] != key;
+	}
+
+	void MarkStaticRendered(int layer, const glm::mat4& key, uint64_t staticVersion)
+	{
+		keys[layer] = key;
+		versions[layer] = staticVersion;
+	}
+
+	// forgets every cached layer, e.g. when a light was removed or its slot reassigned
+	void Invalidate()
+	{
+		versions.assign(Layers, ~(uint64_t)0);
+	}
+
+	// binds one layer of the static or the live texture as the depth target; clears it when asked
+	void BeginLayer(bool staticCopy, int layer, bool clear)
+	{
+		glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+		glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, staticCopy ? StaticTexture : Texture, 0, layer);
+		glDrawBuffer(GL_NONE);
+		glReadBuffer(GL_NONE);
+		glViewport(0, 0, Size, Size);
+		if (clear)
+			glClear(GL_DEPTH_BUFFER_BIT);
+	}
+
+	// copies layers of the static texture into the live one
+	void CopyStaticLayers(int firstLayer, int count)
+	{
+		glCopyImageSubData(StaticTexture, target, 0, 0, 0, firstLayer, Texture, target, 0, 0, 0, firstLayer, Size, Size, count);
+	}
+
+	void Bind(GLuint unit) const
+	{
+		glActiveTexture(GL_TEXTURE0 + unit);
+		glBindTexture(target, Texture);
+		glActiveTexture(GL_TEXTURE0);
+	}
+
+	void Destroy()
+	{
+		if (framebuffer)
+			glDeleteFramebuffers(1, &framebuffer);
+		GLuint textures[2] = { Texture, StaticTexture };
+		glDeleteTextures(2, textures);
+		framebuffer = Texture = StaticTexture = 0;
+	}
+
+private:
+	GLenum target = GL_TEXTURE_2D_ARRAY;
+	GLuint framebuffer = 0;
+	std::vector<glm::mat4> keys;
+	std::vector<uint64_t> versions;
+
+	// depth texture with hardware depth comparison, so the shaders get filtered lit/shadowed results
+	GLuint createTexture()
+	{
+		GLuint texture;
+		glGenTextures(1, &texture);
+		glBindTexture(target, texture);
+		glTexStorage3D(target, 1, GL_DEPTH_COMPONENT24, Size, Size, Layers);
+		glTexParameteri(target, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(target, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(target, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(target, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexParameteri(target, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+		glTexParameteri(target, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+		glTexParameteri(target, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+		glBindTexture(target, 0);
+		return texture;
+	}
+};
+#endif
@@ -0,0 +1,184 @@
+#ifndef SSAO_H
+#define SSAO_H
+
+#include <GL/glew.h>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/type_ptr.hpp>
+
+// Texture unit the lighting shaders read the ambient occlusion from (see shadows.h for the units below it)
+const GLuint AMBIENT_OCCLUSION_TEXTURE_UNIT = 6;
+
+// Screen space ambient occlusion from the depth buffer alone, so it works for the forward path (after the
+// depth pre-pass) as well as the deferred one. Occlusion is estimated at half or quarter resolution, then a
+// resolve pass brings it to full resolution with a depth-aware bilateral upsample and blends it with last
+// frame's result, reprojected, so few samples per pixel are enough. The cost is fixed by the resolution
+// divisor and sample count, picked together with SetQuality.
+//   reduced resolution, R8: raw occlusion
+//   full resolution, R8 x2: resolved occlusion, ping-ponged as this frame's output and next frame's history
+// The full resolution textures are window sized; Compute() works on the scaled viewport it is given and
+// remembers last frame's, so the history is read at the scale it was written with.
+class AmbientOcclusion
+{
+public:
+	int Divisor = 2;             // 2 for half resolution, 4 for quarter
+	int SampleCount = 8;
+	float Radius = 0.4f;         // world units
+	float Intensity = 1.0f;
+	float HistoryWeight = 0.9f;  // share of last frame in the result
+	int Width = 0;               // allocated (window) size
+	int Height = 0;
+
+	// quality/performance knob: 1 quarter resolution with 6 samples, 2 half resolution with 8, 3 half with 16
+	void SetQuality(int level)
+	{
+		static const int divisors[3] = { 4, 2, 2 };
+		static const int samples[3] = { 6, 8, 16 };
+		level = level < 1 ? 1 : (level > 3 ? 3 : level);
+		Divisor = divisors[level - 1];
+		SampleCount = samples[level - 1];
+	}
+
+	// (re)allocates the targets for a new window size or divisor
+	void Resize(int width, int height)
+	{
+		width = width > 0 ? width : 1;
+		height = height > 0 ? height : 1;
+		if (rawFramebuffer && width == Width && height == Height && Divisor == allocatedDivisor)
+			return;
+
+		Destroy();
+		Width = width;
+		Height = height;
+		allocatedDivisor = Divisor;
+
+		rawTexture = createTexture((width + Divisor - 1) / Divisor, (height + Divisor - 1) / Divisor, GL_NEAREST);
+		rawFramebuffer = createFramebuffer(rawTexture);
+		for (int i = 0; i < 2; ++i)
+		{
+			historyTextures[i] = createTexture(width, height, GL_LINEAR);
+			historyFramebuffers[i] = createFramebuffer(historyTextures[i]);
+		}
+		historyValid = false;
+	}
+
+	// estimates the occlusion for the rendered rectangle of depthTexture and resolves it into the current
+	// output. Uses texture units 0 - 2 and leaves the resolve framebuffer bound; the caller disables depth testing
+	void Compute(GLuint depthTexture, int viewportWidth, int viewportHeight, const glm::mat4& projection, const glm::mat4& view,
+		GLuint occlusionProgram, GLuint resolveProgram, GLuint fullscreenVao)
+	{
+		glm::mat4 inverseProjection = glm::inverse(projection);
+		glm::vec2 viewportSize((float)viewportWidth, (float)viewportHeight);
+
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_2D, depthTexture);
+		glActiveTexture(GL_TEXTURE1);
+		glBindTexture(GL_TEXTURE_2D, rawTexture);
+		glActiveTexture(GL_TEXTURE2);
+		glBindTexture(GL_TEXTURE_2D, historyTextures[current]);
+		glActiveTexture(GL_TEXTURE0);
+		glBindVertexArray(fullscreenVao);
+
+		// raw occlusion at the reduced resolution
+		glBindFramebuffer(GL_FRAMEBUFFER, rawFramebuffer);
+		glViewport(0, 0, (viewportWidth + Divisor - 1) / Divisor, (viewportHeight + Divisor - 1) / Divisor);
+		glUseProgram(occlusionProgram);
+		glUniform1i(glGetUniformLocation(occlusionProgram, "depthTexture"), 0);
+		glUniformMatrix4fv(glGetUniformLocation(occlusionProgram, "projection"), 1, GL_FALSE, glm::value_ptr(projection));
+		glUniformMatrix4fv(glGetUniformLocation(occlusionProgram, "inverseProjection"), 1, GL_FALSE, glm::value_ptr(inverseProjection));
+		glUniform2fv(glGetUniformLocation(occlusionProgram, "viewportSize"), 1, glm::value_ptr(viewportSize));
+		glUniform1i(glGetUniformLocation(occlusionProgram, "divisor"), Divisor);
+		glUniform1i(glGetUniformLocation(occlusionProgram, "sampleCount"), SampleCount);
+		glUniform1f(glGetUniformLocation(occlusionProgram, "radius"), Radius);
+		glUniform1f(glGetUniformLocation(occlusionProgram, "intensity"), Intensity);
+		glUniform1ui(glGetUniformLocation(occlusionProgram, "frameIndex"), frame++);
+		glDrawArrays(GL_TRIANGLES, 0, 3);
+
+		// bilateral upsample and temporal blend into the other history texture
+		int next = 1 - current;
+		glm::mat4 viewProjection = projection * view;
+		glBindFramebuffer(GL_FRAMEBUFFER, historyFramebuffers[next]);
+		glViewport(0, 0, viewportWidth, viewportHeight);
+		glUseProgram(resolveProgram);
+		glUniform1i(glGetUniformLocation(resolveProgram, "depthTexture"), 0);
+		glUniform1i(glGetUniformLocation(resolveProgram, "rawOcclusion"), 1);
+		glUniform1i(glGetUniformLocation(resolveProgram, "historyOcclusion"), 2);
+		glUniform2fv(glGetUniformLocation(resolveProgram, "viewportSize"), 1, glm::value_ptr(viewportSize));
+		glUniform1i(glGetUniformLocation(resolveProgram, "divisor"), Divisor);
+		glUniformMatrix4fv(glGetUniformLocation(resolveProgram, "inverseProjection"), 1, GL_FALSE, glm::value_ptr(inverseProjection));
+		glUniformMatrix4fv(glGetUniformLocation(resolveProgram, "inverseView"), 1, GL_FALSE, glm::value_ptr(glm::inverse(view)));
+		glUniformMatrix4fv(glGetUniformLocation(resolveProgram, "previousViewProjection"), 1, GL_FALSE, glm::value_ptr(previousViewProjection));
+		glUniform2f(glGetUniformLocation(resolveProgram, "historyScale"), previousViewport.x / Width, previousViewport.y / Height);
+		glUniform1i(glGetUniformLocation(resolveProgram, "historyValid"), historyValid);
+		glUniform1f(glGetUniformLocation(resolveProgram, "historyWeight"), HistoryWeight);
+		glDrawArrays(GL_TRIANGLES, 0, 3);
+		glBindVertexArray(0);
+
+		current = next;
+		previousViewProjection = viewProjection;
+		previousViewport = viewportSize;
+		historyValid = true;
+	}
+
+	// binds this frame's full resolution occlusion for the lighting shaders
+	void Bind(GLuint unit) const
+	{
+		glActiveTexture(GL_TEXTURE0 + unit);
+		glBindTexture(GL_TEXTURE_2D, historyTextures[current]);
+		glActiveTexture(GL_TEXTURE0);
+	}
+
+	// drops the history, e.g. after the occlusion was off for a while
+	void Invalidate() { historyValid = false; }
+
+	void Destroy()
+	{
+		GLuint framebuffers[3] = { rawFramebuffer, historyFramebuffers[0], historyFramebuffers[1] };
+		GLuint textures[3] = { rawTexture, historyTextures[0], historyTextures[1] };
+		if (rawFramebuffer)
+		{
+			glDeleteFramebuffers(3, framebuffers);
+			glDeleteTextures(3, textures);
+		}
+		rawFramebuffer = rawTexture = 0;
+		historyFramebuffers[0] = historyFramebuffers[1] = historyTextures[0] = historyTextures[1] = 0;
+		Width = Height = 0;
+	}
+
+private:
+	int allocatedDivisor = 0;
+	GLuint rawTexture = 0;
+	GLuint rawFramebuffer = 0;
+	GLuint historyTextures[2] = { 0, 0 };
+	GLuint historyFramebuffers[2] = { 0, 0 };
+	int current = 0;             // history texture holding the latest result
+	bool historyValid = false;
+	glm::mat4 previousViewProjection = glm::mat4(1.0f);
+	glm::vec2 previousViewport = glm::vec2(1.0f);
+	GLuint frame = 0;            // rotates the sample pattern, so the history averages different samples
+
+	static GLuint createTexture(int width, int height, GLint filter)
+	{
+		GLuint texture;
+		glGenTextures(1, &texture);
+		glBindTexture(GL_TEXTURE_2D, texture);
+		glTexStorage2D(GL_TEXTURE_2D, 1, GL_R8, width, height);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, filter);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glBindTexture(GL_TEXTURE_2D, 0);
+		return texture;
+	}
+
+	static GLuint createFramebuffer(GLuint texture)
+	{
+		GLuint framebuffer;
+		glGenFramebuffers(1, &framebuffer);
+		glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture, 0);
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		return framebuffer;
+	}
+};
+#endif
@@ -0,0 +1,426 @@
+#ifndef TEXTURECACHE_H
+#define TEXTURECACHE_H
+
+#include <GL/glew.h>
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "textureloader.h"
+#include "threadpool.h"
+
+// A texture that turned out to hold the same image as another one: every user of From should switch to To.
+// From has already been deleted
+struct TextureRedirect
+{
+	GLuint From;
+	GLuint To;
+};
+
+// Shared textures, reference counted. Acquire() returns the texture already loaded (or loading) for a path, so
+// a file used by several materials is decoded, uploaded and stored once. Files with different paths but
+// identical pixels are found by the content hash once decoded: the later one is dropped before its upload and
+// redirected to the first, which the caller applies to its materials. Textures are loaded with a TextureLoader,
+// so they show a placeholder until their image is in.
+// The cache also keeps the textures within a GPU memory budget. The caller reports every frame which textures it
+// draws and how many pixels they cover (NoteUse); when the resident mip levels exceed the budget, the largest
+// levels of the textures that went unused the longest, or that show more detail than their screen size needs,
+// are dropped, and they are loaded again once they are wanted and fit. Immutable storage cannot lose levels in
+// place, so dropping or restoring levels replaces the texture, which reaches the materials as a redirect
+class TextureCache
+{
+public:
+	// the texture for path, loading it on first use. averageColor, when given, receives the mean color of the
+	// image once it is decoded (at once when it already is) and must stay valid until then
+	GLuint Acquire(const std::string& path, ThreadPool& pool, glm::vec3* averageColor = nullptr)
+	{
+		std::string key = normalize(path);
+		auto found = byPath.find(key);
+		if (found != byPath.end())
+		{
+			Entry& entry = entries[found->second];
+			++entry.references;
+			++entry.acquisitions;
+			++pathHits;
+			if (averageColor && entry.loaded)
+				*averageColor = entry.averageColor;
+			else if (averageColor)
+				entry.colorTargets.push_back(averageColor);
+			return found->second;
+		}
+
+		GLuint texture = loader.Load(path, pool);
+		Entry& entry = entries[texture];
+		entry.paths.push_back(key);
+		if (averageColor)
+			entry.colorTargets.push_back(averageColor);
+		byPath[key] = texture;
+		return texture;
+	}
+
+	// drops one reference; the texture is deleted with the last one
+	void Release(GLuint texture)
+	{
+		auto found = entries.find(texture);
+		if (found == entries.end() || --found->second.references > 0)
+			return;
+		if (found->second.loaded)
+			erase(texture);     // one still decoding is deleted when it arrives
+	}
+
+	// uploads up to maxUploadBytes of the decoded images (see TextureLoader::Update) and appends the textures that
+	// were merged into an identical one to redirects; returns how many textures changed
+	int Update(size_t maxUploadBytes, std::vector<TextureRedirect>& redirects)
+	{
+		return loader.Update(maxUploadBytes, [this, &redirects](GLuint texture, const DecodedImage& image)
+		{
+			auto restore = restores.find(texture);
+			if (restore != restores.end())
+				return restored(texture, restore->second, redirects);
+
+			Entry& entry = entries[texture];
+			entry.loaded = true;
+			entry.averageColor = image.averageColor;
+			entry.contentHash = image.contentHash;
+			entry.bytes = image.gpuBytes;
+			entry.width = image.width;
+			entry.height = image.height;
+			entry.levelCount = image.LevelCount();
+			entry.levelBytes.resize(entry.levelCount);
+			for (int level = 0; level < entry.levelCount; ++level)
+				entry.levelBytes[level] = image.LevelBytes(level);
+			for (glm::vec3* target : entry.colorTargets)
+				*target = image.averageColor;
+			entry.colorTargets.clear();
+
+			if (entry.references == 0)
+			{
+				erase(texture);
+				return false;
+			}
+
+			auto original = byContent.find(image.contentHash);
+			if (original == byContent.end())
+			{
+				byContent[image.contentHash] = texture;
+				return true;
+			}
+
+			// same image under another path: hand this texture's paths and users over to the first one
+			Entry& shared = entries[original->second];
+			shared.references += entry.references;
+			shared.acquisitions += entry.acquisitions;
+			for (const std::string& path : entry.paths)
+			{
+				shared.paths.push_back(path);
+				byPath[path] = original->second;
+			}
+			++contentHits;
+			redirects.push_back({ texture, original->second });
+			glDeleteTextures(1, &texture);
+			entries.erase(texture);
+			return false;
+		});
+	}
+
+	// records that texture is drawn in frame, spanning about screenSize pixels per repeat of its image; the
+	// largest level it needs is the one with about as many texels
+	void NoteUse(GLuint texture, float screenSize, unsigned long long frame)
+	{
+		auto found = entries.find(texture);
+		if (found == entries.end() || !found->second.loaded)
+			return;
+		Entry& entry = found->second;
+		float texels = (float)std::max(entry.width, entry.height);
+		int level = (int)std::floor(std::log2(texels / std::max(screenSize, 1.0f)));
+		level = std::min(std::max(level, 0), entry.levelCount - 1);
+		if (entry.lastUsed != frame)
+			entry.wantedLevel = level;
+		else
+			entry.wantedLevel = std::min(entry.wantedLevel, level);
+		entry.lastUsed = frame;
+	}
+
+	// brings the resident levels back within the budget, or streams wanted levels back in while they fit; frame
+	// is the one about to be drawn, so the textures noted in the frame before it are the ones on screen. Appends
+	// the textures that were replaced to redirects; returns how many were
+	int UpdateResidency(ThreadPool& pool, unsigned long long frame, std::vector<TextureRedirect>& redirects)
+	{
+		size_t resident = ResidentBytes();
+		int changed = 0;
+
+		// over the budget: the longest unused first, then those with the most detail to spare. Textures on
+		// screen that need all of theirs lose one level per frame, so the scene blurs gradually
+		if (resident > budget)
+		{
+			std::vector<GLuint> candidates;
+			for (const auto& entry : entries)
+				if (entry.second.loaded && !entry.second.restoring && entry.second.topLevel < entry.second.levelCount - 1
+					&& !loader.Streaming(entry.first))
+					candidates.push_back(entry.first);
+			std::sort(candidates.begin(), candidates.end(), [this](GLuint a, GLuint b)
+			{
+				const Entry& first = entries[a];
+				const Entry& second = entries[b];
+				if (first.lastUsed != second.lastUsed)
+					return first.lastUsed < second.lastUsed;
+				return first.wantedLevel - first.topLevel > second.wantedLevel - second.topLevel;
+			});
+			for (size_t i = 0; i < candidates.size() && resident > budget; ++i)
+			{
+				const Entry& entry = entries[candidates[i]];
+				bool onScreen = entry.lastUsed + 1 >= frame;
+				int top = onScreen ? std::max(entry.topLevel + 1, entry.wantedLevel) : entry.levelCount - 1;
+				top = std::min(top, entry.levelCount - 1);
+				size_t before = entry.bytes;
+				GLuint smaller = shrink(candidates[i], top, redirects);
+				resident -= before - entries[smaller].bytes;
+				++changed;
+			}
+			return changed;
+		}
+
+		// within it: load the missing levels of the textures on screen, while they fit with room to spare, so
+		// a restore does not push the next frame over and straight into another eviction
+		size_t headroom = budget - budget / 8;
+		// the restores still loading count with the levels they will add, or every frame until they finish
+		// would start more against the same room
+		for (const auto& restore : restores)
+		{
+			auto found = entries.find(restore.second);
+			if (found == entries.end())
+				continue;
+			const Entry& entry = found->second;
+			for (int level = entry.restoreLevel; level < entry.topLevel; ++level)
+				resident += entry.levelBytes[level];
+		}
+		for (auto& found : entries)
+		{
+			Entry& entry = found.second;
+			if (restores.size() >= MAX_RESTORES)
+				break;
+			if (!entry.loaded || entry.restoring || entry.topLevel <= entry.wantedLevel || entry.lastUsed + 1 < frame)
+				continue;
+			size_t missing = 0;
+			for (int level = entry.wantedLevel; level < entry.topLevel; ++level)
+				missing += entry.levelBytes[level];
+			if (resident + missing > headroom)
+				continue;
+			resident += missing;
+			entry.restoring = loader.Load(entry.paths.front(), pool, nullptr, entry.wantedLevel, false);
+			entry.restoreLevel = entry.wantedLevel;
+			restores[entry.restoring] = found.first;
+		}
+		return changed;
+	}
+
+	// GPU memory the textures may take; levels are dropped beyond it
+	void SetBudget(size_t bytes) { budget = bytes; }
+	size_t Budget() const { return budget; }
+
+	// GPU memory the loaded textures take with the levels they have
+	size_t ResidentBytes() const
+	{
+		size_t bytes = 0;
+		for (const auto& entry : entries)
+			bytes += entry.second.bytes;
+		return bytes;
+	}
+
+	size_t Evictions() const { return evictions; }           // textures that had levels dropped
+	size_t EvictedLevels() const { return evictedLevels; }    // levels dropped in all
+	size_t Restores() const { return restoredTextures; }      // textures that got their levels back
+
+	// called on a worker thread whenever an image finishes decoding (see TextureLoader::OnDecoded)
+	void SetDecodedCallback(std::function<void()> callback) { loader.OnDecoded = callback; }
+
+	// keeps the decoded images on disk between runs (see TextureLoader::DiskCache)
+	void SetDiskCache(DecodedImageCache* cache) { loader.DiskCache = cache; }
+
+	// textures still showing their placeholder
+	size_t Pending() const { return loader.Pending(); }
+	double LoadSeconds() const { return loader.LoadSeconds(); }
+
+	size_t TextureCount() const { return entries.size(); }
+	size_t PathHits() const { return pathHits; }         // Acquire() calls answered with a texture already there
+	size_t ContentHits() const { return contentHits; }   // files merged into an identical image
+
+	// GPU memory the sharing saves: every acquisition after the first of a loaded texture would have been a copy
+	// (of the levels it has now)
+	size_t BytesSaved() const
+	{
+		size_t saved = 0;
+		for (const auto& entry : entries)
+			saved += (entry.second.acquisitions - 1) * entry.second.bytes;
+		return saved;
+	}
+
+	// deletes every texture, referenced or not
+	void Destroy()
+	{
+		loader.Destroy();
+		for (const auto& entry : entries)
+			glDeleteTextures(1, &entry.first);
+		for (const auto& restore : restores)
+			glDeleteTextures(1, &restore.first);
+		entries.clear();
+		restores.clear();
+		byPath.clear();
+		byContent.clear();
+	}
+
+private:
+	struct Entry
+	{
+		std::vector<std::string> paths;       // every path resolving to this texture
+		int references = 1;
+		size_t acquisitions = 1;              // references ever taken, for the savings
+		bool loaded = false;
+		size_t bytes = 0;
+		uint64_t contentHash = 0;
+		glm::vec3 averageColor = glm::vec3(0.5f);
+		std::vector<glm::vec3*> colorTargets; // waiting for the image
+
+		// residency
+		int width = 0;                        // of the image's level 0
+		int height = 0;
+		int levelCount = 1;                   // of the image's whole chain
+		std::vector<size_t> levelBytes;       // of every level of the chain
+		int topLevel = 0;                     // largest level in the texture, the ones above it were dropped
+		int wantedLevel = 0;                  // largest level the draws of lastUsed need
+		unsigned long long lastUsed = 0;      // last frame drawing the texture
+		GLuint restoring = 0;                 // texture loading with the levels from restoreLevel, 0 for none
+		int restoreLevel = 0;
+	};
+
+	static const size_t MAX_RESTORES = 4;     // textures loading their levels back at once
+
+	TextureLoader loader;
+	std::unordered_map<GLuint, Entry> entries;
+	std::unordered_map<std::string, GLuint> byPath;
+	std::unordered_map<uint64_t, GLuint> byContent;
+	std::unordered_map<GLuint, GLuint> restores;  // texture loading -> the one it replaces
+	size_t pathHits = 0;
+	size_t contentHits = 0;
+	size_t budget = SIZE_MAX;
+	size_t evictions = 0;
+	size_t evictedLevels = 0;
+	size_t restoredTextures = 0;
+
+	// one spelling per file: forward slashes, no "./" segments
+	static std::string normalize(const std::string& path)
+	{
+		std::string key = path;
+		for (char& c : key)
+			if (c == '\\')
+				c = '/';
+		for (size_t at = key.find("/./"); at != std::string::npos; at = key.find("/./"))
+			key.erase(at, 2);
+		return key;
+	}
+
+	void erase(GLuint texture)
+	{
+		auto found = entries.find(texture);
+		for (const std::string& path : found->second.paths)
+			byPath.erase(path);
+		auto content = byContent.find(found->second.contentHash);
+		if (content != byContent.end() && content->second == texture)
+			byContent.erase(content);
+		loader.Cancel(texture);
+		glDeleteTextures(1, &texture);
+		// a restore still loading for the texture goes with it
+		if (GLuint restoring = found->second.restoring)
+		{
+			loader.Cancel(restoring);
+			glDeleteTextures(1, &restoring);
+			restores.erase(restoring);
+		}
+		entries.erase(found);
+	}
+
+	// moves the entry of from, its paths and its content to to, and deletes from
+	void rename(GLuint from, GLuint to, std::vector<TextureRedirect>& redirects)
+	{
+		auto found = entries.find(from);
+		Entry entry = std::move(found->second);
+		entries.erase(found);
+		for (const std::string& path : entry.paths)
+			byPath[path] = to;
+		auto content = byContent.find(entry.contentHash);
+		if (content != byContent.end() && content->second == from)
+			content->second = to;
+		entries[to] = std::move(entry);
+		loader.Cancel(from);
+		glDeleteTextures(1, &from);
+		redirects.push_back({ from, to });
+	}
+
+	// replaces texture with a copy of its levels from top down (levels of the image, not of the texture);
+	// returns the copy
+	GLuint shrink(GLuint texture, int top, std::vector<TextureRedirect>& redirects)
+	{
+		Entry& entry = entries[texture];
+		int first = top - entry.topLevel;         // in the texture
+		int count = entry.levelCount - top;
+		GLint format, width, height;
+		glBindTexture(GL_TEXTURE_2D, texture);
+		glGetTexLevelParameteriv(GL_TEXTURE_2D, first, GL_TEXTURE_INTERNAL_FORMAT, &format);
+		glGetTexLevelParameteriv(GL_TEXTURE_2D, first, GL_TEXTURE_WIDTH, &width);
+		glGetTexLevelParameteriv(GL_TEXTURE_2D, first, GL_TEXTURE_HEIGHT, &height);
+
+		// sampled like TextureLoader::Load sets the textures up
+		GLuint smaller;
+		glGenTextures(1, &smaller);
+		glBindTexture(GL_TEXTURE_2D, smaller);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexStorage2D(GL_TEXTURE_2D, count, (GLenum)format, width, height);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, count - 1);
+		glBindTexture(GL_TEXTURE_2D, 0);
+		for (int level = 0; level < count; ++level)
+			glCopyImageSubData(texture, GL_TEXTURE_2D, first + level, 0, 0, 0, smaller, GL_TEXTURE_2D, level, 0, 0, 0,
+				std::max(width >> level, 1), std::max(height >> level, 1), 1);
+
+		evictedLevels += first;
+		++evictions;
+		entry.topLevel = top;
+		entry.bytes = 0;
+		for (int level = top; level < entry.levelCount; ++level)
+			entry.bytes += entry.levelBytes[level];
+		rename(texture, smaller, redirects);
+		return smaller;
+	}
+
+	// a texture loaded with its levels back arrived: it replaces the one it was loaded for, unless that one was
+	// released meanwhile
+	bool restored(GLuint texture, GLuint original, std::vector<TextureRedirect>& redirects)
+	{
+		restores.erase(texture);
+		auto found = entries.find(original);
+		if (found == entries.end())
+		{
+			glDeleteTextures(1, &texture);
+			return false;
+		}
+		Entry& entry = found->second;
+		entry.topLevel = std::min(entry.restoreLevel, entry.levelCount - 1);
+		entry.restoring = 0;
+		entry.bytes = 0;
+		for (int level = entry.topLevel; level < entry.levelCount; ++level)
+			entry.bytes += entry.levelBytes[level];
+		++restoredTextures;
+		rename(original, texture, redirects);
+		return true;
+	}
+};
+#endif
@@ -0,0 +1,92 @@
+#ifndef TEXTURECOOK_H
+#define TEXTURECOOK_H
+
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "bcencoder.h"
+#include "hash.h"
+#include "ktx2.h"
+#include "mipgen.h"
+#include "stb_image.h"
+
+// Offline texture cooking: a source image is decoded once, given its whole mip chain, block compressed and
+// written next to it as KTX2 (see CookedTexturePath). At runtime the loader uploads the cooked file as it is,
+// so neither decoding nor mip generation happens at startup, and the textures take 1/8 (BC1) or 1/4 (BC7) of
+// the memory and bandwidth of the padded RGB8 they had
+
+// Mean of the stored (sRGB) values of the image, as the lightmap baker takes the albedo; the cooked and the
+// decoded paths both use it, so the baked lighting matches whichever of them loaded the texture. Takes
+// pixelCount RGBA8 pixels
+inline glm::vec3 AverageColor(const uint8_t* rgba, size_t pixelCount)
+{
+	double sum[3] = { 0.0, 0.0, 0.0 };
+	for (size_t i = 0; i < pixelCount; ++i)
+		for (int c = 0; c < 3; ++c)
+			sum[c] += rgba[i * 4 + c];
+	return glm::vec3((float)sum[0], (float)sum[1], (float)sum[2]) / (255.0f * (pixelCount ? pixelCount : 1));
+}
+
+inline glm::vec3 AverageColor(const MipLevel& level)
+{
+	return AverageColor(level.rgba.data(), (size_t)level.width * level.height);
+}
+
+inline bool ReadFileBytes(const std::string& path, std::vector<uint8_t>& bytes)
+{
+	std::ifstream file(path, std::ios::binary);
+	if (!file)
+		return false;
+	bytes.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+	return !bytes.empty();
+}
+
+// Cooks sourcePath into its KTX2 file in format, unless that is already up to date; returns false when the
+// source cannot be read or the result cannot be written. Rows are flipped like the runtime loader flips them
+// (the caller sets stb_image's flip flag, see TextureLoader::Load), and alpha is dropped, as the renderer has
+// always sampled the textures as RGB
+inline bool CookTexture(const std::string& sourcePath, BcFormat format, BcQuality quality, ThreadPool& pool, bool& cooked)
+{
+	cooked = false;
+	std::vector<uint8_t> source;
+	if (!ReadFileBytes(sourcePath, source))
+		return false;
+	uint64_t sourceHash = HashBytes(source.data(), source.size());
+
+	std::string cookedPath = CookedTexturePath(sourcePath);
+	std::vector<uint8_t> existing;
+	Ktx2View view;
+	if (ReadFileBytes(cookedPath, existing) && ParseKtx2(existing.data(), existing.size(), view)
+		&& view.sourceHash == sourceHash && view.format == (uint32_t)format)
+		return true;
+
+	int width, height, channels;
+	uint8_t* pixels = stbi_load_from_memory(source.data(), (int)source.size(), &width, &height, &channels, 0);
+	if (!pixels)
+		return false;
+
+	MipLevel top = ToMipLevel(pixels, width, height, channels);
+	stbi_image_free(pixels);
+	std::vector<MipLevel> chain = GenerateMipChain(top);
+	for (MipLevel& level : chain)
+		for (size_t i = 3; i < level.rgba.size(); i += 4)
+			level.rgba[i] = 255;
+
+	Ktx2Image image;
+	image.format = format;
+	image.width = width;
+	image.height = height;
+	image.sourceHash = sourceHash;
+	image.averageColor = AverageColor(top);
+	for (const MipLevel& level : chain)
+		image.levels.push_back(EncodeBc(level, format, quality, pool));
+
+	cooked = SaveKtx2(cookedPath, image);
+	return cooked;
+}
+#endif
@@ -0,0 +1,412 @@
+#ifndef TEXTURELOADER_H
+#define TEXTURELOADER_H
+
+#include <GL/glew.h>
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "decodedcache.h"
+#include "hash.h"
+#include "ktx2.h"
+#include "mappedfile.h"
+#include "mipgen.h"
+#include "stb_image.h"      // declarations only, the implementation is compiled in Source.cpp
+#include "texturecook.h"    // ReadFileBytes
+#include "threadpool.h"
+
+// An image file decoded on a worker, waiting for the GL thread to upload it: either the mip chain built from
+// the source file (or read back from the decoded image cache), or the cooked KTX2 file mapped into memory
+struct DecodedImage
+{
+	int width = 0;
+	int height = 0;
+	std::vector<MipLevel> mips;              // RGBA8 down to 1x1, empty when the file could not be read
+	std::shared_ptr<MappedFile> cookedFile;  // set when the cooked file is used instead
+	Ktx2View cooked;                         // points into cookedFile
+	DecodedCacheEntry cached;                // set (its file) when an uncompressed cache entry is used instead
+	glm::vec3 averageColor = glm::vec3(0.5f);
+	uint64_t contentHash = 0;                // of the size and pixels, equal for identical images
+	size_t gpuBytes = 0;                     // texture memory with the mip chain
+
+	bool Valid() const { return !mips.empty() || cookedFile || cached.file; }
+	int LevelCount() const { return cookedFile ? cooked.levelCount : (cached.file ? cached.levelCount : (int)mips.size()); }
+	size_t LevelBytes(int level) const { return cookedFile ? cooked.levelBytes[level] : (cached.file ? cached.LevelBytes(level) : mips[level].rgba.size()); }
+	int LevelWidth(int level) const { return std::max(width >> level, 1); }
+	int LevelHeight(int level) const { return std::max(height >> level, 1); }
+	const void* LevelData(int level) const
+	{
+		if (cookedFile)
+			return cooked.levels[level];
+		return cached.file ? (const void*)cached.levels[level] : (const void*)mips[level].rgba.data();
+	}
+};
+
+// Asynchronous texture loading: Load() creates the texture at once with a 1x1 placeholder, so the objects using
+// it can be drawn right away, and queues the file's decoding on the thread pool. Update(), on the GL thread,
+// uploads the images that have finished decoding through a pixel buffer object and replaces the placeholder in
+// place, so nothing holding the texture name has to change. Decoding runs in parallel, so all of the textures
+// are in after about as long as the slowest one takes, instead of the sum of all of them. The workers also build
+// the mip chains (see mipgen.h), so the GL thread only copies levels and never waits on glGenerateMipmap.
+// When the source has an up to date cooked KTX2 file (see texturecook.h) and the GPU takes its format, the
+// worker only maps that file, and its compressed mip chain goes straight into an immutable texture.
+// Textures come in progressively: a decoded image gets storage for its whole chain but only its smallest levels
+// (up to STREAM_TAIL_SIZE, a few KB) at once, and its base level is set to the largest of those, so it is drawn
+// with its right colors from then on. The larger levels follow, smallest first, within a byte budget per frame,
+// lowering the base level as they land, so the GL thread's share of the loading stays about the same per frame
+// however many textures there are. With a DiskCache, the workers take the decoded chains of the files that did
+// not change since the last run from it, and store the ones they had to decode
+class TextureLoader
+{
+public:
+	// called on a worker thread whenever an image finishes decoding, e.g. to wake up an idle render loop
+	std::function<void()> OnDecoded;
+
+	// decoded images kept between runs, none when null; must outlive the loads
+	DecodedImageCache* DiskCache = nullptr;
+
+	// creates the texture (repeat wrapping, nearest filtering) and starts decoding path. averageColor, when
+	// given, receives the mean color of the image when it is uploaded and must stay valid until then. topLevel
+	// leaves out the mip levels above it: the texture's level 0 is then the image's level topLevel. A texture
+	// that is not progressive gets all of its levels as soon as it is decoded
+	GLuint Load(const std::string& path, ThreadPool& pool, glm::vec3* averageColor = nullptr, int topLevel = 0, bool progressive = true)
+	{
+		static const unsigned char placeholder[3] = { 128, 128, 128 };
+
+		if (pending.empty() && streaming.empty())
+			startTime = std::chrono::steady_clock::now();
+
+		GLuint texture;
+		glGenTextures(1, &texture);
+		glBindTexture(GL_TEXTURE_2D, texture);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, 1, 1, 0, GL_RGB, GL_UNSIGNED_BYTE, placeholder);
+		glBindTexture(GL_TEXTURE_2D, 0);
+
+		// stb_image keeps the flip flag in one global that its decoders read, so it must not change while a
+		// worker decodes; it is set on this thread before the job is submitted, as everything else here that
+		// hands decodes to the workers does
+		stbi_set_flip_vertically_on_load(true);
+		std::function<void()> notify = OnDecoded;
+		bool s3tcSupported = GLEW_EXT_texture_compression_s3tc != 0;
+		DecodedImageCache* diskCache = DiskCache;
+		PendingTexture entry;
+		entry.path = path;
+		entry.texture = texture;
+		entry.averageColor = averageColor;
+		entry.topLevel = topLevel;
+		entry.progressive = progressive;
+		entry.image = pool.Submit([path, notify, s3tcSupported, diskCache]
+		{
+			DecodedImage image = decode(path, s3tcSupported, diskCache);
+			if (notify)
+				notify();
+			return image;
+		});
+		pending.push_back(std::move(entry));
+		return texture;
+	}
+
+	// spends up to maxUploadBytes on the textures: first the smallest levels of the images that are decoded,
+	// oldest first, without waiting for the others, then the next larger level of each texture streaming in,
+	// round after round. A level larger than the whole budget goes alone, so every texture gets there. Returns
+	// how many textures changed. inspect, when given, sees each decoded image first and can return false to drop
+	// it instead of uploading it (e.g. when the same image is already loaded)
+	int Update(size_t maxUploadBytes, const std::function<bool(GLuint texture, const DecodedImage& image)>& inspect = nullptr)
+	{
+		int changed = 0;
+		size_t uploadedBytes = 0;
+		for (size_t i = 0; i < pending.size() && uploadedBytes < maxUploadBytes; )
+		{
+			if (pending[i].image.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+			{
+				++i;
+				continue;
+			}
+
+			DecodedImage image = pending[i].image.get();
+			if (!image.Valid())
+				std::cout << "failed to load texture " << pending[i].path << std::endl;
+			else if (!pending[i].cancelled)
+			{
+				if (pending[i].averageColor)
+					*pending[i].averageColor = image.averageColor;
+				if (!inspect || inspect(pending[i].texture, image))
+					uploadedBytes += start(pending[i].texture, std::move(image), pending[i].topLevel, pending[i].progressive);
+			}
+
+			pending.erase(pending.begin() + i);
+			++changed;
+		}
+
+		for (bool progress = true; progress; )
+		{
+			progress = false;
+			for (size_t i = 0; i < streaming.size(); )
+			{
+				StreamingTexture& entry = streaming[i];
+				int level = entry.baseLevel - 1;
+				size_t bytes = entry.image.LevelBytes(level);
+				if (uploadedBytes > 0 && uploadedBytes + bytes > maxUploadBytes)
+				{
+					++i;
+					continue;
+				}
+				uploadLevels(entry.texture, entry.image, entry.topLevel, level, level + 1);
+				setBaseLevel(entry.texture, level - entry.topLevel);
+				entry.baseLevel = level;
+				uploadedBytes += bytes;
+				progress = true;
+				++changed;
+				if (level == entry.topLevel)
+					streaming.erase(streaming.begin() + i);
+				else
+					++i;
+			}
+		}
+
+		if (changed > 0 && pending.empty() && streaming.empty())
+			loadSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+		return changed;
+	}
+
+	// textures still showing their placeholder or still missing some of their levels
+	size_t Pending() const { return pending.size() + streaming.size(); }
+
+	// whether texture has levels still to come
+	bool Streaming(GLuint texture) const
+	{
+		for (const StreamingTexture& entry : streaming)
+			if (entry.texture == texture)
+				return true;
+		return false;
+	}
+
+	// stops loading texture, e.g. before it is deleted: its remaining levels are not streamed, and an image still
+	// decoding for it is dropped when it arrives
+	void Cancel(GLuint texture)
+	{
+		for (PendingTexture& entry : pending)
+			if (entry.texture == texture)
+				entry.cancelled = true;
+		streaming.erase(std::remove_if(streaming.begin(), streaming.end(),
+			[texture](const StreamingTexture& entry) { return entry.texture == texture; }), streaming.end());
+	}
+
+	// time from the first Load() until the last of that batch was fully uploaded
+	double LoadSeconds() const { return loadSeconds; }
+
+	// waits for the decodes still running and drops their images; the textures belong to the caller
+	void Destroy()
+	{
+		for (PendingTexture& entry : pending)
+			entry.image.wait();
+		pending.clear();
+		streaming.clear();
+		if (uploadBuffers[0])
+			glDeleteBuffers(2, uploadBuffers);
+		uploadBuffers[0] = uploadBuffers[1] = 0;
+	}
+
+private:
+	struct PendingTexture
+	{
+		std::string path;
+		GLuint texture;
+		glm::vec3* averageColor;
+		int topLevel;
+		bool progressive;
+		bool cancelled = false;
+		std::future<DecodedImage> image;
+	};
+
+	// a texture with its smallest levels in, the rest of the image waiting for the upload budget
+	struct StreamingTexture
+	{
+		GLuint texture;
+		DecodedImage image;
+		int topLevel;       // image level that is the texture's level 0
+		int baseLevel;      // largest image level uploaded so far
+	};
+
+	static const int STREAM_TAIL_SIZE = 32;     // levels up to this size are uploaded as soon as the image is in
+
+	std::vector<PendingTexture> pending;
+	std::vector<StreamingTexture> streaming;
+	GLuint uploadBuffers[2] = { 0, 0 };   // alternated, so filling one does not wait for the other's transfer
+	int nextBuffer = 0;
+	std::chrono::steady_clock::time_point startTime;
+	double loadSeconds = 0.0;
+
+	// runs on a worker: maps the cooked file when it was cooked from the source as it is now (or when there is
+	// no source), else takes the decoded chain from the disk cache when the source did not change since it was
+	// stored, else decodes the source, builds its mip chain and averages its color (and stores that), so the GL
+	// thread only has to copy the data. A disk cache hit also knows the source's hash, so then the source is not
+	// even read
+	static DecodedImage decode(const std::string& path, bool s3tcSupported, DecodedImageCache* diskCache)
+	{
+		DecodedImage image;
+		SourceStamp stamp;
+		bool haveStamp = diskCache && StatSource(path, stamp);
+		DecodedCacheEntry cached;
+		bool haveCached = haveStamp && diskCache->Find(path, stamp, cached);
+		std::vector<uint8_t> source;
+		bool haveSource = haveCached || ReadFileBytes(path, source);
+		uint64_t sourceHash = haveCached ? cached.sourceHash : HashBytes(source.data(), source.size());
+		std::shared_ptr<MappedFile> cookedFile = std::make_shared<MappedFile>();
+		if (cookedFile->Open(CookedTexturePath(path)) && ParseKtx2(cookedFile->Data(), cookedFile->Size(), image.cooked)
+			&& Ktx2FormatSupported(image.cooked.format, s3tcSupported)
+			&& (!haveSource || image.cooked.sourceHash == sourceHash))
+		{
+			image.cookedFile = cookedFile;
+			image.width = image.cooked.width;
+			image.height = image.cooked.height;
+			image.averageColor = image.cooked.averageColor;
+			image.contentHash = HashBytes(image.cooked.levels[0], image.cooked.levelBytes[0], image.cooked.format);
+			for (int level = 0; level < image.cooked.levelCount; ++level)
+				image.gpuBytes += image.cooked.levelBytes[level];
+			return image;
+		}
+
+		if (haveCached)
+		{
+			image.width = cached.width;
+			image.height = cached.height;
+			image.averageColor = cached.averageColor;
+			image.contentHash = cached.contentHash;
+			for (int level = 0; level < cached.levelCount; ++level)
+				image.gpuBytes += cached.LevelBytes(level);
+			if (!cached.compressed)
+			{
+				image.cached = cached;
+				return image;
+			}
+			image.mips.resize(cached.levelCount);
+			for (int level = 0; level < cached.levelCount; ++level)
+			{
+				MipLevel& mip = image.mips[level];
+				mip.width = cached.LevelWidth(level);
+				mip.height = cached.LevelHeight(level);
+				mip.rgba.resize(cached.LevelBytes(level));
+				if (!DecodedImageCache::Expand(cached, level, mip.rgba.data()))
+				{
+					image.mips.clear();     // damaged: decode the source after all
+					break;
+				}
+			}
+			if (!image.mips.empty())
+				return image;
+			image = DecodedImage();
+			haveSource = ReadFileBytes(path, source);
+			sourceHash = HashBytes(source.data(), source.size());
+		}
+
+		int channels = 0;
+		unsigned char* pixels = nullptr;
+		if (haveSource)
+			pixels = stbi_load_from_memory(source.data(), (int)source.size(), &image.width, &image.height, &channels, 0);
+		if (!pixels)
+			return image;
+		MipLevel top = ToMipLevel(pixels, image.width, image.height, channels);
+		stbi_image_free(pixels);
+
+		image.averageColor = AverageColor(top);
+		int header[2] = { image.width, image.height };
+		image.contentHash = HashBytes(top.rgba.data(), top.rgba.size(), HashBytes(header, sizeof(header)));
+		image.mips = GenerateMipChain(top);
+		for (const MipLevel& level : image.mips)
+			image.gpuBytes += level.rgba.size();    // RGB8 is padded to 4 bytes
+		if (haveStamp)
+			diskCache->Store(path, stamp, sourceHash, image.contentHash, image.averageColor, image.mips);
+		return image;
+	}
+
+	// gives texture immutable storage for the image's levels from topLevel down and uploads the smallest of them
+	// (all of them when not progressive), queueing the rest; returns the bytes uploaded
+	size_t start(GLuint texture, DecodedImage&& image, int topLevel, bool progressive)
+	{
+		int levelCount = image.LevelCount();
+		int top = std::min(std::max(topLevel, 0), levelCount - 1);
+		int base = top;
+		if (progressive)
+			while (base < levelCount - 1 && std::max(image.LevelWidth(base), image.LevelHeight(base)) > STREAM_TAIL_SIZE)
+				++base;
+
+		GLenum format = image.cookedFile ? Ktx2GlFormat(image.cooked.format) : GL_RGB8;
+		glBindTexture(GL_TEXTURE_2D, texture);
+		glTexStorage2D(GL_TEXTURE_2D, levelCount - top, format, image.LevelWidth(top), image.LevelHeight(top));
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, levelCount - top - 1);
+		glBindTexture(GL_TEXTURE_2D, 0);
+		size_t bytes = uploadLevels(texture, image, top, base, levelCount);
+		setBaseLevel(texture, base - top);
+		if (base > top)
+			streaming.push_back({ texture, std::move(image), top, base });
+		return bytes;
+	}
+
+	// copies the image's levels [first, last) into a freshly orphaned pixel buffer in one go and lets the driver
+	// transfer them into texture, whose level 0 is image level topLevel, from there; returns the bytes copied
+	size_t uploadLevels(GLuint texture, const DecodedImage& image, int topLevel, int first, int last)
+	{
+		if (!uploadBuffers[0])
+			glGenBuffers(2, uploadBuffers);
+		std::vector<size_t> offsets(image.LevelCount());
+		size_t size = 0;
+		for (int level = first; level < last; ++level)
+		{
+			offsets[level] = size;
+			size += image.LevelBytes(level);
+		}
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, uploadBuffers[nextBuffer]);
+		nextBuffer = 1 - nextBuffer;
+		glBufferData(GL_PIXEL_UNPACK_BUFFER, (GLsizeiptr)size, nullptr, GL_STREAM_DRAW);
+		uint8_t* mapped = (uint8_t*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, (GLsizeiptr)size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+		if (mapped)
+		{
+			for (int level = first; level < last; ++level)
+				std::memcpy(mapped + offsets[level], image.LevelData(level), image.LevelBytes(level));
+			glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+		}
+		else
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);   // upload straight from memory instead
+
+		glBindTexture(GL_TEXTURE_2D, texture);
+		for (int level = first; level < last; ++level)
+		{
+			const void* data = mapped ? (const void*)offsets[level] : image.LevelData(level);
+			if (image.cookedFile)
+				glCompressedTexSubImage2D(GL_TEXTURE_2D, level - topLevel, 0, 0, image.LevelWidth(level), image.LevelHeight(level),
+					Ktx2GlFormat(image.cooked.format), (GLsizei)image.LevelBytes(level), data);
+			else
+				glTexSubImage2D(GL_TEXTURE_2D, level - topLevel, 0, 0, image.LevelWidth(level), image.LevelHeight(level),
+					GL_RGBA, GL_UNSIGNED_BYTE, data);
+		}
+		glBindTexture(GL_TEXTURE_2D, 0);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		return size;
+	}
+
+	// samples the texture from level down only, the levels above it not being uploaded yet. The textures are
+	// minified with GL_NEAREST, which reads the base level alone, so the base level is what limits them; a
+	// minimum LOD would not
+	static void setBaseLevel(GLuint texture, int level)
+	{
+		glBindTexture(GL_TEXTURE_2D, texture);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, level);
+		glBindTexture(GL_TEXTURE_2D, 0);
+	}
+};
+#endif
@@ -0,0 +1,153 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+// A fixed set of worker threads fed from a single job queue.
+// Submit() runs fire-and-forget or future-returning jobs; ParallelFor() splits an index range across
+// the workers and the calling thread and returns once every index has been processed.
+class ThreadPool
+{
+public:
+	// creates the pool; by default one worker per hardware thread, minus the calling thread
+	explicit ThreadPool(unsigned int workerCount = 0)
+	{
+		if (workerCount == 0)
+		{
+			unsigned int hardwareThreads = std::thread::hardware_concurrency();
+			workerCount = hardwareThreads > 1 ? hardwareThreads - 1 : 1;
+		}
+
+		for (unsigned int i = 0; i < workerCount; ++i)
+			workers.emplace_back([this] { workerLoop(); });
+	}
+
+	~ThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(queueMutex);
+			stopping = true;
+		}
+		queueCondition.notify_all();
+		for (std::thread& worker : workers)
+			worker.join();
+	}
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	// number of worker threads (the thread calling ParallelFor also helps)
+	unsigned int WorkerCount() const { return (unsigned int)workers.size(); }
+
+	// queues a job and returns a future for its result
+	template <typename F>
+	auto Submit(F job) -> std::future<decltype(job())>
+	{
+		typedef decltype(job()) Result;
+		std::shared_ptr<std::packaged_task<Result()>> task = std::make_shared<std::packaged_task<Result()>>(std::move(job));
+		std::future<Result> result = task->get_future();
+		enqueue([task] { (*task)(); });
+		return result;
+	}
+
+	// calls body(begin, end) over [0, count) in batches of at most grain indices, spread across the pool
+	void ParallelFor(size_t count, size_t grain, const std::function<void(size_t, size_t)>& body)
+	{
+		if (count == 0)
+			return;
+		if (grain == 0)
+			grain = 1;
+
+		size_t batches = (count + grain - 1) / grain;
+		if (batches == 1 || workers.empty())
+		{
+			body(0, count);
+			return;
+		}
+
+		// the state is shared with the helper jobs so a helper that only starts after the range is finished
+		// (or while this thread is itself a worker) never touches a dead stack frame
+		struct ParallelState
+		{
+			std::function<void(size_t, size_t)> body;
+			size_t count, grain, batches;
+			std::atomic<size_t> nextBatch;
+			std::atomic<size_t> batchesDone;
+			std::mutex doneMutex;
+			std::condition_variable doneCondition;
+		};
+		std::shared_ptr<ParallelState> state = std::make_shared<ParallelState>();
+		state->body = body;
+		state->count = count;
+		state->grain = grain;
+		state->batches = batches;
+		state->nextBatch = 0;
+		state->batchesDone = 0;
+
+		auto drain = [](ParallelState& s)
+		{
+			for (size_t batch = s.nextBatch++; batch < s.batches; batch = s.nextBatch++)
+			{
+				size_t begin = batch * s.grain;
+				size_t end = begin + s.grain < s.count ? begin + s.grain : s.count;
+				s.body(begin, end);
+				if (++s.batchesDone == s.batches)
+				{
+					std::lock_guard<std::mutex> lock(s.doneMutex);
+					s.doneCondition.notify_all();
+				}
+			}
+		};
+
+		size_t helpers = batches - 1 < workers.size() ? batches - 1 : workers.size();
+		for (size_t i = 0; i < helpers; ++i)
+			enqueue([state, drain] { drain(*state); });
+
+		drain(*state);
+
+		std::unique_lock<std::mutex> lock(state->doneMutex);
+		state->doneCondition.wait(lock, [&] { return state->batchesDone == state->batches; });
+	}
+
+private:
+	std::vector<std::thread> workers;
+	std::queue<std::function<void()>> jobs;
+	std::mutex queueMutex;
+	std::condition_variable queueCondition;
+	bool stopping = false;
+
+	void enqueue(std::function<void()> job)
+	{
+		{
+			std::lock_guard<std::mutex> lock(queueMutex);
+			jobs.push(std::move(job));
+		}
+		queueCondition.notify_one();
+	}
+
+	void workerLoop()
+	{
+		for (;;)
+		{
+			std::function<void()> job;
+			{
+				std::unique_lock<std::mutex> lock(queueMutex);
+				queueCondition.wait(lock, [this] { return stopping || !jobs.empty(); });
+				if (stopping && jobs.empty())
+					return;
+				job = std::move(jobs.front());
+				jobs.pop();
+			}
+			job();
+		}
+	}
+};
+#endif
@@ -0,0 +1,600 @@
+#ifndef VIRTUALTEXTURE_H
+#define VIRTUALTEXTURE_H
+
+#include <GL/glew.h>
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "hash.h"
+#include "ktx2.h"           // ktx2detail byte helpers
+#include "mappedfile.h"
+#include "mipgen.h"
+#include "stb_image.h"      // declarations only, the implementation is compiled in Source.cpp
+#include "texturecook.h"    // ReadFileBytes, AverageColor
+#include "threadpool.h"
+
+// Texture units the scene shaders read a virtual texture from (see ssao.h for the units below them)
+const GLuint VIRTUAL_TEXTURE_PHYSICAL_UNIT = 7;
+const GLuint VIRTUAL_TEXTURE_INDIRECTION_UNIT = 8;
+
+const int VT_TILE_SIZE = 128;           // texels of the image per tile; the shader chunk has the same numbers
+const int VT_TILE_BORDER = 4;           // texels copied from the neighbouring tiles on every side, for filtering
+const int VT_TILE_STRIDE = VT_TILE_SIZE + 2 * VT_TILE_BORDER;
+const size_t VT_TILE_BYTES = (size_t)VT_TILE_STRIDE * VT_TILE_STRIDE * 4;
+const int VT_CACHE_TILES = 16;          // the physical cache holds 16 x 16 tiles
+const int VT_FEEDBACK_DIVISOR = 8;      // the feedback pass renders at 1/8 of the scene's resolution per axis
+const int VT_MAX_LEVELS = 16;
+const size_t VT_MAX_LOADING = 64;       // tile reads in flight at once
+
+const uint8_t VT_IDENTIFIER[8] = { 'O', 'G', 'S', 'V', 'T', 'E', 'X', '1' };
+
+// The tile file of a source image, next to it like its cooked KTX2 file
+inline std::string VirtualTexturePath(const std::string& sourcePath)
+{
+	size_t dot = sourcePath.find_last_of('.');
+	size_t slash = sourcePath.find_last_of("/\\");
+	if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+		return sourcePath + ".vtex";
+	return sourcePath.substr(0, dot) + ".vtex";
+}
+
+// Layout of a tile file: a header, then every tile of every level, largest level first, each level's tiles in
+// rows from the bottom, each tile VT_TILE_STRIDE square RGBA8 with its border. Tiles are at fixed offsets, so
+// any one of them is read without touching the others
+//   8 bytes identifier, then 32-bit width, height, tile size, border, level count, 0,
+//   64-bit source hash, average color as three floats and a 0, then tiles across and up for each level
+struct VirtualTextureLayout
+{
+	int width = 0;
+	int height = 0;
+	int levelCount = 0;
+	int tilesX[VT_MAX_LEVELS] = {};
+	int tilesY[VT_MAX_LEVELS] = {};
+	size_t firstTile[VT_MAX_LEVELS] = {};   // index of each level's first tile in the file
+	size_t dataOffset = 0;
+	uint64_t sourceHash = 0;
+	glm::vec3 averageColor = glm::vec3(0.5f);
+
+	int LevelWidth(int level) const { return std::max(width >> level, 1); }
+	int LevelHeight(int level) const { return std::max(height >> level, 1); }
+	size_t TileCount() const { return firstTile[levelCount - 1] + (size_t)tilesX[levelCount - 1] * tilesY[levelCount - 1]; }
+	size_t TileOffset(int level, int x, int y) const { return dataOffset + (firstTile[level] + (size_t)y * tilesX[level] + x) * VT_TILE_BYTES; }
+
+	// levels go down to the first that fits in one tile
+	void Compute(int imageWidth, int imageHeight)
+	{
+		width = imageWidth;
+		height = imageHeight;
+		levelCount = 0;
+		size_t tiles = 0;
+		for (int level = 0; level < VT_MAX_LEVELS; ++level)
+		{
+			tilesX[level] = (LevelWidth(level) + VT_TILE_SIZE - 1) / VT_TILE_SIZE;
+			tilesY[level] = (LevelHeight(level) + VT_TILE_SIZE - 1) / VT_TILE_SIZE;
+			firstTile[level] = tiles;
+			tiles += (size_t)tilesX[level] * tilesY[level];
+			levelCount = level + 1;
+			if (tilesX[level] == 1 && tilesY[level] == 1)
+				break;
+		}
+		dataOffset = (8 + 6 * 4 + 8 + 4 * 4 + 8 * (size_t)levelCount + 15) / 16 * 16;
+	}
+
+	// The tile of a coarser level that a tile falls back to: the one holding the center of the part of the image
+	// the tile covers. The shader chunk computes the same, in the same integer steps
+	void Ancestor(int level, int x, int y, int target, int& ancestorX, int& ancestorY) const
+	{
+		int centerX = x * VT_TILE_SIZE + std::min(VT_TILE_SIZE / 2, (LevelWidth(level) - x * VT_TILE_SIZE) / 2);
+		int centerY = y * VT_TILE_SIZE + std::min(VT_TILE_SIZE / 2, (LevelHeight(level) - y * VT_TILE_SIZE) / 2);
+		ancestorX = std::min(centerX * LevelWidth(target) / LevelWidth(level) / VT_TILE_SIZE, tilesX[target] - 1);
+		ancestorY = std::min(centerY * LevelHeight(target) / LevelHeight(level) / VT_TILE_SIZE, tilesY[target] - 1);
+	}
+};
+
+// Reads the header of a tile file in memory, checking that all of its tiles are there
+inline bool ParseVirtualTexture(const uint8_t* data, size_t size, VirtualTextureLayout& layout)
+{
+	using namespace ktx2detail;
+	if (size < 56 || std::memcmp(data, VT_IDENTIFIER, 8) != 0)
+		return false;
+	int width = (int)get32(data + 8), height = (int)get32(data + 12);
+	int levelCount = (int)get32(data + 24);
+	if (width <= 0 || height <= 0 || get32(data + 16) != (uint32_t)VT_TILE_SIZE || get32(data + 20) != (uint32_t)VT_TILE_BORDER)
+		return false;
+	layout.Compute(width, height);
+	if (layout.levelCount != levelCount || size < layout.dataOffset || (size - layout.dataOffset) / VT_TILE_BYTES < layout.TileCount())
+		return false;
+	layout.sourceHash = get64(data + 32);
+	std::memcpy(&layout.averageColor, data + 40, sizeof(float) * 3);
+	return true;
+}
+
+namespace vtdetail
+{
+	// writes the tiles of one level, the border repeating the image across its edges as the material textures do
+	inline void writeTiles(std::ofstream& file, const uint8_t* rgba, int width, int height, int tilesX, int tilesY)
+	{
+		std::vector<uint8_t> tile(VT_TILE_BYTES);
+		for (int y = 0; y < tilesY; ++y)
+			for (int x = 0; x < tilesX; ++x)
+			{
+				for (int row = 0; row < VT_TILE_STRIDE; ++row)
+				{
+					int sourceY = ((y * VT_TILE_SIZE - VT_TILE_BORDER + row) % height + height) % height;
+					for (int column = 0; column < VT_TILE_STRIDE; ++column)
+					{
+						int sourceX = ((x * VT_TILE_SIZE - VT_TILE_BORDER + column) % width + width) % width;
+						std::memcpy(&tile[((size_t)row * VT_TILE_STRIDE + column) * 4], &rgba[((size_t)sourceY * width + sourceX) * 4], 4);
+					}
+				}
+				file.write((const char*)tile.data(), tile.size());
+			}
+	}
+}
+
+// Cuts sourcePath into its tile file, unless that was already made from the source as it is now; returns false
+// when the source cannot be read or the file cannot be written. The caller sets stb_image's flip flag (see
+// TextureLoader::Load). An offline step (see --cook-textures): the levels are made and written one at a time,
+// each filtered in strips from the one above it (NextMipLevel), so besides the decoded image only the next
+// level is held, a quarter of its size, and never a float copy of either
+inline bool CookVirtualTexture(const std::string& sourcePath, bool& cooked)
+{
+	using namespace ktx2detail;
+	cooked = false;
+	std::vector<uint8_t> source;
+	if (!ReadFileBytes(sourcePath, source))
+		return false;
+	uint64_t sourceHash = HashBytes(source.data(), source.size());
+
+	std::string tilePath = VirtualTexturePath(sourcePath);
+	MappedFile existing;
+	VirtualTextureLayout layout;
+	if (existing.Open(tilePath) && ParseVirtualTexture(existing.Data(), existing.Size(), layout) && layout.sourceHash == sourceHash)
+		return true;
+	existing.Close();
+
+	// decoded straight to RGBA8, and the file's bytes let go of before the levels are made
+	int width, height, channels;
+	uint8_t* pixels = stbi_load_from_memory(source.data(), (int)source.size(), &width, &height, &channels, 4);
+	std::vector<uint8_t>().swap(source);
+	if (!pixels)
+		return false;
+	glm::vec3 averageColor = AverageColor(pixels, (size_t)width * height);
+	layout.Compute(width, height);
+
+	std::vector<uint8_t> header(VT_IDENTIFIER, VT_IDENTIFIER + 8);
+	put32(header, (uint32_t)width);
+	put32(header, (uint32_t)height);
+	put32(header, VT_TILE_SIZE);
+	put32(header, VT_TILE_BORDER);
+	put32(header, (uint32_t)layout.levelCount);
+	put32(header, 0);
+	put64(header, sourceHash);
+	uint32_t colorBits[3];
+	std::memcpy(colorBits, &averageColor, sizeof(colorBits));
+	for (uint32_t bits : colorBits)
+		put32(header, bits);
+	put32(header, 0);
+	for (int level = 0; level < layout.levelCount; ++level)
+	{
+		put32(header, (uint32_t)layout.tilesX[level]);
+		put32(header, (uint32_t)layout.tilesY[level]);
+	}
+	header.resize(layout.dataOffset, 0);
+
+	std::ofstream file(tilePath, std::ios::binary);
+	if (!file)
+	{
+		stbi_image_free(pixels);
+		return false;
+	}
+	file.write((const char*)header.data(), header.size());
+
+	// level 0 is cut from the decoded image, which is freed once level 1 has been filtered from it
+	MipLevel image;
+	const uint8_t* rgba = pixels;
+	for (int level = 0; level < layout.levelCount && file; ++level)
+	{
+		vtdetail::writeTiles(file, rgba, layout.LevelWidth(level), layout.LevelHeight(level), layout.tilesX[level], layout.tilesY[level]);
+		if (level + 1 == layout.levelCount)
+			break;
+		image = NextMipLevel(rgba, layout.LevelWidth(level), layout.LevelHeight(level));
+		rgba = image.rgba.data();
+		if (pixels)
+		{
+			stbi_image_free(pixels);
+			pixels = nullptr;
+		}
+	}
+	if (pixels)
+		stbi_image_free(pixels);
+	cooked = (bool)file;
+	return cooked;
+}
+
+// Virtual texturing: an image far larger than the GPU could hold is cut into tiles on disk (see
+// CookVirtualTexture), and only the tiles the camera sees, at the detail it sees them, are kept in a fixed size
+// physical cache texture. A feedback pass renders, at low resolution, which tile each visible pixel wants; its
+// result is read back without stalling, and the missing tiles are read from the mapped file on the thread pool
+// and uploaded a few per frame into the least recently wanted cache slots. An indirection texture maps every
+// tile of every level to the finest resident tile covering it, so pixels whose tile is not in yet show a
+// coarser one. The coarsest level is a single tile that never leaves the cache. Memory use is set by the cache
+// and the screen, not by the size of the image.
+//   physical cache, RGB8: VT_CACHE_TILES x VT_CACHE_TILES tiles of VT_TILE_STRIDE texels with their borders
+//   indirection, RGBA8UI: cache slot x, y and resident level per tile, the levels stacked from the bottom
+//   feedback, RGBA16UI + depth: tile x, y, level and a flag per pixel
+class VirtualTexture
+{
+public:
+	// called on a worker thread whenever a tile has been read, e.g. to wake up an idle render loop
+	std::function<void()> OnTileLoaded;
+
+	// maps the tile file at path and creates the textures, with the coarsest level resident; false when the file
+	// is missing or damaged
+	bool Open(const std::string& path)
+	{
+		Destroy();
+		if (!file.Open(path) || !ParseVirtualTexture(file.Data(), file.Size(), layout))
+		{
+			file.Close();
+			return false;
+		}
+		for (int level = 0; level < layout.levelCount; ++level)
+		{
+			levelRows[level] = indirectionHeight;
+			indirectionHeight += layout.tilesY[level];
+		}
+
+		int physicalSize = VT_CACHE_TILES * VT_TILE_STRIDE;
+		glGenTextures(1, &physicalTexture);
+		glBindTexture(GL_TEXTURE_2D, physicalTexture);
+		glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGB8, physicalSize, physicalSize);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+		glGenTextures(1, &indirectionTexture);
+		glBindTexture(GL_TEXTURE_2D, indirectionTexture);
+		glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA8UI, layout.tilesX[0], indirectionHeight);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glBindTexture(GL_TEXTURE_2D, 0);
+
+		slots.assign(VT_CACHE_TILES * VT_CACHE_TILES, Slot());
+		int coarsest = layout.levelCount - 1;
+		uint32_t key = tileKey(coarsest, 0, 0);
+		std::vector<uint8_t> tile(file.Data() + layout.TileOffset(coarsest, 0, 0), file.Data() + layout.TileOffset(coarsest, 0, 0) + VT_TILE_BYTES);
+		place(key, tile, true);
+		rebuildIndirection();
+		return true;
+	}
+
+	bool IsOpen() const { return physicalTexture != 0; }
+
+	// the cache texture, also what the scene's materials hold in place of a texture of their own
+	GLuint PhysicalTexture() const { return physicalTexture; }
+	glm::vec3 AverageColor() const { return layout.averageColor; }
+
+	void Bind(GLuint physicalUnit, GLuint indirectionUnit) const
+	{
+		glActiveTexture(GL_TEXTURE0 + physicalUnit);
+		glBindTexture(GL_TEXTURE_2D, physicalTexture);
+		glActiveTexture(GL_TEXTURE0 + indirectionUnit);
+		glBindTexture(GL_TEXTURE_2D, indirectionTexture);
+		glActiveTexture(GL_TEXTURE0);
+	}
+
+	// the image's size and level layout, for a program using the shader chunk; lodBias is added to the detail
+	// level the shader picks (the feedback pass corrects for its lower resolution with it). The program must be
+	// in use
+	void SetUniforms(GLuint program, float lodBias) const
+	{
+		glUniform2i(glGetUniformLocation(program, "virtualSize"), layout.width, layout.height);
+		glUniform1i(glGetUniformLocation(program, "virtualLevels"), layout.levelCount);
+		glUniform1iv(glGetUniformLocation(program, "virtualLevelRows"), layout.levelCount, levelRows);
+		glUniform1f(glGetUniformLocation(program, "virtualLodBias"), lodBias);
+	}
+
+	// binds the feedback target for a scene viewport of the given size and clears it; false while the last
+	// feedback is still being read back, in which case there is nothing to draw this frame
+	bool BeginFeedback(int viewportWidth, int viewportHeight)
+	{
+		if (readbackFence)
+			return false;
+		resizeFeedback((viewportWidth + VT_FEEDBACK_DIVISOR - 1) / VT_FEEDBACK_DIVISOR, (viewportHeight + VT_FEEDBACK_DIVISOR - 1) / VT_FEEDBACK_DIVISOR);
+		glBindFramebuffer(GL_FRAMEBUFFER, feedbackFramebuffer);
+		glViewport(0, 0, feedbackWidth, feedbackHeight);
+		static const GLuint empty[4] = { 0, 0, 0, 0 };
+		glClearBufferuiv(GL_COLOR, 0, empty);
+		glClear(GL_DEPTH_BUFFER_BIT);
+		return true;
+	}
+
+	// starts copying the feedback into the readback buffer, to be picked up by Update() once the GPU is done
+	void EndFeedback()
+	{
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, readbackBuffer);
+		glReadBuffer(GL_COLOR_ATTACHMENT0);
+		glReadPixels(0, 0, feedbackWidth, feedbackHeight, GL_RGBA_INTEGER, GL_UNSIGNED_SHORT, nullptr);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		readbackFence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	}
+
+	// whether a feedback readback is still on its way
+	bool ReadbackPending() const { return readbackFence != nullptr; }
+
+	// takes in the feedback once it has arrived and queues the reads of the tiles it wants that are missing
+	// (coarse levels first), then uploads up to maxUploads tiles that have been read; returns how many were
+	int Update(ThreadPool& pool, int maxUploads)
+	{
+		++frame;
+		if (readbackFence && glClientWaitSync(readbackFence, 0, 0) != GL_TIMEOUT_EXPIRED)
+		{
+			glDeleteSync(readbackFence);
+			readbackFence = nullptr;
+			request(pool, readFeedback());
+		}
+
+		int uploaded = 0;
+		for (auto it = loading.begin(); it != loading.end() && uploaded < maxUploads; )
+		{
+			if (it->second.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+			{
+				++it;
+				continue;
+			}
+			std::vector<uint8_t> tile = it->second.get();
+			if (place(it->first, tile, false))
+				++uploaded;
+			else
+				++droppedTiles;     // every slot was wanted this frame; the feedback asks again
+			it = loading.erase(it);
+		}
+		if (uploaded > 0)
+			rebuildIndirection();
+		return uploaded;
+	}
+
+	size_t ResidentTiles() const { return resident.size(); }
+	size_t TileCount() const { return layout.TileCount(); }
+	size_t CacheBytes() const { return slots.size() * (size_t)VT_TILE_STRIDE * VT_TILE_STRIDE * 4; }
+	size_t RequestedTiles() const { return requestedTiles; }
+	size_t UploadedTiles() const { return uploadedTiles; }
+	size_t EvictedTiles() const { return evictedTiles; }
+	size_t DroppedTiles() const { return droppedTiles; }
+
+	// waits for the tile reads still running and deletes everything
+	void Destroy()
+	{
+		for (auto& entry : loading)
+			entry.second.wait();
+		loading.clear();
+		if (readbackFence)
+			glDeleteSync(readbackFence);
+		readbackFence = nullptr;
+		glDeleteTextures(1, &physicalTexture);
+		glDeleteTextures(1, &indirectionTexture);
+		glDeleteTextures(1, &feedbackTexture);
+		glDeleteRenderbuffers(1, &feedbackDepth);
+		glDeleteFramebuffers(1, &feedbackFramebuffer);
+		glDeleteBuffers(1, &readbackBuffer);
+		physicalTexture = indirectionTexture = feedbackTexture = feedbackDepth = feedbackFramebuffer = readbackBuffer = 0;
+		feedbackWidth = feedbackHeight = 0;
+		indirectionHeight = 0;
+		slots.clear();
+		resident.clear();
+		file.Close();
+	}
+
+private:
+	struct Slot
+	{
+		uint32_t key = EMPTY_KEY;
+		uint64_t lastUsed = 0;
+		bool pinned = false;
+	};
+
+	static const uint32_t EMPTY_KEY = 0xFFFFFFFFu;
+
+	MappedFile file;
+	VirtualTextureLayout layout;
+	int levelRows[VT_MAX_LEVELS] = {};
+	int indirectionHeight = 0;
+	GLuint physicalTexture = 0;
+	GLuint indirectionTexture = 0;
+	GLuint feedbackTexture = 0;
+	GLuint feedbackDepth = 0;
+	GLuint feedbackFramebuffer = 0;
+	GLuint readbackBuffer = 0;
+	GLsync readbackFence = nullptr;
+	int feedbackWidth = 0;
+	int feedbackHeight = 0;
+	std::vector<Slot> slots;
+	std::unordered_map<uint32_t, int> resident;                         // tile key to cache slot
+	std::unordered_map<uint32_t, std::future<std::vector<uint8_t>>> loading;
+	uint64_t frame = 0;
+	size_t requestedTiles = 0, uploadedTiles = 0, evictedTiles = 0, droppedTiles = 0;
+
+	static uint32_t tileKey(int level, int x, int y) { return ((uint32_t)level << 24) | ((uint32_t)y << 12) | (uint32_t)x; }
+	static int keyLevel(uint32_t key) { return (int)(key >> 24); }
+	static int keyY(uint32_t key) { return (int)((key >> 12) & 0xFFF); }
+	static int keyX(uint32_t key) { return (int)(key & 0xFFF); }
+
+	void resizeFeedback(int width, int height)
+	{
+		width = std::max(width, 1);
+		height = std::max(height, 1);
+		if (feedbackFramebuffer && width == feedbackWidth && height == feedbackHeight)
+			return;
+		glDeleteTextures(1, &feedbackTexture);
+		glDeleteRenderbuffers(1, &feedbackDepth);
+		glDeleteFramebuffers(1, &feedbackFramebuffer);
+		feedbackWidth = width;
+		feedbackHeight = height;
+
+		glGenTextures(1, &feedbackTexture);
+		glBindTexture(GL_TEXTURE_2D, feedbackTexture);
+		glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA16UI, width, height);
+		glBindTexture(GL_TEXTURE_2D, 0);
+		glGenRenderbuffers(1, &feedbackDepth);
+		glBindRenderbuffer(GL_RENDERBUFFER, feedbackDepth);
+		glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+		glBindRenderbuffer(GL_RENDERBUFFER, 0);
+		glGenFramebuffers(1, &feedbackFramebuffer);
+		glBindFramebuffer(GL_FRAMEBUFFER, feedbackFramebuffer);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, feedbackTexture, 0);
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, feedbackDepth);
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+		if (!readbackBuffer)
+			glGenBuffers(1, &readbackBuffer);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, readbackBuffer);
+		glBufferData(GL_PIXEL_PACK_BUFFER, (GLsizeiptr)width * height * 4 * sizeof(uint16_t), nullptr, GL_STREAM_READ);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	}
+
+	// the distinct tiles of the last feedback, with the coarser tiles they fall back to
+	std::vector<uint32_t> readFeedback()
+	{
+		std::unordered_set<uint32_t> wanted;
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, readbackBuffer);
+		size_t count = (size_t)feedbackWidth * feedbackHeight;
+		const uint16_t* pixels = (const uint16_t*)glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, (GLsizeiptr)(count * 4 * sizeof(uint16_t)), GL_MAP_READ_BIT);
+		if (pixels)
+		{
+			uint32_t last = EMPTY_KEY;
+			for (size_t i = 0; i < count; ++i)
+			{
+				const uint16_t* pixel = pixels + i * 4;
+				if (pixel[3] == 0 || pixel[2] >= layout.levelCount || pixel[0] >= layout.tilesX[pixel[2]] || pixel[1] >= layout.tilesY[pixel[2]])
+					continue;
+				uint32_t key = tileKey(pixel[2], pixel[0], pixel[1]);
+				if (key != last)    // neighbouring pixels mostly want the same tile
+					wanted.insert(key);
+				last = key;
+			}
+			glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+		}
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+		std::vector<uint32_t> tiles(wanted.begin(), wanted.end());
+		for (uint32_t key : tiles)
+			for (int level = keyLevel(key) + 1; level < layout.levelCount; ++level)
+			{
+				int x, y;
+				layout.Ancestor(keyLevel(key), keyX(key), keyY(key), level, x, y);
+				wanted.insert(tileKey(level, x, y));
+			}
+		tiles.assign(wanted.begin(), wanted.end());
+		std::sort(tiles.begin(), tiles.end(), [](uint32_t a, uint32_t b) { return keyLevel(a) != keyLevel(b) ? keyLevel(a) > keyLevel(b) : a < b; });
+		return tiles;
+	}
+
+	// marks the resident tiles as used and starts reading the missing ones
+	void request(ThreadPool& pool, const std::vector<uint32_t>& tiles)
+	{
+		for (uint32_t key : tiles)
+		{
+			auto found = resident.find(key);
+			if (found != resident.end())
+			{
+				slots[found->second].lastUsed = frame;
+				continue;
+			}
+			if (loading.count(key) || loading.size() >= VT_MAX_LOADING)
+				continue;
+			const uint8_t* source = file.Data() + layout.TileOffset(keyLevel(key), keyX(key), keyY(key));
+			std::function<void()> notify = OnTileLoaded;
+			loading[key] = pool.Submit([source, notify]
+			{
+				// copying out of the mapping is where the file is actually read, off the GL thread
+				std::vector<uint8_t> tile(source, source + VT_TILE_BYTES);
+				if (notify)
+					notify();
+				return tile;
+			});
+			++requestedTiles;
+		}
+	}
+
+	// uploads a tile into a free slot, or else the least recently used one not wanted this frame; false when there
+	// is none
+	bool place(uint32_t key, const std::vector<uint8_t>& tile, bool pinned)
+	{
+		int best = -1;
+		for (int i = 0; i < (int)slots.size(); ++i)
+		{
+			const Slot& slot = slots[i];
+			if (slot.key == EMPTY_KEY)
+			{
+				best = i;
+				break;
+			}
+			if (!slot.pinned && slot.lastUsed < frame && (best < 0 || slot.lastUsed < slots[best].lastUsed))
+				best = i;
+		}
+		if (best < 0)
+			return false;
+
+		Slot& slot = slots[best];
+		if (slot.key != EMPTY_KEY)
+		{
+			resident.erase(slot.key);
+			++evictedTiles;
+		}
+		slot.key = key;
+		slot.lastUsed = frame;
+		slot.pinned = pinned;
+		resident[key] = best;
+
+		glBindTexture(GL_TEXTURE_2D, physicalTexture);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, (best % VT_CACHE_TILES) * VT_TILE_STRIDE, (best / VT_CACHE_TILES) * VT_TILE_STRIDE,
+			VT_TILE_STRIDE, VT_TILE_STRIDE, GL_RGBA, GL_UNSIGNED_BYTE, tile.data());
+		glBindTexture(GL_TEXTURE_2D, 0);
+		++uploadedTiles;
+		return true;
+	}
+
+	// points every tile of every level at the finest resident tile covering it; the coarsest level is always in
+	void rebuildIndirection()
+	{
+		std::vector<uint8_t> table((size_t)layout.tilesX[0] * indirectionHeight * 4, 0);
+		for (int level = 0; level < layout.levelCount; ++level)
+			for (int y = 0; y < layout.tilesY[level]; ++y)
+				for (int x = 0; x < layout.tilesX[level]; ++x)
+					for (int target = level; target < layout.levelCount; ++target)
+					{
+						int ancestorX = x, ancestorY = y;
+						if (target != level)
+							layout.Ancestor(level, x, y, target, ancestorX, ancestorY);
+						auto found = resident.find(tileKey(target, ancestorX, ancestorY));
+						if (found == resident.end())
+							continue;
+						uint8_t* entry = &table[((size_t)(levelRows[level] + y) * layout.tilesX[0] + x) * 4];
+						entry[0] = (uint8_t)(found->second % VT_CACHE_TILES);
+						entry[1] = (uint8_t)(found->second / VT_CACHE_TILES);
+						entry[2] = (uint8_t)target;
+						entry[3] = 1;
+						break;
+					}
+
+		glBindTexture(GL_TEXTURE_2D, indirectionTexture);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, layout.tilesX[0], indirectionHeight, GL_RGBA_INTEGER, GL_UNSIGNED_BYTE, table.data());
+		glBindTexture(GL_TEXTURE_2D, 0);
+	}
+};
+#endif